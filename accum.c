@@ -0,0 +1,184 @@
+#include "accum.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Identifies checkpoint files.
+#define ACCUM_MAGIC "RTAC"
+
+// Bumped whenever the layout of checkpoint files changes.
+#define ACCUM_VERSION 1
+
+// The header of checkpoint files. It is followed by the sums, then by the
+// counts, both row-major.
+typedef struct _AccumHeader {
+    // Always ACCUM_MAGIC.
+    char magic[4];
+    // Always ACCUM_VERSION.
+    uint32_t version;
+    // The width of the image.
+    int32_t width;
+    // The height of the image.
+    int32_t height;
+    // Number of passes accumulated.
+    int32_t passes;
+} _AccumHeader;
+
+Accum Accum_make(int width, int height) {
+    assert(width > 0);
+    assert(height > 0);
+    int size = width * height;
+    return (Accum){
+        .width = width,
+        .height = height,
+        .passes = 0,
+        .sum = calloc(3 * size, sizeof(float)),
+        .count = calloc(size, sizeof(uint32_t)),
+    };
+}
+
+void Accum_free(Accum* acc) {
+    free(acc->sum);
+    free(acc->count);
+    acc->sum = NULL;
+    acc->count = NULL;
+}
+
+void Accum_add(Accum* acc, Frame frame, int samples) {
+    assert(acc->width == frame.width);
+    assert(acc->height == frame.height);
+
+    int size = acc->width * acc->height;
+    float* sum = acc->sum;
+    uint32_t* count = acc->count;
+
+#pragma omp parallel for simd default(none) \
+    shared(frame, samples, size, sum, count)
+    for (int i = 0; i < size; ++i) {
+        Vector c = frame.radiance[i];
+        sum[3 * i + 0] += (float)(c.x * samples);
+        sum[3 * i + 1] += (float)(c.y * samples);
+        sum[3 * i + 2] += (float)(c.z * samples);
+        count[i] += samples;
+    }
+    ++acc->passes;
+}
+
+void Accum_add_px(Accum* acc, int index, Vector radiance, int samples) {
+    assert(index >= 0 && index < acc->width * acc->height);
+    acc->sum[3 * index + 0] += (float)(radiance.x * samples);
+    acc->sum[3 * index + 1] += (float)(radiance.y * samples);
+    acc->sum[3 * index + 2] += (float)(radiance.z * samples);
+    acc->count[index] += samples;
+}
+
+bool Accum_merge(Accum* acc, Accum other) {
+    if (acc->width != other.width || acc->height != other.height) {
+        return false;
+    }
+
+    int size = acc->width * acc->height;
+    float* sum = acc->sum;
+    uint32_t* count = acc->count;
+
+#pragma omp parallel for simd default(none) shared(other, size, sum, count)
+    for (int i = 0; i < size; ++i) {
+        sum[3 * i + 0] += other.sum[3 * i + 0];
+        sum[3 * i + 1] += other.sum[3 * i + 1];
+        sum[3 * i + 2] += other.sum[3 * i + 2];
+        count[i] += other.count[i];
+    }
+    acc->passes += other.passes;
+    return true;
+}
+
+Vector Accum_mean(Accum acc, int index) {
+    double n = acc.count[index] ? acc.count[index] : 1;
+    return (Vector){
+        acc.sum[3 * index + 0] / n,
+        acc.sum[3 * index + 1] / n,
+        acc.sum[3 * index + 2] / n,
+    };
+}
+
+void Accum_resolve(Accum acc, Frame frame) {
+    assert(acc.width == frame.width);
+    assert(acc.height == frame.height);
+
+    int size = acc.width * acc.height;
+
+#pragma omp parallel for default(none) shared(acc, frame, size)
+    for (int i = 0; i < size; ++i) {
+        Vector c = Accum_mean(acc, i);
+        frame.radiance[i] = c;
+        frame.image[i] = Vec_2Px(c);
+    }
+}
+
+bool Accum_save(Accum acc, const char* path) {
+    // Written next to the destination, then renamed over it.
+    size_t len = strlen(path);
+    char* tmp = malloc(len + 5);
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    FILE* file = fopen(tmp, "wb");
+    if (!file) {
+        free(tmp);
+        return false;
+    }
+
+    _AccumHeader header = {
+        .version = ACCUM_VERSION,
+        .width = acc.width,
+        .height = acc.height,
+        .passes = acc.passes,
+    };
+    memcpy(header.magic, ACCUM_MAGIC, sizeof(header.magic));
+
+    size_t size = acc.width * acc.height;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(acc.sum, 3 * sizeof(float), size, file) == size &&
+              fwrite(acc.count, sizeof(uint32_t), size, file) == size;
+    ok = (fclose(file) == 0) && ok;
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok) {
+        remove(tmp);
+    }
+    free(tmp);
+    return ok;
+}
+
+bool Accum_load(Accum* acc, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    _AccumHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, ACCUM_MAGIC, sizeof(header.magic)) ||
+        header.version != ACCUM_VERSION || header.width <= 0 ||
+        header.height <= 0) {
+        fclose(file);
+        return false;
+    }
+
+    Accum loaded = Accum_make(header.width, header.height);
+    loaded.passes = header.passes;
+
+    size_t size = loaded.width * loaded.height;
+    bool ok = fread(loaded.sum, 3 * sizeof(float), size, file) == size &&
+              fread(loaded.count, sizeof(uint32_t), size, file) == size;
+    fclose(file);
+
+    if (!ok) {
+        Accum_free(&loaded);
+        return false;
+    }
+    *acc = loaded;
+    return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "render.h"
+
+// Accum accumulates the samples of many passes, possibly rendered by many
+// processes, so that a render can be checkpointed, resumed and merged.
+// @author RenTrueWang
+typedef struct Accum {
+    // The width of the image.
+    int width;
+    // The height of the image.
+    int height;
+    // Number of passes accumulated so far.
+    int passes;
+    // Row-major sums of radiance, three floats (r, g, b) per pixel.
+    float* sum;
+    // Row-major number of samples summed per pixel.
+    uint32_t* count;
+} Accum;
+
+// Creates an empty accumulation buffer.
+// @param width The width of the image.
+// @param height The height of the image.
+// @return A new Accum with no samples.
+Accum Accum_make(int width, int height);
+
+// Free the resources controlled by Accum.
+// @param acc Accum to free.
+// @see free
+void Accum_free(Accum* acc);
+
+// Adds a rendered pass to the buffer.
+// @param acc The buffer to add to.
+// @param frame The pass. Its radiance is the mean of samples per pixel.
+// @param samples Number of samples per pixel in the pass.
+void Accum_add(Accum* acc, Frame frame, int samples);
+
+// Adds the samples of one pixel to the buffer. Different pixels may be added
+// concurrently.
+// @param acc The buffer to add to.
+// @param index The row-major index of the pixel.
+// @param radiance The mean of the samples.
+// @param samples Number of samples.
+void Accum_add_px(Accum* acc, int index, Vector radiance, int samples);
+
+// Adds all samples of another buffer, as if they were rendered into this
+// one. Buffers rendered with different seeds are combined into a render with
+// the total number of samples.
+// @param acc The buffer to add to.
+// @param other The buffer to add. Must have the same size.
+// @return False if the sizes differ.
+bool Accum_merge(Accum* acc, Accum other);
+
+// The mean radiance of a pixel.
+// @param acc The buffer to read.
+// @param index The row-major index of the pixel.
+// @return The mean of the samples. Black if the pixel has none.
+Vector Accum_mean(Accum acc, int index);
+
+// Writes the mean radiance of every pixel into a frame.
+// @param acc The buffer to read.
+// @param frame The output. radiance and image are written.
+void Accum_resolve(Accum acc, Frame frame);
+
+// Writes the buffer to a file. The file is replaced atomically, so a
+// process that dies while saving leaves the previous checkpoint intact.
+// @param acc The buffer to write.
+// @param path The file to write to.
+// @return True if the file is written successfully.
+bool Accum_save(Accum acc, const char* path);
+
+// Reads a buffer written by Accum_save.
+// @param acc Where to read into. Must be freed with Accum_free afterwards.
+// @param path The file to read from.
+// @return True if the file is read successfully. acc is untouched if not.
+bool Accum_load(Accum* acc, const char* path);
@@ -0,0 +1,131 @@
+#include "camera.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+// The alignment of the arrays of a RayBatch.
+#define RAY_ALIGN 64
+
+// Number of arrays in a RayBatch.
+#define RAY_ARRAYS 13
+
+Lens Lens_make(Camera cam, int width, int height) {
+    assert(width > 0);
+    assert(height > 0);
+
+    return (Lens){
+        .source = cam.source,
+        .corner = cam.corner,
+        .horiz = cam.horiz,
+        .vertic = cam.vertic,
+        .right = Vec_unit(cam.horiz),
+        .up = Vec_unit(cam.vertic),
+        .aperture = cam.aperture,
+        .inv_width = 1. / width,
+        .inv_height = 1. / height,
+    };
+}
+
+void Lens_rays(const Lens* lens,
+               int x0,
+               int y0,
+               int x1,
+               int y1,
+               int samples,
+               unsigned* seed,
+               RayBatch* rays) {
+    assert(x0 <= x1);
+    assert(y0 <= y1);
+    assert(samples > 0);
+
+    int length = (x1 - x0) * (y1 - y0) * samples;
+    assert(length <= rays->capacity);
+    rays->length = length;
+
+    // The random numbers. rand_r is sequential, so this part is scalar.
+    int k = 0;
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            Pair a = Pair_rand_disk(lens->aperture, seed);
+            for (int s = 0; s < samples; ++s, ++k) {
+                rays->lx[k] = a.x;
+                rays->ly[k] = a.y;
+                rays->fx[k] = (x + genfloat(seed)) * lens->inv_width;
+                rays->fy[k] = (y + genfloat(seed)) * lens->inv_height;
+            }
+        }
+    }
+
+    // The rays. Copied to locals so the compiler knows nothing aliases.
+    Vector src = lens->source, cor = lens->corner;
+    Vector hor = lens->horiz, ver = lens->vertic;
+    Vector rig = lens->right, up = lens->up;
+    const double* restrict lx = rays->lx;
+    const double* restrict ly = rays->ly;
+    const double* restrict fx = rays->fx;
+    const double* restrict fy = rays->fy;
+    double* restrict ox = rays->ox;
+    double* restrict oy = rays->oy;
+    double* restrict oz = rays->oz;
+    double* restrict dx = rays->dx;
+    double* restrict dy = rays->dy;
+    double* restrict dz = rays->dz;
+    double* restrict ix = rays->ix;
+    double* restrict iy = rays->iy;
+    double* restrict iz = rays->iz;
+
+#pragma omp simd aligned(lx, ly, fx, fy, ox, oy, oz, dx, dy, dz, ix, iy, iz \
+                         : RAY_ALIGN)
+    for (int i = 0; i < length; ++i) {
+        ox[i] = src.x + rig.x * lx[i] + up.x * ly[i];
+        oy[i] = src.y + rig.y * lx[i] + up.y * ly[i];
+        oz[i] = src.z + rig.z * lx[i] + up.z * ly[i];
+        dx[i] = cor.x + hor.x * fx[i] + ver.x * fy[i] - ox[i];
+        dy[i] = cor.y + hor.y * fx[i] + ver.y * fy[i] - oy[i];
+        dz[i] = cor.z + hor.z * fx[i] + ver.z * fy[i] - oz[i];
+        ix[i] = 1. / dx[i];
+        iy[i] = 1. / dy[i];
+        iz[i] = 1. / dz[i];
+    }
+}
+
+RayBatch RayBatch_make(int capacity) {
+    RayBatch rays = {.length = 0, .capacity = 0};
+    RayBatch_reserve(&rays, capacity);
+    return rays;
+}
+
+void RayBatch_free(RayBatch* rays) {
+    // All arrays share the block that starts at ox.
+    free(rays->ox);
+    memset(rays, 0, sizeof(RayBatch));
+}
+
+void RayBatch_reserve(RayBatch* rays, int capacity) {
+    if (capacity <= rays->capacity && rays->ox) {
+        rays->length = 0;
+        return;
+    }
+    RayBatch_free(rays);
+
+    // Rounded up so that every array starts on a cache line.
+    int per_line = RAY_ALIGN / sizeof(double);
+    int stride = (capacity + per_line - 1) / per_line * per_line;
+    stride = stride > 0 ? stride : per_line;
+    double* block = aligned_alloc(
+        RAY_ALIGN, (size_t)RAY_ARRAYS * stride * sizeof(double));
+
+    double** arrays[RAY_ARRAYS] = {
+        &rays->ox, &rays->oy, &rays->oz, &rays->dx, &rays->dy,
+        &rays->dz, &rays->ix, &rays->iy, &rays->iz, &rays->lx,
+        &rays->ly, &rays->fx, &rays->fy,
+    };
+    for (int i = 0; i < RAY_ARRAYS; ++i) {
+        *arrays[i] = block + (size_t)i * stride;
+    }
+    rays->length = 0;
+    rays->capacity = stride;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "geometric.h"
+
+// Camera stores the source, corner, horizontal and vertical directions.
+// @author RenTrueWang
+typedef struct Camera {
+    // The location of the film.
+    Vector source;
+    // The viewport's bottom-left corner.
+    Vector corner;
+    // Camera's right direction.
+    Vector horiz;
+    // Camera's up direction.
+    Vector vertic;
+    // The size of the aperture.
+    double aperture;
+} Camera;
+
+// Lens is a camera prepared for an image of a given size. Everything that
+// doesn't change from ray to ray is computed once, up front.
+// @author RenTrueWang
+typedef struct Lens {
+    // The center of the aperture.
+    Vector source;
+    // The viewport's bottom-left corner.
+    Vector corner;
+    // The viewport's right edge.
+    Vector horiz;
+    // The viewport's up edge.
+    Vector vertic;
+    // Unit right direction, along which the aperture is sampled.
+    Vector right;
+    // Unit up direction, along which the aperture is sampled.
+    Vector up;
+    // The radius of the aperture.
+    double aperture;
+    // The reciprocal of the image's width.
+    double inv_width;
+    // The reciprocal of the image's height.
+    double inv_height;
+} Lens;
+
+// A batch of rays in structure-of-arrays layout, so that a component of
+// consecutive rays is contiguous in memory. Every array is aligned to a
+// cache line.
+// @author RenTrueWang
+typedef struct RayBatch {
+    // Number of rays in the batch.
+    int length;
+    // Number of rays the arrays can hold.
+    int capacity;
+    // The origins of the rays.
+    double *ox, *oy, *oz;
+    // The directions of the rays. Not normalized.
+    double *dx, *dy, *dz;
+    // The reciprocals of the directions. Infinite where a component is 0.
+    double *ix, *iy, *iz;
+    // Where every ray passes through the aperture, relative to its center.
+    double *lx, *ly;
+    // Where every ray passes through the viewport, in [0, 1].
+    double *fx, *fy;
+} RayBatch;
+
+// Prepares a camera for an image.
+// @param cam The camera.
+// @param width The width of the image.
+// @param height The height of the image.
+// @return A new Lens.
+Lens Lens_make(Camera cam, int width, int height);
+
+// Generates the camera rays of a rectangle of pixels. The random numbers are
+// drawn first, one pixel after another in row-major order: a point on the
+// aperture shared by all samples of the pixel, then a point in the pixel
+// for every sample. Then the rays are built in a single vectorized pass.
+// @param lens The lens.
+// @param x0 The left of the rectangle, inclusive.
+// @param y0 The bottom of the rectangle, inclusive.
+// @param x1 The right of the rectangle, exclusive.
+// @param y1 The top of the rectangle, exclusive.
+// @param samples Number of rays per pixel.
+// @param seed The seed pointer for the random number generator.
+// @param rays Where the rays are stored. The samples of a pixel are
+// consecutive. Must have enough capacity.
+void Lens_rays(const Lens* lens,
+               int x0,
+               int y0,
+               int x1,
+               int y1,
+               int samples,
+               unsigned* seed,
+               RayBatch* rays);
+
+// Creates an empty batch.
+// @param capacity Number of rays the batch can hold.
+// @return A new RayBatch.
+RayBatch RayBatch_make(int capacity);
+
+// Free the batch.
+// @param rays RayBatch to free.
+// @see free
+void RayBatch_free(RayBatch* rays);
+
+// Makes sure a batch can hold a number of rays. Its rays are lost.
+// @param rays The batch.
+// @param capacity Number of rays the batch must hold.
+void RayBatch_reserve(RayBatch* rays, int capacity);
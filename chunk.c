@@ -0,0 +1,939 @@
+#define _GNU_SOURCE
+
+#include "chunk.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <omp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "camera.h"
+
+// Identifies chunk files.
+#define CHUNK_MAGIC "RTCK"
+
+// Bumped whenever the layout of chunk files changes.
+#define CHUNK_VERSION 1
+
+// Prefetching walks every CHUNK_PROBE-th ray of a batch down the top-level
+// tree. Rays of a batch are close together, so a sparse probe finds their
+// chunks.
+#define CHUNK_PROBE 16
+
+// A sphere as stored in spools and chunk files.
+typedef struct _DiskSphere {
+    // The center of the sphere.
+    Vector center;
+    // The radius of the sphere.
+    double radius;
+    // The index of the material of the sphere.
+    int32_t material;
+    // The cell that the sphere belongs to. -1 for resident spheres.
+    int32_t cell;
+} _DiskSphere;
+
+// The header of chunk files. It is followed by the resident spheres, then by
+// the chunk entries, then by the chunks.
+typedef struct _ChunkHeader {
+    // Always CHUNK_MAGIC.
+    char magic[4];
+    // Always CHUNK_VERSION.
+    uint32_t version;
+    // Number of chunks.
+    int32_t chunks;
+    // Number of resident spheres.
+    int32_t resident;
+} _ChunkHeader;
+
+// Where a chunk is stored. A chunk is its spheres in the order of the leaves
+// of its tree, followed by the nodes of its tree.
+typedef struct _ChunkEntry {
+    // The bounds of the chunk's spheres.
+    Box bounds;
+    // The offset of the chunk in the file.
+    int64_t offset;
+    // Number of spheres.
+    int32_t spheres;
+    // Number of nodes of the tree.
+    int32_t nodes;
+    // The root of the tree.
+    int32_t root;
+    // Always 0.
+    int32_t reserved;
+} _ChunkEntry;
+
+// A run of spheres of one cell in the spool.
+typedef struct _SpoolBlock {
+    // The offset of the run.
+    long offset;
+    // Number of spheres.
+    int count;
+} _SpoolBlock;
+
+struct ChunkWriter {
+    // The file to write.
+    char* path;
+    // The region that the grid covers.
+    Box bounds;
+    // Number of cells along every axis.
+    int cells;
+    // Spheres added since the last flush, in the order they were added.
+    _DiskSphere* buffer;
+    // Number of spheres in buffer.
+    int buffered;
+    // Capacity of buffer.
+    int capacity;
+    // The spheres flushed so far.
+    FILE* spool;
+    // The runs of every cell in the spool.
+    _SpoolBlock** blocks;
+    // Number of runs of every cell.
+    int* nblocks;
+    // Capacity of the runs of every cell.
+    int* cblocks;
+    // The resident spheres.
+    _DiskSphere* resident;
+    // Number of resident spheres.
+    int nresident;
+    // Capacity of resident.
+    int cresident;
+};
+
+// A chunk of an open file.
+typedef struct _Chunk {
+    // The tree the chunk belongs to.
+    ChunkTree* tree;
+    // Where the chunk is stored.
+    _ChunkEntry entry;
+    // The bytes the chunk takes in memory once loaded.
+    size_t bytes;
+    // Held while the chunk is loaded or evicted.
+    omp_lock_t lock;
+    // The spheres. NULL if the chunk isn't in memory.
+    Sphere* spheres;
+    // The tree over spheres. Valid if spheres isn't NULL.
+    QuantTree qt;
+    // Whether queries can use qt without taking lock.
+    atomic_bool loaded;
+    // Number of queries using the chunk. Chunks in use are never evicted.
+    atomic_int refs;
+    // The tree's clock when the chunk was last moved to the front of the LRU
+    // list. Chunks used again before the next load stay where they are.
+    atomic_ulong stamp;
+    // The neighbours of the chunk in the tree's LRU list, towards the most
+    // and the least recently used end. Guarded by the tree's lock.
+    struct _Chunk* newer;
+    struct _Chunk* older;
+    // Whether a read ahead is scheduled, or the chunk is in memory.
+    atomic_bool advised;
+    // Whether the chunk couldn't be read. It is then treated as empty.
+    atomic_bool broken;
+} _Chunk;
+
+struct ChunkTree {
+    // The file.
+    int fd;
+    // The materials that spheres refer to.
+    const Material* materials;
+    // Number of materials.
+    int nmaterials;
+    // Bytes of chunks kept in memory.
+    size_t cache;
+    // The resident spheres.
+    Sphere* resident;
+    // Number of resident spheres.
+    int nresident;
+    // The chunks.
+    _Chunk* chunks;
+    // Number of chunks.
+    int nchunks;
+    // The tree over the chunks and the resident spheres.
+    HitTree top;
+    // Guards stats and the LRU list, and is held while chunks are evicted.
+    omp_lock_t lock;
+    // The loaded chunks, from the most to the least recently used.
+    _Chunk* newest;
+    _Chunk* oldest;
+    // Incremented every time a chunk is loaded. A chunk is only moved to the
+    // front of the LRU list once between two loads, which is close enough to
+    // LRU and keeps queries from all taking the lock.
+    atomic_ulong clock;
+    // Whether the cache was still over its size after the last eviction.
+    atomic_bool over;
+    // What the cache has been doing.
+    ChunkStats stats;
+};
+
+// Makes room for one more element at the end of an array.
+// @param list The array. Updated if it moves.
+// @param length The number of elements in the array.
+// @param capacity The capacity of the array. Updated if it grows.
+// @param size The size of an element.
+static void reserve(void** list, int length, int* capacity, size_t size) {
+    if (length < *capacity) {
+        return;
+    }
+    *capacity = *capacity ? 2 * *capacity : 8;
+    *list = realloc(*list, *capacity * size);
+    assert(*list);
+}
+
+ChunkWriter* ChunkWriter_make(const char* path,
+                              Box bounds,
+                              int cells,
+                              size_t budget) {
+    assert(cells > 0);
+    FILE* spool = tmpfile();
+    if (!spool) {
+        return NULL;
+    }
+
+    int count = cells * cells * cells;
+    size_t capacity = budget / sizeof(_DiskSphere);
+    ChunkWriter* w = calloc(1, sizeof(ChunkWriter));
+    *w = (ChunkWriter){
+        .path = strdup(path),
+        .bounds = bounds,
+        .cells = cells,
+        .capacity = capacity ? (capacity < INT32_MAX ? capacity : INT32_MAX)
+                             : 1,
+        .spool = spool,
+        .blocks = calloc(count, sizeof(_SpoolBlock*)),
+        .nblocks = calloc(count, sizeof(int)),
+        .cblocks = calloc(count, sizeof(int)),
+    };
+    w->buffer = malloc(w->capacity * sizeof(_DiskSphere));
+    return w;
+}
+
+// The cell of a point along one axis.
+// @param extent The extent of the grid along the axis.
+// @param value The coordinate of the point.
+// @param cells Number of cells along the axis.
+// @return The index of the cell, clamped to the grid.
+static int cell_of(Pair extent, double value, int cells) {
+    double size = extent.y - extent.x;
+    int i = size > 0 ? (int)floor((value - extent.x) / size * cells) : 0;
+    return (i < 0) ? 0 : (i >= cells) ? cells - 1 : i;
+}
+
+// Writes the buffered spheres to the spool, one run per cell.
+// @param w The writer.
+// @return False if the spool can't be written.
+static bool flush(ChunkWriter* w) {
+    if (!w->buffered) {
+        return true;
+    }
+
+    // Counting sort by cell, which keeps the order spheres were added in.
+    int count = w->cells * w->cells * w->cells;
+    int* start = calloc(count + 1, sizeof(int));
+    for (int i = 0; i < w->buffered; ++i) {
+        ++start[w->buffer[i].cell + 1];
+    }
+    for (int c = 0; c < count; ++c) {
+        start[c + 1] += start[c];
+    }
+    _DiskSphere* sorted = malloc(w->buffered * sizeof(_DiskSphere));
+    int* next = malloc(count * sizeof(int));
+    memcpy(next, start, count * sizeof(int));
+    for (int i = 0; i < w->buffered; ++i) {
+        sorted[next[w->buffer[i].cell]++] = w->buffer[i];
+    }
+    free(next);
+
+    bool ok = !fseek(w->spool, 0, SEEK_END);
+    for (int c = 0; ok && c < count; ++c) {
+        int n = start[c + 1] - start[c];
+        if (!n) {
+            continue;
+        }
+        reserve((void**)&w->blocks[c], w->nblocks[c], &w->cblocks[c],
+                sizeof(_SpoolBlock));
+        w->blocks[c][w->nblocks[c]++] = (_SpoolBlock){
+            .offset = ftell(w->spool),
+            .count = n,
+        };
+        ok = fwrite(sorted + start[c], sizeof(_DiskSphere), n, w->spool) ==
+             (size_t)n;
+    }
+
+    free(sorted);
+    free(start);
+    w->buffered = 0;
+    return ok;
+}
+
+bool ChunkWriter_add(ChunkWriter* w,
+                     Vector center,
+                     double radius,
+                     int material,
+                     bool resident) {
+    _DiskSphere ds = {
+        .center = center,
+        .radius = radius,
+        .material = material,
+        .cell = -1,
+    };
+    if (resident) {
+        reserve((void**)&w->resident, w->nresident, &w->cresident,
+                sizeof(_DiskSphere));
+        w->resident[w->nresident++] = ds;
+        return true;
+    }
+
+    int n = w->cells;
+    ds.cell = (cell_of(w->bounds.z, center.z, n) * n +
+               cell_of(w->bounds.y, center.y, n)) *
+                  n +
+              cell_of(w->bounds.x, center.x, n);
+    if (w->buffered == w->capacity && !flush(w)) {
+        return false;
+    }
+    w->buffer[w->buffered++] = ds;
+    return true;
+}
+
+// Builds the tree of a cell, and appends the chunk to a file.
+// @param w The writer.
+// @param c The cell.
+// @param out The file.
+// @param entry Where the chunk's entry is stored.
+// @return False if the spool can't be read or the file can't be written.
+static bool write_chunk(ChunkWriter* w, int c, FILE* out, _ChunkEntry* entry) {
+    int n = 0;
+    for (int b = 0; b < w->nblocks[c]; ++b) {
+        n += w->blocks[c][b].count;
+    }
+
+    _DiskSphere* disk = malloc(n * sizeof(_DiskSphere));
+    bool ok = true;
+    for (int b = 0, k = 0; ok && b < w->nblocks[c]; ++b) {
+        _SpoolBlock block = w->blocks[c][b];
+        ok = !fseek(w->spool, block.offset, SEEK_SET) &&
+             fread(disk + k, sizeof(_DiskSphere), block.count, w->spool) ==
+                 (size_t)block.count;
+        k += block.count;
+    }
+
+    // Materials aren't known here, and trees don't look at them.
+    Sphere* spheres = calloc(n, sizeof(Sphere));
+    HitList hl = HitList_make(n);
+    for (int i = 0; i < n; ++i) {
+        spheres[i] = Sph_make(disk[i].center, disk[i].radius, (Material){0});
+        *HitList_getitem(hl, i) = Sph_Hittable(spheres + i);
+    }
+    HitTree ht = HitTree_make(hl);
+    HitList_free(&hl);
+    QuantTree qt = QuantTree_make(&ht);
+    HitTree_free(&ht);
+
+    // Spheres are stored in the order of the leaves, so that leaf i is
+    // sphere i once loaded.
+    _DiskSphere* ordered = malloc(n * sizeof(_DiskSphere));
+    for (int i = 0; i < n; ++i) {
+        const Sphere* sphere = qt.leaves[i].object;
+        ordered[i] = disk[sphere - spheres];
+    }
+
+    *entry = (_ChunkEntry){
+        .bounds = qt.bounds,
+        .offset = ftell(out),
+        .spheres = n,
+        .nodes = qt.length,
+        .root = qt.root,
+    };
+    ok = ok &&
+         fwrite(ordered, sizeof(_DiskSphere), n, out) == (size_t)n &&
+         fwrite(qt.nodes, sizeof(_QuantNode), qt.length, out) ==
+             (size_t)qt.length;
+
+    free(ordered);
+    QuantTree_free(&qt);
+    free(spheres);
+    free(disk);
+    return ok;
+}
+
+// Frees a writer.
+// @param w The writer.
+static void writer_free(ChunkWriter* w) {
+    int count = w->cells * w->cells * w->cells;
+    for (int c = 0; c < count; ++c) {
+        free(w->blocks[c]);
+    }
+    fclose(w->spool);
+    free(w->blocks);
+    free(w->nblocks);
+    free(w->cblocks);
+    free(w->buffer);
+    free(w->resident);
+    free(w->path);
+    free(w);
+}
+
+bool ChunkWriter_finish(ChunkWriter* w) {
+    if (!flush(w)) {
+        writer_free(w);
+        return false;
+    }
+
+    int count = w->cells * w->cells * w->cells;
+    int chunks = 0;
+    for (int c = 0; c < count; ++c) {
+        chunks += w->nblocks[c] > 0;
+    }
+
+    // Written next to the file, then moved over it, so that an interrupted
+    // write never leaves a broken file behind.
+    size_t len = strlen(w->path);
+    char* tmp = malloc(len + 5);
+    memcpy(tmp, w->path, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    FILE* out = fopen(tmp, "wb");
+    if (!out) {
+        free(tmp);
+        writer_free(w);
+        return false;
+    }
+
+    _ChunkHeader header = {
+        .magic = CHUNK_MAGIC,
+        .version = CHUNK_VERSION,
+        .chunks = chunks,
+        .resident = w->nresident,
+    };
+    _ChunkEntry* entries = calloc(chunks ? chunks : 1, sizeof(_ChunkEntry));
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+              (!w->nresident ||
+               fwrite(w->resident, sizeof(_DiskSphere), w->nresident, out) ==
+                   (size_t)w->nresident);
+    long table = ftell(out);
+    ok = ok && fwrite(entries, sizeof(_ChunkEntry), chunks, out) ==
+                   (size_t)chunks;
+
+    for (int c = 0, i = 0; ok && c < count; ++c) {
+        if (w->nblocks[c]) {
+            ok = write_chunk(w, c, out, entries + i++);
+        }
+    }
+
+    ok = ok && !fseek(out, table, SEEK_SET) &&
+         fwrite(entries, sizeof(_ChunkEntry), chunks, out) == (size_t)chunks;
+    ok = !fclose(out) && ok;
+    ok = ok && !rename(tmp, w->path);
+    if (!ok) {
+        remove(tmp);
+    }
+
+    free(entries);
+    free(tmp);
+    writer_free(w);
+    return ok;
+}
+
+// Reads from a position of a file.
+// @param fd The file.
+// @param buf Where to read to.
+// @param size Number of bytes to read.
+// @param offset Where to read from.
+// @return False if the file is too short or can't be read.
+static bool read_at(int fd, void* buf, size_t size, off_t offset) {
+    char* p = buf;
+    while (size) {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// Takes a chunk out of the LRU list. Called with the tree's lock held.
+// @param ct The tree.
+// @param chunk The chunk. Must be in the list.
+static void unlink_chunk(ChunkTree* ct, _Chunk* chunk) {
+    if (chunk->newer) {
+        chunk->newer->older = chunk->older;
+    } else {
+        ct->newest = chunk->older;
+    }
+    if (chunk->older) {
+        chunk->older->newer = chunk->newer;
+    } else {
+        ct->oldest = chunk->newer;
+    }
+    chunk->newer = NULL;
+    chunk->older = NULL;
+}
+
+// Puts a chunk at the front of the LRU list. Called with the tree's lock
+// held.
+// @param ct The tree.
+// @param chunk The chunk. Must not be in the list.
+static void push_chunk(ChunkTree* ct, _Chunk* chunk) {
+    chunk->newer = NULL;
+    chunk->older = ct->newest;
+    if (ct->newest) {
+        ct->newest->newer = chunk;
+    } else {
+        ct->oldest = chunk;
+    }
+    ct->newest = chunk;
+}
+
+// Drops the least recently used chunks that aren't in use until the cache
+// fits. Called with the tree's lock held. Only the chunks in use are
+// skipped, so it takes time in the number of chunks dropped and in use, not
+// in the number of chunks.
+// @param ct The tree.
+static void evict(ChunkTree* ct) {
+    _Chunk* next;
+    for (_Chunk* lru = ct->oldest; lru && ct->stats.resident > ct->cache;
+         lru = next) {
+        next = lru->newer;
+        // A chunk being loaded or in use is about to be used.
+        if (atomic_load(&lru->refs) || !omp_test_lock(&lru->lock)) {
+            continue;
+        }
+        // Queries count themselves before they check loaded, and this clears
+        // loaded before it checks the count, so either the query sees the
+        // chunk unloaded and waits for lock, or this sees the query.
+        atomic_store(&lru->loaded, false);
+        if (atomic_load(&lru->refs)) {
+            atomic_store(&lru->loaded, true);
+            omp_unset_lock(&lru->lock);
+            continue;
+        }
+
+        unlink_chunk(ct, lru);
+        QuantTree_free(&lru->qt);
+        free(lru->spheres);
+        lru->spheres = NULL;
+        atomic_store(&lru->advised, false);
+        omp_unset_lock(&lru->lock);
+        ct->stats.resident -= lru->bytes;
+        ++ct->stats.evictions;
+    }
+    atomic_store(&ct->over, ct->stats.resident > ct->cache);
+}
+
+// Checks that a chunk lies inside its file, and that its tree is shaped as
+// ChunkWriter writes it: a binary tree with its root first.
+// @param e The chunk's entry.
+// @param size The size of the file.
+// @return True if the chunk is valid.
+static bool entry_valid(_ChunkEntry e, off_t size) {
+    if (e.spheres < 1 || e.nodes != e.spheres - 1 || e.offset < 0 ||
+        e.root != (e.nodes ? 0 : ~0)) {
+        return false;
+    }
+    uint64_t bytes = (uint64_t)e.spheres * sizeof(_DiskSphere) +
+                     (uint64_t)e.nodes * sizeof(_QuantNode);
+    return (uint64_t)e.offset <= (uint64_t)size &&
+           bytes <= (uint64_t)size - (uint64_t)e.offset;
+}
+
+// Checks that the nodes of a chunk's tree only refer to nodes and leaves
+// that exist, and only to nodes after themselves, so that the tree has no
+// cycles.
+// @param nodes The nodes.
+// @param e The chunk's entry.
+// @return True if the nodes are valid.
+static bool nodes_valid(const _QuantNode* nodes, _ChunkEntry e) {
+    for (int i = 0; i < e.nodes; ++i) {
+        for (int c = 0; c < 2; ++c) {
+            int child = nodes[i].child[c];
+            if (child >= 0 ? child <= i || child >= e.nodes
+                           : ~child >= e.spheres) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Reads a chunk into memory. Called with the chunk's lock held.
+// @param chunk The chunk.
+// @return False if the chunk can't be read, because the file changed since
+// it was opened or a sphere refers to a material that doesn't exist.
+static bool load(_Chunk* chunk) {
+    ChunkTree* ct = chunk->tree;
+    _ChunkEntry e = chunk->entry;
+
+    _DiskSphere* disk = malloc(e.spheres * sizeof(_DiskSphere));
+    _QuantNode* nodes = calloc(e.nodes ? e.nodes : 1, sizeof(_QuantNode));
+    off_t nodes_at = e.offset + e.spheres * sizeof(_DiskSphere);
+    bool ok =
+        read_at(ct->fd, disk, e.spheres * sizeof(_DiskSphere), e.offset) &&
+        read_at(ct->fd, nodes, e.nodes * sizeof(_QuantNode), nodes_at) &&
+        nodes_valid(nodes, e);
+    for (int i = 0; ok && i < e.spheres; ++i) {
+        ok = disk[i].material >= 0 && disk[i].material < ct->nmaterials;
+    }
+    if (!ok) {
+        free(disk);
+        free(nodes);
+        return false;
+    }
+
+    Sphere* spheres = malloc(e.spheres * sizeof(Sphere));
+    Hittable* leaves = malloc(e.spheres * sizeof(Hittable));
+    for (int i = 0; i < e.spheres; ++i) {
+        Material mat = ct->materials[disk[i].material];
+        spheres[i] = Sph_make(disk[i].center, disk[i].radius, mat);
+        leaves[i] = Sph_Hittable(spheres + i);
+    }
+    free(disk);
+
+    chunk->qt = (QuantTree){
+        .nodes = nodes,
+        .length = e.nodes,
+        .leaves = leaves,
+        .nleaves = e.spheres,
+        .bounds = e.bounds,
+        .root = e.root,
+    };
+    chunk->spheres = spheres;
+    atomic_store(&chunk->advised, true);
+    atomic_store(&chunk->stamp, atomic_fetch_add(&ct->clock, 1) + 1);
+
+    // The chunk is in the LRU list before queries that don't take its lock
+    // can see it loaded, and move it in the list.
+    omp_set_lock(&ct->lock);
+    push_chunk(ct, chunk);
+    ct->stats.resident += chunk->bytes;
+    ++ct->stats.loads;
+    evict(ct);
+    omp_unset_lock(&ct->lock);
+    atomic_store(&chunk->loaded, true);
+    return true;
+}
+
+// Makes sure a chunk is in memory, and keeps it there until released.
+// @param chunk The chunk.
+// @return The tree over the chunk's spheres. NULL if the chunk can't be
+// read, and it must still be released.
+static const QuantTree* acquire(_Chunk* chunk) {
+    ChunkTree* ct = chunk->tree;
+    atomic_fetch_add(&chunk->refs, 1);
+    if (!atomic_load(&chunk->loaded)) {
+        omp_set_lock(&chunk->lock);
+        // Another thread may have loaded it, or failed to, meanwhile.
+        if (!chunk->spheres && !atomic_load(&chunk->broken) && !load(chunk)) {
+            atomic_store(&chunk->broken, true);
+            omp_set_lock(&ct->lock);
+            ++ct->stats.errors;
+            omp_unset_lock(&ct->lock);
+        }
+        omp_unset_lock(&chunk->lock);
+        if (atomic_load(&chunk->broken)) {
+            return NULL;
+        }
+    }
+
+    // The chunk is loaded and counted, so it can't be evicted, and stays in
+    // the list.
+    unsigned long now = atomic_load_explicit(&ct->clock, memory_order_relaxed);
+    if (atomic_load_explicit(&chunk->stamp, memory_order_relaxed) != now) {
+        atomic_store_explicit(&chunk->stamp, now, memory_order_relaxed);
+        omp_set_lock(&ct->lock);
+        unlink_chunk(ct, chunk);
+        push_chunk(ct, chunk);
+        omp_unset_lock(&ct->lock);
+    }
+    return &chunk->qt;
+}
+
+// Lets a chunk be evicted again. If the cache is over its size, chunks are
+// evicted, unless another thread is already at it.
+// @param chunk The chunk acquired before.
+static void release(_Chunk* chunk) {
+    ChunkTree* ct = chunk->tree;
+    atomic_fetch_sub(&chunk->refs, 1);
+    if (atomic_load_explicit(&ct->over, memory_order_relaxed) &&
+        omp_test_lock(&ct->lock)) {
+        evict(ct);
+        omp_unset_lock(&ct->lock);
+    }
+}
+
+// ChunkHit is the implementation of hit for a chunk.
+// @see Hittable
+static HitData Chunk_hit(const void* c, Vector source, Vector towards) {
+    _Chunk* chunk = (_Chunk*)c;
+    // The top-level tree tests whole lines, so chunks behind the ray would
+    // be paged in for nothing.
+    if (!Box_is_through_until(chunk->entry.bounds, source, towards,
+                              INFINITY)) {
+        return HitData_miss();
+    }
+
+    const QuantTree* qt = acquire(chunk);
+    HitData hd = qt ? Hittable_hit(QuantTree_Hittable(qt), source, towards)
+                    : HitData_miss();
+    release(chunk);
+    return hd;
+}
+
+// ChunkOccluded is the implementation of occluded for a chunk.
+// @see Hittable
+static bool Chunk_occluded(const void* c,
+                           Vector source,
+                           Vector towards,
+                           double t_max) {
+    _Chunk* chunk = (_Chunk*)c;
+    const QuantTree* qt = acquire(chunk);
+    bool occluded =
+        qt && Hittable_occluded(QuantTree_Hittable(qt), source, towards, t_max);
+    release(chunk);
+    return occluded;
+}
+
+// ChunkBounds is the implementation of bounds for a chunk.
+// @see Hittable
+static Box Chunk_bounds(const void* c) {
+    const _Chunk* chunk = c;
+    return chunk->entry.bounds;
+}
+
+ChunkTree* ChunkTree_open(const char* path,
+                          const Material* materials,
+                          int count,
+                          size_t cache) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Counts are checked against the size of the file before anything is
+    // allocated for them.
+    _ChunkHeader header;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < 0 || !read_at(fd, &header, sizeof(header), 0) ||
+        memcmp(header.magic, CHUNK_MAGIC, 4) ||
+        header.version != CHUNK_VERSION || header.chunks < 0 ||
+        header.resident < 0 || header.chunks + header.resident == 0 ||
+        sizeof(header) + (uint64_t)header.resident * sizeof(_DiskSphere) +
+                (uint64_t)header.chunks * sizeof(_ChunkEntry) >
+            (uint64_t)size) {
+        close(fd);
+        return NULL;
+    }
+
+    int nres = header.resident;
+    int nchunks = header.chunks;
+    _DiskSphere* disk = malloc((nres ? nres : 1) * sizeof(_DiskSphere));
+    _ChunkEntry* entries =
+        malloc((nchunks ? nchunks : 1) * sizeof(_ChunkEntry));
+    off_t table = sizeof(header) + nres * sizeof(_DiskSphere);
+    bool ok = read_at(fd, disk, nres * sizeof(_DiskSphere), sizeof(header)) &&
+              read_at(fd, entries, nchunks * sizeof(_ChunkEntry), table);
+    for (int i = 0; ok && i < nres; ++i) {
+        ok = disk[i].material >= 0 && disk[i].material < count;
+    }
+
+    // The trees of chunks are read once through a buffer that grows to the
+    // largest of them, so that no chunk is paged in that can't be traced.
+    _QuantNode* nodes = NULL;
+    int capacity = 0;
+    for (int i = 0; ok && i < nchunks; ++i) {
+        _ChunkEntry e = entries[i];
+        ok = entry_valid(e, size);
+        if (ok && e.nodes > capacity) {
+            capacity = e.nodes;
+            nodes = realloc(nodes, capacity * sizeof(_QuantNode));
+        }
+        off_t nodes_at = e.offset + e.spheres * sizeof(_DiskSphere);
+        ok = ok &&
+             read_at(fd, nodes, e.nodes * sizeof(_QuantNode), nodes_at) &&
+             nodes_valid(nodes, e);
+    }
+    free(nodes);
+    if (!ok) {
+        free(disk);
+        free(entries);
+        close(fd);
+        return NULL;
+    }
+
+    ChunkTree* ct = calloc(1, sizeof(ChunkTree));
+    ct->fd = fd;
+    ct->materials = materials;
+    ct->nmaterials = count;
+    ct->cache = cache;
+    ct->nresident = nres;
+    ct->resident = calloc(nres ? nres : 1, sizeof(Sphere));
+    ct->nchunks = nchunks;
+    ct->chunks = calloc(nchunks ? nchunks : 1, sizeof(_Chunk));
+    omp_init_lock(&ct->lock);
+    atomic_init(&ct->clock, 0);
+    atomic_init(&ct->over, false);
+
+    HitList hl = HitList_make(nres + nchunks);
+    for (int i = 0; i < nres; ++i) {
+        Material mat = materials[disk[i].material];
+        ct->resident[i] = Sph_make(disk[i].center, disk[i].radius, mat);
+        *HitList_getitem(hl, i) = Sph_Hittable(ct->resident + i);
+    }
+    for (int i = 0; i < nchunks; ++i) {
+        _Chunk* chunk = ct->chunks + i;
+        _ChunkEntry e = entries[i];
+        chunk->tree = ct;
+        chunk->entry = e;
+        chunk->bytes = e.spheres * (sizeof(Sphere) + sizeof(Hittable)) +
+                       e.nodes * sizeof(_QuantNode);
+        omp_init_lock(&chunk->lock);
+        atomic_init(&chunk->loaded, false);
+        atomic_init(&chunk->refs, 0);
+        atomic_init(&chunk->stamp, 0);
+        atomic_init(&chunk->advised, false);
+        atomic_init(&chunk->broken, false);
+        *HitList_getitem(hl, nres + i) = (Hittable){
+            .object = chunk,
+            .hit = Chunk_hit,
+            .occluded = Chunk_occluded,
+            .bounds = Chunk_bounds,
+        };
+    }
+    ct->top = HitTree_make(hl);
+    HitList_free(&hl);
+
+    free(disk);
+    free(entries);
+    return ct;
+}
+
+void ChunkTree_free(ChunkTree* ct) {
+    for (int i = 0; i < ct->nchunks; ++i) {
+        _Chunk* chunk = ct->chunks + i;
+        if (chunk->spheres) {
+            QuantTree_free(&chunk->qt);
+            free(chunk->spheres);
+        }
+        omp_destroy_lock(&chunk->lock);
+    }
+    omp_destroy_lock(&ct->lock);
+    HitTree_free(&ct->top);
+    free(ct->chunks);
+    free(ct->resident);
+    close(ct->fd);
+    free(ct);
+}
+
+const Sphere* ChunkTree_resident(const ChunkTree* ct, int* count) {
+    *count = ct->nresident;
+    return ct->resident;
+}
+
+ChunkStats ChunkTree_stats(const ChunkTree* ct) {
+    ChunkTree* mut = (ChunkTree*)ct;
+    omp_set_lock(&mut->lock);
+    ChunkStats stats = ct->stats;
+    omp_unset_lock(&mut->lock);
+    return stats;
+}
+
+// ChunkTreeHit is the implementation of hit for ChunkTree.
+// @see Hittable
+static HitData ChunkTree_hit(const void* ct, Vector source, Vector towards) {
+    const ChunkTree* tree = ct;
+    return Hittable_hit(HitTree_Hittable(&tree->top), source, towards);
+}
+
+// ChunkTreeOccluded is the implementation of occluded for ChunkTree.
+// @see Hittable
+static bool ChunkTree_occluded(const void* ct,
+                               Vector source,
+                               Vector towards,
+                               double t_max) {
+    const ChunkTree* tree = ct;
+    return Hittable_occluded(HitTree_Hittable(&tree->top), source, towards,
+                             t_max);
+}
+
+// ChunkTreeBounds is the implementation of bounds for ChunkTree.
+// @see Hittable
+static Box ChunkTree_bounds(const void* ct) {
+    const ChunkTree* tree = ct;
+    return Hittable_bounds(HitTree_Hittable(&tree->top));
+}
+
+// Schedules reads of the chunks that a ray enters, by walking the top-level
+// tree down the boxes that the ray passes through.
+// @param tree The tree.
+// @param source The source of the ray.
+// @param towards The direction of the ray.
+// @param stack Room for as many node indices as the top-level tree has.
+static void advise_ray(ChunkTree* tree,
+                       Vector source,
+                       Vector towards,
+                       int* stack) {
+    const _HitNode* nodes = tree->top.nodelist;
+    int depth = 0;
+    stack[depth++] = tree->top.length - 1;
+
+    while (depth) {
+        const _HitNode* node = nodes + stack[--depth];
+        if (!Box_is_through_until(node->bounds, source, towards, INFINITY)) {
+            continue;
+        }
+        if (node->left >= 0) {
+            stack[depth++] = node->left;
+            stack[depth++] = node->right;
+            continue;
+        }
+
+        // Resident spheres are leaves too.
+        if (node->hittable.hit != Chunk_hit) {
+            continue;
+        }
+        _Chunk* chunk = (_Chunk*)node->hittable.object;
+        if (!atomic_load_explicit(&chunk->advised, memory_order_relaxed) &&
+            !atomic_exchange(&chunk->advised, true)) {
+            _ChunkEntry e = chunk->entry;
+            off_t size =
+                e.spheres * sizeof(_DiskSphere) + e.nodes * sizeof(_QuantNode);
+            posix_fadvise(tree->fd, e.offset, size, POSIX_FADV_WILLNEED);
+            omp_set_lock(&tree->lock);
+            ++tree->stats.prefetches;
+            omp_unset_lock(&tree->lock);
+        }
+    }
+}
+
+// ChunkTreePrefetch is the implementation of prefetch for ChunkTree. The
+// kernel reads the chunks that the rays enter in the background, so that
+// paging them in later doesn't wait for the disk. Only the chunks along the
+// probed rays are visited, whatever the number of chunks.
+// @see Hittable
+static void ChunkTree_prefetch(const void* ct, const RayBatch* rays) {
+    ChunkTree* tree = (ChunkTree*)ct;
+    int* stack = malloc(tree->top.length * sizeof(int));
+    for (int k = 0; k < rays->length; k += CHUNK_PROBE) {
+        Vector source = {rays->ox[k], rays->oy[k], rays->oz[k]};
+        Vector towards = {rays->dx[k], rays->dy[k], rays->dz[k]};
+        advise_ray(tree, source, towards, stack);
+    }
+    free(stack);
+}
+
+Hittable ChunkTree_Hittable(const ChunkTree* ct) {
+    return (Hittable){
+        .object = ct,
+        .hit = ChunkTree_hit,
+        .occluded = ChunkTree_occluded,
+        .bounds = ChunkTree_bounds,
+        .prefetch = ChunkTree_prefetch,
+    };
+}
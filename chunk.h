@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "geometric.h"
+#include "hittable.h"
+#include "material.h"
+#include "object.h"
+
+// Chunk files hold scenes too large for memory. Spheres are partitioned by a
+// grid into spatial chunks, and every chunk is stored with its own quantized
+// tree, so that it can be paged in as a whole and traced right away. A few
+// spheres, typically the lights, are kept resident instead.
+//
+// Materials can't be stored, so spheres refer to them by index, and the
+// table of materials is given when the file is opened.
+
+// Writes a chunk file, with bounded memory. Spheres are spooled to a
+// temporary file as they are added, then every chunk is built on its own.
+// @author RenTrueWang
+typedef struct ChunkWriter ChunkWriter;
+
+// Renders a chunk file. Its top-level tree over the chunks and its resident
+// spheres stay in memory, and chunks are paged in on demand through an LRU
+// cache. Hits on a paged sphere refer to memory that may be evicted once the
+// query returns, so HitData.object must not be kept.
+// @author RenTrueWang
+typedef struct ChunkTree ChunkTree;
+
+// What a chunk tree's cache has been doing.
+// @author RenTrueWang
+typedef struct ChunkStats {
+    // Number of chunks read from the file.
+    unsigned long loads;
+    // Number of chunks dropped from the cache.
+    unsigned long evictions;
+    // Number of chunks that reads were scheduled ahead for.
+    unsigned long prefetches;
+    // Number of chunks that couldn't be read, because the file changed
+    // while it is open or their spheres refer to materials that don't exist.
+    // They are rendered as if they were empty.
+    unsigned long errors;
+    // Bytes of chunks in the cache now.
+    size_t resident;
+} ChunkStats;
+
+// Starts a chunk file.
+// @param path The file to write. Replaced only once it is finished.
+// @param bounds The region that the centers of the spheres lie in.
+// @param cells Number of chunks along every axis.
+// @param budget Bytes of spheres buffered before they are spooled.
+// @return A new ChunkWriter. NULL if the spool can't be created.
+ChunkWriter* ChunkWriter_make(const char* path,
+                              Box bounds,
+                              int cells,
+                              size_t budget);
+
+// Adds a sphere.
+// @param w The writer.
+// @param center The center of the sphere.
+// @param radius The radius of the sphere.
+// @param material The index of the material of the sphere.
+// @param resident Whether the sphere is kept in memory rather than in a
+// chunk. Lights must be, so that light samplers can refer to them.
+// @return False if the spool can't be written.
+bool ChunkWriter_add(ChunkWriter* w,
+                     Vector center,
+                     double radius,
+                     int material,
+                     bool resident);
+
+// Builds every chunk, writes the file, and frees the writer.
+// @param w The writer.
+// @return False if the file can't be written.
+bool ChunkWriter_finish(ChunkWriter* w);
+
+// Opens a chunk file.
+// @param path The file.
+// @param materials The materials that spheres refer to. Must outlive the
+// tree.
+// @param count Number of materials.
+// @param cache Bytes of chunks kept in memory. Chunks in use are never
+// evicted, so the cache may exceed it while many threads render.
+// @return A new ChunkTree. NULL if the file can't be read, its chunks or
+// their trees point outside of it, or its resident spheres refer to
+// materials that don't exist. The materials of paged spheres are checked as
+// they are read, and chunks that fail are counted in ChunkStats.errors.
+ChunkTree* ChunkTree_open(const char* path,
+                          const Material* materials,
+                          int count,
+                          size_t cache);
+
+// Free the tree and everything it has paged in.
+// @param ct ChunkTree to free.
+// @see free
+void ChunkTree_free(ChunkTree* ct);
+
+// The resident spheres, in the order they were added.
+// @param ct The tree.
+// @param count Where the number of resident spheres is stored.
+// @return The resident spheres.
+const Sphere* ChunkTree_resident(const ChunkTree* ct, int* count);
+
+// The statistics since the tree was opened.
+// @param ct The tree.
+// @return The statistics.
+ChunkStats ChunkTree_stats(const ChunkTree* ct);
+
+// Converts a ChunkTree to a Hittable. Its prefetch schedules reads of the
+// chunks that rays are about to enter.
+// @param ct ChunkTree to convert.
+// @return Hittable object that stores a ChunkTree.
+Hittable ChunkTree_Hittable(const ChunkTree* ct);
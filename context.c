@@ -0,0 +1,541 @@
+#include "context.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "hittable.h"
+#include "light.h"
+#include "object.h"
+
+// The number of spheres a chunk is sized for, when streaming.
+#define CTX_CHUNK 4096
+
+// Bytes of spheres buffered while a chunk file is written.
+#define CTX_SPOOL ((size_t)64 << 20)
+
+// Number of strata of the polar angle of an irradiance record's sweep.
+#define CTX_IRR_STRATA 8
+
+// A material owned by a context.
+typedef struct _CtxMaterial {
+    // Which member of the union is used.
+    MatKind kind;
+    union {
+        Matte matte;
+        Metal metal;
+        Glass glass;
+        Emissive emissive;
+    };
+} _CtxMaterial;
+
+// A sphere as added to a context. Its material is resolved on commit.
+typedef struct _CtxSphere {
+    // The center of the sphere.
+    Vector center;
+    // The radius of the sphere.
+    double radius;
+    // The index of the material.
+    int material;
+} _CtxSphere;
+
+// Everything built on commit. Read-only while rendering, so it can be copied
+// to every NUMA node.
+typedef struct _CtxReplica {
+    // The spheres.
+    Sphere* spheres;
+    // The tree over spheres. Freed once quantized.
+    HitTree ht;
+    // The quantized tree over spheres, if the context quantizes.
+    QuantTree qt;
+    // The emissive spheres.
+    LightList ll;
+    // The tree over the emissive spheres.
+    LightTree lt;
+    // The materials that streamed spheres refer to.
+    Material* mats;
+    // The streamed spheres, if the context streams.
+    ChunkTree* ct;
+} _CtxReplica;
+
+struct Context {
+    // The image properties.
+    ImgProp cfg;
+    // The camera.
+    Camera cam;
+
+    // The materials added so far.
+    _CtxMaterial* materials;
+    // Number of materials.
+    int nmaterials;
+    // Capacity of materials.
+    int cmaterials;
+
+    // The spheres added so far.
+    _CtxSphere* added;
+    // Number of spheres.
+    int nspheres;
+    // Capacity of added.
+    int cspheres;
+
+    // The nodes to replicate on. NULL keeps a single copy.
+    const Topology* topo;
+    // Whether the tree over spheres is quantized.
+    bool quantized;
+    // The chunk file spheres are streamed from. NULL keeps them in memory.
+    char* stream;
+    // Bytes of chunks kept in memory, when streaming.
+    size_t cache;
+    // How far irradiance records reach. 0 disables the irradiance cache.
+    double irr_accuracy;
+    // The smallest radius of an irradiance record.
+    double irr_min;
+    // The largest radius of an irradiance record.
+    double irr_max;
+    // Whether diffuse bounces are guided.
+    bool guided;
+    // Whether the paths of a tile are traced together, sorted by bounce.
+    bool reorder;
+    // Number of photons shot per generation. 0 disables caustics.
+    size_t photons;
+    // The radius the first generation of photons is gathered over.
+    double photon_radius;
+
+    // Whether everything below is built over everything above.
+    bool committed;
+    // One copy per node of the topology, or a single copy.
+    _CtxReplica* replicas;
+    // The scene of every replica.
+    Scene* scenes;
+    // The length of replicas and scenes.
+    int nreplicas;
+    // The irradiance cache shared by every replica. NULL if disabled.
+    IrrCache* irradiance;
+    // The guide shared by every replica. NULL if disabled.
+    Guide* guide;
+    // The photons shared by every replica. NULL if disabled.
+    PhotonMap* caustics;
+};
+
+Context* Ctx_make(ImgProp cfg, Camera cam) {
+    Context* ctx = calloc(1, sizeof(Context));
+    ctx->cfg = cfg;
+    ctx->cam = cam;
+    return ctx;
+}
+
+// Free the structures built by the last commit.
+// @param ctx The context to uncommit.
+static void uncommit(Context* ctx) {
+    if (!ctx->committed) {
+        return;
+    }
+    for (int i = 0; i < ctx->nreplicas; ++i) {
+        _CtxReplica* rep = ctx->replicas + i;
+        LightTree_free(&rep->lt);
+        LightList_free(&rep->ll);
+        HitTree_free(&rep->ht);
+        QuantTree_free(&rep->qt);
+        free(rep->spheres);
+        if (rep->ct) {
+            ChunkTree_free(rep->ct);
+        }
+        free(rep->mats);
+    }
+    if (ctx->irradiance) {
+        IrrCache_free(ctx->irradiance);
+        ctx->irradiance = NULL;
+    }
+    if (ctx->guide) {
+        Guide_free(ctx->guide);
+        ctx->guide = NULL;
+    }
+    if (ctx->caustics) {
+        PhotonMap_free(ctx->caustics);
+        ctx->caustics = NULL;
+    }
+    free(ctx->replicas);
+    free(ctx->scenes);
+    ctx->replicas = NULL;
+    ctx->scenes = NULL;
+    ctx->nreplicas = 0;
+    ctx->committed = false;
+}
+
+void Ctx_free(Context* ctx) {
+    uncommit(ctx);
+    free(ctx->materials);
+    free(ctx->added);
+    free(ctx->stream);
+    free(ctx);
+}
+
+void Ctx_set_cfg(Context* ctx, ImgProp cfg) {
+    ctx->cfg = cfg;
+    for (int i = 0; i < ctx->nreplicas; ++i) {
+        ctx->scenes[i].cfg = cfg;
+    }
+}
+
+void Ctx_set_camera(Context* ctx, Camera cam) {
+    ctx->cam = cam;
+    for (int i = 0; i < ctx->nreplicas; ++i) {
+        ctx->scenes[i].cam = cam;
+    }
+}
+
+void Ctx_set_reordered(Context* ctx, bool reorder) {
+    ctx->reorder = reorder;
+    for (int i = 0; i < ctx->nreplicas; ++i) {
+        ctx->scenes[i].reorder = reorder;
+    }
+}
+
+void Ctx_set_topology(Context* ctx, const Topology* topo) {
+    uncommit(ctx);
+    ctx->topo = topo;
+}
+
+void Ctx_set_quantized(Context* ctx, bool quantized) {
+    uncommit(ctx);
+    ctx->quantized = quantized;
+}
+
+void Ctx_set_irradiance(Context* ctx,
+                        double accuracy,
+                        double min_radius,
+                        double max_radius) {
+    uncommit(ctx);
+    ctx->irr_accuracy = accuracy;
+    ctx->irr_min = min_radius;
+    ctx->irr_max = max_radius;
+}
+
+void Ctx_set_guided(Context* ctx, bool guided) {
+    uncommit(ctx);
+    ctx->guided = guided;
+}
+
+void Ctx_set_caustics(Context* ctx, size_t photons, double radius) {
+    uncommit(ctx);
+    ctx->photons = photons;
+    ctx->photon_radius = radius;
+}
+
+void Ctx_set_streamed(Context* ctx, const char* path, size_t cache) {
+    uncommit(ctx);
+    free(ctx->stream);
+    ctx->stream = path ? strdup(path) : NULL;
+    ctx->cache = cache;
+}
+
+// Makes room for one more element at the end of an array.
+// @param list The array. Updated if it moves.
+// @param length The number of elements in the array.
+// @param capacity The capacity of the array. Updated if it grows.
+// @param size The size of an element.
+static void reserve(void** list, int length, int* capacity, size_t size) {
+    if (length < *capacity) {
+        return;
+    }
+    *capacity = *capacity ? 2 * *capacity : 8;
+    *list = realloc(*list, *capacity * size);
+    assert(*list);
+}
+
+// Adds a material to a context.
+// @param ctx The context to add to.
+// @param mat The material.
+// @return The index of the material.
+static int add_material(Context* ctx, _CtxMaterial mat) {
+    // Built spheres point into materials, which may move.
+    uncommit(ctx);
+    reserve((void**)&ctx->materials, ctx->nmaterials, &ctx->cmaterials,
+            sizeof(_CtxMaterial));
+    ctx->materials[ctx->nmaterials] = mat;
+    return ctx->nmaterials++;
+}
+
+int Ctx_matte(Context* ctx, Matte matte) {
+    _CtxMaterial mat = {.kind = MAT_MATTE, .matte = matte};
+    return add_material(ctx, mat);
+}
+
+int Ctx_metal(Context* ctx, Metal metal) {
+    _CtxMaterial mat = {.kind = MAT_METAL, .metal = metal};
+    return add_material(ctx, mat);
+}
+
+int Ctx_glass(Context* ctx, Glass glass) {
+    _CtxMaterial mat = {.kind = MAT_GLASS, .glass = glass};
+    return add_material(ctx, mat);
+}
+
+int Ctx_emissive(Context* ctx, Emissive emissive) {
+    _CtxMaterial mat = {.kind = MAT_EMISSIVE, .emissive = emissive};
+    return add_material(ctx, mat);
+}
+
+int Ctx_sphere(Context* ctx, Vector center, double radius, int material) {
+    if (material < 0 || material >= ctx->nmaterials) {
+        return -1;
+    }
+    uncommit(ctx);
+    reserve((void**)&ctx->added, ctx->nspheres, &ctx->cspheres,
+            sizeof(_CtxSphere));
+    ctx->added[ctx->nspheres] = (_CtxSphere){
+        .center = center,
+        .radius = radius,
+        .material = material,
+    };
+    return ctx->nspheres++;
+}
+
+// Converts a material owned by a context to Material.
+// @param mat The material to convert.
+// @return The material object that holds mat.
+static Material as_material(const _CtxMaterial* mat) {
+    switch (mat->kind) {
+        case MAT_MATTE:
+            return Matte_Mat(&mat->matte);
+        case MAT_METAL:
+            return Metal_Mat(&mat->metal);
+        case MAT_GLASS:
+            return Glass_Mat(&mat->glass);
+        case MAT_EMISSIVE:
+            return Emissive_Mat(&mat->emissive);
+        default:
+            assert(0 && "unreachable");
+            return Matte_Mat(&mat->matte);
+    }
+}
+
+// Writes the spheres of a context to its chunk file. Emissive spheres are
+// kept resident, so that light samplers can refer to them.
+// @param ctx The context.
+// @return False if the file can't be written.
+static bool write_chunks(const Context* ctx) {
+    int paged = 0;
+    Vector lo = ctx->added[0].center, hi = lo;
+    for (int i = 0; i < ctx->nspheres; ++i) {
+        _CtxSphere s = ctx->added[i];
+        paged += ctx->materials[s.material].kind != MAT_EMISSIVE;
+        lo = (Vector){fmin(lo.x, s.center.x), fmin(lo.y, s.center.y),
+                      fmin(lo.z, s.center.z)};
+        hi = (Vector){fmax(hi.x, s.center.x), fmax(hi.y, s.center.y),
+                      fmax(hi.z, s.center.z)};
+    }
+
+    int cells = (int)ceil(cbrt((double)paged / CTX_CHUNK));
+    Box bounds = Box_make(lo.x, hi.x, lo.y, hi.y, lo.z, hi.z);
+    ChunkWriter* w =
+        ChunkWriter_make(ctx->stream, bounds, cells ? cells : 1, CTX_SPOOL);
+    if (!w) {
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; ok && i < ctx->nspheres; ++i) {
+        _CtxSphere s = ctx->added[i];
+        bool light = ctx->materials[s.material].kind == MAT_EMISSIVE;
+        ok = ChunkWriter_add(w, s.center, s.radius, s.material, light);
+    }
+    // Finishing frees the writer, even if adding failed.
+    return ChunkWriter_finish(w) && ok;
+}
+
+// Builds one replica of a streaming context. Only the chunk file's top-level
+// tree and the lights are loaded; chunks are paged in while rendering.
+// @param ctx The context.
+// @param node Index of the replica to build.
+static void build_streamed(Context* ctx, int node) {
+    _CtxReplica* rep = ctx->replicas + node;
+
+    int count = ctx->nmaterials;
+    rep->mats = malloc(count * sizeof(Material));
+    for (int i = 0; i < count; ++i) {
+        rep->mats[i] = as_material(ctx->materials + i);
+    }
+    // Every replica pages chunks in on its own, so they share the budget.
+    size_t cache = ctx->cache / ctx->nreplicas;
+    rep->ct = ChunkTree_open(ctx->stream, rep->mats, count, cache);
+    if (!rep->ct) {
+        return;
+    }
+
+    int nres;
+    const Sphere* resident = ChunkTree_resident(rep->ct, &nres);
+    rep->ll = LightList_make(resident, nres);
+    rep->lt = LightTree_make(rep->ll);
+
+    ctx->scenes[node] = (Scene){
+        .cfg = ctx->cfg,
+        .cam = ctx->cam,
+        .hittable = ChunkTree_Hittable(rep->ct),
+        .lights = rep->ll.length ? LightTree_Sampler(&rep->lt)
+                                 : LightSampler_null(),
+        .reorder = ctx->reorder,
+    };
+}
+
+// Builds one replica of everything added to a context.
+// @param arg The context.
+// @param node Index of the replica to build.
+static void build(void* arg, int node) {
+    Context* ctx = arg;
+    _CtxReplica* rep = ctx->replicas + node;
+    if (ctx->stream) {
+        build_streamed(ctx, node);
+        return;
+    }
+
+    int count = ctx->nspheres;
+    rep->spheres = calloc(count, sizeof(Sphere));
+    HitList hl = HitList_make(count);
+    for (int i = 0; i < count; ++i) {
+        _CtxSphere s = ctx->added[i];
+        Material mat = as_material(ctx->materials + s.material);
+        rep->spheres[i] = Sph_make(s.center, s.radius, mat);
+        *HitList_getitem(hl, i) = Sph_Hittable(rep->spheres + i);
+    }
+    rep->ht = HitTree_make(hl);
+    HitList_free(&hl);
+    if (ctx->quantized) {
+        rep->qt = QuantTree_make(&rep->ht);
+        HitTree_free(&rep->ht);
+    }
+    rep->ll = LightList_make(rep->spheres, count);
+    rep->lt = LightTree_make(rep->ll);
+
+    ctx->scenes[node] = (Scene){
+        .cfg = ctx->cfg,
+        .cam = ctx->cam,
+        .hittable = ctx->quantized ? QuantTree_Hittable(&rep->qt)
+                                   : HitTree_Hittable(&rep->ht),
+        .lights = rep->ll.length ? LightTree_Sampler(&rep->lt)
+                                 : LightSampler_null(),
+        .reorder = ctx->reorder,
+    };
+}
+
+bool Ctx_commit(Context* ctx) {
+    uncommit(ctx);
+    if (!ctx->nspheres) {
+        return false;
+    }
+    if (ctx->stream && !write_chunks(ctx)) {
+        return false;
+    }
+
+    // Every replica is built by a thread on its own node, so its memory is
+    // allocated there. Building is deterministic, so replicas are identical.
+    int count = ctx->topo ? ctx->topo->nodes : 1;
+    ctx->replicas = calloc(count, sizeof(_CtxReplica));
+    ctx->scenes = calloc(count, sizeof(Scene));
+    ctx->nreplicas = count;
+    if (count > 1) {
+        Topo_each_node(*ctx->topo, build, ctx);
+    } else {
+        build(ctx, 0);
+    }
+
+    ctx->committed = true;
+    for (int i = 0; i < count; ++i) {
+        if (ctx->stream && !ctx->replicas[i].ct) {
+            uncommit(ctx);
+            return false;
+        }
+    }
+
+    // Records only hold positions and colors, so replicas can share them.
+    if (ctx->irr_accuracy > 0) {
+        ctx->irradiance = IrrCache_make(ctx->irr_accuracy, ctx->irr_min,
+                                        ctx->irr_max, CTX_IRR_STRATA);
+        for (int i = 0; i < count; ++i) {
+            ctx->scenes[i].irradiance = ctx->irradiance;
+        }
+    }
+
+    // Replicas learn together, so that every pass teaches all of them.
+    if (ctx->guided) {
+        ctx->guide = Guide_make();
+        for (int i = 0; i < count; ++i) {
+            ctx->scenes[i].guide = ctx->guide;
+        }
+    }
+
+    // Photons are shot through the first replica. They only hold positions
+    // and powers, so replicas can share them. Streamed spheres have no fixed
+    // addresses to tell the glass apart by, so they get no caustics.
+    if (ctx->photons && !ctx->stream) {
+        ctx->caustics =
+            PhotonMap_make(ctx->scenes[0].hittable, ctx->replicas[0].spheres,
+                           ctx->nspheres, ctx->photons, ctx->photon_radius);
+        PhotonMap_shoot(ctx->caustics);
+        for (int i = 0; i < count; ++i) {
+            ctx->scenes[i].photons = ctx->caustics;
+        }
+    }
+    return true;
+}
+
+Scene Ctx_scene(const Context* ctx) {
+    assert(ctx->committed);
+    return ctx->scenes[0];
+}
+
+const Scene* Ctx_replicas(const Context* ctx) {
+    assert(ctx->committed);
+    return ctx->scenes;
+}
+
+const Topology* Ctx_topology(const Context* ctx) {
+    return ctx->nreplicas > 1 ? ctx->topo : NULL;
+}
+
+ChunkStats Ctx_stream_stats(const Context* ctx) {
+    ChunkStats sum = {0};
+    for (int i = 0; i < ctx->nreplicas; ++i) {
+        if (!ctx->replicas[i].ct) {
+            continue;
+        }
+        ChunkStats s = ChunkTree_stats(ctx->replicas[i].ct);
+        sum.loads += s.loads;
+        sum.evictions += s.evictions;
+        sum.prefetches += s.prefetches;
+        sum.errors += s.errors;
+        sum.resident += s.resident;
+    }
+    return sum;
+}
+
+bool Ctx_render(const Context* ctx,
+                Tile region,
+                int size,
+                Frame frame,
+                unsigned seed,
+                TileDone done,
+                void* user) {
+    if (!ctx->committed || size <= 0) {
+        return false;
+    }
+
+    int width = ctx->cfg.width;
+    int height = ctx->cfg.height;
+    if (frame.width != width || frame.height != height) {
+        return false;
+    }
+    if (region.x0 < 0 || region.y0 < 0 || region.x1 > width ||
+        region.y1 > height || region.x0 > region.x1 ||
+        region.y0 > region.y1) {
+        return false;
+    }
+
+    TileList tl = TileList_region(region, size);
+    Rnd_render_replicas(Ctx_replicas(ctx), Ctx_topology(ctx), NULL, tl, frame,
+                        NULL, NULL, 0, seed, done, user);
+    TileList_free(&tl);
+    return true;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "chunk.h"
+#include "material.h"
+#include "numa.h"
+#include "render.h"
+#include "scene.h"
+
+// Context owns everything needed to render a scene: its materials, spheres,
+// acceleration structures and settings. The library keeps no state outside
+// of contexts, so any number of contexts can be used from different threads
+// of one process.
+//
+// A context is built up with Ctx_matte and friends, and Ctx_sphere, then
+// Ctx_commit builds its acceleration structures. A committed context can be
+// rendered by many threads at once, but must not be modified while it is
+// rendered. Modifying it requires another Ctx_commit before rendering.
+typedef struct Context Context;
+
+// Creates an empty context.
+// @param cfg The image properties.
+// @param cam The camera.
+// @return A new Context.
+Context* Ctx_make(ImgProp cfg, Camera cam);
+
+// Free the context and everything it owns.
+// @param ctx Context to free.
+// @see free
+void Ctx_free(Context* ctx);
+
+// Replaces the image properties. Doesn't require another commit.
+// @param ctx The context to modify.
+// @param cfg The new image properties.
+void Ctx_set_cfg(Context* ctx, ImgProp cfg);
+
+// Replaces the camera. Doesn't require another commit.
+// @param ctx The context to modify.
+// @param cam The new camera.
+void Ctx_set_camera(Context* ctx, Camera cam);
+
+// Replicates the acceleration structures and spheres on every node of a
+// topology from the next commit on, so that threads on every node trace
+// through local memory. Requires another commit.
+// @param ctx The context to modify.
+// @param topo The topology. Must outlive the context. NULL keeps one copy.
+void Ctx_set_topology(Context* ctx, const Topology* topo);
+
+// Stores the tree over the spheres with quantized bounds from the next
+// commit on. Images are identical; the tree takes several times less memory
+// and rays visit slightly more nodes. Requires another commit.
+// @param ctx The context to modify.
+// @param quantized Whether to quantize.
+void Ctx_set_quantized(Context* ctx, bool quantized);
+
+// Caches the indirect light of diffuse surfaces from the next commit on.
+// Paths stop at their first diffuse hit, and take its indirect light from
+// records interpolated over the surfaces, which are made as renders reach
+// them and kept until the next commit. Much faster for matte scenes, at the
+// cost of smooth low-frequency bias. Requires another commit.
+// @param ctx The context to modify.
+// @param accuracy How far records reach. 0 disables the cache.
+// @param min_radius The smallest radius of a record, in scene units.
+// @param max_radius The largest radius of a record, in scene units.
+// @see IrrCache
+void Ctx_set_irradiance(Context* ctx,
+                        double accuracy,
+                        double min_radius,
+                        double max_radius);
+
+// Guides diffuse bounces from the next commit on. The scene learns where
+// light comes from as it is rendered, and bounces sample towards it as well
+// as from the BSDF, so light through small gaps is found much sooner.
+// Learning happens between passes: call Guide_refine on the scene's guide
+// after every pass. Images stay unbiased. Requires another commit.
+// @param ctx The context to modify.
+// @param guided Whether to guide.
+// @see Guide
+void Ctx_set_guided(Context* ctx, bool guided);
+
+// Resolves the caustics of glass with photons from the next commit on.
+// Commits shoot the first generation of photons from the sky and the lights
+// through the glass spheres, and diffuse surfaces gather them instead of
+// tracing back through the glass. Call PhotonMap_shoot on the scene's
+// photons after every pass, so that the radius shrinks and the average of
+// the passes converges. Not supported when streaming. Requires another
+// commit.
+// @param ctx The context to modify.
+// @param photons Number of photons per generation. 0 disables caustics.
+// @param radius The radius the first generation is gathered over, in scene
+// units.
+// @see PhotonMap
+void Ctx_set_caustics(Context* ctx, size_t photons, double radius);
+
+// Traces the paths of every tile together, one bounce at a time, sorting
+// the rays before every bounce so that similar rays are traced one after
+// another. Faster for large scenes whose nodes don't fit in the cache.
+// Doesn't require another commit.
+// @param ctx The context to modify.
+// @param reorder Whether to sort.
+// @see Scn_trace_sorted
+void Ctx_set_reordered(Context* ctx, bool reorder);
+
+// Streams the spheres from a chunk file from the next commit on, for scenes
+// larger than memory. Commits write the file, then keep only the lights and
+// a tree over the chunks in memory, and chunks are paged in as rays reach
+// them. Images are identical. Requires another commit.
+// @param ctx The context to modify.
+// @param path The chunk file. Overwritten. NULL keeps spheres in memory.
+// @param cache Bytes of chunks kept in memory, split evenly between the
+// replicas of a NUMA topology.
+// @see ChunkTree
+void Ctx_set_streamed(Context* ctx, const char* path, size_t cache);
+
+// Adds a matte material. The material is copied.
+// @param ctx The context to add to.
+// @param matte The material.
+// @return The index of the material.
+int Ctx_matte(Context* ctx, Matte matte);
+
+// Adds a metal material. The material is copied.
+// @param ctx The context to add to.
+// @param metal The material.
+// @return The index of the material.
+int Ctx_metal(Context* ctx, Metal metal);
+
+// Adds a glass material. The material is copied.
+// @param ctx The context to add to.
+// @param glass The material.
+// @return The index of the material.
+int Ctx_glass(Context* ctx, Glass glass);
+
+// Adds an emissive material. The material is copied.
+// @param ctx The context to add to.
+// @param emissive The material.
+// @return The index of the material.
+int Ctx_emissive(Context* ctx, Emissive emissive);
+
+// Adds a sphere.
+// @param ctx The context to add to.
+// @param center The center of the sphere.
+// @param radius The radius of the sphere.
+// @param material The index of the material of the sphere.
+// @return The index of the sphere. -1 if material is not a valid index.
+int Ctx_sphere(Context* ctx, Vector center, double radius, int material);
+
+// Builds the acceleration structures and light samplers over everything
+// added so far.
+// @param ctx The context to commit.
+// @return False if the context has no sphere, or its chunk file can't be
+// written.
+bool Ctx_commit(Context* ctx);
+
+// The scene of a committed context, for use with the lower level renderers.
+// It refers to memory owned by the context, and is valid until the context
+// is modified or freed.
+// @param ctx The committed context.
+// @return The scene.
+Scene Ctx_scene(const Context* ctx);
+
+// The scene on every node of the context's topology, for use with
+// Rnd_render_replicas. Valid until the context is modified or freed.
+// @param ctx The committed context.
+// @return An array with one scene per node.
+const Scene* Ctx_replicas(const Context* ctx);
+
+// The topology that Ctx_replicas is indexed by.
+// @param ctx The committed context.
+// @return The topology, or NULL if there is a single replica.
+const Topology* Ctx_topology(const Context* ctx);
+
+// What the chunk caches of a streamed context have been doing, summed over
+// its replicas.
+// @param ctx The committed context.
+// @return The statistics. All 0 if the context isn't streamed.
+ChunkStats Ctx_stream_stats(const Context* ctx);
+
+// Renders a region of the image. Tiles are reported as soon as they are
+// finished, so results can be streamed out before the region is done.
+// @param ctx The committed context to render.
+// @param region The region to render. Its cost is ignored.
+// @param size The side length of a tile.
+// @param frame The output. The same size as the context's image. Only
+// pixels inside region are written.
+// @param seed The seed of the render. Pixels get the same samples whatever
+// region they are rendered as part of, as long as tiles are aligned alike.
+// @param done Called when a tile is finished. Can be NULL.
+// @param user Passed to done.
+// @return False if the context isn't committed, or region or frame don't
+// fit the image.
+bool Ctx_render(const Context* ctx,
+                Tile region,
+                int size,
+                Frame frame,
+                unsigned seed,
+                TileDone done,
+                void* user);
@@ -0,0 +1,239 @@
+#include "denoise.h"
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "macro.h"
+
+// Albedo below this is treated as black, so dividing by it is avoided.
+#define ALBEDO_EPS 1e-3f
+
+// Number of channels in the feature buffer.
+#define CHANNELS 7
+
+// The 1D B3-spline kernel. The 2D kernel is its outer product.
+static const float KERNEL[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+
+DenoiseCfg DenoiseCfg_default(void) {
+    return (DenoiseCfg){
+        .iterations = 5,
+        .sigma_color = 4.,
+        .sigma_normal = 128.,
+        .sigma_depth = .1,
+    };
+}
+
+// The features, split into one plane per channel so that the filter reads
+// consecutive floats when it moves along a row. (SoA)
+typedef struct Planes {
+    // Color divided by albedo.
+    float *r, *g, *b;
+    // The unit normal.
+    float *nx, *ny, *nz;
+    // The depth. FLT_MAX for the sky.
+    float* z;
+} Planes;
+
+// Clamps an index into the range [0, n).
+// @param i The index.
+// @param n The length.
+// @return The clamped index.
+static inline int clamp_idx(int i, int n) {
+    return (i < 0) ? 0 : (i >= n) ? n - 1 : i;
+}
+
+// One a-trous pass: every pixel becomes the weighted average of 5x5 taps that
+// are step pixels apart, weighted by the kernel and by the similarity of the
+// features.
+// @param in The colors and features to read.
+// @param out Where the filtered colors are written. Features are not copied.
+// @param width The width of the image.
+// @param height The height of the image.
+// @param step The distance between taps.
+// @param cfg The parameters of the filter.
+static void atrous_pass(Planes in,
+                        Planes out,
+                        int width,
+                        int height,
+                        int step,
+                        DenoiseCfg cfg) {
+    // Depth is compared less strictly for taps further apart, because depth
+    // changes with distance even on the same surface.
+    float inv_color = 1.f / (float)(cfg.sigma_color * cfg.sigma_color);
+    float sigma_n = (float)cfg.sigma_normal;
+    float inv_depth = 1.f / (float)(cfg.sigma_depth * step);
+
+#pragma omp parallel default(none) \
+    shared(in, out, width, height, step, inv_color, sigma_n, inv_depth, KERNEL)
+    {
+        // Per-row accumulators, so the inner loop runs along x and vectorizes.
+        float* sr = calloc(width, sizeof(float));
+        float* sg = calloc(width, sizeof(float));
+        float* sb = calloc(width, sizeof(float));
+        float* sw = calloc(width, sizeof(float));
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                sr[x] = sg[x] = sb[x] = sw[x] = 0;
+            }
+
+            const float* pr = in.r + y * width;
+            const float* pg = in.g + y * width;
+            const float* pb = in.b + y * width;
+            const float* pnx = in.nx + y * width;
+            const float* pny = in.ny + y * width;
+            const float* pnz = in.nz + y * width;
+            const float* pz = in.z + y * width;
+
+            for (int ky = 0; ky < 5; ++ky) {
+                int qy = clamp_idx(y + (ky - 2) * step, height);
+                const float* qr = in.r + qy * width;
+                const float* qg = in.g + qy * width;
+                const float* qb = in.b + qy * width;
+                const float* qnx = in.nx + qy * width;
+                const float* qny = in.ny + qy * width;
+                const float* qnz = in.nz + qy * width;
+                const float* qz = in.z + qy * width;
+
+                for (int kx = 0; kx < 5; ++kx) {
+                    float k = KERNEL[ky] * KERNEL[kx];
+                    int dx = (kx - 2) * step;
+
+#pragma omp simd
+                    for (int x = 0; x < width; ++x) {
+                        int q = clamp_idx(x + dx, width);
+
+                        float dr = pr[x] - qr[q];
+                        float dg = pg[x] - qg[q];
+                        float db = pb[x] - qb[q];
+                        float dc = (dr * dr + dg * dg + db * db) * inv_color;
+
+                        float cos = pnx[x] * qnx[q] + pny[x] * qny[q] +
+                                    pnz[x] * qnz[q];
+                        float wn = powf(fmaxf(0.f, cos), sigma_n);
+                        // Two sky pixels (no normals) are always similar.
+                        wn = (pnx[x] == 0 && pny[x] == 0 && pnz[x] == 0 &&
+                              qnx[q] == 0 && qny[q] == 0 && qnz[q] == 0)
+                                 ? 1.f
+                                 : wn;
+
+                        float dz = fabsf(pz[x] - qz[q]) /
+                                   fmaxf(fminf(pz[x], qz[q]), FLT_MIN);
+
+                        float w = k * wn * expf(-dc - dz * inv_depth);
+                        sr[x] += w * qr[q];
+                        sg[x] += w * qg[q];
+                        sb[x] += w * qb[q];
+                        sw[x] += w;
+                    }
+                }
+            }
+
+#pragma omp simd
+            for (int x = 0; x < width; ++x) {
+                // The center tap always has weight > 0, so sw is positive.
+                float inv = 1.f / sw[x];
+                out.r[y * width + x] = sr[x] * inv;
+                out.g[y * width + x] = sg[x] * inv;
+                out.b[y * width + x] = sb[x] * inv;
+            }
+        }
+
+        free(sr);
+        free(sg);
+        free(sb);
+        free(sw);
+    }
+}
+
+// Allocates planes.
+// @param size Number of pixels.
+// @param features Whether normal and depth planes are allocated, or only
+// color planes.
+// @return The new planes.
+static Planes planes_make(int size, bool features) {
+    Planes pl = {
+        .r = calloc(size, sizeof(float)),
+        .g = calloc(size, sizeof(float)),
+        .b = calloc(size, sizeof(float)),
+    };
+    if (features) {
+        pl.nx = calloc(size, sizeof(float));
+        pl.ny = calloc(size, sizeof(float));
+        pl.nz = calloc(size, sizeof(float));
+        pl.z = calloc(size, sizeof(float));
+    }
+    return pl;
+}
+
+// Frees planes allocated with planes_make.
+// @param pl The planes to free.
+static void planes_free(Planes pl) {
+    float* all[CHANNELS] = {pl.r, pl.g, pl.b, pl.nx, pl.ny, pl.nz, pl.z};
+    for (int i = 0; i < CHANNELS; ++i) {
+        free(all[i]);
+    }
+}
+
+// Divides out the albedo of one channel.
+// @param color The color channel.
+// @param albedo The albedo channel.
+// @return The color that the surface receives.
+static float demodulate(double color, double albedo) {
+    return (float)(color / fmax(albedo, ALBEDO_EPS));
+}
+
+void Dn_atrous(Frame frame, DenoiseCfg cfg) {
+    assert(frame.aov);
+
+    int width = frame.width;
+    int height = frame.height;
+    int size = width * height;
+
+    Planes cur = planes_make(size, true);
+    Planes next = planes_make(size, false);
+
+#pragma omp parallel for simd default(none) shared(frame, cur, size)
+    for (int i = 0; i < size; ++i) {
+        Vector c = frame.radiance[i];
+        Aov aov = frame.aov[i];
+        cur.r[i] = demodulate(c.x, aov.albedo.x);
+        cur.g[i] = demodulate(c.y, aov.albedo.y);
+        cur.b[i] = demodulate(c.z, aov.albedo.z);
+        cur.nx[i] = (float)aov.normal.x;
+        cur.ny[i] = (float)aov.normal.y;
+        cur.nz[i] = (float)aov.normal.z;
+        cur.z[i] = isinf(aov.depth) ? FLT_MAX : (float)aov.depth;
+    }
+
+    // Features are shared by both buffers, only colors ping-pong.
+    next.nx = cur.nx;
+    next.ny = cur.ny;
+    next.nz = cur.nz;
+    next.z = cur.z;
+
+    for (int i = 0; i < cfg.iterations; ++i) {
+        atrous_pass(cur, next, width, height, 1 << i, cfg);
+        swap(Planes, cur, next);
+    }
+
+#pragma omp parallel for default(none) shared(frame, cur, size)
+    for (int i = 0; i < size; ++i) {
+        Vector albedo = frame.aov[i].albedo;
+        Vector c = {
+            cur.r[i] * fmax(albedo.x, ALBEDO_EPS),
+            cur.g[i] * fmax(albedo.y, ALBEDO_EPS),
+            cur.b[i] * fmax(albedo.z, ALBEDO_EPS),
+        };
+        frame.radiance[i] = c;
+        frame.image[i] = Vec_2Px(c);
+    }
+
+    next.nx = next.ny = next.nz = next.z = NULL;
+    planes_free(cur);
+    planes_free(next);
+}
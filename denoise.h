@@ -0,0 +1,29 @@
+#pragma once
+
+#include "render.h"
+
+// Parameters of the edge-aware denoiser.
+// @author RenTrueWang
+typedef struct DenoiseCfg {
+    // Number of a-trous passes. Pass i filters with taps 2^i pixels apart, so
+    // the footprint grows to 4 * 2^iterations pixels wide.
+    int iterations;
+    // How much a neighbor's color may differ before it stops contributing.
+    double sigma_color;
+    // How much a neighbor's normal may differ. Larger is more permissive.
+    double sigma_normal;
+    // How much a neighbor's relative depth may differ.
+    double sigma_depth;
+} DenoiseCfg;
+
+// Default parameters, suitable for previews rendered with 4-16 samples.
+// @return The default DenoiseCfg.
+DenoiseCfg DenoiseCfg_default(void);
+
+// Denoises a frame in place with an edge-aware a-trous wavelet filter, guided
+// by the frame's first-hit features. The albedo is divided out before
+// filtering and multiplied back after, so textures are not blurred. Both
+// radiance and image are updated.
+// @param frame The frame to denoise. frame.aov must not be NULL.
+// @param cfg The parameters of the filter.
+void Dn_atrous(Frame frame, DenoiseCfg cfg);
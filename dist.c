@@ -0,0 +1,422 @@
+#include "dist.h"
+
+#include <assert.h>
+#include <omp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "camera.h"
+#include "macro.h"
+#include "net.h"
+
+// How long the coordinator waits for messages before checking on idle
+// workers again, in milliseconds.
+#define POLL_MS 100
+
+// Sent by the coordinator to a worker that connects.
+typedef struct _DistHello {
+    // The coordinator's image properties.
+    ImgProp cfg;
+    // The coordinator's camera.
+    Camera cam;
+} _DistHello;
+
+// A tile that a worker is asked to render.
+typedef struct _DistJob {
+    // Index of the tile in the coordinator's TileList.
+    int32_t index;
+    // The tile.
+    Tile tile;
+    // The seed of the tile.
+    uint32_t seed;
+} _DistJob;
+
+// Precedes the radiance of a rendered tile.
+typedef struct _DistResult {
+    // Index of the tile in the coordinator's TileList.
+    int32_t index;
+    // Number of radiance values that follow.
+    int32_t count;
+} _DistResult;
+
+// A worker, as seen by the coordinator.
+typedef struct _DistPeer {
+    // The socket.
+    int fd;
+    // Number of tiles the worker renders at once.
+    int slots;
+    // Indices of tiles handed to the worker and not yet returned.
+    int* held;
+    // The length of held.
+    int nheld;
+} _DistPeer;
+
+// Greets a newly connected worker.
+// @param fd The worker's socket.
+// @param scene The coordinator's scene.
+// @param peer Where the worker is recorded.
+// @return False if the worker can't be greeted.
+static bool greet(int fd, Scene scene, _DistPeer* peer) {
+    _DistHello hello = {.cfg = scene.cfg, .cam = scene.cam};
+    int32_t slots;
+    if (!Net_write(fd, &hello, sizeof(hello)) ||
+        !Net_read(fd, &slots, sizeof(slots)) || slots <= 0) {
+        return false;
+    }
+
+    *peer = (_DistPeer){
+        .fd = fd,
+        .slots = slots,
+        .held = calloc(slots, sizeof(int)),
+        .nheld = 0,
+    };
+    return true;
+}
+
+// Disconnects a worker. Its tiles are handed out again.
+// @param peer The worker.
+// @param owners Number of workers holding each tile.
+static void drop(_DistPeer* peer, int* owners) {
+    for (int i = 0; i < peer->nheld; ++i) {
+        --owners[peer->held[i]];
+    }
+    close(peer->fd);
+    free(peer->held);
+    peer->fd = -1;
+    peer->held = NULL;
+    peer->nheld = 0;
+}
+
+// Whether a worker holds a tile.
+// @param peer The worker.
+// @param index The index of the tile.
+// @return True if the tile is held by the worker.
+static bool holds(const _DistPeer* peer, int index) {
+    for (int i = 0; i < peer->nheld; ++i) {
+        if (peer->held[i] == index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hands out a batch of tiles to an idle worker. Tiles nobody holds go first,
+// in list order. When there are none, tiles held by others are duplicated,
+// those handed out the earliest first, because their holders are the most
+// likely to be slow.
+// @param peer The idle worker.
+// @param tl The tiles.
+// @param done Whether each tile is done.
+// @param owners Number of workers holding each tile.
+// @param issued When each tile was last handed out.
+// @param width The width of the image.
+// @param seed The seed of the frame.
+// @return False if the worker can't be reached.
+static bool assign(_DistPeer* peer,
+                   TileList tl,
+                   const bool* done,
+                   int* owners,
+                   double* issued,
+                   int width,
+                   unsigned seed) {
+    _DistJob* jobs = calloc(peer->slots, sizeof(_DistJob));
+    int count = 0;
+
+    for (int i = 0; i < tl.length && count < peer->slots; ++i) {
+        if (!done[i] && !owners[i]) {
+            peer->held[count] = i;
+            jobs[count++] = (_DistJob){.index = i};
+        }
+    }
+
+    while (count < peer->slots) {
+        int oldest = -1;
+        for (int i = 0; i < tl.length; ++i) {
+            bool taken = false;
+            for (int j = 0; j < count && !taken; ++j) {
+                taken = jobs[j].index == i;
+            }
+            if (!done[i] && !taken &&
+                (oldest < 0 || issued[i] < issued[oldest])) {
+                oldest = i;
+            }
+        }
+        if (oldest < 0) {
+            break;
+        }
+        peer->held[count] = oldest;
+        jobs[count++] = (_DistJob){.index = oldest};
+    }
+
+    double now = omp_get_wtime();
+    for (int i = 0; i < count; ++i) {
+        int index = jobs[i].index;
+        jobs[i].tile = tl.list[index];
+        jobs[i].seed = Tile_seed(tl.list[index], width, seed);
+        ++owners[index];
+        issued[index] = now;
+    }
+    peer->nheld = count;
+
+    int32_t n = count;
+    bool ok = !count || (Net_write(peer->fd, &n, sizeof(n)) &&
+                         Net_write(peer->fd, jobs, count * sizeof(_DistJob)));
+    free(jobs);
+    return ok;
+}
+
+// Receives a rendered tile from a worker.
+// @param peer The worker.
+// @param tl The tiles.
+// @param frame The output.
+// @param done Whether each tile is done. Updated.
+// @param owners Number of workers holding each tile. Updated.
+// @return Number of tiles newly done (0 or 1), or -1 if the worker is gone.
+static int receive(_DistPeer* peer,
+                   TileList tl,
+                   Frame frame,
+                   bool* done,
+                   int* owners) {
+    _DistResult res;
+    if (!Net_read(peer->fd, &res, sizeof(res)) || res.index < 0 ||
+        res.index >= tl.length || !holds(peer, res.index)) {
+        return -1;
+    }
+
+    Tile tile = tl.list[res.index];
+    int tw = tile.x1 - tile.x0;
+    int th = tile.y1 - tile.y0;
+    if (res.count != tw * th) {
+        return -1;
+    }
+
+    Vector* buf = calloc(res.count, sizeof(Vector));
+    if (!Net_read(peer->fd, buf, res.count * sizeof(Vector))) {
+        free(buf);
+        return -1;
+    }
+
+    // Remove the tile from the worker's held tiles.
+    for (int i = 0; i < peer->nheld; ++i) {
+        if (peer->held[i] == res.index) {
+            peer->held[i] = peer->held[--peer->nheld];
+            break;
+        }
+    }
+    --owners[res.index];
+
+    int fresh = 0;
+    if (!done[res.index]) {
+        // The first copy of a duplicated tile wins, the rest are dropped.
+        for (int y = 0; y < th; ++y) {
+            for (int x = 0; x < tw; ++x) {
+                int idx = (tile.y0 + y) * frame.width + tile.x0 + x;
+                frame.radiance[idx] = buf[y * tw + x];
+                frame.image[idx] = Vec_2Px(buf[y * tw + x]);
+            }
+        }
+        done[res.index] = true;
+        fresh = 1;
+    }
+    free(buf);
+    return fresh;
+}
+
+bool Dist_coordinate(Scene scene,
+                     TileList tl,
+                     Frame frame,
+                     const char* addr,
+                     unsigned seed) {
+    int lfd = Net_open(addr, true);
+    if (lfd < 0) {
+        return false;
+    }
+
+    bool* done = calloc(tl.length, sizeof(bool));
+    int* owners = calloc(tl.length, sizeof(int));
+    double* issued = calloc(tl.length, sizeof(double));
+
+    int cap = 16;
+    _DistPeer* peers = calloc(cap, sizeof(_DistPeer));
+    struct pollfd* fds = calloc(cap + 1, sizeof(struct pollfd));
+    int npeers = 0;
+
+    int remaining = tl.length;
+    while (remaining) {
+        for (int i = 0; i < npeers; ++i) {
+            _DistPeer* peer = peers + i;
+            if (peer->fd >= 0 && !peer->nheld &&
+                !assign(peer, tl, done, owners, issued, frame.width, seed)) {
+                drop(peer, owners);
+            }
+        }
+
+        fds[0] = (struct pollfd){.fd = lfd, .events = POLLIN};
+        for (int i = 0; i < npeers; ++i) {
+            // Negative descriptors are ignored by poll.
+            fds[i + 1] = (struct pollfd){.fd = peers[i].fd, .events = POLLIN};
+        }
+        if (poll(fds, npeers + 1, POLL_MS) <= 0) {
+            continue;
+        }
+
+        for (int i = 0; i < npeers; ++i) {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            int fresh = receive(peers + i, tl, frame, done, owners);
+            if (fresh < 0) {
+                drop(peers + i, owners);
+            } else {
+                remaining -= fresh;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+            if (npeers == cap) {
+                cap *= 2;
+                peers = realloc(peers, cap * sizeof(_DistPeer));
+                fds = realloc(fds, (cap + 1) * sizeof(struct pollfd));
+            }
+            if (greet(fd, scene, peers + npeers)) {
+                ++npeers;
+            } else {
+                close(fd);
+            }
+        }
+    }
+
+    // Tell every worker that the frame is done.
+    int32_t quit = 0;
+    for (int i = 0; i < npeers; ++i) {
+        if (peers[i].fd >= 0) {
+            Net_write(peers[i].fd, &quit, sizeof(quit));
+            drop(peers + i, owners);
+        }
+    }
+
+    close(lfd);
+    if (!strncmp(addr, "unix:", 5)) {
+        unlink(addr + 5);
+    }
+    free(fds);
+    free(peers);
+    free(issued);
+    free(owners);
+    free(done);
+    return true;
+}
+
+// Renders one tile for the coordinator.
+// @param scene The scene.
+// @param lens The scene's camera, prepared for the image.
+// @param job The tile to render.
+// @param scratch The buffers of sorted traces, for scenes that reorder them.
+// @param buf Where the radiance is written, row-major within the tile.
+static void render_job(const Scene* scene,
+                       const Lens* lens,
+                       _DistJob job,
+                       SortScratch* scratch,
+                       Vector* buf) {
+    Tile tile = job.tile;
+    int size = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    int samples = scene->cfg.samples;
+    unsigned ts = job.seed;
+
+    // Same rays, order and seeds as Rnd_render, so images are identical.
+    RayBatch rays = RayBatch_make(size * samples);
+    Lens_rays(lens, tile.x0, tile.y0, tile.x1, tile.y1, samples, &ts, &rays);
+    if (scene->reorder) {
+        Scn_trace_sorted(scene, &rays, samples, scratch, &ts, buf, NULL);
+    } else {
+        for (int k = 0; k < size; ++k) {
+            buf[k] =
+                Scn_trace_rays(scene, &rays, k * samples, samples, &ts, NULL);
+        }
+    }
+    RayBatch_free(&rays);
+}
+
+bool Dist_work(Scene scene, const char* addr) {
+    int fd = Net_open(addr, false);
+    if (fd < 0) {
+        return false;
+    }
+
+    _DistHello hello;
+    int32_t slots = omp_get_max_threads();
+    if (!Net_read(fd, &hello, sizeof(hello)) ||
+        !Net_write(fd, &slots, sizeof(slots))) {
+        close(fd);
+        return false;
+    }
+    scene.cfg = hello.cfg;
+    scene.cam = hello.cam;
+    Lens lens = Lens_make(scene.cam, scene.cfg.width, scene.cfg.height);
+    // One per thread, made by the thread's first tile of a reordered scene.
+    SortScratch** scratch = calloc(slots, sizeof(SortScratch*));
+
+    bool ok = true;
+    forever {
+        int32_t count;
+        if (!Net_read(fd, &count, sizeof(count)) || count > slots) {
+            ok = false;
+            break;
+        }
+        if (count <= 0) {
+            break;
+        }
+
+        _DistJob* jobs = calloc(count, sizeof(_DistJob));
+        if (!Net_read(fd, jobs, count * sizeof(_DistJob))) {
+            free(jobs);
+            ok = false;
+            break;
+        }
+
+        // Every thread renders its own tile, and sends it as soon as it is
+        // done.
+#pragma omp parallel for schedule(dynamic, 1) default(none) \
+    shared(scene, lens, scratch, jobs, count, fd, ok)
+        for (int i = 0; i < count; ++i) {
+            Tile tile = jobs[i].tile;
+            int size = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+            Vector* buf = calloc(size, sizeof(Vector));
+            int thread = omp_get_thread_num();
+            if (scene.reorder && !scratch[thread]) {
+                scratch[thread] = SortScratch_make();
+            }
+            render_job(&scene, &lens, jobs[i], scratch[thread], buf);
+
+            _DistResult res = {.index = jobs[i].index, .count = size};
+#pragma omp critical(dist_send)
+            {
+                ok = ok && Net_write(fd, &res, sizeof(res)) &&
+                     Net_write(fd, buf, size * sizeof(Vector));
+            }
+            free(buf);
+        }
+        free(jobs);
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < slots; ++i) {
+        if (scratch[i]) {
+            SortScratch_free(scratch[i]);
+        }
+    }
+    free(scratch);
+    close(fd);
+    return ok;
+}
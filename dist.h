@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "render.h"
+#include "scene.h"
+
+// Addresses are either "unix:/path/to/socket" or "tcp:host:port".
+
+// Renders a frame by handing out tiles to worker processes that connect to
+// the given address. Workers may join at any time. Every worker is given as
+// many tiles at a time as it has threads; when no tile is left, tiles still
+// being rendered by others are handed out again, so a slow worker can't hold
+// up the frame, and tiles of workers that disconnect are rendered elsewhere.
+// @param scene The scene. Its image properties and camera are sent to the
+// workers.
+// @param tl The tiles to render, in dispatch order.
+// @param frame The output. Only radiance and image are written.
+// @param addr The address to listen on.
+// @param seed The seed of the frame.
+// @return True if the frame is rendered. False if addr can't be listened on.
+bool Dist_coordinate(Scene scene,
+                     TileList tl,
+                     Frame frame,
+                     const char* addr,
+                     unsigned seed);
+
+// Connects to a coordinator and renders the tiles that it hands out, until
+// the coordinator is done.
+// @param scene The scene, loaded by the worker itself. Its image properties
+// and camera are replaced by the coordinator's.
+// @param addr The address of the coordinator.
+// @return True if the worker exits because the coordinator is done.
+bool Dist_work(Scene scene, const char* addr);
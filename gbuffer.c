@@ -0,0 +1,148 @@
+#include "gbuffer.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+// The direction of the camera ray through a position.
+// @param gb The buffer.
+// @param k The index of the position.
+// @return The direction. Not normalized.
+static Vector towards(const GBuffer* gb, size_t k) {
+    Lens lens = gb->lens;
+    Vector h = Vec_mul_s(lens.horiz, gb->fx[k]);
+    Vector v = Vec_mul_s(lens.vertic, gb->fy[k]);
+    Vector end = Vec_add(lens.corner, Vec_add(h, v));
+    return Vec_sub(end, lens.source);
+}
+
+// The cached first hit of a position, as the scene would report it.
+// @param gb The buffer.
+// @param k The index of the position.
+// @return The hit.
+static HitData first_hit(const GBuffer* gb, size_t k) {
+    const Sphere* sphere = gb->sphere[k];
+    if (!sphere) {
+        return HitData_miss();
+    }
+
+    Vector point = gb->point[k];
+    Vector normal = Sph_normal(*sphere, point);
+    HitData hd = HitData_hit(gb->t[k], point, normal, sphere->mat);
+    hd.object = sphere;
+    return hd;
+}
+
+GBuffer GBuf_make(const Scene* scene, int positions, unsigned seed) {
+    assert(positions > 0);
+    assert(scene->cam.aperture == 0);
+
+    int width = scene->cfg.width;
+    int height = scene->cfg.height;
+    size_t count = (size_t)width * height * positions;
+
+    GBuffer gb = {
+        .width = width,
+        .height = height,
+        .positions = positions,
+        .lens = Lens_make(scene->cam, width, height),
+        .fx = malloc(count * sizeof(float)),
+        .fy = malloc(count * sizeof(float)),
+        .t = malloc(count * sizeof(float)),
+        .point = malloc(count * sizeof(Vector)),
+        .sphere = malloc(count * sizeof(Sphere*)),
+    };
+
+#pragma omp parallel for schedule(dynamic, 1) default(none) \
+    shared(gb, scene, width, height, positions, seed)
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int idx = y * width + x;
+            // Seeded by position, so the buffer doesn't depend on threads.
+            // Hashed, so that pixels draw unrelated positions whatever seed
+            // they are given.
+            unsigned ps = hash32(seed + (unsigned)idx);
+
+            for (int s = 0; s < positions; ++s) {
+                size_t k = (size_t)idx * positions + s;
+                gb.fx[k] = (x + genfloat(&ps)) * gb.lens.inv_width;
+                gb.fy[k] = (y + genfloat(&ps)) * gb.lens.inv_height;
+
+                HitData hd = Hittable_hit(scene->hittable, gb.lens.source,
+                                          towards(&gb, k));
+                bool hit = HitData_has_hit(hd);
+                assert(!hit || hd.object);
+                gb.t[k] = hd.t;
+                gb.point[k] = hd.point;
+                gb.sphere[k] = hit ? hd.object : NULL;
+            }
+        }
+    }
+    return gb;
+}
+
+void GBuf_free(GBuffer* gb) {
+    free(gb->fx);
+    free(gb->fy);
+    free(gb->t);
+    free(gb->point);
+    free(gb->sphere);
+    gb->fx = NULL;
+    gb->fy = NULL;
+    gb->t = NULL;
+    gb->point = NULL;
+    gb->sphere = NULL;
+}
+
+bool GBuf_matches(const GBuffer* gb, const Scene* scene) {
+    int width = scene->cfg.width;
+    int height = scene->cfg.height;
+    if (gb->width != width || gb->height != height) {
+        return false;
+    }
+
+    // Lens is all doubles, so it has no padding to compare.
+    Lens lens = Lens_make(scene->cam, width, height);
+    return !memcmp(&lens, &gb->lens, sizeof(Lens));
+}
+
+Vector GBuf_radiance(const GBuffer* gb,
+                     const Scene* scene,
+                     int x,
+                     int y,
+                     int first,
+                     int count,
+                     unsigned* seed,
+                     Aov* aov) {
+    assert(x >= 0 && x < gb->width);
+    assert(y >= 0 && y < gb->height);
+    assert(first >= 0);
+    assert(count > 0);
+
+    size_t base = ((size_t)y * gb->width + x) * gb->positions;
+    Vector color = Vec_o();
+    Aov sum = {.albedo = Vec_o(), .normal = Vec_o(), .depth = 0};
+    for (int i = 0; i < count; ++i) {
+        size_t k = base + (first + i) % gb->positions;
+
+        Aov sa;
+        Aov* rec = aov ? &sa : NULL;
+        Vector sc = Scn_trace_hit(scene, gb->lens.source, towards(gb, k),
+                                  first_hit(gb, k), seed, rec);
+
+        Vec_iadd(&color, sc);
+        if (aov) {
+            Vec_iadd(&sum.albedo, sa.albedo);
+            Vec_iadd(&sum.normal, sa.normal);
+            sum.depth += sa.depth;
+        }
+    }
+    Vec_idiv_s(&color, count);
+
+    if (aov) {
+        *aov = Aov_mean(sum, count);
+    }
+    return color;
+}
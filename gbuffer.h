@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "camera.h"
+#include "object.h"
+#include "scene.h"
+
+// GBuffer caches the first hit of camera rays, so that renders that trace a
+// static scene many times over start every path at its first bounce instead
+// of traversing the scene for it. Every pixel gets a fixed set of positions
+// that camera rays pass through, and the rays through a position always hit
+// the same surface. Only for pinhole cameras, whose rays all leave from the
+// same point.
+//
+// Renders that take more samples of a pixel than it has positions reuse the
+// positions in turn, so antialiasing converges to the average over the
+// positions rather than over the whole pixel.
+// @author RenTrueWang
+typedef struct GBuffer {
+    // The width of the image.
+    int width;
+    // The height of the image.
+    int height;
+    // Number of positions per pixel.
+    int positions;
+    // The camera that the buffer is valid for.
+    Lens lens;
+    // Where every position is on the viewport, in [0, 1]. The positions of a
+    // pixel are consecutive, and pixels are row-major.
+    float *fx, *fy;
+    // The parameter of every first hit. Only tells hits from misses.
+    float* t;
+    // The point of every first hit.
+    Vector* point;
+    // The sphere of every first hit. NULL for rays that hit nothing.
+    const Sphere** sphere;
+} GBuffer;
+
+// Traces the first hit of every position of every pixel.
+// @param scene The scene. Its spheres must outlive the buffer, so it can't
+// be streamed from a chunk file. Its camera must be a pinhole one.
+// @param positions Number of positions per pixel.
+// @param seed The seed the positions are drawn with.
+// @return A new GBuffer.
+GBuffer GBuf_make(const Scene* scene, int positions, unsigned seed);
+
+// Free the resources controlled by GBuffer.
+// @param gb GBuffer to free.
+// @see free
+void GBuf_free(GBuffer* gb);
+
+// Checks if a buffer can be used to render a scene: its camera and image
+// size must be the ones the buffer was made for.
+// @param gb The buffer.
+// @param scene The scene.
+// @return True if the buffer is valid for the scene.
+bool GBuf_matches(const GBuffer* gb, const Scene* scene);
+
+// Determines the radiance of a pixel from its cached first hits, averaged
+// over a range of its positions.
+// @param gb The buffer.
+// @param scene The scene the buffer was made for.
+// @param x The X position of the pixel.
+// @param y The Y position of the pixel.
+// @param first The index of the first position. Wraps around.
+// @param count Number of samples.
+// @param seed The seed pointer for the random number generator.
+// @param aov Where to record the averaged features. Can be NULL.
+// @return The radiance calculated. Not limited to [0, 1].
+Vector GBuf_radiance(const GBuffer* gb,
+                     const Scene* scene,
+                     int x,
+                     int y,
+                     int first,
+                     int count,
+                     unsigned* seed,
+                     Aov* aov);
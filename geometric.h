@@ -1,5 +1,7 @@
 #pragma once
 
+#include <assert.h>
+#include <math.h>
 #include <stdbool.h>
 
 #include "pixel.h"
@@ -7,6 +9,12 @@
 // External linkage.
 struct Pixel;
 
+// The math on pairs, vectors and boxes is defined in this header, so that it
+// inlines into the loops that use it. Building with RT_SIMD defined computes
+// vectors with the compiler's vector extensions, which are lowered to SSE2
+// or NEON. The default is plain scalar code, which compilers often vectorize
+// as well. Both round the same way, so images don't depend on the choice.
+
 // A pair consists of two numbers. (x, y) respectively.
 // @author RenTrueWang
 typedef struct Pair {
@@ -18,19 +26,24 @@ typedef struct Pair {
 // @param x The first number.
 // @param y The second number.
 // @return The pair generated such that pair.x < pair.y
-Pair Pair_ordered(double x, double y);
+static inline Pair Pair_ordered(double x, double y) {
+    return (x <= y) ? (Pair){x, y} : (Pair){y, x};
+}
 
 // Checks if a pair is ordered.
 // @param pair The pair is checked.
 // @return True if the pair is ordered.
-bool Pair_is_ordered(Pair pair);
+static inline bool Pair_is_ordered(Pair pair) {
+    return pair.x <= pair.y;
+}
 
 // Random pair in the range [0, 1].
 // @param seed The seed pointer for the random number generator.
 // @return A random pair.
 Pair Pair_rand_r(unsigned* seed);
 
-// Random pair that with norm <= radius.
+// Random pair that with norm <= radius, uniform over the disk centered at
+// the origin.
 // @param radius The radius to which the norm of the result pair is smaller
 // @param seed The seed pointer for the random number generator.
 // @return A random pair in a ball.
@@ -40,7 +53,15 @@ Pair Pair_rand_disk(double radius, unsigned* seed);
 // @param a The first pair.
 // @param b The second pair.
 // @return A pair that is big enough to contain both a and b.
-Pair Pair_wraps(Pair a, Pair b);
+static inline Pair Pair_wraps(Pair a, Pair b) {
+    assert(Pair_is_ordered(a));
+    assert(Pair_is_ordered(b));
+
+    double lower = (a.x <= b.x) ? a.x : b.x;
+    double higher = (a.y >= b.y) ? a.y : b.y;
+
+    return (Pair){lower, higher};
+}
 
 // Vector is composed of three numbers. (x, y, z) respectively.
 // @author RenTrueWang
@@ -49,178 +70,329 @@ typedef struct Vector {
     double x, y, z;
 } Vector;
 
+#ifdef RT_SIMD
+// Two lanes of doubles, which every SIMD extension has. Vectors are computed
+// as (x, y) in lanes and z on its own, since four lanes would need AVX.
+typedef double Vec2 __attribute__((vector_size(2 * sizeof(double))));
+
+// The lanes of a vector.
+// @param vec The vector.
+// @return (x, y) of the vector.
+static inline Vec2 Vec2_xy(Vector vec) {
+    return (Vec2){vec.x, vec.y};
+}
+
+// Joins lanes with z into a vector.
+// @param xy (x, y) of the vector.
+// @param z z of the vector.
+// @return The vector.
+static inline Vector Vec2_join(Vec2 xy, double z) {
+    return (Vector){xy[0], xy[1], z};
+}
+#endif
+
 // vec[dim]
 // @param vec The vector to use.
 // @param dim The dimension of the vector to access. dim is one of {0, 1, 2}.
 // @return The value at the dimension.
-double Vec_dim(Vector vec, int dim);
+static inline double Vec_dim(Vector vec, int dim) {
+    switch (dim) {
+        case 0:
+            return vec.x;
+        case 1:
+            return vec.y;
+        case 2:
+            return vec.z;
+        default:
+            assert(0 && "dim should be one of {0, 1, 2}");
+    }
+}
 
 // a == b
 // @param a First vector.
 // @param b Second vector.
 // @return Return if a is equal to b
-bool Vec_eq(Vector a, Vector b);
+static inline bool Vec_eq(Vector a, Vector b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
 
 // a + b
 // @param a First vector.
 // @param b Second vector.
 // @return The value of a + b
-Vector Vec_add(Vector a, Vector b);
+static inline Vector Vec_add(Vector a, Vector b) {
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(a) + Vec2_xy(b), a.z + b.z);
+#else
+    return (Vector){a.x + b.x, a.y + b.y, a.z + b.z};
+#endif
+}
 
 // a - b
 // @param a First vector.
 // @param b Second vector.
 // @return The value of a - b
-Vector Vec_sub(Vector a, Vector b);
+static inline Vector Vec_sub(Vector a, Vector b) {
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(a) - Vec2_xy(b), a.z - b.z);
+#else
+    return (Vector){a.x - b.x, a.y - b.y, a.z - b.z};
+#endif
+}
 
 // a * b
 // @param a First vector.
 // @param b Second vector.
 // @return The value of a * b
-Vector Vec_mul(Vector a, Vector b);
+static inline Vector Vec_mul(Vector a, Vector b) {
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(a) * Vec2_xy(b), a.z * b.z);
+#else
+    return (Vector){a.x * b.x, a.y * b.y, a.z * b.z};
+#endif
+}
 
 // a / b
 // @param a First vector.
 // @param b Second vector. Cannot contain 0.
 // @return The value of a / b
-Vector Vec_div(Vector a, Vector b);
+static inline Vector Vec_div(Vector a, Vector b) {
+    assert(b.x && b.y && b.z);
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(a) / Vec2_xy(b), a.z / b.z);
+#else
+    return (Vector){a.x / b.x, a.y / b.y, a.z / b.z};
+#endif
+}
 
 // vec + s
 // @param vec Vector.
 // @param s Scalar.
 // @return The value of vec + s after broadcast operation.
-Vector Vec_add_s(Vector vec, double s);
+static inline Vector Vec_add_s(Vector vec, double s) {
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(vec) + s, vec.z + s);
+#else
+    return (Vector){vec.x + s, vec.y + s, vec.z + s};
+#endif
+}
 
 // vec - s
 // @param vec Vector.
 // @param s Scalar.
 // @return The value of vec - s after broadcast operation.
-Vector Vec_sub_s(Vector vec, double s);
+static inline Vector Vec_sub_s(Vector vec, double s) {
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(vec) - s, vec.z - s);
+#else
+    return (Vector){vec.x - s, vec.y - s, vec.z - s};
+#endif
+}
 
 // vec - s
 // @param vec Vector.
 // @param s Scalar.
 // @return The value of vec - s after broadcast operation.
-Vector Vec_mul_s(Vector vec, double s);
+static inline Vector Vec_mul_s(Vector vec, double s) {
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(vec) * s, vec.z * s);
+#else
+    return (Vector){vec.x * s, vec.y * s, vec.z * s};
+#endif
+}
 
 // vec / s
 // @param vec Vector.
 // @param s Scalar. Cannot be 0.
 // @return The value of vec / s after broadcast operation.
-Vector Vec_div_s(Vector vec, double s);
+static inline Vector Vec_div_s(Vector vec, double s) {
+    assert(s);
+#ifdef RT_SIMD
+    return Vec2_join(Vec2_xy(vec) / s, vec.z / s);
+#else
+    return (Vector){vec.x / s, vec.y / s, vec.z / s};
+#endif
+}
 
 // a += b
 // @param a Vector to modify.
 // @param b Vector to use.
-void Vec_iadd(Vector* a, Vector b);
+static inline void Vec_iadd(Vector* a, Vector b) {
+    *a = Vec_add(*a, b);
+}
 
 // a -= b
 // @param a Vector to modify.
 // @param b Vector to use.
-void Vec_isub(Vector* a, Vector b);
+static inline void Vec_isub(Vector* a, Vector b) {
+    *a = Vec_sub(*a, b);
+}
 
 // a *= b
 // @param a Vector to modify.
 // @param b Vector to use.
-void Vec_imul(Vector* a, Vector b);
+static inline void Vec_imul(Vector* a, Vector b) {
+    *a = Vec_mul(*a, b);
+}
 
 // a /= b
 // @param a Vector to modify.
 // @param b Vector to use. Cannot contain 0.
-void Vec_idiv(Vector* a, Vector b);
+static inline void Vec_idiv(Vector* a, Vector b) {
+    *a = Vec_div(*a, b);
+}
 
 // vec += s
 // @param vec Vector to modify.
 // @param s Scalar to use.
-void Vec_iadd_s(Vector* vec, double s);
+static inline void Vec_iadd_s(Vector* vec, double s) {
+    *vec = Vec_add_s(*vec, s);
+}
 
 // vec -= s
 // @param vec Vector to modify.
 // @param s Scalar to use.
-void Vec_isub_s(Vector* vec, double s);
+static inline void Vec_isub_s(Vector* vec, double s) {
+    *vec = Vec_sub_s(*vec, s);
+}
 
 // vec *= s
 // @param vec Vector to modify.
 // @param s Scalar to use.
-void Vec_imul_s(Vector* vec, double s);
+static inline void Vec_imul_s(Vector* vec, double s) {
+    *vec = Vec_mul_s(*vec, s);
+}
 
 // vec /= s
 // @param vec Vector to modify.
 // @param s Scalar to use. Cannot be 0.
-void Vec_idiv_s(Vector* vec, double s);
+static inline void Vec_idiv_s(Vector* vec, double s) {
+    *vec = Vec_div_s(*vec, s);
+}
 
 // cross(a, b)
 // @param a First vector.
 // @param b Second vector.
 // @return The value of a cross b.
-Vector Vec_cross(Vector a, Vector b);
+static inline Vector Vec_cross(Vector a, Vector b) {
+    // cross(a, b) will utilize three determinants
+    return (Vector){
+        .x = a.y * b.z - a.z * b.y,
+        .y = a.z * b.x - a.x * b.z,
+        .z = a.x * b.y - a.y * b.x,
+    };
+}
 
 // dot(a, b)
 // @param a First vector.
 // @param b Second vector.
 // @return The value of a dot b.
-double Vec_dot(Vector a, Vector b);
+static inline double Vec_dot(Vector a, Vector b) {
+#ifdef RT_SIMD
+    Vec2 xy = Vec2_xy(a) * Vec2_xy(b);
+    return xy[0] + xy[1] + a.z * b.z;
+#else
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+#endif
+}
 
 // dot(vec, vec)
 // @param vec Vector.
 // @return The L2 norm of the vector.
-double Vec_l2(Vector vec);
+static inline double Vec_l2(Vector vec) {
+    return Vec_dot(vec, vec);
+}
 
 // len(vec)
 // @param vec Vector.
 // @return The length of the vector.
-double Vec_len(Vector vec);
+static inline double Vec_len(Vector vec) {
+    return sqrt(Vec_l2(vec));
+}
+
+// 1/len(vec)
+// @param vec Vector. Cannot be 0.
+// @return The reciprocal of the length of the vector.
+static inline double Vec_rlen(Vector vec) {
+    double l2 = Vec_l2(vec);
+    assert(l2);
+    return 1. / sqrt(l2);
+}
 
 // vec/len(vec)
 // @param vec Vector.
 // @return The direction of the vector.
-Vector Vec_unit(Vector vec);
+static inline Vector Vec_unit(Vector vec) {
+    // One division and three multiplications are cheaper than three
+    // divisions.
+    return Vec_mul_s(vec, Vec_rlen(vec));
+}
 
 // sqrt(vec)
 // @param vec Vector.
 // @return The sqrt of the vector.
-Vector Vec_sqrt(Vector vec);
+static inline Vector Vec_sqrt(Vector vec) {
+    return (Vector){sqrt(vec.x), sqrt(vec.y), sqrt(vec.z)};
+}
 
 // abs(vec)
 // @param vec Vector.
 // @return The absolute value of the vector.
-Vector Vec_abs(Vector vec);
+static inline Vector Vec_abs(Vector vec) {
+    return (Vector){fabs(vec.x), fabs(vec.y), fabs(vec.z)};
+}
 
 // isnan(vec)
 // @param vec Vector.
 // @return True if the vector contains NaN.
-bool Vec_nan(Vector vec);
+static inline bool Vec_nan(Vector vec) {
+    return isnan(vec.x) && isnan(vec.y) && isnan(vec.z);
+}
 
 // all(vec)
 // @param vec Vector.
 // @return True if the vector contains no 0. Else False.
-bool Vec_all(Vector vec);
+static inline bool Vec_all(Vector vec) {
+    return vec.x && vec.y && vec.z;
+}
 
 // any(vec)
 // @param vec Vector.
 // @return False if all elements are 0. Else True.
-bool Vec_any(Vector vec);
+static inline bool Vec_any(Vector vec) {
+    return vec.x || vec.y || vec.z;
+}
 
 // (n, n, n)
 // @param n Number.
 // @return A vector (n, n, n)
-Vector Vec_from(double n);
+static inline Vector Vec_from(double n) {
+    return (Vector){n, n, n};
+}
 
 // (0, 0, 0)
 // @return A vector (0, 0, 0)
-Vector Vec_o(void);
+static inline Vector Vec_o(void) {
+    return (Vector){0, 0, 0};
+}
 
 // (1, 0, 0)
 // @return A vector (1, 0, 0)
-Vector Vec_i(void);
+static inline Vector Vec_i(void) {
+    return (Vector){1, 0, 0};
+}
 
 // (0, 1, 0)
 // @return A vector (0, 1, 0)
-Vector Vec_j(void);
+static inline Vector Vec_j(void) {
+    return (Vector){0, 1, 0};
+}
 
 // (0, 0, 1)
 // @return A vector (0, 0, 1)
-Vector Vec_k(void);
+static inline Vector Vec_k(void) {
+    return (Vector){0, 0, 1};
+}
 
 // Random vector in the range [0, 1].
 // @param seed The seed pointer for the random number generator.
@@ -233,8 +405,8 @@ Vector Vec_rand_r(unsigned* seed);
 // @return A random vector in a ball.
 Vector Vec_rand_ball(double radius, unsigned* seed);
 
-// Converts a vector to a pixel. Scales the range from [0, 1) to [0, 255]
-// integer.
+// Converts a vector to a pixel. Scales the range from [0, 1] to [0, 255]
+// integer, rounded to nearest. Channels outside of [0, 1] are clamped.
 // @param vec Vector to transform.
 // @return A pixel (r, g, b) in the range [0, 255].
 // @see Pixel
@@ -255,22 +427,119 @@ typedef struct Box {
 // @param z1 The first z.
 // @param z2 The second z.
 // @return A box that has the boundaries as the parameters.
-Box Box_make(double x1, double x2, double y1, double y2, double z1, double z2);
+static inline Box Box_make(double x1,
+                           double x2,
+                           double y1,
+                           double y2,
+                           double z1,
+                           double z2) {
+    // X, Y, Z are ordered pairs.
+    return (Box){
+        .x = Pair_ordered(x1, x2),
+        .y = Pair_ordered(y1, y2),
+        .z = Pair_ordered(z1, z2),
+    };
+}
 
 // Determines whether the box intersects with the ray.
 // @param box The box for the ray to hit.
 // @param source The source of the ray.
 // @param ray The direction of the ray.
 // @return True if the ray intersects with the box.
-bool Box_is_through(Box box, Vector source, Vector towards);
+static inline bool Box_is_through(Box box, Vector source, Vector towards) {
+    Pair slabs[3] = {box.x, box.y, box.z};
+    double src[3] = {source.x, source.y, source.z};
+    double dir[3] = {towards.x, towards.y, towards.z};
+
+    // t_min will be the largest of the smaller values.
+    double t_min = -INFINITY;
+    // t_max will be the smallest of the larger values.
+    double t_max = +INFINITY;
+
+    // TODO: explain why this works.
+    for (int i = 0; i < 3; ++i) {
+        double inv_b = 1. / dir[i];
+
+        double t_small = (slabs[i].x - src[i]) * inv_b;
+        double t_large = (slabs[i].y - src[i]) * inv_b;
+
+        if (inv_b < 0) {
+            // If inv_b < 0 then t_small would be larger than t_large
+            double tmp = t_small;
+            t_small = t_large;
+            t_large = tmp;
+        }
+
+        assert(t_small < t_large);
+
+        if (t_min < t_small) {
+            t_min = t_small;
+        }
+        if (t_max > t_large) {
+            t_max = t_large;
+        }
+    }
+
+    // If t_min < t_max, that means the ray didn't pass through the block.
+    return t_min < t_max;
+}
+
+// Determines whether the box intersects with a segment of the ray.
+// @param box The box for the ray to hit.
+// @param source The source of the ray.
+// @param towards The direction of the ray.
+// @param t_max The end of the segment, in multiples of towards.
+// @return True if the ray intersects with the box between source and
+// source + towards * t_max.
+static inline bool Box_is_through_until(Box box,
+                                        Vector source,
+                                        Vector towards,
+                                        double t_max) {
+    Pair slabs[3] = {box.x, box.y, box.z};
+    double src[3] = {source.x, source.y, source.z};
+    double dir[3] = {towards.x, towards.y, towards.z};
+    double t_min = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        double inv_b = 1. / dir[i];
+        double t_small = (slabs[i].x - src[i]) * inv_b;
+        double t_large = (slabs[i].y - src[i]) * inv_b;
+        if (inv_b < 0) {
+            double tmp = t_small;
+            t_small = t_large;
+            t_large = tmp;
+        }
+
+        // Written so that NaN, from a ray parallel to a slab that starts on
+        // its plane, leaves the interval as is.
+        t_min = (t_small > t_min) ? t_small : t_min;
+        t_max = (t_large < t_max) ? t_large : t_max;
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    return true;
+}
 
 // The center of the box.
 // @param box The box to use.
 // @return The 3D dimensional position for the center of the box.
-Vector Box_center(Box box);
+static inline Vector Box_center(Box box) {
+    return (Vector){
+        .x = (box.x.x + box.x.y) / 2.,
+        .y = (box.y.x + box.y.y) / 2.,
+        .z = (box.z.x + box.z.y) / 2.,
+    };
+}
 
 // Creates a box that contains both of the boxes.
 // @param a The first box.
 // @param b The second box.
 // @return A box that is big enough to contain both a and b.
-Box Box_wraps(Box a, Box b);
+static inline Box Box_wraps(Box a, Box b) {
+    return (Box){
+        .x = Pair_wraps(a.x, b.x),
+        .y = Pair_wraps(a.y, b.y),
+        .z = Pair_wraps(a.z, b.z),
+    };
+}
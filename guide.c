@@ -0,0 +1,425 @@
+#include "guide.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+// Cells that get more splats than this in a pass are split in two.
+#define GUIDE_SPLIT 1500
+
+// Quadrants that hold more than this share of a cell's radiance are split
+// in four.
+#define GUIDE_SHARE .01
+
+// The deepest level of a quadtree.
+#define GUIDE_DEPTH 20
+
+// A node of a quadtree over the unit square. Quadrant i is the right half if
+// i & 1, and the top half if i & 2.
+typedef struct _DNode {
+    // The node of every quadrant. 0 for quadrants that are leaves.
+    int child[4];
+    // The radiance of every quadrant. Splatted to leaves while rendering,
+    // and summed up to inner quadrants by Guide_refine.
+    _Atomic double sum[4];
+} _DNode;
+
+// A quadtree over the directions, mapped to the unit square.
+typedef struct _DTree {
+    // The nodes. The root is nodes[0]. NULL for a tree with no nodes.
+    _DNode* nodes;
+    // Number of nodes.
+    int length;
+    // Capacity of nodes.
+    int capacity;
+    // The radiance of the whole tree, once summed up.
+    double total;
+} _DTree;
+
+struct GuideCell {
+    // The first of the two children. 0 for leaves. The first child holds the
+    // points below split along axis.
+    int child;
+    // The axis that the cell is split along. Its children split along the
+    // next one.
+    int axis;
+    // Where the cell is split along axis.
+    double split;
+    // The quadtree that directions are sampled from.
+    _DTree sampling;
+    // The quadtree that radiance is splatted into.
+    _DTree training;
+    // Number of splats since the last refinement.
+    atomic_ulong splats;
+    // The sum of the points of the splats since the last refinement. Cells
+    // are split through their mean.
+    _Atomic double moments[3];
+};
+
+struct Guide {
+    // The nodes of the spatial tree. The root is cells[0], and the children
+    // of a cell are next to each other.
+    GuideCell* cells;
+    // Number of nodes.
+    int length;
+    // Capacity of cells.
+    int capacity;
+    // Number of leaves.
+    size_t leaves;
+};
+
+// Appends a node whose quadrants are all leaves with no radiance.
+// @param tree The quadtree to append to.
+// @return The index of the node.
+static int dtree_push(_DTree* tree) {
+    if (tree->length == tree->capacity) {
+        tree->capacity = tree->capacity ? 2 * tree->capacity : 4;
+        tree->nodes = realloc(tree->nodes, tree->capacity * sizeof(_DNode));
+    }
+    _DNode* node = tree->nodes + tree->length;
+    for (int i = 0; i < 4; ++i) {
+        node->child[i] = 0;
+        atomic_init(&node->sum[i], 0.);
+    }
+    return tree->length++;
+}
+
+// Copies a quadtree.
+// @param tree The quadtree to copy.
+// @return A quadtree with its own nodes.
+static _DTree dtree_copy(const _DTree* tree) {
+    _DTree copy = *tree;
+    copy.capacity = tree->length;
+    copy.nodes = NULL;
+    if (tree->length) {
+        copy.nodes = malloc(tree->length * sizeof(_DNode));
+        memcpy(copy.nodes, tree->nodes, tree->length * sizeof(_DNode));
+    }
+    return copy;
+}
+
+// Free the nodes of a quadtree, leaving a tree with no nodes.
+// @param tree The quadtree to free.
+static void dtree_free(_DTree* tree) {
+    free(tree->nodes);
+    *tree = (_DTree){.nodes = NULL};
+}
+
+// Adds to an atomic sum.
+// @param sum The sum.
+// @param value What to add.
+static void add_atomic(_Atomic double* sum, double value) {
+    double old = atomic_load_explicit(sum, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        sum, &old, old + value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Maps a unit direction to the unit square, preserving area: x is the
+// height on the unit sphere and y is the azimuth.
+// @param towards The unit direction.
+// @return The point in the square.
+static Pair to_square(Vector towards) {
+    double z = (towards.z < -1) ? -1 : (towards.z > 1) ? 1 : towards.z;
+    double phi = atan2(towards.y, towards.x);
+    phi = (phi < 0) ? phi + 2 * M_PI : phi;
+    return (Pair){.x = .5 * (z + 1), .y = phi / (2 * M_PI)};
+}
+
+// The inverse of to_square.
+// @param square The point in the unit square.
+// @return The unit direction.
+static Vector from_square(Pair square) {
+    double z = 2 * square.x - 1;
+    double r = sqrt(fmax(0, 1 - z * z));
+    double phi = 2 * M_PI * square.y;
+    return (Vector){r * cos(phi), r * sin(phi), z};
+}
+
+// Picks the quadrant of a point, and maps the point to the quadrant.
+// @param square The point in the unit square, mapped in place.
+// @return The quadrant.
+static int quadrant(Pair* square) {
+    int right = square->x >= .5;
+    int top = square->y >= .5;
+    square->x = 2 * square->x - right;
+    square->y = 2 * square->y - top;
+    return right | (top << 1);
+}
+
+// The sums of the quadrants of a node.
+// @param node The node.
+// @param sum Where to store the sums.
+// @return The sum of the node.
+static double node_sums(const _DNode* node, double sum[4]) {
+    double total = 0;
+    for (int i = 0; i < 4; ++i) {
+        sum[i] = atomic_load_explicit((_Atomic double*)&node->sum[i],
+                                      memory_order_relaxed);
+        total += sum[i];
+    }
+    return total;
+}
+
+// Forgets the splats of a cell since the last refinement.
+// @param cell The cell.
+static void reset_splats(GuideCell* cell) {
+    atomic_init(&cell->splats, 0);
+    for (int a = 0; a < 3; ++a) {
+        atomic_init(&cell->moments[a], 0.);
+    }
+}
+
+Guide* Guide_make(void) {
+    Guide* guide = calloc(1, sizeof(Guide));
+    guide->capacity = 1;
+    guide->cells = calloc(1, sizeof(GuideCell));
+    guide->length = 1;
+    guide->leaves = 1;
+    dtree_push(&guide->cells[0].training);
+    reset_splats(guide->cells);
+    return guide;
+}
+
+void Guide_free(Guide* guide) {
+    for (int i = 0; i < guide->length; ++i) {
+        dtree_free(&guide->cells[i].sampling);
+        dtree_free(&guide->cells[i].training);
+    }
+    free(guide->cells);
+    free(guide);
+}
+
+GuideCell* Guide_cell(Guide* guide, Vector point) {
+    double p[3] = {point.x, point.y, point.z};
+    GuideCell* cell = guide->cells;
+    while (cell->child) {
+        bool above = p[cell->axis] >= cell->split;
+        cell = guide->cells + cell->child + above;
+    }
+    return cell;
+}
+
+bool GuideCell_trained(const GuideCell* cell) {
+    return cell->sampling.total > 0;
+}
+
+Vector GuideCell_sample(const GuideCell* cell, unsigned* seed) {
+    assert(GuideCell_trained(cell));
+
+    const _DTree* tree = &cell->sampling;
+    Pair corner = {0, 0};
+    double size = 1;
+    int at = 0;
+    forever {
+        double sum[4];
+        double r = genfloat(seed) * node_sums(tree->nodes + at, sum);
+        int i = 0;
+        while (i < 3 && (r >= sum[i] || !sum[i])) {
+            r -= sum[i];
+            ++i;
+        }
+        // Rounding can run past the last quadrant with radiance.
+        while (!sum[i]) {
+            --i;
+        }
+
+        size *= .5;
+        corner.x += (i & 1) * size;
+        corner.y += (i >> 1) * size;
+        int child = tree->nodes[at].child[i];
+        if (!child) {
+            break;
+        }
+        at = child;
+    }
+
+    Pair square = {
+        .x = corner.x + genfloat(seed) * size,
+        .y = corner.y + genfloat(seed) * size,
+    };
+    return from_square(square);
+}
+
+double GuideCell_pdf(const GuideCell* cell, Vector towards) {
+    assert(GuideCell_trained(cell));
+
+    const _DTree* tree = &cell->sampling;
+    Pair square = to_square(towards);
+    // The square has area 1 and the sphere 4 pi.
+    double pdf = 1 / (4 * M_PI);
+    int at = 0;
+    forever {
+        double sum[4];
+        double total = node_sums(tree->nodes + at, sum);
+        int i = quadrant(&square);
+        pdf *= 4 * sum[i] / total;
+
+        int child = tree->nodes[at].child[i];
+        if (!child || !sum[i]) {
+            return pdf;
+        }
+        at = child;
+    }
+}
+
+void GuideCell_splat(GuideCell* cell,
+                     Vector point,
+                     Vector towards,
+                     double value) {
+    atomic_fetch_add_explicit(&cell->splats, 1, memory_order_relaxed);
+    double p[3] = {point.x, point.y, point.z};
+    for (int a = 0; a < 3; ++a) {
+        add_atomic(&cell->moments[a], p[a]);
+    }
+    if (!(value > 0) || isinf(value)) {
+        return;
+    }
+
+    // Only leaves are splatted to, so that threads rarely write the same
+    // sum. Inner quadrants are summed up when refining.
+    _DTree* tree = &cell->training;
+    Pair square = to_square(towards);
+    int at = 0;
+    forever {
+        int i = quadrant(&square);
+        int child = tree->nodes[at].child[i];
+        if (!child) {
+            add_atomic(&tree->nodes[at].sum[i], value);
+            return;
+        }
+        at = child;
+    }
+}
+
+// Sums the leaves of a quadtree up to its inner quadrants.
+// @param tree The quadtree.
+// @param at The node to sum.
+// @return The sum of the node.
+static double sum_up(_DTree* tree, int at) {
+    double total = 0;
+    for (int i = 0; i < 4; ++i) {
+        int child = tree->nodes[at].child[i];
+        if (child) {
+            atomic_store_explicit(&tree->nodes[at].sum[i], sum_up(tree, child),
+                                  memory_order_relaxed);
+        }
+        total += atomic_load_explicit(&tree->nodes[at].sum[i],
+                                      memory_order_relaxed);
+    }
+    return total;
+}
+
+// Builds the quadrants of a node of the next quadtree to splat into. Bright
+// quadrants are split and dim ones merged, so that every leaf holds at most
+// about GUIDE_SHARE of the radiance. The leaves start with the radiance
+// learned so far, so that what a cell samples is learned from every pass
+// rather than only the last one.
+// @param next The quadtree to build.
+// @param at The node of next to build.
+// @param learned The quadtree that was learned.
+// @param from The node of learned over the same square as at. -1 where
+// learned is coarser than next.
+// @param share The share of the radiance in the square.
+// @param depth The depth of at.
+static void grow(_DTree* next,
+                 int at,
+                 const _DTree* learned,
+                 int from,
+                 double share,
+                 int depth) {
+    for (int i = 0; i < 4; ++i) {
+        int source = -1;
+        double part = share / 4;
+        if (from >= 0) {
+            const _DNode* node = learned->nodes + from;
+            double sum = atomic_load_explicit((_Atomic double*)&node->sum[i],
+                                              memory_order_relaxed);
+            part = sum / learned->total;
+            source = node->child[i] ? node->child[i] : -1;
+        }
+        if (part > GUIDE_SHARE && depth < GUIDE_DEPTH) {
+            int child = dtree_push(next);
+            next->nodes[at].child[i] = child;
+            grow(next, child, learned, source, part, depth + 1);
+        } else {
+            atomic_store_explicit(&next->nodes[at].sum[i],
+                                  part * learned->total, memory_order_relaxed);
+        }
+    }
+}
+
+// Splits a cell in two, through the mean of its splats. Both halves start
+// from what the cell has learned.
+// @param guide The guide.
+// @param index The index of the cell.
+static void split(Guide* guide, int index) {
+    GuideCell* cell = guide->cells + index;
+    double n = atomic_load(&cell->splats);
+    cell->split = atomic_load(&cell->moments[cell->axis]) / n;
+
+    if (guide->length + 2 > guide->capacity) {
+        guide->capacity = 2 * guide->capacity + 2;
+        guide->cells = realloc(guide->cells,
+                               guide->capacity * sizeof(GuideCell));
+    }
+
+    cell = guide->cells + index;
+    for (int i = 0; i < 2; ++i) {
+        GuideCell* half = guide->cells + guide->length + i;
+        half->child = 0;
+        half->axis = (cell->axis + 1) % 3;
+        half->sampling = dtree_copy(&cell->sampling);
+        half->training = dtree_copy(&cell->training);
+        reset_splats(half);
+    }
+    dtree_free(&cell->sampling);
+    dtree_free(&cell->training);
+    cell->child = guide->length;
+    guide->length += 2;
+    ++guide->leaves;
+}
+
+// Makes what a cell learned the quadtree to sample from, and starts a finer
+// one to splat into.
+// @param cell The cell, a leaf.
+static void learn(GuideCell* cell) {
+    double total = sum_up(&cell->training, 0);
+    reset_splats(cell);
+    if (!(total > 0)) {
+        // Nothing was learned. The cell keeps sampling what it knew.
+        return;
+    }
+
+    dtree_free(&cell->sampling);
+    cell->sampling = cell->training;
+    cell->sampling.total = total;
+    cell->training = (_DTree){.nodes = NULL};
+    dtree_push(&cell->training);
+    grow(&cell->training, 0, &cell->sampling, 0, 1., 1);
+}
+
+void Guide_refine(Guide* guide) {
+    // Halves haven't been splatted to yet, so they are split by later
+    // refinements if they turn out busy.
+    int cells = guide->length;
+    for (int i = 0; i < cells; ++i) {
+        GuideCell* cell = guide->cells + i;
+        if (!cell->child && atomic_load(&cell->splats) > GUIDE_SPLIT) {
+            split(guide, i);
+        }
+    }
+    for (int i = 0; i < guide->length; ++i) {
+        if (!guide->cells[i].child) {
+            learn(guide->cells + i);
+        }
+    }
+}
+
+size_t Guide_cells(const Guide* guide) {
+    return guide->leaves;
+}
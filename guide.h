@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "geometric.h"
+
+// Guide learns where light comes from as a scene is rendered, and samples
+// directions that follow it (practical path guiding). Space is split by a
+// binary tree where paths go most, and every leaf (a cell) holds a quadtree
+// over the sphere of directions, built from the light that paths brought
+// back through it.
+//
+// Every cell has two quadtrees. Passes sample directions from one, which
+// is read-only while rendering, and splat the radiance they find into the
+// other with atomic adds, so threads share a guide without locks. Between
+// passes, Guide_refine makes everything learned so far the quadtree to
+// sample from, and splits busy cells and the bright parts of quadtrees.
+// @author RenTrueWang
+typedef struct Guide Guide;
+
+// A leaf of the spatial tree of a guide.
+typedef struct GuideCell GuideCell;
+
+// Creates a guide that hasn't learned anything yet. It has a single cell.
+// @return A new Guide.
+Guide* Guide_make(void);
+
+// Free the guide and its cells.
+// @param guide Guide to free.
+// @see free
+void Guide_free(Guide* guide);
+
+// Finds the cell of a point.
+// @param guide The guide.
+// @param point The point.
+// @return The cell. Valid until the next Guide_refine.
+GuideCell* Guide_cell(Guide* guide, Vector point);
+
+// Whether a cell has anything to sample from yet.
+// @param cell The cell.
+// @return True if the cell has learned some radiance.
+bool GuideCell_trained(const GuideCell* cell);
+
+// Samples a direction in proportion to the light the cell learned.
+// @param cell The cell. Must be trained.
+// @param seed The seed pointer for the random number generator.
+// @return The unit direction.
+Vector GuideCell_sample(const GuideCell* cell, unsigned* seed);
+
+// The density of sampling a direction with GuideCell_sample.
+// @param cell The cell. Must be trained.
+// @param towards The unit direction.
+// @return The density, per unit solid angle.
+double GuideCell_pdf(const GuideCell* cell, Vector towards);
+
+// Records light arriving at a cell. Safe to call from many threads.
+// @param cell The cell.
+// @param point Where the light arrives. Cells are split where it arrives.
+// @param towards The unit direction that the light arrives from.
+// @param value What the light contributes at point, divided by the density
+// that towards was sampled with.
+void GuideCell_splat(GuideCell* cell,
+                     Vector point,
+                     Vector towards,
+                     double value);
+
+// Learns from everything splatted since the last call, and starts over
+// with finer cells and quadtrees. Must not be called while rendering.
+// @param guide The guide.
+void Guide_refine(Guide* guide);
+
+// Number of cells.
+// @param guide The guide.
+// @return Number of leaves of the spatial tree.
+size_t Guide_cells(const Guide* guide);
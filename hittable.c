@@ -2,15 +2,41 @@
 
 #include <assert.h>
 #include <math.h>
+#include <omp.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 #include "macro.h"
+#include "pool.h"
+
+// Sub-trees with fewer leaves than this are built by a single thread.
+#define PARTITION_GRAIN 1024
+
+// Traversal steps of the current thread.
+// @see Hittable_steps
+static _Thread_local unsigned long steps = 0;
+
+unsigned long Hittable_steps(void) {
+    return steps;
+}
 
 HitData Hittable_hit(const Hittable ht, Vector source, Vector towards) {
     return ht.hit(ht.object, source, towards);
 }
 
+bool Hittable_occluded(const Hittable ht,
+                       Vector source,
+                       Vector towards,
+                       double t_max) {
+    return ht.occluded(ht.object, source, towards, t_max);
+}
+
+void Hittable_prefetch(const Hittable ht, const struct RayBatch* rays) {
+    if (ht.prefetch) {
+        ht.prefetch(ht.object, rays);
+    }
+}
+
 Box Hittable_bounds(const Hittable ht) {
     return ht.bounds(ht.object);
 }
@@ -19,7 +45,9 @@ Hittable Hittable_null(void) {
     return (Hittable){
         .object = NULL,
         .hit = NULL,
+        .occluded = NULL,
         .bounds = NULL,
+        .prefetch = NULL,
     };
 }
 
@@ -33,7 +61,7 @@ bool HitData_has_hit(const HitData hd) {
 }
 
 HitData HitData_hit(double t, Vector point, Vector normal, Material mat) {
-    return (HitData){t, point, normal, mat};
+    return (HitData){t, point, normal, mat, NULL};
 }
 
 HitData HitData_miss(void) {
@@ -43,7 +71,7 @@ HitData HitData_miss(void) {
 
 HitList HitList_make(int length) {
     return (HitList){
-        .list = calloc(length, sizeof(HitList)),
+        .list = calloc(length, sizeof(Hittable)),
         .length = length,
     };
 }
@@ -67,6 +95,7 @@ static HitData HitList_hit(const void* hl, Vector source, Vector towards) {
     HitData closest = HitData_miss();
     for (int i = 0; i < hitlist->length; ++i) {
         const Hittable* hittable = HitList_getitem(*hitlist, i);
+        ++steps;
         HitData hitdata = Hittable_hit(*hittable, source, towards);
         if (hitdata.t < closest.t) {
             closest = hitdata;
@@ -75,6 +104,25 @@ static HitData HitList_hit(const void* hl, Vector source, Vector towards) {
     return closest;
 }
 
+// HitListOccluded is the implementation of occluded for HitList.
+// @see Hittable
+static bool HitList_occluded(const void* hl,
+                             Vector source,
+                             Vector towards,
+                             double t_max) {
+    const HitList* hitlist = hl;
+
+    // Unlike hit, towards isn't normalized, because t_max is relative to it.
+    for (int i = 0; i < hitlist->length; ++i) {
+        const Hittable* hittable = HitList_getitem(*hitlist, i);
+        ++steps;
+        if (Hittable_occluded(*hittable, source, towards, t_max)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 // HitListBounds is the implementation of bounds for HitList.
 // @see Hittable
 static Box HitList_bounds(const void* hl) {
@@ -97,6 +145,7 @@ Hittable HitList_Hittable(const HitList* hl) {
     return (Hittable){
         .object = hl,
         .hit = HitList_hit,
+        .occluded = HitList_occluded,
         .bounds = HitList_bounds,
     };
 }
@@ -216,23 +265,55 @@ static void sort_max_var(Hittable* hl, int len) {
 
 // Partition the list according to how far apart each objects are along each
 // axis, and convert the list into a tree. List elements will end up in tree's
-// leaves, and internal nodes will be freshly allocated. This is not
-// thread-safe. Every call to this function stores a new element in the
-// nodelist. Every call to this function visits an increasingly narrow region in
-// the original Hittable list hl, eventually down to length 1.
+// leaves, and internal nodes will be freshly allocated. Every call to this
+// function visits an increasingly narrow region in the original Hittable list
+// hl, eventually down to length 1. A sub-tree of n leaves takes exactly 2n-1
+// nodes, with its root last, so the nodes of the left and right sub-trees are
+// known in advance and large sub-trees can be built in parallel.
 // @param hl HitList's pointer. The original elements.
 // @param hl_len Length of HitList.
 // @param nl NodeList's pointer. The new elements.
-// @param nl_idx Current index of NodeList to modify.
+// @param base Index of the first node of the sub-tree in NodeList.
+// @param w The worker to build large sub-trees in parallel with. Can be NULL.
 // @return Index of node stored by the function.
-static int partition(Hittable* hl, int hl_len, _HitNode* nl, int* nl_idx) {
+static int partition(Hittable* hl,
+                     int hl_len,
+                     _HitNode* nl,
+                     int base,
+                     Worker* w);
+
+// The arguments of a partition run as a task.
+typedef struct _PartitionArgs {
+    // The original elements.
+    Hittable* hl;
+    // Number of elements.
+    int hl_len;
+    // The new elements.
+    _HitNode* nl;
+    // Index of the first node of the sub-tree.
+    int base;
+} _PartitionArgs;
+
+// Runs partition as a task.
+// @param w The worker that runs the task.
+// @param arg The _PartitionArgs.
+static void partition_task(Worker* w, void* arg) {
+    _PartitionArgs* pa = arg;
+    partition(pa->hl, pa->hl_len, pa->nl, pa->base, w);
+}
+
+static int partition(Hittable* hl,
+                     int hl_len,
+                     _HitNode* nl,
+                     int base,
+                     Worker* w) {
     if (hl_len == 0) {
         // Because case 1 and case 2 are all handled, case 0 will not happen.
         assert(0 && "unreachable");
     } else if (hl_len == 1) {
         // Every call eventually falls into this case since case 2 directly
         // calls this 2 times. So every element is going to be visited.
-        int mod = (*nl_idx)++;
+        int mod = base;
 
         // Makes copy to hl[0]
         Hittable object = hl[0];
@@ -246,12 +327,24 @@ static int partition(Hittable* hl, int hl_len, _HitNode* nl, int* nl_idx) {
     sort_max_var(hl, hl_len);
 
     int half = hl_len / 2;
-    int left = partition(hl, half, nl, nl_idx);
-    int right = partition(hl + half, hl_len - half, nl, nl_idx);
+    int left, right;
+    if (w && hl_len >= PARTITION_GRAIN) {
+        // The left sub-tree may be stolen by another thread.
+        atomic_int pending = 0;
+        _PartitionArgs pa = {hl, half, nl, base};
+        Task task = {.fn = partition_task, .arg = &pa, .pending = &pending};
+        Pool_spawn(w, &task);
+        right = partition(hl + half, hl_len - half, nl, base + 2 * half - 1, w);
+        Pool_wait(w, &pending);
+        left = base + 2 * half - 2;
+    } else {
+        left = partition(hl, half, nl, base, w);
+        right = partition(hl + half, hl_len - half, nl, base + 2 * half - 1, w);
+    }
 
     // Now nl[left] is the left node, and nl[right] is the right node.
     // mod is the index to modify.
-    int mod = (*nl_idx)++;
+    int mod = base + 2 * hl_len - 2;
     assert(left < mod);
     assert(right < mod);
 
@@ -268,9 +361,15 @@ HitTree HitTree_make(HitList hl) {
 
     _HitNode* nodelist = calloc(length, sizeof(_HitNode));
 
-    int cidx = 0;
-    partition(list, hl.length, nodelist, &cidx);
-    assert(cidx == length);
+    if (hl.length >= PARTITION_GRAIN) {
+        Pool* pool = Pool_make(omp_get_max_threads());
+        _PartitionArgs pa = {list, hl.length, nodelist, 0};
+        Task root = {.fn = partition_task, .arg = &pa, .pending = NULL};
+        Pool_run(pool, &root);
+        Pool_free(pool);
+    } else {
+        partition(list, hl.length, nodelist, 0, NULL);
+    }
 
     return (HitTree){.nodelist = nodelist, .length = length};
 }
@@ -291,6 +390,7 @@ static HitData nl_hit(const _HitNode* nodelist,
                       Vector source,
                       Vector towards) {
     _HitNode root = nodelist[index];
+    ++steps;
     // The ray passes through the object only if it passes through the box.
     if (Box_is_through(root.bounds, source, towards)) {
         Hittable ht = root.hittable;
@@ -312,6 +412,36 @@ static HitData nl_hit(const _HitNode* nodelist,
     }
 }
 
+// Performs occluded on a nodelist representing a tree.
+// @param nodelist The nodelist that is actually a tree.
+// @param index The root index of the current sub-tree.
+// @param source The source of the ray.
+// @param towards The direction the ray is moving towards.
+// @param t_max Only hits closer than source + towards * t_max count.
+// @return True if the ray is blocked.
+static bool nl_occluded(const _HitNode* nodelist,
+                        int index,
+                        Vector source,
+                        Vector towards,
+                        double t_max) {
+    _HitNode root = nodelist[index];
+    ++steps;
+    // Boxes behind the source or past t_max are skipped too.
+    if (!Box_is_through_until(root.bounds, source, towards, t_max)) {
+        return false;
+    }
+
+    Hittable ht = root.hittable;
+    if (Hittable_is_null(ht)) {
+        // The node is internal. Any blocker will do, so the right sub-tree
+        // is only visited if the left one has none.
+        return nl_occluded(nodelist, root.left, source, towards, t_max) ||
+               nl_occluded(nodelist, root.right, source, towards, t_max);
+    } else {
+        return Hittable_occluded(ht, source, towards, t_max);
+    }
+}
+
 // HitTreeHit is the implementation of hit for HitTree.
 // @see Hittable
 static HitData HitTree_hit(const void* ht, Vector source, Vector towards) {
@@ -320,6 +450,17 @@ static HitData HitTree_hit(const void* ht, Vector source, Vector towards) {
     return nl_hit(hittree->nodelist, root_idx, source, towards);
 }
 
+// HitTreeOccluded is the implementation of occluded for HitTree.
+// @see Hittable
+static bool HitTree_occluded(const void* ht,
+                             Vector source,
+                             Vector towards,
+                             double t_max) {
+    const HitTree* hittree = ht;
+    int root_idx = hittree->length - 1;
+    return nl_occluded(hittree->nodelist, root_idx, source, towards, t_max);
+}
+
 // HitTreeBounds is the implementation of bounds for HitTree.
 // @see Hittable
 static Box HitTree_bounds(const void* ht) {
@@ -332,6 +473,204 @@ Hittable HitTree_Hittable(const HitTree* ht) {
     return (Hittable){
         .object = ht,
         .hit = HitTree_hit,
+        .occluded = HitTree_occluded,
         .bounds = HitTree_bounds,
     };
 }
+
+// The largest quantized position.
+#define QUANT_MAX 255
+
+// Decodes a child's extent on one axis.
+// @param parent The extent of the node's box.
+// @param lo The quantized low end.
+// @param hi The quantized high end.
+// @return The decoded extent.
+static Pair dequantize(Pair parent, uint8_t lo, uint8_t hi) {
+    double step = (parent.y - parent.x) / QUANT_MAX;
+    return (Pair){parent.x + lo * step, parent.y - (QUANT_MAX - hi) * step};
+}
+
+// Encodes a child's extent on one axis, rounding outwards. The rounding is
+// checked against dequantize itself, so no floating-point error can make a
+// decoded box smaller than the child.
+// @param parent The extent of the node's box. Contains child.
+// @param child The extent to encode.
+// @param lo Where the quantized low end is stored.
+// @param hi Where the quantized high end is stored.
+static void quantize(Pair parent, Pair child, uint8_t* lo, uint8_t* hi) {
+    double step = (parent.y - parent.x) / QUANT_MAX;
+    int l = 0;
+    int h = QUANT_MAX;
+    if (step > 0) {
+        l = (int)floor((child.x - parent.x) / step);
+        h = QUANT_MAX - (int)floor((parent.y - child.y) / step);
+        l = (l < 0) ? 0 : (l > QUANT_MAX) ? QUANT_MAX : l;
+        h = (h < 0) ? 0 : (h > QUANT_MAX) ? QUANT_MAX : h;
+    }
+    while (l > 0 && dequantize(parent, l, QUANT_MAX).x > child.x) {
+        --l;
+    }
+    while (h < QUANT_MAX && dequantize(parent, 0, h).y < child.y) {
+        ++h;
+    }
+    *lo = l;
+    *hi = h;
+}
+
+// Decodes the box of a child of a node.
+// @param box The decoded box of the node.
+// @param node The node.
+// @param c The index of the child, 0 or 1.
+// @return The decoded box of the child.
+static Box child_box(Box box, const _QuantNode* node, int c) {
+    return (Box){
+        .x = dequantize(box.x, node->lo[c][0], node->hi[c][0]),
+        .y = dequantize(box.y, node->lo[c][1], node->hi[c][1]),
+        .z = dequantize(box.z, node->lo[c][2], node->hi[c][2]),
+    };
+}
+
+// Quantizes a sub-tree of a HitTree, parents before children.
+// @param ht The tree to copy.
+// @param index The root index of the sub-tree in ht.
+// @param box The decoded box of the sub-tree's root. Contains its bounds.
+// @param qt The tree to add to.
+// @return The reference to the copy of the sub-tree's root.
+static int quantize_node(const HitTree* ht, int index, Box box, QuantTree* qt) {
+    _HitNode root = ht->nodelist[index];
+    if (!Hittable_is_null(root.hittable)) {
+        qt->leaves[qt->nleaves] = root.hittable;
+        return ~qt->nleaves++;
+    }
+
+    int mod = qt->length++;
+    int children[2] = {root.left, root.right};
+    for (int c = 0; c < 2; ++c) {
+        Box cb = ht->nodelist[children[c]].bounds;
+        _QuantNode* node = qt->nodes + mod;
+        quantize(box.x, cb.x, &node->lo[c][0], &node->hi[c][0]);
+        quantize(box.y, cb.y, &node->lo[c][1], &node->hi[c][1]);
+        quantize(box.z, cb.z, &node->lo[c][2], &node->hi[c][2]);
+
+        Box decoded = child_box(box, node, c);
+        int child = quantize_node(ht, children[c], decoded, qt);
+        qt->nodes[mod].child[c] = child;
+    }
+    return mod;
+}
+
+QuantTree QuantTree_make(const HitTree* ht) {
+    assert(ht->length > 0);
+    int leaves = (ht->length + 1) / 2;
+    int root_idx = ht->length - 1;
+
+    QuantTree qt = {
+        .nodes = calloc(leaves > 1 ? leaves - 1 : 1, sizeof(_QuantNode)),
+        .length = 0,
+        .leaves = calloc(leaves, sizeof(Hittable)),
+        .nleaves = 0,
+        .bounds = ht->nodelist[root_idx].bounds,
+    };
+    qt.root = quantize_node(ht, root_idx, qt.bounds, &qt);
+    assert(qt.nleaves == leaves);
+    return qt;
+}
+
+void QuantTree_free(QuantTree* qt) {
+    free(qt->nodes);
+    free(qt->leaves);
+    qt->nodes = NULL;
+    qt->leaves = NULL;
+}
+
+// Performs hit on a sub-tree of a QuantTree.
+// @param qt The tree.
+// @param ref The reference to the root of the sub-tree.
+// @param box The decoded box of the root.
+// @param source The source of the ray.
+// @param towards The direction the ray is moving towards.
+// @return The record of this hit.
+static HitData qt_hit(const QuantTree* qt,
+                      int ref,
+                      Box box,
+                      Vector source,
+                      Vector towards) {
+    ++steps;
+    if (!Box_is_through(box, source, towards)) {
+        return HitData_miss();
+    }
+    if (ref < 0) {
+        return Hittable_hit(qt->leaves[~ref], source, towards);
+    }
+
+    // Children in the same order as HitTree, so ties resolve alike.
+    const _QuantNode* node = qt->nodes + ref;
+    HitData lh =
+        qt_hit(qt, node->child[0], child_box(box, node, 0), source, towards);
+    HitData rh =
+        qt_hit(qt, node->child[1], child_box(box, node, 1), source, towards);
+    return (lh.t <= rh.t) ? lh : rh;
+}
+
+// Performs occluded on a sub-tree of a QuantTree.
+// @param qt The tree.
+// @param ref The reference to the root of the sub-tree.
+// @param box The decoded box of the root.
+// @param source The source of the ray.
+// @param towards The direction the ray is moving towards.
+// @param t_max Only hits closer than source + towards * t_max count.
+// @return True if the ray is blocked.
+static bool qt_occluded(const QuantTree* qt,
+                        int ref,
+                        Box box,
+                        Vector source,
+                        Vector towards,
+                        double t_max) {
+    ++steps;
+    if (!Box_is_through_until(box, source, towards, t_max)) {
+        return false;
+    }
+    if (ref < 0) {
+        return Hittable_occluded(qt->leaves[~ref], source, towards, t_max);
+    }
+
+    const _QuantNode* node = qt->nodes + ref;
+    return qt_occluded(qt, node->child[0], child_box(box, node, 0), source,
+                       towards, t_max) ||
+           qt_occluded(qt, node->child[1], child_box(box, node, 1), source,
+                       towards, t_max);
+}
+
+// QuantTreeHit is the implementation of hit for QuantTree.
+// @see Hittable
+static HitData QuantTree_hit(const void* qt, Vector source, Vector towards) {
+    const QuantTree* tree = qt;
+    return qt_hit(tree, tree->root, tree->bounds, source, towards);
+}
+
+// QuantTreeOccluded is the implementation of occluded for QuantTree.
+// @see Hittable
+static bool QuantTree_occluded(const void* qt,
+                               Vector source,
+                               Vector towards,
+                               double t_max) {
+    const QuantTree* tree = qt;
+    return qt_occluded(tree, tree->root, tree->bounds, source, towards, t_max);
+}
+
+// QuantTreeBounds is the implementation of bounds for QuantTree.
+// @see Hittable
+static Box QuantTree_bounds(const void* qt) {
+    const QuantTree* tree = qt;
+    return tree->bounds;
+}
+
+Hittable QuantTree_Hittable(const QuantTree* qt) {
+    return (Hittable){
+        .object = qt,
+        .hit = QuantTree_hit,
+        .occluded = QuantTree_occluded,
+        .bounds = QuantTree_bounds,
+    };
+}
@@ -1,12 +1,14 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "geometric.h"
 #include "material.h"
 
 // Forward declaration
 struct HitData;
+struct RayBatch;
 
 // Hittable is an interface representing everything you can hit.
 // @author RenTrueWang
@@ -19,10 +21,26 @@ typedef struct Hittable {
     // @param towards The direction the ray is moving towards.
     // @return The record of this hit.
     struct HitData (*hit)(const void* object, Vector source, Vector towards);
+    // Whether the ray hits anything before a distance. Stops at the first
+    // hit found, which need not be the closest, so it is cheaper than hit.
+    // @param object The interface object.
+    // @param source The source of the ray.
+    // @param towards The direction the ray is moving towards.
+    // @param t_max Only hits closer than source + towards * t_max count.
+    // @return True if the ray is blocked.
+    bool (*occluded)(const void* object,
+                     Vector source,
+                     Vector towards,
+                     double t_max);
     // The bounds of the object.
     // @param object The interface object.
     // @return The region that the object occupies.
     Box (*bounds)(const void* object);
+    // Hints that rays are about to be traced, so that whatever they may hit
+    // can be loaded ahead of time. NULL for objects that are always resident.
+    // @param object The interface object.
+    // @param rays The rays.
+    void (*prefetch)(const void* object, const struct RayBatch* rays);
 } Hittable;
 
 // Calls hit for Hittable.
@@ -32,11 +50,32 @@ typedef struct Hittable {
 // @return The record of this hit.
 struct HitData Hittable_hit(Hittable ht, Vector source, Vector towards);
 
+// Calls occluded for Hittable.
+// @param ht Hittable object to use.
+// @param source The source of the ray.
+// @param towards The direction the ray is moving towards.
+// @param t_max Only hits closer than source + towards * t_max count.
+// @return True if the ray is blocked.
+bool Hittable_occluded(Hittable ht,
+                       Vector source,
+                       Vector towards,
+                       double t_max);
+
+// Calls prefetch for Hittable, if it has one.
+// @param ht Hittable object to use.
+// @param rays The rays that are about to be traced.
+void Hittable_prefetch(Hittable ht, const struct RayBatch* rays);
+
 // Calls bounds for Hittable.
 // @param ht Hittable object to use.
 // @return The bounding box of the Hittable.
 struct Box Hittable_bounds(Hittable ht);
 
+// The number of nodes and primitives the calling thread has visited while
+// looking for hits. Used to measure how expensive rays are.
+// @return The running count of traversal steps of the calling thread.
+unsigned long Hittable_steps(void);
+
 // Creates a null value for hittable.
 // @return A Hittable object that's zero initialized, suitable for null value.
 Hittable Hittable_null(void);
@@ -57,6 +96,8 @@ typedef struct HitData {
     Vector normal;
     // The material of the surface of the hit.
     struct Material mat;
+    // The primitive that is hit. NULL if unknown.
+    const void* object;
 } HitData;
 
 // Whether the hit data indicates a hit.
@@ -161,3 +202,55 @@ void HitTree_free(HitTree* ht);
 // @param ht HitTree to convert. ht lives on the heap.
 // @return Hittable object that stores a HitTree.
 Hittable HitTree_Hittable(const HitTree* ht);
+
+// A node of a QuantTree. Instead of its own bounds, a node stores the bounds
+// of its two children, each as 8-bit positions within the node's own box,
+// rounded outwards so that a child's decoded box always contains it.
+// @author RenTrueWang
+typedef struct _QuantNode {
+    // The low end of every child's box on every axis, in 255ths of the
+    // node's box from its low end.
+    uint8_t lo[2][3];
+    // The high end of every child's box on every axis, in 255ths of the
+    // node's box from its low end. Decoded from the high end, so 255 is
+    // exactly the high end of the node's box.
+    uint8_t hi[2][3];
+    // The children. Non-negative values are indices of nodes, negative
+    // values are complements (~) of indices of leaves.
+    int32_t child[2];
+} _QuantNode;
+
+// QuantTree is a HitTree with quantized bounds. Its nodes are about a
+// quarter of the size of HitTree's, so far more of a large tree stays in
+// cache. Decoded boxes only ever grow, so a QuantTree finds exactly the hits
+// of the HitTree it is made from, at the cost of a few more box tests.
+// @author RenTrueWang
+typedef struct QuantTree {
+    // The internal nodes.
+    _QuantNode* nodes;
+    // Number of internal nodes.
+    int length;
+    // The hittables at the leaves.
+    Hittable* leaves;
+    // Number of leaves.
+    int nleaves;
+    // The exact bounds of the root.
+    Box bounds;
+    // The root. A node index, or the complement of a leaf index.
+    int root;
+} QuantTree;
+
+// Creates a quantized copy of a tree.
+// @param ht The tree to copy. Can be freed afterwards.
+// @return A new QuantTree.
+QuantTree QuantTree_make(const HitTree* ht);
+
+// Free the resources controlled by QuantTree.
+// @param qt QuantTree to free.
+// @see free
+void QuantTree_free(QuantTree* qt);
+
+// Converts a QuantTree to a Hittable.
+// @param qt QuantTree to convert. qt lives on the heap.
+// @return Hittable object that stores a QuantTree.
+Hittable QuantTree_Hittable(const QuantTree* qt);
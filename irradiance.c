@@ -0,0 +1,388 @@
+#include "irradiance.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "macro.h"
+
+// Number of buckets of the hashed grids. A power of 2.
+#define IRR_BUCKETS (1 << 16)
+
+// Strata of the azimuth per stratum of the polar angle. Ward recommends
+// about pi.
+#define IRR_AZIMUTHS 3
+
+// Records lying this far in front of a point, relative to their radius, are
+// not used by it: they see light that the point doesn't.
+#define IRR_FRONT .05
+
+// A cached irradiance.
+typedef struct _IrrRecord {
+    // Where the hemisphere was swept.
+    Vector point;
+    // The unit normal at point.
+    Vector normal;
+    // The irradiance at point.
+    Vector irradiance;
+    // The harmonic mean distance to the surfaces around, limited by the
+    // gradient and clamped.
+    double radius;
+    // The rotational gradient of every channel.
+    Vector rot[3];
+    // The translational gradient of every channel.
+    Vector trans[3];
+    // The record made before this one.
+    struct _IrrRecord* next;
+} _IrrRecord;
+
+// A record in a cell of a grid.
+typedef struct _IrrEntry {
+    // The level of the grid.
+    int level;
+    // The cell.
+    int cell[3];
+    // The record.
+    const _IrrRecord* record;
+    // The next entry in the same bucket.
+    struct _IrrEntry* next;
+} _IrrEntry;
+
+struct IrrCache {
+    // How far records reach.
+    double accuracy;
+    // The smallest radius of a record.
+    double min_radius;
+    // The largest radius of a record.
+    double max_radius;
+    // Number of strata of the polar angle.
+    int strata;
+    // The side of a cell of the coarsest grid. Every level halves it. A
+    // record is kept in the finest grid whose cells are twice its reach, so
+    // every record is in at most 8 cells, and the records in a cell are all
+    // about as large as it.
+    double side;
+    // Number of levels of grids.
+    int levels;
+    // Bit i is set once the grid of level i has a record, so that lookups
+    // skip the empty ones.
+    atomic_uint used;
+    // Lists of entries, by the hash of their level and cell. Only ever
+    // prepended to.
+    _Atomic(_IrrEntry*)* buckets;
+    // All records, to free them.
+    _Atomic(_IrrRecord*) records;
+    // Number of records.
+    atomic_size_t size;
+};
+
+IrrCache* IrrCache_make(double accuracy,
+                        double min_radius,
+                        double max_radius,
+                        int strata) {
+    assert(accuracy > 0);
+    assert(min_radius > 0 && min_radius <= max_radius);
+    assert(strata > 1);
+
+    IrrCache* ic = calloc(1, sizeof(IrrCache));
+    ic->accuracy = accuracy;
+    ic->min_radius = min_radius;
+    ic->max_radius = max_radius;
+    ic->strata = strata;
+    ic->side = 2 * accuracy * max_radius;
+    ic->levels = 1 + (int)ceil(log2(max_radius / min_radius));
+    ic->levels = (ic->levels > 32) ? 32 : ic->levels;
+    ic->buckets = calloc(IRR_BUCKETS, sizeof(_Atomic(_IrrEntry*)));
+    for (int i = 0; i < IRR_BUCKETS; ++i) {
+        atomic_init(&ic->buckets[i], NULL);
+    }
+    atomic_init(&ic->records, NULL);
+    atomic_init(&ic->size, 0);
+    atomic_init(&ic->used, 0);
+    return ic;
+}
+
+void IrrCache_free(IrrCache* ic) {
+    for (int i = 0; i < IRR_BUCKETS; ++i) {
+        _IrrEntry* e = atomic_load(&ic->buckets[i]);
+        while (e) {
+            _IrrEntry* next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    _IrrRecord* r = atomic_load(&ic->records);
+    while (r) {
+        _IrrRecord* next = r->next;
+        free(r);
+        r = next;
+    }
+    free(ic->buckets);
+    free(ic);
+}
+
+size_t IrrCache_size(const IrrCache* ic) {
+    return atomic_load(&((IrrCache*)ic)->size);
+}
+
+// The bucket of a cell.
+// @param level The level of the grid.
+// @param cell The cell.
+// @return The index of the bucket.
+static unsigned bucket_of(int level, const int cell[3]) {
+    unsigned h = (unsigned)cell[0] * 73856093u ^ (unsigned)cell[1] * 19349663u ^
+                 (unsigned)cell[2] * 83492791u ^ (unsigned)level * 2654435761u;
+    return h & (IRR_BUCKETS - 1);
+}
+
+// The cell of a coordinate along one axis.
+// @param ic The cache.
+// @param level The level of the grid.
+// @param value The coordinate.
+// @return The index of the cell.
+static int cell_of(const IrrCache* ic, int level, double value) {
+    return (int)floor(value / ldexp(ic->side, -level));
+}
+
+// Estimates the irradiance at a point from one record.
+// @param r The record.
+// @param point The point.
+// @param normal The unit normal at the point.
+// @return The extrapolated irradiance.
+static Vector extrapolate(const _IrrRecord* r, Vector point, Vector normal) {
+    Vector offset = Vec_sub(point, r->point);
+    Vector turn = Vec_cross(r->normal, normal);
+    double e[3] = {r->irradiance.x, r->irradiance.y, r->irradiance.z};
+    for (int c = 0; c < 3; ++c) {
+        e[c] += Vec_dot(turn, r->rot[c]) + Vec_dot(offset, r->trans[c]);
+        e[c] = (e[c] > 0) ? e[c] : 0;
+    }
+    return (Vector){e[0], e[1], e[2]};
+}
+
+// Interpolates the records around a point.
+// @param ic The cache.
+// @param point The point.
+// @param normal The unit normal at the point.
+// @param irradiance Where the interpolated irradiance is stored.
+// @return False if no record is close enough.
+static bool lookup(const IrrCache* ic,
+                   Vector point,
+                   Vector normal,
+                   Vector* irradiance) {
+    Vector sum = Vec_o();
+    double weights = 0;
+    unsigned used = atomic_load_explicit(&ic->used, memory_order_relaxed);
+    for (int level = 0; level < ic->levels; ++level) {
+        if (!(used >> level & 1)) {
+            continue;
+        }
+        int cell[3] = {cell_of(ic, level, point.x), cell_of(ic, level, point.y),
+                       cell_of(ic, level, point.z)};
+        const _IrrEntry* e = atomic_load(&ic->buckets[bucket_of(level, cell)]);
+        for (; e; e = e->next) {
+            if (e->level != level || e->cell[0] != cell[0] ||
+                e->cell[1] != cell[1] || e->cell[2] != cell[2]) {
+                continue;
+            }
+
+            // Ward's error estimate: how far the point is relative to the
+            // record's radius, plus how much the normals differ.
+            const _IrrRecord* r = e->record;
+            Vector offset = Vec_sub(point, r->point);
+            double cos = Vec_dot(normal, r->normal);
+            double error = Vec_len(offset) / r->radius +
+                           sqrt((cos < 1) ? 1 - cos : 0);
+            if (error >= ic->accuracy) {
+                continue;
+            }
+            double front = Vec_dot(offset, Vec_add(normal, r->normal)) / 2;
+            if (front < -IRR_FRONT * r->radius) {
+                continue;
+            }
+
+            double w = 1. / ((error > 1e-9) ? error : 1e-9);
+            Vec_iadd(&sum, Vec_mul_s(extrapolate(r, point, normal), w));
+            weights += w;
+        }
+    }
+
+    if (!weights) {
+        return false;
+    }
+    *irradiance = Vec_div_s(sum, weights);
+    return true;
+}
+
+// Adds a record to every cell it reaches.
+// @param ic The cache.
+// @param r The record. Owned by the cache from now on.
+static void insert(IrrCache* ic, _IrrRecord* r) {
+    r->next = atomic_load(&ic->records);
+    while (!atomic_compare_exchange_weak(&ic->records, &r->next, r)) {
+    }
+    atomic_fetch_add(&ic->size, 1);
+
+    double reach = ic->accuracy * r->radius;
+    int level = (int)floor(log2(ic->side / (2 * reach)));
+    level = (level < 0) ? 0 : (level >= ic->levels) ? ic->levels - 1 : level;
+
+    double p[3] = {r->point.x, r->point.y, r->point.z};
+    int lo[3], hi[3];
+    for (int i = 0; i < 3; ++i) {
+        lo[i] = cell_of(ic, level, p[i] - reach);
+        hi[i] = cell_of(ic, level, p[i] + reach);
+    }
+
+    for (int x = lo[0]; x <= hi[0]; ++x) {
+        for (int y = lo[1]; y <= hi[1]; ++y) {
+            for (int z = lo[2]; z <= hi[2]; ++z) {
+                _IrrEntry* e = malloc(sizeof(_IrrEntry));
+                *e = (_IrrEntry){
+                    .level = level,
+                    .cell = {x, y, z},
+                    .record = r,
+                };
+                _Atomic(_IrrEntry*)* head =
+                    &ic->buckets[bucket_of(level, e->cell)];
+                e->next = atomic_load(head);
+                while (!atomic_compare_exchange_weak(head, &e->next, e)) {
+                }
+            }
+        }
+    }
+    atomic_fetch_or(&ic->used, 1u << level);
+}
+
+// Sweeps the hemisphere over a point, and computes its record with Ward and
+// Heckbert's gradients.
+// @param ic The cache.
+// @param point The point.
+// @param n The unit normal at the point.
+// @param sample Traces the directions.
+// @param user Passed to sample.
+// @param seed The seed pointer for the random number generator.
+// @return The new record.
+static _IrrRecord* sweep(const IrrCache* ic,
+                         Vector point,
+                         Vector n,
+                         IrrSample sample,
+                         const void* user,
+                         unsigned* seed) {
+    int rows = ic->strata;
+    int cols = IRR_AZIMUTHS * ic->strata;
+    Vector* radiance = malloc(rows * cols * sizeof(Vector));
+    double* distance = malloc(rows * cols * sizeof(double));
+
+    // A tangent frame (Duff et al.), without branches on the normal.
+    double sign = copysign(1., n.z);
+    double a = -1. / (sign + n.z);
+    double b = n.x * n.y * a;
+    Vector u = {1. + sign * n.x * n.x * a, sign * b, -sign * n.x};
+    Vector v = {b, sign + n.y * n.y * a, -n.y};
+
+    // Cosine-weighted stratified directions, so that the irradiance is the
+    // mean of the radiance.
+    Vector mean = Vec_o();
+    double inverse = 0;
+    for (int j = 0; j < rows; ++j) {
+        for (int k = 0; k < cols; ++k) {
+            double sin2 = (j + genfloat(seed)) / rows;
+            double phi = 2 * M_PI * (k + genfloat(seed)) / cols;
+            double st = sqrt(sin2);
+            Vector t = Vec_add(Vec_mul_s(u, cos(phi) * st),
+                               Vec_mul_s(v, sin(phi) * st));
+            Vector towards = Vec_add(t, Vec_mul_s(n, sqrt(1 - sin2)));
+
+            int i = j * cols + k;
+            radiance[i] = sample(user, point, towards, distance + i, seed);
+            Vec_iadd(&mean, radiance[i]);
+            inverse += 1. / distance[i];
+        }
+    }
+    Vec_idiv_s(&mean, rows * cols);
+
+    _IrrRecord* r = calloc(1, sizeof(_IrrRecord));
+    r->point = point;
+    r->normal = n;
+    r->irradiance = mean;
+
+    // The gradients, divided by pi like the irradiance. They use the center
+    // of every stratum rather than its sample.
+    for (int k = 0; k < cols; ++k) {
+        double phi = 2 * M_PI * (k + .5) / cols;
+        double edge = 2 * M_PI * k / cols;
+        Vector uk = Vec_add(Vec_mul_s(u, cos(phi)), Vec_mul_s(v, sin(phi)));
+        Vector vk = Vec_sub(Vec_mul_s(v, cos(phi)), Vec_mul_s(u, sin(phi)));
+        Vector ve = Vec_sub(Vec_mul_s(v, cos(edge)), Vec_mul_s(u, sin(edge)));
+        int prev = (k + cols - 1) % cols;
+
+        for (int j = 0; j < rows; ++j) {
+            Vector l = radiance[j * cols + k];
+            double sin2 = (j + .5) / rows;
+            double rot = -sqrt(sin2 / (1 - sin2)) / (rows * cols);
+
+            // Between this stratum and the one before in azimuth.
+            double sin_lo = sqrt((double)j / rows);
+            double sin_hi = sqrt((double)(j + 1) / rows);
+            double near = fmin(distance[j * cols + k],
+                               distance[j * cols + prev]);
+            Vector dl = Vec_sub(l, radiance[j * cols + prev]);
+            double across = (sin_hi - sin_lo) / near / M_PI;
+
+            // Between this stratum and the one before in polar angle.
+            double down = 0;
+            Vector dj = Vec_o();
+            if (j > 0) {
+                double near_j = fmin(distance[j * cols + k],
+                                     distance[(j - 1) * cols + k]);
+                dj = Vec_sub(l, radiance[(j - 1) * cols + k]);
+                double cos2 = 1 - (double)j / rows;
+                down = 2 * M_PI / cols * sin_lo * cos2 / near_j / M_PI;
+            }
+
+            double lc[3] = {l.x, l.y, l.z};
+            double dlc[3] = {dl.x, dl.y, dl.z};
+            double djc[3] = {dj.x, dj.y, dj.z};
+            for (int c = 0; c < 3; ++c) {
+                Vec_iadd(&r->rot[c], Vec_mul_s(vk, rot * lc[c]));
+                Vec_iadd(&r->trans[c], Vec_mul_s(uk, down * djc[c]));
+                Vec_iadd(&r->trans[c], Vec_mul_s(ve, across * dlc[c]));
+            }
+        }
+    }
+
+    // The harmonic mean distance, kept small enough that the gradient can't
+    // change the irradiance by more than itself within it.
+    double radius = inverse ? rows * cols / inverse : ic->max_radius;
+    double e[3] = {mean.x, mean.y, mean.z};
+    for (int c = 0; c < 3; ++c) {
+        double slope = Vec_len(r->trans[c]);
+        if (slope * radius > e[c]) {
+            radius = e[c] / slope;
+        }
+    }
+    radius = (radius < ic->min_radius) ? ic->min_radius : radius;
+    r->radius = (radius > ic->max_radius) ? ic->max_radius : radius;
+
+    free(radiance);
+    free(distance);
+    return r;
+}
+
+Vector IrrCache_get(IrrCache* ic,
+                    Vector point,
+                    Vector normal,
+                    IrrSample sample,
+                    const void* user,
+                    unsigned* seed) {
+    Vector irradiance;
+    if (lookup(ic, point, normal, &irradiance)) {
+        return irradiance;
+    }
+
+    _IrrRecord* r = sweep(ic, point, normal, sample, user, seed);
+    insert(ic, r);
+    return r->irradiance;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "geometric.h"
+
+// IrrCache caches the indirect irradiance of diffuse surfaces (Ward's
+// irradiance caching). A record is made from a stratified sweep of the
+// hemisphere over a point, and stores the irradiance there together with
+// its translational and rotational gradients. Nearby points with similar
+// normals interpolate the records instead of sweeping their own hemisphere.
+//
+// Records are added lazily while rendering, and a cache can be shared by
+// any number of threads: lookups take no lock, and insertions only
+// publish a record with an atomic exchange. Which records exist depends
+// on the order that threads reach the points, so images with a cache vary
+// slightly between runs.
+// @author RenTrueWang
+typedef struct IrrCache IrrCache;
+
+// Traces one direction of a sweep.
+// @param user The user data given to IrrCache_get.
+// @param source The point of the record.
+// @param towards The unit direction to trace.
+// @param distance Where the distance to the first hit is stored. INFINITY
+// if nothing is hit.
+// @param seed The seed pointer for the random number generator.
+// @return The radiance arriving at source from towards.
+typedef Vector (*IrrSample)(const void* user,
+                            Vector source,
+                            Vector towards,
+                            double* distance,
+                            unsigned* seed);
+
+// Creates an empty cache.
+// @param accuracy How far records reach. A record is used by points whose
+// distance relative to the record's radius, plus the difference of their
+// normals, is below accuracy. Smaller is slower and more accurate.
+// @param min_radius The smallest radius of a record.
+// @param max_radius The largest radius of a record.
+// @param strata Number of strata of the polar angle of a sweep. The azimuth
+// gets three times as many, so a sweep traces 3 * strata^2 directions.
+// @return A new IrrCache.
+IrrCache* IrrCache_make(double accuracy,
+                        double min_radius,
+                        double max_radius,
+                        int strata);
+
+// Free the cache and its records.
+// @param ic IrrCache to free.
+// @see free
+void IrrCache_free(IrrCache* ic);
+
+// Determines the indirect irradiance at a point, from the records nearby, or
+// from a new record if none is close enough. The irradiance is normalized
+// so that a Lambertian surface reflects albedo * irradiance.
+// @param ic The cache.
+// @param point The point.
+// @param normal The unit surface normal at the point.
+// @param sample Traces the directions of a new record.
+// @param user Passed to sample.
+// @param seed The seed pointer for the random number generator.
+// @return The irradiance.
+Vector IrrCache_get(IrrCache* ic,
+                    Vector point,
+                    Vector normal,
+                    IrrSample sample,
+                    const void* user,
+                    unsigned* seed);
+
+// Number of records made so far.
+// @param ic The cache.
+// @return Number of records.
+size_t IrrCache_size(const IrrCache* ic);
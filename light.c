@@ -0,0 +1,459 @@
+#include "light.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "macro.h"
+#include "material.h"
+
+LightSample LightSampler_sample(LightSampler ls,
+                                Vector point,
+                                Vector normal,
+                                unsigned* seed) {
+    return ls.sample(ls.object, point, normal, seed);
+}
+
+double LightSampler_pdf(LightSampler ls,
+                        const Sphere* light,
+                        Vector point,
+                        Vector normal) {
+    return ls.pdf(ls.object, light, point, normal);
+}
+
+LightSampler LightSampler_null(void) {
+    return (LightSampler){.object = NULL, .sample = NULL, .pdf = NULL};
+}
+
+bool LightSampler_is_null(LightSampler ls) {
+    return !ls.object;
+}
+
+LightList LightList_make(const Sphere* spheres, int count) {
+    const Sphere** list = calloc(count, sizeof(Sphere*));
+
+    int length = 0;
+    for (int i = 0; i < count; ++i) {
+        if (spheres[i].mat.kind == MAT_EMISSIVE) {
+            list[length++] = spheres + i;
+        }
+    }
+
+    return (LightList){.list = list, .length = length};
+}
+
+void LightList_free(LightList* ll) {
+    free(ll->list);
+    ll->list = NULL;
+}
+
+// LightListSample is the implementation of sample for LightList.
+// @see LightSampler
+static LightSample LightList_sample(const void* ll,
+                                    Vector point,
+                                    Vector normal,
+                                    unsigned* seed) {
+    const LightList* lightlist = ll;
+    (void)normal;
+
+    if (!lightlist->length) {
+        return (LightSample){.light = NULL};
+    }
+
+    int idx = rand_r(seed) % lightlist->length;
+    const Sphere* light = lightlist->list[idx];
+
+    return (LightSample){
+        .light = light,
+        .towards = Sph_sample(*light, point, seed),
+        .pdf = Sph_pdf(*light, point) / lightlist->length,
+    };
+}
+
+// LightListPdf is the implementation of pdf for LightList.
+// @see LightSampler
+static double LightList_pdf(const void* ll,
+                            const Sphere* light,
+                            Vector point,
+                            Vector normal) {
+    const LightList* lightlist = ll;
+    (void)normal;
+
+    assert(lightlist->length);
+    return Sph_pdf(*light, point) / lightlist->length;
+}
+
+LightSampler LightList_Sampler(const LightList* ll) {
+    return (LightSampler){
+        .object = ll,
+        .sample = LightList_sample,
+        .pdf = LightList_pdf,
+    };
+}
+
+// Approximate power of an emissive sphere. Luminance times surface area.
+// @param light The emissive sphere.
+// @return The power.
+static double light_power(const Sphere* light) {
+    Vector le = Mat_emitted(light->mat);
+    double lum = .2126 * le.x + .7152 * le.y + .0722 * le.z;
+    double r = light->radius;
+    return lum * 4. * M_PI * r * r;
+}
+
+// Angle between two unit vectors.
+// @param a The first unit vector.
+// @param b The second unit vector.
+// @return The angle in the range [0, pi].
+static double angle(Vector a, Vector b) {
+    double cos = Vec_dot(a, b);
+    return acos((cos < -1) ? -1 : (cos > 1) ? 1 : cos);
+}
+
+// Merges two bounding cones into one that bounds both, written into a.
+// @param axis The axis of the first cone, modified to the merged axis.
+// @param theta The half angle of the first cone, modified to the merged one.
+// @param other_axis The axis of the second cone.
+// @param other_theta The half angle of the second cone.
+static void cone_wraps(Vector* axis,
+                       double* theta,
+                       Vector other_axis,
+                       double other_theta) {
+    if (other_theta > *theta) {
+        swap(Vector, *axis, other_axis);
+        swap(double, *theta, other_theta);
+    }
+
+    // Now the first cone is the wider one.
+    double between = angle(*axis, other_axis);
+    if (fmin(between + other_theta, M_PI) <= *theta) {
+        return;
+    }
+
+    double merged = (*theta + between + other_theta) / 2.;
+    if (merged >= M_PI) {
+        *theta = M_PI;
+        return;
+    }
+
+    // Rotate the axis towards the other one, far enough to cover both.
+    double rotate = merged - *theta;
+    Vector ortho =
+        Vec_sub(other_axis, Vec_mul_s(*axis, Vec_dot(*axis, other_axis)));
+    if (Vec_l2(ortho) > 0) {
+        Vector along = Vec_mul_s(*axis, cos(rotate));
+        Vector across = Vec_mul_s(Vec_unit(ortho), sin(rotate));
+        *axis = Vec_unit(Vec_add(along, across));
+    }
+    *theta = merged;
+}
+
+// Compare lights along the X axis.
+// @param a The first light to compare.
+// @param b The second light to compare.
+// @return The sign of a.center.x - b.center.x
+static int cmp_x(const void* a, const void* b) {
+    double ax = (*(const Sphere**)a)->center.x;
+    double bx = (*(const Sphere**)b)->center.x;
+    return (ax > bx) - (ax < bx);
+}
+
+// Compare lights along the Y axis.
+// @param a The first light to compare.
+// @param b The second light to compare.
+// @return The sign of a.center.y - b.center.y
+static int cmp_y(const void* a, const void* b) {
+    double ay = (*(const Sphere**)a)->center.y;
+    double by = (*(const Sphere**)b)->center.y;
+    return (ay > by) - (ay < by);
+}
+
+// Compare lights along the Z axis.
+// @param a The first light to compare.
+// @param b The second light to compare.
+// @return The sign of a.center.z - b.center.z
+static int cmp_z(const void* a, const void* b) {
+    double az = (*(const Sphere**)a)->center.z;
+    double bz = (*(const Sphere**)b)->center.z;
+    return (az > bz) - (az < bz);
+}
+
+// Sort the lights along the axis where their centers are the most spread.
+// @param list The lights.
+// @param len Length of the list.
+static void sort_max_extent(const Sphere** list, int len) {
+    Vector lo = list[0]->center;
+    Vector hi = list[0]->center;
+    for (int i = 1; i < len; ++i) {
+        Vector c = list[i]->center;
+        lo = (Vector){fmin(lo.x, c.x), fmin(lo.y, c.y), fmin(lo.z, c.z)};
+        hi = (Vector){fmax(hi.x, c.x), fmax(hi.y, c.y), fmax(hi.z, c.z)};
+    }
+    Vector extent = Vec_sub(hi, lo);
+
+    if (extent.x >= extent.y && extent.x >= extent.z) {
+        qsort(list, len, sizeof(Sphere*), cmp_x);
+    } else if (extent.y >= extent.z) {
+        qsort(list, len, sizeof(Sphere*), cmp_y);
+    } else {
+        qsort(list, len, sizeof(Sphere*), cmp_z);
+    }
+}
+
+// Converts a list of lights into a tree, the same way HitTree partitions
+// hittables: sort along the widest axis and split in halves.
+// @param list The lights. Reordered in place.
+// @param len Length of the list.
+// @param nl NodeList's pointer. The new elements.
+// @param nl_idx Current index of NodeList to modify.
+// @return Index of node stored by the function.
+static int partition(const Sphere** list,
+                     int len,
+                     _LightNode* nl,
+                     int* nl_idx) {
+    assert(len > 0);
+
+    if (len == 1) {
+        int mod = (*nl_idx)++;
+        const Sphere* light = list[0];
+        Vector c = light->center;
+        double r = light->radius;
+        nl[mod] = (_LightNode){
+            .light = light,
+            .bounds = Box_make(c.x - r, c.x + r, c.y - r, c.y + r, c.z - r,
+                               c.z + r),
+            .power = light_power(light),
+            .axis = Vec_j(),
+            .theta = M_PI,
+            .left = -1,
+            .right = -1,
+            .parent = -1,
+        };
+        return mod;
+    }
+
+    sort_max_extent(list, len);
+
+    int half = len / 2;
+    int left = partition(list, half, nl, nl_idx);
+    int right = partition(list + half, len - half, nl, nl_idx);
+
+    int mod = (*nl_idx)++;
+    nl[left].parent = mod;
+    nl[right].parent = mod;
+
+    Vector axis = nl[left].axis;
+    double theta = nl[left].theta;
+    cone_wraps(&axis, &theta, nl[right].axis, nl[right].theta);
+
+    nl[mod] = (_LightNode){
+        .light = NULL,
+        .bounds = Box_wraps(nl[left].bounds, nl[right].bounds),
+        .power = nl[left].power + nl[right].power,
+        .axis = axis,
+        .theta = theta,
+        .left = left,
+        .right = right,
+        .parent = -1,
+    };
+    return mod;
+}
+
+// Compare refs by the address of their light.
+// @param a The first _LightRef to compare.
+// @param b The second _LightRef to compare.
+// @return The order of the addresses.
+static int cmp_ref(const void* a, const void* b) {
+    uintptr_t la = (uintptr_t)((const _LightRef*)a)->light;
+    uintptr_t lb = (uintptr_t)((const _LightRef*)b)->light;
+    return (la > lb) - (la < lb);
+}
+
+LightTree LightTree_make(LightList ll) {
+    int count = ll.length;
+    if (!count) {
+        return (LightTree){
+            .nodelist = NULL,
+            .length = 0,
+            .refs = NULL,
+            .count = 0,
+        };
+    }
+
+    int length = 2 * count - 1;
+    _LightNode* nodelist = calloc(length, sizeof(_LightNode));
+
+    const Sphere** list = calloc(count, sizeof(Sphere*));
+    for (int i = 0; i < count; ++i) {
+        list[i] = ll.list[i];
+    }
+
+    int cidx = 0;
+    partition(list, count, nodelist, &cidx);
+    assert(cidx == length);
+    free(list);
+
+    _LightRef* refs = calloc(count, sizeof(_LightRef));
+    int ridx = 0;
+    for (int i = 0; i < length; ++i) {
+        if (nodelist[i].light) {
+            refs[ridx++] = (_LightRef){.light = nodelist[i].light, .leaf = i};
+        }
+    }
+    assert(ridx == count);
+    qsort(refs, count, sizeof(_LightRef), cmp_ref);
+
+    return (LightTree){
+        .nodelist = nodelist,
+        .length = length,
+        .refs = refs,
+        .count = count,
+    };
+}
+
+void LightTree_free(LightTree* lt) {
+    free(lt->nodelist);
+    free(lt->refs);
+    lt->nodelist = NULL;
+    lt->refs = NULL;
+}
+
+// Estimates how much a node contributes to a point. The estimate is
+// conservative: lights that can reach the point never get 0.
+// @param node The node to estimate.
+// @param point The point that is lit.
+// @param normal The unit surface normal at the point. Zero if unknown.
+// @return The importance of the node.
+static double importance(const _LightNode* node, Vector point, Vector normal) {
+    Box b = node->bounds;
+    Vector center = Box_center(b);
+    Vector half = (Vector){
+        (b.x.y - b.x.x) / 2.,
+        (b.y.y - b.y.x) / 2.,
+        (b.z.y - b.z.x) / 2.,
+    };
+    double radius_sq = Vec_l2(half);
+
+    Vector d = Vec_sub(center, point);
+    double dist_sq = Vec_l2(d);
+    if (dist_sq <= radius_sq) {
+        // The point is within the bounds, every direction is possible.
+        return node->power / radius_sq;
+    }
+
+    Vector towards = Vec_div_s(d, sqrt(dist_sq));
+    // The half angle that the bounds subtend from the point.
+    double uncertain = asin(sqrt(radius_sq / dist_sq));
+
+    // Is the point within the cone of emitted directions?
+    double emit = angle(node->axis, Vec_mul_s(towards, -1.));
+    double emit_min = fmax(0., emit - node->theta - uncertain);
+    if (emit_min >= M_PI / 2.) {
+        return 0;
+    }
+
+    // Is the light above the surface?
+    double incident = 1.;
+    if (Vec_any(normal)) {
+        double inc = fmax(0., angle(normal, towards) - uncertain);
+        if (inc >= M_PI / 2.) {
+            return 0;
+        }
+        incident = cos(inc);
+    }
+
+    return node->power * cos(emit_min) * incident / dist_sq;
+}
+
+// The probability of descending into the left child of a node.
+// @param nodelist The nodelist of the tree.
+// @param node The internal node.
+// @param point The point that is lit.
+// @param normal The unit surface normal at the point.
+// @return The probability. Negative if neither child contributes.
+static double prob_left(const _LightNode* nodelist,
+                        const _LightNode* node,
+                        Vector point,
+                        Vector normal) {
+    double il = importance(nodelist + node->left, point, normal);
+    double ir = importance(nodelist + node->right, point, normal);
+    return (il + ir > 0) ? il / (il + ir) : -1.;
+}
+
+// LightTreeSample is the implementation of sample for LightTree.
+// @see LightSampler
+static LightSample LightTree_sample(const void* lt,
+                                    Vector point,
+                                    Vector normal,
+                                    unsigned* seed) {
+    const LightTree* lighttree = lt;
+    const _LightNode* nodelist = lighttree->nodelist;
+
+    if (!lighttree->length) {
+        return (LightSample){.light = NULL};
+    }
+
+    const _LightNode* node = nodelist + lighttree->length - 1;
+    double prob = 1.;
+    while (!node->light) {
+        double pl = prob_left(nodelist, node, point, normal);
+        if (pl < 0) {
+            return (LightSample){.light = NULL};
+        }
+
+        if (genfloat(seed) < pl) {
+            node = nodelist + node->left;
+            prob *= pl;
+        } else {
+            node = nodelist + node->right;
+            prob *= 1. - pl;
+        }
+    }
+
+    const Sphere* light = node->light;
+    return (LightSample){
+        .light = light,
+        .towards = Sph_sample(*light, point, seed),
+        .pdf = Sph_pdf(*light, point) * prob,
+    };
+}
+
+// LightTreePdf is the implementation of pdf for LightTree.
+// @see LightSampler
+static double LightTree_pdf(const void* lt,
+                            const Sphere* light,
+                            Vector point,
+                            Vector normal) {
+    const LightTree* lighttree = lt;
+    const _LightNode* nodelist = lighttree->nodelist;
+
+    _LightRef key = {.light = light};
+    const _LightRef* ref = bsearch(&key, lighttree->refs, lighttree->count,
+                                   sizeof(_LightRef), cmp_ref);
+    if (!ref) {
+        return 0;
+    }
+
+    // Walk up from the leaf, multiplying the probability of every turn.
+    double prob = 1.;
+    int idx = ref->leaf;
+    for (int p = nodelist[idx].parent; p >= 0; p = nodelist[p].parent) {
+        double pl = prob_left(nodelist, nodelist + p, point, normal);
+        if (pl < 0) {
+            return 0;
+        }
+        prob *= (nodelist[p].left == idx) ? pl : 1. - pl;
+        idx = p;
+    }
+
+    return Sph_pdf(*light, point) * prob;
+}
+
+LightSampler LightTree_Sampler(const LightTree* lt) {
+    return (LightSampler){
+        .object = lt,
+        .sample = LightTree_sample,
+        .pdf = LightTree_pdf,
+    };
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "geometric.h"
+#include "object.h"
+
+// A direction sampled towards a light.
+typedef struct LightSample {
+    // The light that is sampled. NULL if there is no light to sample.
+    const Sphere* light;
+    // The unit direction towards the light.
+    Vector towards;
+    // The density of the direction with respect to solid angle, including
+    // the probability of picking the light.
+    double pdf;
+} LightSample;
+
+// LightSampler is an interface that picks lights for a shading point.
+// @author RenTrueWang
+typedef struct LightSampler {
+    // The interface object.
+    const void* object;
+    // Picks a light and samples a direction towards it.
+    // @param object The interface object.
+    // @param point The point that is lit.
+    // @param normal The unit surface normal at the point.
+    // @param seed The seed pointer for the random number generator.
+    // @return The sampled direction.
+    LightSample (*sample)(const void* object,
+                          Vector point,
+                          Vector normal,
+                          unsigned* seed);
+    // The density of sample producing a direction that hits a light.
+    // @param object The interface object.
+    // @param light The light that is hit. Must be one of the sampled lights.
+    // @param point The point that is lit.
+    // @param normal The unit surface normal at the point.
+    // @return The density with respect to solid angle.
+    double (*pdf)(const void* object,
+                  const Sphere* light,
+                  Vector point,
+                  Vector normal);
+} LightSampler;
+
+// Calls sample for LightSampler.
+// @param ls LightSampler object to use.
+// @param point The point that is lit.
+// @param normal The unit surface normal at the point.
+// @param seed The seed pointer for the random number generator.
+// @return The sampled direction.
+LightSample LightSampler_sample(LightSampler ls,
+                                Vector point,
+                                Vector normal,
+                                unsigned* seed);
+
+// Calls pdf for LightSampler.
+// @param ls LightSampler object to use.
+// @param light The light that is hit.
+// @param point The point that is lit.
+// @param normal The unit surface normal at the point.
+// @return The density with respect to solid angle.
+double LightSampler_pdf(LightSampler ls,
+                        const Sphere* light,
+                        Vector point,
+                        Vector normal);
+
+// Creates a null value for LightSampler.
+// @return A LightSampler that's zero initialized, suitable for null value.
+LightSampler LightSampler_null(void);
+
+// Determines if the LightSampler is a null value.
+// @param ls LightSampler object to check.
+// @return true if ls is a null value. Else false.
+bool LightSampler_is_null(LightSampler ls);
+
+// LightList stores the emissive spheres of a scene.
+// @author RenTrueWang
+typedef struct LightList {
+    // An array of emissive spheres. The spheres are not owned.
+    const Sphere** list;
+    // The length of the array.
+    int length;
+} LightList;
+
+// Creates a list of all the emissive spheres among the given spheres.
+// @param spheres An array of spheres. It must outlive the list.
+// @param count The length of the array.
+// @return A new LightList.
+LightList LightList_make(const Sphere* spheres, int count);
+
+// Free the resources controlled by LightList.
+// @param ll LightList to free.
+// @see free
+void LightList_free(LightList* ll);
+
+// Converts a LightList to a LightSampler. Lights are picked uniformly.
+// @param ll LightList to convert. ll lives on the heap.
+// @return LightSampler object that stores a LightList.
+LightSampler LightList_Sampler(const LightList* ll);
+
+// A binary node of the light hierarchy.
+// @author RenTrueWang
+typedef struct _LightNode {
+    // The light that the node carries. NULL if the node is internal.
+    const Sphere* light;
+    // The bounds of all lights in the sub-tree.
+    Box bounds;
+    // The total emitted power of all lights in the sub-tree.
+    double power;
+    // The axis of the cone that bounds the emitted directions.
+    Vector axis;
+    // The half angle of the cone that bounds the emitted directions. Spheres
+    // emit in every direction, so their cone is the whole sphere (pi).
+    double theta;
+    // Child nodes index. Both are negative if the node is a leaf.
+    int left, right;
+    // Parent node index. Negative if the node is the root.
+    int parent;
+} _LightNode;
+
+// Maps a light to the leaf node that holds it.
+typedef struct _LightRef {
+    // The light.
+    const Sphere* light;
+    // Index of the leaf in the nodelist.
+    int leaf;
+} _LightRef;
+
+// LightTree is a hierarchy over lights that picks lights proportional to
+// their estimated contribution to a point, in O(log n).
+// @author RenTrueWang
+typedef struct LightTree {
+    // The list of nodes, laid out like HitTree, the root being the last one.
+    _LightNode* nodelist;
+    // The length of the nodelist.
+    int length;
+    // The leaves, sorted by the address of their light, for looking up pdf.
+    _LightRef* refs;
+    // The length of refs.
+    int count;
+} LightTree;
+
+// Creates a new tree of lights.
+// @param ll The lights to build the tree from. The list is not modified.
+// @return A new LightTree. Empty if there are no lights.
+LightTree LightTree_make(LightList ll);
+
+// Free the resources controlled by LightTree.
+// @param lt LightTree to free.
+// @see free
+void LightTree_free(LightTree* lt);
+
+// Converts a LightTree to a LightSampler.
+// @param lt LightTree to convert. lt lives on the heap.
+// @return LightSampler object that stores a LightTree.
+LightSampler LightTree_Sampler(const LightTree* lt);
@@ -17,3 +17,17 @@
 // Generates a floating point in the range [0, 1].
 // @param SEED The pointer-to-state used in the random number generator.
 #define genfloat(SEED) (double)rand_r(SEED) / RAND_MAX
+
+// Mixes the bits of an integer, so that nearby integers hash to unrelated
+// ones. Every integer has a different hash. Only multiplies and shifts are
+// used, so loops over it vectorize.
+// @param x The integer.
+// @return The hash.
+static inline unsigned hash32(unsigned x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
@@ -1,12 +1,556 @@
 #include <assert.h>
 #include <omp.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "accum.h"
+#include "context.h"
+#include "denoise.h"
+#include "dist.h"
+#include "gbuffer.h"
+#include "macro.h"
+#include "material.h"
+#include "progressive.h"
+#include "render.h"
+#include "scene.h"
+#include "service.h"
+#include "temporal.h"
+#include "tonemap.h"
+
+// The side length of a tile.
+#define TILE_SIZE 16
+
+// Number of scenes the render service keeps resident.
+#define SERVICE_CACHE 8
+
+// How far irradiance records reach, and the range of their radii, for the
+// demo scene.
+#define IRR_ACCURACY .2
+#define IRR_MIN_RADIUS .01
+#define IRR_MAX_RADIUS 1.
+
+// Number of photons per generation, and the radius the first generation is
+// gathered over, for the demo scene.
+#define PHOTONS 200000
+#define PHOTON_RADIUS .05
+
+// How far the camera moves sideways between the frames of a fly-through.
+#define FLY_STEP .01
+
+// Bytes of chunks kept in memory when the demo scene is streamed.
+#define STREAM_CACHE ((size_t)256 << 20)
+
+// Builds the demo scene. Every process builds the same scene.
+// @return The committed demo scene.
+static Context* demo_make(void) {
+    ImgProp cfg = {
+        .samples = 16,
+        .depth = 50,
+        .width = 400,
+        .height = 200,
+        .rr_policy = RR_THROUGHPUT,
+        .rr_depth = 3,
+        .rr_prob = .05,
+    };
+    Camera cam = {
+        .source = {0, 0, 0},
+        .corner = {-2, -1, -1},
+        .horiz = {4, 0, 0},
+        .vertic = {0, 2, 0},
+        .aperture = 0,
+    };
+    Context* ctx = Ctx_make(cfg, cam);
+
+    int ground = Ctx_matte(ctx, (Matte){.albedo = {.5, .5, .5}});
+    int matte = Ctx_matte(ctx, (Matte){.albedo = {.1, .2, .5}});
+    int metal = Ctx_metal(ctx, (Metal){.albedo = {.8, .6, .2}, .blur = .1});
+    Glass clear = {.albedo = {1., 1., 1.}, .blur = 0., .refractive = 1.5};
+    int glass = Ctx_glass(ctx, clear);
+    int lamp = Ctx_emissive(ctx, (Emissive){.radiance = {8., 7., 6.}});
+
+    Ctx_sphere(ctx, (Vector){0, -100.5, -1}, 100, ground);
+    Ctx_sphere(ctx, (Vector){0, 0, -1}, .5, matte);
+    Ctx_sphere(ctx, (Vector){-1, 0, -1}, .5, glass);
+    Ctx_sphere(ctx, (Vector){1, 0, -1}, .5, metal);
+    Ctx_sphere(ctx, (Vector){0, 1.2, -1.5}, .25, lamp);
+
+    Ctx_commit(ctx);
+    return ctx;
+}
+
+// The seed of a pass, hashed from the seed of the render and the index of the
+// pass, so that the passes of renders started with different seeds draw
+// unrelated samples and their checkpoints can be merged.
+// @param seed The seed of the render.
+// @param pass The index of the pass.
+// @return The seed of the pass.
+static unsigned pass_seed(unsigned seed, int pass) {
+    return hash32(hash32(seed) + (unsigned)pass);
+}
+
+// Converts the mean radiance of every pixel of a buffer and writes it in the
+// binary PPM format.
+// @param acc The buffer.
+// @param tone The parameters of the conversion.
+// @param deep Whether channels are written with 16 bits rather than 8.
+// @param path The file to write to.
+// @return True if the file is written successfully.
+static bool write_image(Accum acc, ToneCfg tone, bool deep, const char* path) {
+    int width = acc.width;
+    int height = acc.height;
+    bool ok;
+    if (deep) {
+        uint16_t* image = malloc(3 * width * height * sizeof(uint16_t));
+        Tone_resolve16(tone, acc, image);
+        ok = Px_write_ppm16(image, width, height, path);
+        free(image);
+    } else {
+        Pixel* image = malloc(width * height * sizeof(Pixel));
+        Tone_resolve(tone, acc, image);
+        ok = Px_write_ppm(image, width, height, path);
+        free(image);
+    }
+    return ok;
+}
+
+// Renders a fly-through of the demo scene, with the camera moving sideways,
+// and accumulates the frames over time. Frame i is written to
+// frame<i>.ppm.
+// @param ctx The committed demo scene.
+// @param frames Number of frames.
+// @param seed The seed of the render.
+// @param tone How frames are converted from radiance. Every frame dithers
+// with a seed of its own.
+// @param deep Whether channels are written with 16 bits rather than 8.
+static void fly_through(Context* ctx,
+                        int frames,
+                        unsigned seed,
+                        ToneCfg tone,
+                        bool deep) {
+    Scene scene = Ctx_scene(ctx);
+    Camera start = scene.cam;
+    int width = scene.cfg.width;
+    int height = scene.cfg.height;
+    Frame frame = Frame_make(width, height, true);
+    Pool* pool = Pool_make(omp_get_max_threads());
+    TileList tl = TileList_make(width, height, TILE_SIZE);
+    Temporal tmp = Temporal_make(width, height);
+
+    for (int f = 0; f < frames; ++f) {
+        double begin = omp_get_wtime();
+        Camera cam = start;
+        Vector shift = Vec_mul_s(Vec_unit(cam.horiz), FLY_STEP * f);
+        cam.source = Vec_add(cam.source, shift);
+        cam.corner = Vec_add(cam.corner, shift);
+        Ctx_set_camera(ctx, cam);
+
+        Rnd_render_replicas(Ctx_replicas(ctx), Ctx_topology(ctx), pool, tl,
+                            frame, NULL, NULL, 0, pass_seed(seed, f), NULL,
+                            NULL);
+        Temporal_add(&tmp, frame, cam, TemporalCfg_default());
+
+        // The scene doesn't move, so what a frame learned guides the next.
+        if (scene.guide) {
+            Guide_refine(scene.guide);
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "frame%03d.ppm", f);
+        Accum acc = Accum_make(width, height);
+        Accum_add(&acc, frame, 1);
+        tone.seed = pass_seed(seed, f);
+        if (!write_image(acc, tone, deep, name)) {
+            fprintf(stderr, "cannot write %s\n", name);
+        }
+        Accum_free(&acc);
+        printf("frame %d: %.3fs\n", f, omp_get_wtime() - begin);
+    }
+
+    Ctx_set_camera(ctx, start);
+    Temporal_free(&tmp);
+    TileList_free(&tl);
+    Pool_free(pool);
+    Frame_free(&frame);
+}
 
 int main(int argc, char const* argv[]) {
-    // This region runs in parallel.
-#pragma omp parallel default(none)
-    {
-        // #pragma omp for
+    // Number of passes to accumulate, each of scene.cfg.samples samples per
+    // pixel. The costs measured in one pass decide the order that tiles are
+    // dispatched in the next.
+    int passes = 1;
+    // The seed of the render.
+    unsigned seed = 0;
+    // The checkpoint to resume from and to save after every pass. NULL
+    // disables checkpoints.
+    const char* checkpoint = NULL;
+    // Checkpoints of other renders of the same scene to add in.
+    const char** merge = calloc(argc, sizeof(const char*));
+    int merges = 0;
+    // Whether the last frame is denoised.
+    bool denoise = false;
+    // The address to coordinate workers on. NULL renders locally.
+    const char* coordinate = NULL;
+    // The address of the coordinator to work for. NULL renders locally.
+    const char* work = NULL;
+    // Whether threads are pinned and the scene replicated on every NUMA node.
+    bool numa = false;
+    // The address to serve render jobs on. NULL renders the demo scene.
+    const char* serve = NULL;
+    // Number of local workers the coordinator starts.
+    int spawn = 0;
+    // Wall-clock seconds to render a progressive preview for. 0 renders the
+    // full image.
+    double preview = 0;
+    // Number of frames of a fly-through to render, accumulated over time. 0
+    // renders a single image.
+    int frames = 0;
+    // Whether the tree over the scene is stored with quantized bounds.
+    bool quantize = false;
+    // Whether the first hits of camera rays are traced once and reused by
+    // every pass.
+    bool gbuffer = false;
+    // Whether diffuse hits interpolate indirect light from a cache.
+    bool irradiance = false;
+    // Whether diffuse bounces are guided by what earlier passes learned.
+    bool guide = false;
+    // Whether diffuse surfaces gather the caustics of glass from photons.
+    bool caustics = false;
+    // Whether the paths of a tile are traced together, sorted by bounce.
+    bool reorder = false;
+    // The chunk file the scene is streamed from. NULL keeps it in memory.
+    const char* stream = NULL;
+    // How the final image is converted from radiance.
+    ToneCfg tone = ToneCfg_default();
+    // Whether the final image has 16 bits per channel rather than 8.
+    bool deep = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--denoise")) {
+            denoise = true;
+        } else if (!strcmp(argv[i], "--numa")) {
+            numa = true;
+        } else if (!strcmp(argv[i], "--quantize")) {
+            quantize = true;
+        } else if (!strcmp(argv[i], "--gbuffer")) {
+            gbuffer = true;
+        } else if (!strcmp(argv[i], "--irradiance")) {
+            irradiance = true;
+        } else if (!strcmp(argv[i], "--guide")) {
+            guide = true;
+        } else if (!strcmp(argv[i], "--caustics")) {
+            caustics = true;
+        } else if (!strcmp(argv[i], "--reorder")) {
+            reorder = true;
+        } else if (!strcmp(argv[i], "--aces")) {
+            tone.aces = true;
+        } else if (!strcmp(argv[i], "--srgb")) {
+            tone.srgb = true;
+        } else if (!strcmp(argv[i], "--dither")) {
+            tone.dither = true;
+        } else if (!strcmp(argv[i], "--16bit")) {
+            deep = true;
+        } else if (!strcmp(argv[i], "--exposure") && i + 1 < argc) {
+            tone.exposure = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--stream") && i + 1 < argc) {
+            stream = argv[++i];
+        } else if (!strcmp(argv[i], "--coordinate") && i + 1 < argc) {
+            coordinate = argv[++i];
+        } else if (!strcmp(argv[i], "--work") && i + 1 < argc) {
+            work = argv[++i];
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            serve = argv[++i];
+        } else if (!strcmp(argv[i], "--spawn") && i + 1 < argc) {
+            spawn = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--preview") && i + 1 < argc) {
+            preview = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+            checkpoint = argv[++i];
+        } else if (!strcmp(argv[i], "--merge") && i + 1 < argc) {
+            merge[merges++] = argv[++i];
+        } else {
+            passes = atoi(argv[i]);
+        }
+    }
+
+    if (serve) {
+        free(merge);
+        if (!Svc_serve(serve, SERVICE_CACHE)) {
+            fprintf(stderr, "cannot listen on %s\n", serve);
+            return 1;
+        }
+        return 0;
+    }
+
+    Context* demo = demo_make();
+    Topology topo = Topo_detect();
+    if (quantize) {
+        Ctx_set_quantized(demo, true);
+        Ctx_commit(demo);
+    }
+    if (irradiance) {
+        Ctx_set_irradiance(demo, IRR_ACCURACY, IRR_MIN_RADIUS, IRR_MAX_RADIUS);
+        Ctx_commit(demo);
+    }
+    if (guide && (coordinate || work)) {
+        // Workers would each learn from their own tiles only, and
+        // coordinators don't render any.
+        fprintf(stderr, "--guide needs a local render\n");
+        guide = false;
+    }
+    if (guide) {
+        Ctx_set_guided(demo, true);
+        Ctx_commit(demo);
+    }
+    if (caustics && (coordinate || work)) {
+        // Workers don't know which pass they render, so they can't shoot the
+        // generation of photons that goes with it.
+        fprintf(stderr, "--caustics needs a local render\n");
+        caustics = false;
+    }
+    if (caustics) {
+        Ctx_set_caustics(demo, PHOTONS, PHOTON_RADIUS);
+        Ctx_commit(demo);
     }
+    Ctx_set_reordered(demo, reorder);
+    if (stream) {
+        Ctx_set_streamed(demo, stream, STREAM_CACHE);
+        if (!Ctx_commit(demo)) {
+            fprintf(stderr, "cannot write %s\n", stream);
+            Ctx_free(demo);
+            Topo_free(&topo);
+            free(merge);
+            return 1;
+        }
+    }
+    if (stream && gbuffer) {
+        // Cached hits would point into chunks that may be evicted.
+        fprintf(stderr, "--gbuffer needs resident geometry\n");
+        gbuffer = false;
+    }
+    if (numa) {
+        Ctx_set_topology(demo, &topo);
+        Ctx_commit(demo);
+        if (!Topo_pin(topo)) {
+            fprintf(stderr, "cannot pin threads\n");
+        }
+        printf("%d nodes, %d cpus\n", topo.nodes, topo.ncpus);
+    }
+    Scene scene = Ctx_scene(demo);
+
+    if (work) {
+        bool ok = Dist_work(scene, work);
+        free(merge);
+        Ctx_free(demo);
+        Topo_free(&topo);
+        return ok ? 0 : 1;
+    }
+
+    int width = scene.cfg.width;
+    int height = scene.cfg.height;
+
+    if (preview > 0) {
+        Progressive prog = Prog_make(scene, TILE_SIZE);
+        prog.tone = tone;
+        prog.tone.seed = seed;
+        if (deep) {
+            // Snapshots are published with 8 bits per channel.
+            fprintf(stderr, "--16bit needs a full render\n");
+        }
+        if (gbuffer && !Prog_cache_primary(&prog, seed)) {
+            fprintf(stderr, "--gbuffer needs a pinhole camera\n");
+        }
+        bool done = Prog_render(&prog, preview, seed);
+        Pixel* image = calloc(width * height, sizeof(Pixel));
+        unsigned version = Prog_snapshot(&prog, image);
+        PoolStats stats = Pool_stats(prog.pool);
+        printf("preview: %d passes, snapshot %u%s, %lu steals, %.3fs idle\n",
+               prog.passes, version, done ? ", finished" : "", stats.steals,
+               stats.idle);
+        Px_write_ppm(image, width, height, "image.ppm");
+        free(image);
+        Prog_free(&prog);
+        free(merge);
+        Ctx_free(demo);
+        Topo_free(&topo);
+        return 0;
+    }
+
+    if (frames > 0) {
+        fly_through(demo, frames, seed, tone, deep);
+        free(merge);
+        Ctx_free(demo);
+        Topo_free(&topo);
+        return 0;
+    }
+
+    Accum acc = Accum_make(width, height);
+
+    // A checkpoint that doesn't exist yet starts a new render. Merged buffers
+    // are saved into it, so they are only merged into a new one, or running
+    // the same command again would add them twice.
+    if (checkpoint && !access(checkpoint, F_OK)) {
+        if (merges) {
+            fprintf(stderr, "%s exists, so --merge would count %s twice\n",
+                    checkpoint, merge[0]);
+            return 1;
+        }
+        Accum_free(&acc);
+        if (!Accum_load(&acc, checkpoint) || acc.width != width ||
+            acc.height != height) {
+            fprintf(stderr, "cannot resume from %s\n", checkpoint);
+            return 1;
+        }
+        printf("resumed %d passes from %s\n", acc.passes, checkpoint);
+    }
+    for (int i = 0; i < merges; ++i) {
+        Accum other;
+        if (!Accum_load(&other, merge[i])) {
+            fprintf(stderr, "cannot read %s\n", merge[i]);
+            return 1;
+        }
+        bool ok = Accum_merge(&acc, other);
+        Accum_free(&other);
+        if (!ok) {
+            fprintf(stderr, "%s has a different size\n", merge[i]);
+            return 1;
+        }
+    }
+    if (merges && checkpoint && !Accum_save(acc, checkpoint)) {
+        fprintf(stderr, "cannot write %s\n", checkpoint);
+    }
+    free(merge);
+
+    // Every pass gathers the generation of photons of its index, so resumed
+    // renders shoot the one they carry on with.
+    if (scene.photons && acc.passes) {
+        PhotonMap_skip(scene.photons, acc.passes);
+        PhotonMap_shoot(scene.photons);
+    }
+
+    // Passes already accumulated count towards the total.
+    int first = acc.passes;
+
+    // Local workers retry until the coordinator is listening.
+    pid_t* workers = calloc(spawn > 0 ? spawn : 1, sizeof(pid_t));
+    for (int i = 0; coordinate && i < spawn; ++i) {
+        if (!(workers[i] = fork())) {
+            for (int p = first; p < passes; ++p) {
+                while (!Dist_work(scene, coordinate)) {
+                    usleep(10000);
+                }
+            }
+            Ctx_free(demo);
+            Topo_free(&topo);
+            return 0;
+        }
+    }
+
+    Frame frame = Frame_make(width, height, denoise);
+    Pool* pool = Pool_make(omp_get_max_threads());
+    CostMap cm = CostMap_make(width, height, COST_TIME);
+    TileList tl = TileList_make(width, height, TILE_SIZE);
+
+    // Workers trace their own camera rays.
+    GBuffer primary = {0};
+    bool cached =
+        gbuffer && !coordinate && scene.cam.aperture == 0 && first < passes;
+    if (cached) {
+        // Every pass gets positions of its own, the same ones whether it is
+        // resumed or not.
+        primary = GBuf_make(&scene, passes * scene.cfg.samples, seed);
+    } else if (gbuffer && !coordinate && scene.cam.aperture != 0) {
+        fprintf(stderr, "--gbuffer needs a pinhole camera\n");
+    }
+
+    for (int p = first; p < passes; ++p) {
+        double start = omp_get_wtime();
+        unsigned ps = pass_seed(seed, acc.passes);
+        if (coordinate) {
+            if (!Dist_coordinate(scene, tl, frame, coordinate, ps)) {
+                fprintf(stderr, "cannot listen on %s\n", coordinate);
+                return 1;
+            }
+        } else {
+            Rnd_render_replicas(Ctx_replicas(demo), Ctx_topology(demo), pool,
+                                tl, frame, &cm, cached ? &primary : NULL,
+                                p * scene.cfg.samples, ps, NULL, NULL);
+
+            // Expensive tiles go first in the next pass.
+            TileList_sort_cost(&tl, cm);
+        }
+        Accum_add(&acc, frame, scene.cfg.samples);
+        if (checkpoint && !Accum_save(acc, checkpoint)) {
+            fprintf(stderr, "cannot write %s\n", checkpoint);
+        }
+        PoolStats stats = Pool_stats(pool);
+        Pool_reset_stats(pool);
+        printf("pass %d: %.3fs, %lu steals, %.3fs idle\n", p,
+               omp_get_wtime() - start, stats.steals, stats.idle);
+        if (scene.irradiance) {
+            printf("irradiance: %zu records\n",
+                   IrrCache_size(scene.irradiance));
+        }
+        if (scene.guide) {
+            Guide_refine(scene.guide);
+            printf("guide: %zu cells\n", Guide_cells(scene.guide));
+        }
+        if (scene.photons) {
+            PhotonMap_shoot(scene.photons);
+            printf("caustics: %zu photons, radius %.4f\n",
+                   PhotonMap_size(scene.photons),
+                   PhotonMap_radius(scene.photons));
+        }
+    }
+    Accum_resolve(acc, frame);
+    if (stream && Ctx_stream_stats(demo).errors) {
+        fprintf(stderr, "%lu chunks of %s can't be read, and are left out\n",
+                Ctx_stream_stats(demo).errors, stream);
+    }
+
+    // Workers don't send the features that the denoiser needs, and merged
+    // checkpoints don't have any. The denoised radiance is written as if it
+    // were a single sample per pixel.
+    tone.seed = seed;
+    bool written;
+    if (denoise && !coordinate && first < passes) {
+        Dn_atrous(frame, DenoiseCfg_default());
+        Accum denoised = Accum_make(width, height);
+        Accum_add(&denoised, frame, 1);
+        written = write_image(denoised, tone, deep, "image.ppm");
+        Accum_free(&denoised);
+    } else {
+        written = write_image(acc, tone, deep, "image.ppm");
+    }
+    if (!written) {
+        fprintf(stderr, "cannot write image.ppm\n");
+    }
+    if (!coordinate) {
+        CostMap_write_heatmap(cm, "heatmap.ppm");
+    }
+
+    // Workers that joined too late to get any tile are still retrying.
+    for (int i = 0; coordinate && i < spawn; ++i) {
+        kill(workers[i], SIGTERM);
+        waitpid(workers[i], NULL, 0);
+    }
+    free(workers);
+
+    GBuf_free(&primary);
+    TileList_free(&tl);
+    Pool_free(pool);
+    CostMap_free(&cm);
+    Frame_free(&frame);
+    Accum_free(&acc);
+    Ctx_free(demo);
+    Topo_free(&topo);
     return 0;
 }
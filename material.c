@@ -1,11 +1,19 @@
 #include "material.h"
 
+#include <assert.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "macro.h"
 
+// The alignment of the arrays of a ShadeBatch.
+#define SHADE_ALIGN 64
+
+// Number of double arrays in a ShadeBatch.
+#define SHADE_ARRAYS 14
+
 Vector Mat_scatter(Material mat, Vector input, Vector normal, unsigned* seed) {
     return mat.scatter(mat.object, input, normal, seed);
 }
@@ -14,6 +22,17 @@ Vector Mat_albedo(Material mat) {
     return mat.albedo(mat.object);
 }
 
+Vector Mat_emitted(Material mat) {
+    return mat.emitted(mat.object);
+}
+
+// The implementation of emitted for materials that don't emit.
+// @see Material
+static Vector no_emission(const void* object) {
+    (void)object;
+    return Vec_o();
+}
+
 // MatteScatter is the implementation of scatter for Matte.
 // @see Material
 static Vector Matte_scatter(const void* ma,
@@ -24,9 +43,10 @@ static Vector Matte_scatter(const void* ma,
     (void)ma;
     (void)input;
 
-    // Lambertian is simulated with vector in balls.
+    // Lambertian is simulated with vectors on the unit sphere, which
+    // distributes the output with density cos(theta) / pi.
     Vector un = Vec_unit(normal);
-    Vector rb = Vec_rand_ball(1., seed);
+    Vector rb = Vec_unit(Vec_rand_ball(1., seed));
     return Vec_add(rb, un);
 }
 
@@ -40,8 +60,10 @@ static Vector Matte_albedo(const void* ma) {
 Material Matte_Mat(const Matte* matte) {
     return (Material){
         .object = matte,
+        .kind = MAT_MATTE,
         .scatter = Matte_scatter,
         .albedo = Matte_albedo,
+        .emitted = no_emission,
     };
 }
 
@@ -75,8 +97,10 @@ static Vector Metal_albedo(const void* me) {
 Material Metal_Mat(const Metal* metal) {
     return (Material){
         .object = metal,
+        .kind = MAT_METAL,
         .scatter = Metal_scatter,
         .albedo = Metal_albedo,
+        .emitted = no_emission,
     };
 }
 
@@ -142,7 +166,344 @@ static Vector Glass_albedo(const void* gl) {
 Material Glass_Mat(const Glass* glass) {
     return (Material){
         .object = glass,
+        .kind = MAT_GLASS,
         .scatter = Glass_scatter,
         .albedo = Glass_albedo,
+        .emitted = no_emission,
     };
 }
+
+// EmissiveScatter is the implementation of scatter for Emissive.
+// @see Material
+static Vector Emissive_scatter(const void* em,
+                               Vector input,
+                               Vector normal,
+                               unsigned* seed) {
+    // Light sources absorb everything, so paths end on them. The direction
+    // is never used.
+    (void)em;
+    (void)input;
+    (void)seed;
+    return normal;
+}
+
+// EmissiveAlbedo is the implementation of albedo for Emissive.
+// @see Material
+static Vector Emissive_albedo(const void* em) {
+    (void)em;
+    return Vec_o();
+}
+
+// EmissiveEmitted is the implementation of emitted for Emissive.
+// @see Material
+static Vector Emissive_emitted(const void* em) {
+    const Emissive* emissive = em;
+    return emissive->radiance;
+}
+
+Material Emissive_Mat(const Emissive* emissive) {
+    return (Material){
+        .object = emissive,
+        .kind = MAT_EMISSIVE,
+        .scatter = Emissive_scatter,
+        .albedo = Emissive_albedo,
+        .emitted = Emissive_emitted,
+    };
+}
+
+ShadeBatch ShadeBatch_make(MatKind kind, int capacity) {
+    assert(kind != MAT_EMISSIVE);
+    assert(capacity >= 0);
+
+    // Rounded up so that every array starts on a cache line.
+    int per_line = SHADE_ALIGN / sizeof(double);
+    int stride = (capacity + per_line - 1) / per_line * per_line;
+    stride = stride > 0 ? stride : per_line;
+    double* block = aligned_alloc(
+        SHADE_ALIGN, (size_t)SHADE_ARRAYS * stride * sizeof(double));
+
+    ShadeBatch batch = {.kind = kind, .length = 0, .capacity = stride};
+    double** arrays[SHADE_ARRAYS] = {
+        &batch.ix, &batch.iy, &batch.iz, &batch.nx,   &batch.ny,
+        &batch.nz, &batch.ar, &batch.ag, &batch.ab,   &batch.blur,
+        &batch.refractive,    &batch.ox, &batch.oy,   &batch.oz,
+    };
+    for (int i = 0; i < SHADE_ARRAYS; ++i) {
+        *arrays[i] = block + (size_t)i * stride;
+    }
+    // The seeds and tags share a block of their own.
+    batch.seed = aligned_alloc(SHADE_ALIGN, 2 * stride * sizeof(unsigned));
+    batch.tag = (int*)(batch.seed + stride);
+    return batch;
+}
+
+void ShadeBatch_free(ShadeBatch* batch) {
+    // All double arrays share the block that starts at ix.
+    free(batch->ix);
+    free(batch->seed);
+    memset(batch, 0, sizeof(ShadeBatch));
+}
+
+void ShadeBatch_push(ShadeBatch* batch,
+                     Material mat,
+                     Vector input,
+                     Vector normal,
+                     unsigned seed,
+                     int tag) {
+    assert(mat.kind == batch->kind);
+    assert(batch->length < batch->capacity);
+
+    Vector albedo = Vec_o();
+    double blur = 0;
+    double refractive = 1;
+    switch (mat.kind) {
+        case MAT_MATTE:
+            albedo = ((const Matte*)mat.object)->albedo;
+            break;
+        case MAT_METAL: {
+            const Metal* metal = mat.object;
+            albedo = metal->albedo;
+            blur = metal->blur;
+            break;
+        }
+        case MAT_GLASS: {
+            const Glass* glass = mat.object;
+            albedo = glass->albedo;
+            blur = glass->blur;
+            refractive = glass->refractive;
+            break;
+        }
+        default:
+            assert(0 && "unreachable");
+    }
+
+    int i = batch->length++;
+    batch->ix[i] = input.x;
+    batch->iy[i] = input.y;
+    batch->iz[i] = input.z;
+    batch->nx[i] = normal.x;
+    batch->ny[i] = normal.y;
+    batch->nz[i] = normal.z;
+    batch->ar[i] = albedo.x;
+    batch->ag[i] = albedo.y;
+    batch->ab[i] = albedo.z;
+    batch->blur[i] = blur;
+    batch->refractive[i] = refractive;
+    batch->seed[i] = seed;
+    batch->tag[i] = tag;
+}
+
+// A random number of a lane. Lanes hash their state with the index of the
+// number, so numbers are drawn without advancing any state in between, and
+// only integer multiplies and shifts are needed, so lanes draw together.
+// @param state The state of the lane.
+// @param k The index of the number.
+// @return A random number in [0, 1).
+static inline double lane_rand(unsigned state, unsigned k) {
+    unsigned s = hash32(state + k * 0x9e3779b9u);
+    return (int)(s >> 1) * (1. / 2147483648.);
+}
+
+// The state of a lane once its hit is scattered: a linear congruential step.
+// @param state The state of the lane.
+// @return The next state.
+static inline unsigned lane_next(unsigned state) {
+    return state * 1664525u + 1013904223u;
+}
+
+// Samples the unit sphere uniformly for every hit, by the equal-area map of
+// the square onto the octahedron, into the scattered directions. The angle
+// around the axis only spans a quarter turn, so short polynomials give its
+// sine and cosine without branches.
+// @param b The batch.
+// @param k The index of the first of the 2 random numbers used.
+static void sphere_stage(ShadeBatch* b, unsigned k) {
+    int n = b->length;
+    const unsigned* restrict seed = b->seed;
+    double* restrict ox = b->ox;
+    double* restrict oy = b->oy;
+    double* restrict oz = b->oz;
+
+#pragma omp simd aligned(seed, ox, oy, oz : SHADE_ALIGN)
+    for (int i = 0; i < n; ++i) {
+        double u = 2 * lane_rand(seed[i], k) - 1;
+        double v = 2 * lane_rand(seed[i], k + 1) - 1;
+        double au = fabs(u);
+        double av = fabs(v);
+        double sd = 1 - (au + av);
+        double r = 1 - fabs(sd);
+
+        // The angle is in [0, pi / 2], and t in [-pi / 4, pi / 4] around
+        // the middle of that, where the Taylor series are accurate to 1e-8.
+        double t = (av - au) / (r > 1e-300 ? r : 1e-300) * (M_PI / 4);
+        double t2 = t * t;
+        double st = t * (1 - t2 / 6 * (1 - t2 / 20 * (1 - t2 / 42 *
+                                                      (1 - t2 / 72))));
+        double ct =
+            1 - t2 / 2 *
+                    (1 - t2 / 12 * (1 - t2 / 30 * (1 - t2 / 56 *
+                                                       (1 - t2 / 90))));
+        double cos_phi = (ct - st) * M_SQRT1_2;
+        double sin_phi = (ct + st) * M_SQRT1_2;
+
+        double ring = r * sqrt(2 - r * r);
+        ox[i] = copysign(cos_phi, u) * ring;
+        oy[i] = copysign(sin_phi, v) * ring;
+        oz[i] = copysign(1 - r * r, sd);
+    }
+}
+
+// The distance of a uniform point in a ball from its center. The largest of
+// three uniform numbers has its distribution, so no cube root is taken.
+// @param state The state of the lane.
+// @param k The index of the first of the 3 random numbers used.
+// @param radius The radius of the ball.
+// @return The distance.
+static inline double lane_radius(unsigned state, unsigned k, double radius) {
+    double a = lane_rand(state, k);
+    double b = lane_rand(state, k + 1);
+    double c = lane_rand(state, k + 2);
+    // Selects rather than fmax, which doesn't vectorize.
+    double ab = a > b ? a : b;
+    return radius * (ab > c ? ab : c);
+}
+
+// The scatter kernel of Matte.
+// @param b The batch.
+// @see Matte_scatter
+static void matte_kernel(ShadeBatch* b) {
+    sphere_stage(b, 0);
+
+    int n = b->length;
+    const double* restrict nx = b->nx;
+    const double* restrict ny = b->ny;
+    const double* restrict nz = b->nz;
+    double* restrict ox = b->ox;
+    double* restrict oy = b->oy;
+    double* restrict oz = b->oz;
+    unsigned* restrict seed = b->seed;
+
+#pragma omp simd aligned(nx, ny, nz, ox, oy, oz, seed : SHADE_ALIGN)
+    for (int i = 0; i < n; ++i) {
+        double inv = 1 / sqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i]);
+        ox[i] += nx[i] * inv;
+        oy[i] += ny[i] * inv;
+        oz[i] += nz[i] * inv;
+        seed[i] = lane_next(seed[i]);
+    }
+}
+
+// The scatter kernel of Metal.
+// @param b The batch.
+// @see Metal_scatter
+static void metal_kernel(ShadeBatch* b) {
+    sphere_stage(b, 0);
+
+    int n = b->length;
+    const double* restrict ix = b->ix;
+    const double* restrict iy = b->iy;
+    const double* restrict iz = b->iz;
+    const double* restrict nx = b->nx;
+    const double* restrict ny = b->ny;
+    const double* restrict nz = b->nz;
+    const double* restrict blur = b->blur;
+    double* restrict ox = b->ox;
+    double* restrict oy = b->oy;
+    double* restrict oz = b->oz;
+    unsigned* restrict seed = b->seed;
+
+#pragma omp simd aligned(ix, iy, iz, nx, ny, nz, blur, ox, oy, oz, seed \
+                         : SHADE_ALIGN)
+    for (int i = 0; i < n; ++i) {
+        double ri = 1 / sqrt(ix[i] * ix[i] + iy[i] * iy[i] + iz[i] * iz[i]);
+        double rn = 1 / sqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i]);
+        double ux = ix[i] * ri, uy = iy[i] * ri, uz = iz[i] * ri;
+        double vx = nx[i] * rn, vy = ny[i] * rn, vz = nz[i] * rn;
+
+        double len = lane_radius(seed[i], 2, blur[i]);
+        double cast = (ux * vx + uy * vy + uz * vz) * 2.;
+        ox[i] = ox[i] * len + ux - vx * cast;
+        oy[i] = oy[i] * len + uy - vy * cast;
+        oz[i] = oz[i] * len + uz - vz * cast;
+        seed[i] = lane_next(seed[i]);
+    }
+}
+
+// The scatter kernel of Glass. Both refraction and reflection are computed
+// for every lane, and one of them is picked.
+// @param b The batch.
+// @see Glass_scatter
+static void glass_kernel(ShadeBatch* b) {
+    sphere_stage(b, 0);
+
+    int n = b->length;
+    const double* restrict ix = b->ix;
+    const double* restrict iy = b->iy;
+    const double* restrict iz = b->iz;
+    const double* restrict nx = b->nx;
+    const double* restrict ny = b->ny;
+    const double* restrict nz = b->nz;
+    const double* restrict blur = b->blur;
+    const double* restrict refr = b->refractive;
+    double* restrict ox = b->ox;
+    double* restrict oy = b->oy;
+    double* restrict oz = b->oz;
+    unsigned* restrict seed = b->seed;
+
+#pragma omp simd aligned(ix, iy, iz, nx, ny, nz, blur, refr, ox, oy, oz, \
+                         seed : SHADE_ALIGN)
+    for (int i = 0; i < n; ++i) {
+        double ri = 1 / sqrt(ix[i] * ix[i] + iy[i] * iy[i] + iz[i] * iz[i]);
+        double rn = 1 / sqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i]);
+        double ux = ix[i] * ri, uy = iy[i] * ri, uz = iz[i] * ri;
+        double vx = nx[i] * rn, vy = ny[i] * rn, vz = nz[i] * rn;
+
+        // Snell's law, as in Glass_scatter.
+        double cos = ux * vx + uy * vy + uz * vz;
+        double ratio = (cos < 0) ? 1. / refr[i] : refr[i];
+        double cos_sq_ref = 1. - ratio * ratio * (1. - cos * cos);
+
+        // Schlick's approximation, with the fifth power multiplied out.
+        double r0 = (1. - refr[i]) / (1. + refr[i]);
+        double sq = r0 * r0;
+        double m = 1. - fabs(cos);
+        double m2 = m * m;
+        double reflectance = sq + (1. - sq) * (m2 * m2 * m);
+
+        // Facing the correct direction, no total internal reflection, and
+        // not reflected by chance. Combined without branches.
+        double random = lane_rand(seed[i], 2);
+        bool refract =
+            (cos < 0) & (cos_sq_ref >= 0) & (random >= reflectance);
+
+        double len = lane_radius(seed[i], 3, blur[i]);
+        double bx = ox[i] * len, by = oy[i] * len, bz = oz[i] * len;
+        double cos_ref = sqrt(cos_sq_ref > 0 ? cos_sq_ref : 0.);
+        double tx = (ux + vx * cos) * ratio + vx * cos_ref + bx;
+        double ty = (uy + vy * cos) * ratio + vy * cos_ref + by;
+        double tz = (uz + vz * cos) * ratio + vz * cos_ref + bz;
+        double fx = ix[i] + bx - vx * cos * 2.;
+        double fy = iy[i] + by - vy * cos * 2.;
+        double fz = iz[i] + bz - vz * cos * 2.;
+        ox[i] = refract ? tx : fx;
+        oy[i] = refract ? ty : fy;
+        oz[i] = refract ? tz : fz;
+        seed[i] = lane_next(seed[i]);
+    }
+}
+
+void Mat_scatter_batch(ShadeBatch* batch) {
+    switch (batch->kind) {
+        case MAT_MATTE:
+            matte_kernel(batch);
+            break;
+        case MAT_METAL:
+            metal_kernel(batch);
+            break;
+        case MAT_GLASS:
+            glass_kernel(batch);
+            break;
+        default:
+            assert(0 && "unreachable");
+    }
+}
@@ -2,11 +2,26 @@
 
 #include "geometric.h"
 
+// The kind of a material. Used by integrators that need to treat some
+// materials specially, for example only sampling lights at diffuse surfaces.
+typedef enum MatKind {
+    // Lambertian surfaces.
+    MAT_MATTE = 0,
+    // Mirrors.
+    MAT_METAL,
+    // Reflective and refractive surfaces.
+    MAT_GLASS,
+    // Light sources. They emit and absorb, but never scatter.
+    MAT_EMISSIVE,
+} MatKind;
+
 // Material is an interface that stores a certain kind of material.
 // @author RenTrueWang
 typedef struct Material {
     // Interface object pointer.
     const void* object;
+    // The kind of the material.
+    MatKind kind;
     // How the output ray is scattered from the surface.
     // @param object The interface object.
     // @param input The direction of the input ray.
@@ -20,6 +35,10 @@ typedef struct Material {
     // @param object The interface object.
     // @return The color of the surface.
     Vector (*albedo)(const void* object);
+    // The radiance that the surface emits.
+    // @param object The interface object.
+    // @return The emitted radiance. Zero for surfaces that don't emit.
+    Vector (*emitted)(const void* object);
 } Material;
 
 // Calls scatter for Material.
@@ -34,6 +53,11 @@ Vector Mat_scatter(Material mat, Vector input, Vector normal, unsigned* seed);
 // @return The albedo. Albedo_i is in the range [0, 1]
 Vector Mat_albedo(Material mat);
 
+// Calls emitted for Material.
+// @param mat The material in use.
+// @return The emitted radiance.
+Vector Mat_emitted(Material mat);
+
 // Matte is a Lambertian material.
 typedef struct Matte {
     // The albedo of a matte material.
@@ -72,3 +96,79 @@ typedef struct Glass {
 // @param glass Glass to convert.
 // @return The material object that holds glass.
 Material Glass_Mat(const Glass* glass);
+
+// Emissive is a light source. It emits the same radiance in every direction.
+typedef struct Emissive {
+    // The radiance emitted. Can be larger than 1.
+    Vector radiance;
+} Emissive;
+
+// Converts Emissive to Material.
+// @param emissive Emissive to convert.
+// @return The material object that holds emissive.
+Material Emissive_Mat(const Emissive* emissive);
+
+// A batch of hits on surfaces of one kind of material, in
+// structure-of-arrays layout, so that they are scattered together by a
+// vectorized kernel rather than one at a time through the interface. Every
+// array is aligned to a cache line.
+// @author RenTrueWang
+typedef struct ShadeBatch {
+    // The kind of the materials of the hits. MAT_MATTE, MAT_METAL or
+    // MAT_GLASS.
+    MatKind kind;
+    // Number of hits in the batch.
+    int length;
+    // Number of hits the arrays can hold.
+    int capacity;
+    // The directions of the incoming rays.
+    double *ix, *iy, *iz;
+    // The directions that the surfaces are facing.
+    double *nx, *ny, *nz;
+    // The albedos of the surfaces.
+    double *ar, *ag, *ab;
+    // The blurring radii of the materials. 0 for matte.
+    double* blur;
+    // The refractive indices of the materials. Only used by glass.
+    double* refractive;
+    // The scattered directions, written by Mat_scatter_batch.
+    double *ox, *oy, *oz;
+    // The state of the random number generator of every hit, advanced as
+    // the hit is scattered.
+    unsigned* seed;
+    // What the caller identifies every hit by.
+    int* tag;
+} ShadeBatch;
+
+// Creates an empty batch.
+// @param kind The kind of the materials of the hits.
+// @param capacity Number of hits the batch can hold.
+// @return A new ShadeBatch.
+ShadeBatch ShadeBatch_make(MatKind kind, int capacity);
+
+// Free the batch.
+// @param batch ShadeBatch to free.
+// @see free
+void ShadeBatch_free(ShadeBatch* batch);
+
+// Adds a hit to a batch. Its material's parameters are copied in, so the
+// kernel doesn't go through the interface.
+// @param batch The batch. Must not be full.
+// @param mat The material of the hit. Must be of the kind of the batch.
+// @param input The direction of the incoming ray.
+// @param normal The direction of the surface where the ray hits.
+// @param seed The state of the random number generator of the hit.
+// @param tag What the caller identifies the hit by.
+void ShadeBatch_push(ShadeBatch* batch,
+                     Material mat,
+                     Vector input,
+                     Vector normal,
+                     unsigned seed,
+                     int tag);
+
+// Scatters every hit of a batch like Mat_scatter does, with one vectorized
+// kernel per kind of material. Random numbers come from a generator that
+// every lane advances on its own, so they differ from the ones that
+// Mat_scatter would draw, but have the same distribution.
+// @param batch The batch.
+void Mat_scatter_batch(ShadeBatch* batch);
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+
+#include "net.h"
+
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool Net_read(int fd, void* buf, size_t len) {
+    char* p = buf;
+    while (len) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool Net_write(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len) {
+        // A peer that disappears must not kill the process with SIGPIPE.
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+int Net_open(const char* addr, bool server) {
+    if (!strncmp(addr, "unix:", 5)) {
+        struct sockaddr_un sa = {.sun_family = AF_UNIX};
+        const char* path = addr + 5;
+        if (strlen(path) >= sizeof(sa.sun_path)) {
+            return -1;
+        }
+        strcpy(sa.sun_path, path);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        int ok;
+        if (server) {
+            // A socket file left by an earlier coordinator blocks bind.
+            unlink(path);
+            ok = !bind(fd, (struct sockaddr*)&sa, sizeof(sa)) &&
+                 !listen(fd, SOMAXCONN);
+        } else {
+            ok = !connect(fd, (struct sockaddr*)&sa, sizeof(sa));
+        }
+
+        if (!ok) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (!strncmp(addr, "tcp:", 4)) {
+        char host[256];
+        const char* port = strrchr(addr + 4, ':');
+        size_t len = port ? (size_t)(port - addr - 4) : 0;
+        if (!port || len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, addr + 4, len);
+        host[len] = '\0';
+
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+            .ai_flags = server ? AI_PASSIVE : 0,
+        };
+        struct addrinfo* res;
+        if (getaddrinfo(len ? host : NULL, port + 1, &hints, &res)) {
+            return -1;
+        }
+
+        int fd = -1;
+        for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+
+            int ok;
+            if (server) {
+                int one = 1;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                ok = !bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+                     !listen(fd, SOMAXCONN);
+            } else {
+                ok = !connect(fd, ai->ai_addr, ai->ai_addrlen);
+            }
+
+            if (ok) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        return fd;
+    }
+
+    return -1;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Addresses are either "unix:/path/to/socket" or "tcp:host:port".
+
+// Reads exactly len bytes.
+// @param fd The socket.
+// @param buf Where to read into.
+// @param len Number of bytes.
+// @return False if the connection is closed or broken.
+bool Net_read(int fd, void* buf, size_t len);
+
+// Writes exactly len bytes. A peer that disappears doesn't raise SIGPIPE.
+// @param fd The socket.
+// @param buf What to write.
+// @param len Number of bytes.
+// @return False if the connection is closed or broken.
+bool Net_write(int fd, const void* buf, size_t len);
+
+// Creates a stream socket for an address, and either binds or connects it.
+// @param addr The address, "unix:path" or "tcp:host:port".
+// @param server True to bind and listen, false to connect.
+// @return The socket, or -1 on failure.
+int Net_open(const char* addr, bool server);
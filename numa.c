@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+
+#include "numa.h"
+
+#include <omp.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Where sysfs describes NUMA nodes.
+#define NODE_DIR "/sys/devices/system/node"
+
+// Reads a list such as "0-3,8,10-11" from a file.
+// @param path The file to read.
+// @param list Where the numbers are stored. Must be freed.
+// @return The number of numbers, or -1 if the file can't be read.
+static int read_list(const char* path, int** list) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    int length = 0;
+    int capacity = 16;
+    *list = malloc(capacity * sizeof(int));
+
+    int lo, hi;
+    while (fscanf(file, "%d", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(file);
+        if (c == '-') {
+            if (fscanf(file, "%d", &hi) != 1) {
+                break;
+            }
+            c = fgetc(file);
+        }
+        for (int i = lo; i <= hi; ++i) {
+            if (length == capacity) {
+                capacity *= 2;
+                *list = realloc(*list, capacity * sizeof(int));
+            }
+            (*list)[length++] = i;
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+
+    fclose(file);
+    return length;
+}
+
+Topology Topo_detect(void) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    int* online = NULL;
+    int nonline = read_list(NODE_DIR "/online", &online);
+
+    Topology topo = {
+        .nodes = 0,
+        .first = calloc((nonline > 0 ? nonline : 1) + 1, sizeof(int)),
+        .cpus = calloc(CPU_COUNT(&allowed), sizeof(int)),
+        .ncpus = 0,
+    };
+
+    for (int n = 0; n < nonline; ++n) {
+        char path[64];
+        snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", online[n]);
+
+        int* cpus = NULL;
+        int ncpus = read_list(path, &cpus);
+        for (int i = 0; i < ncpus; ++i) {
+            if (CPU_ISSET(cpus[i], &allowed) &&
+                topo.ncpus < CPU_COUNT(&allowed)) {
+                topo.cpus[topo.ncpus++] = cpus[i];
+            }
+        }
+        free(cpus);
+
+        // Memory-only nodes and nodes we may not run on are left out.
+        if (topo.ncpus > topo.first[topo.nodes]) {
+            topo.first[++topo.nodes] = topo.ncpus;
+        }
+    }
+    free(online);
+
+    if (!topo.nodes) {
+        topo.ncpus = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                topo.cpus[topo.ncpus++] = cpu;
+            }
+        }
+        topo.nodes = 1;
+        topo.first[1] = topo.ncpus;
+    }
+
+    return topo;
+}
+
+void Topo_free(Topology* topo) {
+    free(topo->first);
+    free(topo->cpus);
+    topo->first = NULL;
+    topo->cpus = NULL;
+}
+
+int Topo_node(Topology topo, int cpu) {
+    for (int n = 0; n < topo.nodes; ++n) {
+        for (int i = topo.first[n]; i < topo.first[n + 1]; ++i) {
+            if (topo.cpus[i] == cpu) {
+                return n;
+            }
+        }
+    }
+    return 0;
+}
+
+int Topo_current(Topology topo) {
+    return topo.nodes > 1 ? Topo_node(topo, sched_getcpu()) : 0;
+}
+
+void Topo_each_node(Topology topo, void (*fn)(void* arg, int node), void* arg) {
+#pragma omp parallel for schedule(static, 1) num_threads(topo.nodes) \
+    default(none) shared(topo, fn, arg)
+    for (int node = 0; node < topo.nodes; ++node) {
+        cpu_set_t old;
+        sched_getaffinity(0, sizeof(old), &old);
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int i = topo.first[node]; i < topo.first[node + 1]; ++i) {
+            CPU_SET(topo.cpus[i], &set);
+        }
+        sched_setaffinity(0, sizeof(set), &set);
+
+        fn(arg, node);
+        sched_setaffinity(0, sizeof(old), &old);
+    }
+}
+
+bool Topo_pin(Topology topo) {
+    bool ok = true;
+
+#pragma omp parallel default(none) shared(topo) reduction(&& : ok)
+    {
+        int thread = omp_get_thread_num();
+        int node = thread % topo.nodes;
+        int count = topo.first[node + 1] - topo.first[node];
+        int cpu = topo.cpus[topo.first[node] + (thread / topo.nodes) % count];
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        ok = !sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    return ok;
+}
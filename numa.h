@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Topology lists the CPUs that the process may run on, grouped by NUMA node.
+// Nodes without such CPUs are left out, so nodes are numbered from 0
+// whatever the system numbers them.
+// @author RenTrueWang
+typedef struct Topology {
+    // Number of nodes.
+    int nodes;
+    // The CPUs of node i are cpus[first[i]] to cpus[first[i + 1] - 1].
+    int* first;
+    // CPU numbers, node by node.
+    int* cpus;
+    // The length of cpus.
+    int ncpus;
+} Topology;
+
+// Reads the topology from sysfs. Systems without NUMA information are one
+// node with every allowed CPU.
+// @return A new Topology.
+Topology Topo_detect(void);
+
+// Free the resources controlled by Topology.
+// @param topo Topology to free.
+// @see free
+void Topo_free(Topology* topo);
+
+// The node that a CPU belongs to.
+// @param topo The topology.
+// @param cpu The CPU number.
+// @return The node. 0 if the CPU is not in the topology.
+int Topo_node(Topology topo, int cpu);
+
+// The node that the calling thread is running on.
+// @param topo The topology.
+// @return The node.
+int Topo_current(Topology topo);
+
+// Calls a function once for every node, in parallel, each from a thread that
+// runs on that node. Memory that the function touches first is allocated on
+// its node. The threads run wherever they did before afterwards.
+// @param topo The topology.
+// @param fn The function to call.
+// @param arg Passed to fn.
+void Topo_each_node(Topology topo, void (*fn)(void* arg, int node), void* arg);
+
+// Pins every thread of the OpenMP thread pool to one CPU. Threads are spread
+// over nodes round-robin, so that a partly used machine uses every node's
+// memory bandwidth. The pool keeps the same threads between parallel
+// regions, so they stay pinned.
+// @param topo The topology.
+// @return False if a thread can't be pinned.
+bool Topo_pin(Topology topo);
@@ -2,6 +2,13 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdlib.h>
+
+#include "macro.h"
+
+// Rays leaving a surface start exactly on it. Hits closer than this are
+// rounding errors of the previous hit, not actual hits.
+#define SPH_EPS 1e-6
 
 Sphere Sph_make(Vector center, double radius, Material mat) {
     assert(radius >= 0);
@@ -25,20 +32,57 @@ static HitData Sph_hit(const void* sp, Vector source, Vector towards) {
     double b = Vec_dot(oc, towards);
     double c = Vec_l2(oc) - radius * radius;
 
-    double base = sqrt(b * b - a * c);
+    double disc = b * b - a * c;
+    if (disc < 0) {
+        // The ray misses the sphere entirely.
+        return HitData_miss();
+    }
+
+    double base = sqrt(disc);
     double root1 = (-b - base) / a;
     double root2 = (-b + base) / a;
 
-    if (root1 <= 0 && root2 <= 0) {
+    // Roots too close to the source are the surface the ray just left.
+    if (root1 <= SPH_EPS && root2 <= SPH_EPS) {
         return HitData_miss();
     }
 
-    double root = (root1 > 0) ? root1 : root2;
+    double root = (root1 > SPH_EPS) ? root1 : root2;
 
     assert(root > 0);
 
     Vector point = Vec_add(source, Vec_mul_s(towards, root));
-    return HitData_hit(root, point, Sph_normal(*sphere, point), sphere->mat);
+    HitData hd =
+        HitData_hit(root, point, Sph_normal(*sphere, point), sphere->mat);
+    hd.object = sphere;
+    return hd;
+}
+
+// SphereOccluded is the implementation of occluded for Sphere.
+// @see Hittable
+static bool Sph_occluded(const void* sp,
+                         Vector source,
+                         Vector towards,
+                         double t_max) {
+    const Sphere* sphere = sp;
+    double radius = sphere->radius;
+
+    // The same roots as hit, without the point and normal.
+    Vector oc = Sph_normal(*sphere, source);
+    double a = Vec_l2(towards);
+    double b = Vec_dot(oc, towards);
+    double c = Vec_l2(oc) - radius * radius;
+
+    double disc = b * b - a * c;
+    if (disc < 0) {
+        return false;
+    }
+
+    double base = sqrt(disc);
+    double root1 = (-b - base) / a;
+    double root2 = (-b + base) / a;
+    return (root1 > SPH_EPS && root1 < t_max) ||
+           (root2 > SPH_EPS && root2 < t_max);
 }
 
 // SphereBounds is the implementation of bounds for Sphere.
@@ -58,6 +102,44 @@ Hittable Sph_Hittable(const Sphere* sphere) {
     return (Hittable){
         .object = sphere,
         .hit = Sph_hit,
+        .occluded = Sph_occluded,
         .bounds = Sph_bounds,
     };
 }
+
+// Computes 1 - cos(theta) of the cone the sphere occupies, seen from a point.
+// @param sphere The sphere that is seen.
+// @param point The point that sees the sphere.
+// @return 1 - cos(theta), or 0 if point is inside of the sphere.
+static double cone_gap(Sphere sphere, Vector point) {
+    double dist_sq = Vec_l2(Vec_sub(sphere.center, point));
+    double sin_sq = sphere.radius * sphere.radius / dist_sq;
+    if (sin_sq >= 1) {
+        return 0;
+    }
+    // 1 - cos == sin**2 / (1 + cos), which doesn't cancel for tiny spheres.
+    return sin_sq / (1. + sqrt(1. - sin_sq));
+}
+
+Vector Sph_sample(Sphere sphere, Vector point, unsigned* seed) {
+    Vector w = Vec_unit(Vec_sub(sphere.center, point));
+
+    // An orthonormal basis (u, v, w) around the direction to the center.
+    Vector a = (fabs(w.x) > .9) ? Vec_j() : Vec_i();
+    Vector u = Vec_unit(Vec_cross(a, w));
+    Vector v = Vec_cross(w, u);
+
+    double gap = cone_gap(sphere, point);
+    double cos_t = 1. - genfloat(seed) * gap;
+    double sin_t = sqrt(fmax(0., 1. - cos_t * cos_t));
+    double phi = 2. * M_PI * genfloat(seed);
+
+    Vector su = Vec_mul_s(u, sin_t * cos(phi));
+    Vector sv = Vec_mul_s(v, sin_t * sin(phi));
+    return Vec_add(Vec_add(su, sv), Vec_mul_s(w, cos_t));
+}
+
+double Sph_pdf(Sphere sphere, Vector point) {
+    double gap = cone_gap(sphere, point);
+    return gap ? 1. / (2. * M_PI * gap) : 0;
+}
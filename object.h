@@ -28,6 +28,21 @@ Sphere Sph_make(Vector center, double radius, Material mat);
 // @return The normal vector at the point, with respect to sphere.
 Vector Sph_normal(Sphere sphere, Vector point);
 
+// Samples a direction from a point towards the sphere, uniformly over the
+// cone that the sphere occupies as seen from the point.
+// @param sphere The sphere to sample.
+// @param point The point that looks at the sphere. Outside of the sphere.
+// @param seed The seed pointer for the random number generator.
+// @return A unit vector pointing towards the sphere.
+Vector Sph_sample(Sphere sphere, Vector point, unsigned* seed);
+
+// The density of Sph_sample with respect to solid angle.
+// @param sphere The sphere that is sampled.
+// @param point The point that looks at the sphere.
+// @return The density of every direction within the cone. 0 if point is
+// inside of the sphere.
+double Sph_pdf(Sphere sphere, Vector point);
+
 // Converts Sphere to Hittable.
 // @param sphere The sphere to convert.
 // @return The Hittable object that holds a sphere.
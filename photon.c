@@ -0,0 +1,490 @@
+#include "photon.h"
+
+#include <assert.h>
+#include <math.h>
+#include <omp.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+#include "material.h"
+#include "scene.h"
+
+// The most glass bounces a photon is followed through.
+#define PHOTON_BOUNCES 16
+
+// How fast the radius shrinks. Every generation keeps this share of the
+// photons that fell within the radius of the last one (Knaus and Zwicker).
+#define PHOTON_ALPHA (2. / 3.)
+
+// Photons further than this share of the radius from the tangent plane of
+// a point are on another surface, and aren't gathered by it.
+#define PHOTON_FLAT .25
+
+// A photon that landed on a diffuse surface. Single precision, so that more
+// of them fit in the cache while gathering.
+typedef struct _Photon {
+    // Where the photon landed.
+    float point[3];
+    // The unit direction the photon travelled in.
+    float towards[3];
+    // The power of the photon.
+    float power[3];
+} _Photon;
+
+// The photons that a thread has shot.
+typedef struct _PhotonBuf {
+    // The photons.
+    _Photon* photons;
+    // Number of photons.
+    size_t length;
+    // Capacity of photons.
+    size_t capacity;
+} _PhotonBuf;
+
+struct PhotonMap {
+    // The scene that photons are traced through.
+    Hittable scene;
+    // The glass spheres that photons from the sky are shot at.
+    const Sphere** casters;
+    // Number of casters.
+    int ncasters;
+    // The running sums of the squared radii of casters.
+    double* caster_cdf;
+    // The emissive spheres.
+    const Sphere** lights;
+    // Number of lights.
+    int nlights;
+    // The running sums of the power of lights.
+    double* light_cdf;
+    // The probability that a photon is shot from the sky rather than from a
+    // light.
+    double sky_share;
+    // Number of photons shot per generation.
+    size_t shots;
+    // The radius that photons are gathered over.
+    double radius;
+    // Number of generations shot so far.
+    int generation;
+
+    // The photons of the current generation, by bucket.
+    _Photon* photons;
+    // Number of photons.
+    size_t length;
+    // The photons of bucket b are photons[start[b]] to photons[start[b + 1]].
+    size_t* start;
+    // Number of buckets. A power of 2.
+    size_t buckets;
+    // The side of a cell of the grid. Twice the radius, so that the photons
+    // around a point are in at most 8 cells.
+    double side;
+};
+
+// The mean of the channels of a color.
+// @param color The color.
+// @return The mean.
+static double mean(Vector color) {
+    return (color.x + color.y + color.z) / 3;
+}
+
+// Picks an index in proportion to weights.
+// @param cdf The running sums of the weights.
+// @param count Number of weights.
+// @param seed The seed pointer for the random number generator.
+// @return The index.
+static int pick(const double* cdf, int count, unsigned* seed) {
+    double r = genfloat(seed) * cdf[count - 1];
+    int lo = 0;
+    int hi = count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] <= r) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+PhotonMap* PhotonMap_make(Hittable scene,
+                          const Sphere* spheres,
+                          int count,
+                          size_t photons,
+                          double radius) {
+    assert(radius > 0);
+
+    PhotonMap* pm = calloc(1, sizeof(PhotonMap));
+    pm->scene = scene;
+    pm->shots = photons;
+    pm->radius = radius;
+    pm->casters = calloc(count, sizeof(const Sphere*));
+    pm->caster_cdf = calloc(count, sizeof(double));
+    pm->lights = calloc(count, sizeof(const Sphere*));
+    pm->light_cdf = calloc(count, sizeof(double));
+
+    double area = 0;
+    double power = 0;
+    for (int i = 0; i < count; ++i) {
+        const Sphere* s = spheres + i;
+        double r2 = s->radius * s->radius;
+        if (s->mat.kind == MAT_GLASS) {
+            area += r2;
+            pm->caster_cdf[pm->ncasters] = area;
+            pm->casters[pm->ncasters++] = s;
+        } else if (s->mat.kind == MAT_EMISSIVE) {
+            power += mean(Mat_emitted(s->mat)) * r2;
+            pm->light_cdf[pm->nlights] = power;
+            pm->lights[pm->nlights++] = s;
+        }
+    }
+
+    // The power of the sky through the casters, and of the lights, both
+    // over 4 pi^2. The sky is linear in the height of the direction, so its
+    // mean is at the horizon.
+    double sky = mean(Scn_sky(Vec_i())) * area;
+    pm->sky_share = (sky + power > 0) ? sky / (sky + power) : 0;
+    if (!pm->ncasters) {
+        pm->sky_share = 0;
+    }
+
+    pm->buckets = 1;
+    pm->start = calloc(2, sizeof(size_t));
+    pm->side = 2 * radius;
+    return pm;
+}
+
+void PhotonMap_free(PhotonMap* pm) {
+    free(pm->casters);
+    free(pm->caster_cdf);
+    free(pm->lights);
+    free(pm->light_cdf);
+    free(pm->photons);
+    free(pm->start);
+    free(pm);
+}
+
+// An orthonormal basis (u, v) of the plane perpendicular to a direction.
+// @param w The unit direction.
+// @param u Where to store the first vector.
+// @param v Where to store the second vector.
+static void basis(Vector w, Vector* u, Vector* v) {
+    Vector a = (fabs(w.x) > .9) ? Vec_j() : Vec_i();
+    *u = Vec_unit(Vec_cross(a, w));
+    *v = Vec_cross(w, *u);
+}
+
+// Emits a photon from the sky. The photon crosses the silhouette of a glass
+// sphere, and is only kept if that sphere is the first thing it hits, so
+// that no path from the sky is counted by two spheres.
+// @param pm The map.
+// @param source Where to store the source of the photon.
+// @param towards Where to store the direction of the photon.
+// @param power Where to store the power of the photon, times the number of
+// photons.
+// @param first Where to store the first hit of the photon.
+// @param seed The seed pointer for the random number generator.
+// @return False if the photon is lost.
+static bool from_sky(const PhotonMap* pm,
+                     Vector* source,
+                     Vector* towards,
+                     Vector* power,
+                     HitData* first,
+                     unsigned* seed) {
+    const Sphere* target = pm->casters[pick(pm->caster_cdf, pm->ncasters,
+                                            seed)];
+    Vector d = Vec_unit(Vec_rand_ball(1., seed));
+    Vector u, v;
+    basis(d, &u, &v);
+    Pair a = Pair_rand_disk(target->radius, seed);
+    Vector across = Vec_add(Vec_mul_s(u, a.x), Vec_mul_s(v, a.y));
+    Vector back = Vec_mul_s(d, -2 * target->radius);
+    *source = Vec_add(target->center, Vec_add(across, back));
+    *towards = d;
+
+    // The sky must be seen from where the photon starts.
+    Vector sky = Vec_mul_s(d, -1.);
+    if (Hittable_occluded(pm->scene, *source, sky, INFINITY)) {
+        return false;
+    }
+    *first = Hittable_hit(pm->scene, *source, d);
+    if (first->object != target) {
+        return false;
+    }
+
+    // Directions have density 1 / 4 pi, and points on the silhouettes
+    // 1 / (pi * the sum of the squared radii).
+    double area = pm->caster_cdf[pm->ncasters - 1];
+    double scale = 4 * M_PI * M_PI * area / pm->sky_share;
+    *power = Vec_mul_s(Scn_sky(sky), scale);
+    return true;
+}
+
+// Emits a photon from a point on a light towards a glass sphere. Like
+// photons from the sky, it is only kept if that sphere is the first thing
+// it hits.
+// @param pm The map.
+// @param source Where to store the source of the photon.
+// @param towards Where to store the direction of the photon.
+// @param power Where to store the power of the photon, times the number of
+// photons.
+// @param first Where to store the first hit of the photon.
+// @param seed The seed pointer for the random number generator.
+// @return False if the photon is lost.
+static bool from_light(const PhotonMap* pm,
+                       Vector* source,
+                       Vector* towards,
+                       Vector* power,
+                       HitData* first,
+                       unsigned* seed) {
+    int index = pick(pm->light_cdf, pm->nlights, seed);
+    const Sphere* light = pm->lights[index];
+    int k = pick(pm->caster_cdf, pm->ncasters, seed);
+    const Sphere* target = pm->casters[k];
+
+    Vector n = Vec_unit(Vec_rand_ball(1., seed));
+    *source = Vec_add(light->center, Vec_mul_s(n, light->radius));
+    *towards = Sph_sample(*target, *source, seed);
+    double cos = Vec_dot(*towards, n);
+    double pdf = Sph_pdf(*target, *source);
+    if (cos <= 0 || !pdf) {
+        return false;
+    }
+    *first = Hittable_hit(pm->scene, *source, *towards);
+    if (first->object != target) {
+        return false;
+    }
+
+    // Points have density 1 / area, and directions are picked by the cone
+    // of a caster.
+    double before = index ? pm->light_cdf[index - 1] : 0;
+    double chosen = (pm->light_cdf[index] - before) /
+                    pm->light_cdf[pm->nlights - 1];
+    double r2 = target->radius * target->radius;
+    double aimed = r2 / pm->caster_cdf[pm->ncasters - 1] * pdf;
+    double area = 4 * M_PI * light->radius * light->radius;
+    double scale = cos * area / (chosen * (1 - pm->sky_share) * aimed);
+    *power = Vec_mul_s(Mat_emitted(light->mat), scale);
+    return true;
+}
+
+// Shoots a photon, and follows it through glass to a diffuse surface.
+// @param pm The map.
+// @param index The index of the photon in the generation.
+// @param photon Where to store the photon.
+// @return True if the photon landed after passing through glass.
+static bool shoot(const PhotonMap* pm, size_t index, _Photon* photon) {
+    unsigned seed = (unsigned)pm->generation * 2246822519u ^
+                    (unsigned)index * 2654435761u;
+    Vector source, towards, power;
+    HitData hd;
+    bool sky = genfloat(&seed) < pm->sky_share;
+    bool emitted = sky ? from_sky(pm, &source, &towards, &power, &hd, &seed)
+                       : from_light(pm, &source, &towards, &power, &hd, &seed);
+    if (!emitted) {
+        return false;
+    }
+
+    for (int b = 0; HitData_has_hit(hd) && b <= PHOTON_BOUNCES; ++b) {
+        if (hd.mat.kind == MAT_MATTE) {
+            if (!b) {
+                // Light that reaches a surface directly isn't a caustic.
+                return false;
+            }
+            Vector unit = Vec_unit(towards);
+            Vector p = Vec_div_s(power, pm->shots);
+            *photon = (_Photon){
+                .point = {hd.point.x, hd.point.y, hd.point.z},
+                .towards = {unit.x, unit.y, unit.z},
+                .power = {p.x, p.y, p.z},
+            };
+            return true;
+        }
+        if (hd.mat.kind != MAT_GLASS) {
+            return false;
+        }
+        towards = Mat_scatter(hd.mat, towards, hd.normal, &seed);
+        power = Vec_mul(power, Mat_albedo(hd.mat));
+        source = hd.point;
+        hd = Hittable_hit(pm->scene, source, towards);
+    }
+    return false;
+}
+
+// The cell of a coordinate along one axis.
+// @param pm The map.
+// @param value The coordinate.
+// @return The index of the cell.
+static int cell_of(const PhotonMap* pm, double value) {
+    return (int)floor(value / pm->side);
+}
+
+// The bucket of a cell.
+// @param pm The map.
+// @param x The index of the cell along x.
+// @param y The index of the cell along y.
+// @param z The index of the cell along z.
+// @return The index of the bucket.
+static size_t bucket_of(const PhotonMap* pm, int x, int y, int z) {
+    unsigned h = (unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^
+                 (unsigned)z * 83492791u;
+    return h & (pm->buckets - 1);
+}
+
+// The bucket of a photon.
+// @param pm The map.
+// @param photon The photon.
+// @return The index of the bucket.
+static size_t photon_bucket(const PhotonMap* pm, const _Photon* photon) {
+    return bucket_of(pm, cell_of(pm, photon->point[0]),
+                     cell_of(pm, photon->point[1]),
+                     cell_of(pm, photon->point[2]));
+}
+
+// Shrinks the radius as the generation about to be shot does.
+// @param pm The map.
+static void shrink(PhotonMap* pm) {
+    if (pm->generation) {
+        double g = pm->generation;
+        pm->radius *= sqrt((g + PHOTON_ALPHA) / (g + 1));
+    }
+}
+
+void PhotonMap_skip(PhotonMap* pm, int generation) {
+    assert(generation >= pm->generation);
+    for (; pm->generation < generation; ++pm->generation) {
+        shrink(pm);
+    }
+}
+
+void PhotonMap_shoot(PhotonMap* pm) {
+    shrink(pm);
+    pm->side = 2 * pm->radius;
+
+    // Every thread shoots a contiguous range of photons into its own buffer,
+    // and the buffers are joined in order, so the map doesn't depend on the
+    // number of threads.
+    int threads = omp_get_max_threads();
+    _PhotonBuf* bufs = calloc(threads, sizeof(_PhotonBuf));
+    bool any = pm->ncasters && (pm->sky_share > 0 || pm->nlights);
+#pragma omp parallel num_threads(threads) if (any) default(none) \
+    shared(pm, bufs, any)
+    {
+        int t = omp_get_thread_num();
+        int n = omp_get_num_threads();
+        size_t begin = any ? pm->shots * t / n : 0;
+        size_t end = any ? pm->shots * (t + 1) / n : 0;
+        _PhotonBuf* buf = bufs + t;
+        for (size_t i = begin; i < end; ++i) {
+            _Photon photon;
+            if (!shoot(pm, i, &photon)) {
+                continue;
+            }
+            if (buf->length == buf->capacity) {
+                buf->capacity = buf->capacity ? 2 * buf->capacity : 256;
+                buf->photons = realloc(buf->photons,
+                                       buf->capacity * sizeof(_Photon));
+            }
+            buf->photons[buf->length++] = photon;
+        }
+    }
+
+    size_t length = 0;
+    for (int t = 0; t < threads; ++t) {
+        length += bufs[t].length;
+    }
+    pm->buckets = 1;
+    while (pm->buckets < length) {
+        pm->buckets *= 2;
+    }
+
+    // Counting sort by bucket.
+    free(pm->start);
+    pm->start = calloc(pm->buckets + 1, sizeof(size_t));
+    for (int t = 0; t < threads; ++t) {
+        for (size_t i = 0; i < bufs[t].length; ++i) {
+            ++pm->start[photon_bucket(pm, bufs[t].photons + i) + 1];
+        }
+    }
+    for (size_t b = 0; b < pm->buckets; ++b) {
+        pm->start[b + 1] += pm->start[b];
+    }
+    size_t* next = malloc(pm->buckets * sizeof(size_t));
+    memcpy(next, pm->start, pm->buckets * sizeof(size_t));
+    free(pm->photons);
+    pm->photons = malloc((length ? length : 1) * sizeof(_Photon));
+    for (int t = 0; t < threads; ++t) {
+        for (size_t i = 0; i < bufs[t].length; ++i) {
+            const _Photon* photon = bufs[t].photons + i;
+            pm->photons[next[photon_bucket(pm, photon)]++] = *photon;
+        }
+        free(bufs[t].photons);
+    }
+    free(next);
+    free(bufs);
+
+    pm->length = length;
+    ++pm->generation;
+}
+
+Vector PhotonMap_gather(const PhotonMap* pm, Vector point, Vector normal) {
+    Vector sum = Vec_o();
+    if (!pm->length) {
+        return sum;
+    }
+
+    double p[3] = {point.x, point.y, point.z};
+    double n[3] = {normal.x, normal.y, normal.z};
+    double r = pm->radius;
+    int lo[3];
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = cell_of(pm, p[a] - r);
+    }
+
+    // Two of the 8 cells may share a bucket, which is only visited once.
+    size_t seen[8];
+    int nseen = 0;
+    for (int c = 0; c < 8; ++c) {
+        size_t b = bucket_of(pm, lo[0] + (c & 1), lo[1] + ((c >> 1) & 1),
+                             lo[2] + (c >> 2));
+        bool visited = false;
+        for (int i = 0; i < nseen; ++i) {
+            visited |= seen[i] == b;
+        }
+        if (visited) {
+            continue;
+        }
+        seen[nseen++] = b;
+
+        for (size_t i = pm->start[b]; i < pm->start[b + 1]; ++i) {
+            const _Photon* ph = pm->photons + i;
+            double d[3];
+            double dist = 0;
+            double plane = 0;
+            double facing = 0;
+            for (int a = 0; a < 3; ++a) {
+                d[a] = ph->point[a] - p[a];
+                dist += d[a] * d[a];
+                plane += d[a] * n[a];
+                facing += ph->towards[a] * n[a];
+            }
+            if (dist >= r * r || fabs(plane) > PHOTON_FLAT * r ||
+                facing >= 0) {
+                continue;
+            }
+            sum.x += ph->power[0];
+            sum.y += ph->power[1];
+            sum.z += ph->power[2];
+        }
+    }
+    return Vec_div_s(sum, M_PI * r * r);
+}
+
+size_t PhotonMap_size(const PhotonMap* pm) {
+    return pm->length;
+}
+
+double PhotonMap_radius(const PhotonMap* pm) {
+    return pm->radius;
+}
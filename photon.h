@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "geometric.h"
+#include "hittable.h"
+#include "object.h"
+
+// PhotonMap resolves the caustics of glass spheres by tracing light forward
+// (progressive photon mapping). Photons are shot from the sky towards the
+// glass spheres, and from the emissive spheres, and followed through glass
+// only. A photon is kept where it first lands on a diffuse surface after at
+// least one glass bounce. Diffuse surfaces gather the photons around them
+// instead of finding the same light by tracing back through the glass.
+//
+// Every generation of photons replaces the last one, so memory is bounded
+// by the number of photons per generation, and the radius that photons are
+// gathered over shrinks with every generation. Averaging the passes that
+// the generations are gathered in converges to the caustics without bias.
+//
+// Photons are shot by every thread into their own buffers, then sorted
+// into a hashed grid whose photons are stored by cell. A generation is
+// read-only, so any number of threads can gather from it.
+// @author RenTrueWang
+typedef struct PhotonMap PhotonMap;
+
+// Creates a map without any photons.
+// @param scene The scene that photons are traced through. Must outlive the
+// map.
+// @param spheres The spheres of the scene, which the glass and emissive
+// spheres are picked from. Must outlive the map, and be the ones that
+// scene reports hits on.
+// @param count The length of spheres.
+// @param photons Number of photons shot per generation.
+// @param radius The radius photons are gathered over by the first
+// generation.
+// @return A new PhotonMap.
+PhotonMap* PhotonMap_make(Hittable scene,
+                          const Sphere* spheres,
+                          int count,
+                          size_t photons,
+                          double radius);
+
+// Free the map and its photons.
+// @param pm PhotonMap to free.
+// @see free
+void PhotonMap_free(PhotonMap* pm);
+
+// Shoots the next generation of photons, replacing the last one, and
+// shrinks the radius. Must not be called while rendering.
+// @param pm The map.
+void PhotonMap_shoot(PhotonMap* pm);
+
+// Skips generations without shooting them, so that the next generation shot
+// is the given one, gathered over the radius it would have had. The radius
+// only depends on the generation, so a render resumed from a checkpoint of
+// that many passes carries on where it stopped. Must not be called while
+// rendering.
+// @param pm The map.
+// @param generation The generation to shoot next. Not before the next one.
+void PhotonMap_skip(PhotonMap* pm, int generation);
+
+// The irradiance that the caustics bring to a point of a diffuse surface.
+// @param pm The map.
+// @param point The point.
+// @param normal The unit surface normal at the point.
+// @return The irradiance. A Lambertian surface reflects albedo / pi of it.
+Vector PhotonMap_gather(const PhotonMap* pm, Vector point, Vector normal);
+
+// Number of photons kept by the current generation.
+// @param pm The map.
+// @return Number of photons.
+size_t PhotonMap_size(const PhotonMap* pm);
+
+// The radius that the current generation is gathered over.
+// @param pm The map.
+// @return The radius.
+double PhotonMap_radius(const PhotonMap* pm);
@@ -1,4 +1,9 @@
 #include "pixel.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "geometric.h"
 
 Vector Px_2Vec(Pixel px) {
@@ -8,3 +13,50 @@ Vector Px_2Vec(Pixel px) {
         .z = px.b / 255.,
     };
 }
+
+bool Px_fwrite_ppm(const Pixel* image, int width, int height, FILE* file) {
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+
+    // PPM stores the top row first, but y grows upwards in the scene.
+    for (int y = height - 1; y >= 0; --y) {
+        fwrite(image + y * width, sizeof(Pixel), width, file);
+    }
+
+    return !ferror(file);
+}
+
+bool Px_write_ppm(const Pixel* image, int width, int height, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    bool ok = Px_fwrite_ppm(image, width, height, file);
+    return (fclose(file) == 0) && ok;
+}
+
+bool Px_write_ppm16(const uint16_t* image,
+                    int width,
+                    int height,
+                    const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n65535\n", width, height);
+
+    // PPM stores the most significant byte of a channel first.
+    unsigned char* row = malloc(6 * width);
+    for (int y = height - 1; y >= 0; --y) {
+        const uint16_t* src = image + 3 * y * width;
+        for (int i = 0; i < 3 * width; ++i) {
+            row[2 * i + 0] = src[i] >> 8;
+            row[2 * i + 1] = src[i] & 0xff;
+        }
+        fwrite(row, 1, 6 * width, file);
+    }
+    free(row);
+
+    bool ok = !ferror(file);
+    return (fclose(file) == 0) && ok;
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
 #include "geometric.h"
 
 // External linkage.
@@ -9,12 +13,40 @@ struct Vector;
 // @author RenTrueWang
 typedef struct Pixel {
     // (r, g, b) of a pixel
-    char r, g, b;
+    unsigned char r, g, b;
 } Pixel;
 
 // Converts a pixel to a vector. Scale the range from [0, 255] integer to [0,
-// 1).
+// 1].
 // @param px Pixel to transform.
-// @return A vector (x, y, z) in the range [0, 1).
+// @return A vector (x, y, z) in the range [0, 1].
 // @see Vector
 struct Vector Px_2Vec(Pixel px);
+
+// Writes an image in the binary PPM format to an open stream.
+// @param image Row-major pixels, with the bottom row first.
+// @param width The width of the image.
+// @param height The height of the image.
+// @param file The stream to write to.
+// @return True if the image is written successfully.
+bool Px_fwrite_ppm(const Pixel* image, int width, int height, FILE* file);
+
+// Writes an image in the binary PPM format.
+// @param image Row-major pixels, with the bottom row first.
+// @param width The width of the image.
+// @param height The height of the image.
+// @param path The file to write to.
+// @return True if the file is written successfully.
+bool Px_write_ppm(const Pixel* image, int width, int height, const char* path);
+
+// Writes an image of 16-bit channels in the binary PPM format.
+// @param image Row-major channels, three (r, g, b) per pixel, with the bottom
+// row first.
+// @param width The width of the image.
+// @param height The height of the image.
+// @param path The file to write to.
+// @return True if the file is written successfully.
+bool Px_write_ppm16(const uint16_t* image,
+                    int width,
+                    int height,
+                    const char* path);
@@ -0,0 +1,383 @@
+#include "pool.h"
+
+#include <omp.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The capacity of a deque. Must be a power of 2. A task that doesn't fit is
+// run right away by the thread that spawns it.
+#define DEQUE_SIZE 1024
+
+// The size of a cache line. Data written by different threads is kept on
+// different lines.
+#define CACHE_LINE 64
+
+// A Chase-Lev deque. The owner pushes and pops at the bottom, thieves steal
+// at the top.
+// @see "Correct and Efficient Work-Stealing for Weak Memory Models", Le et al.
+typedef struct _Deque {
+    // The index of the oldest task. Only ever incremented, by a successful
+    // steal or by the owner taking the last task.
+    _Alignas(CACHE_LINE) atomic_long top;
+    // One past the index of the newest task. Only written by the owner.
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    // Circular buffer of tasks.
+    _Atomic(Task*) tasks[DEQUE_SIZE];
+} _Deque;
+
+struct Worker {
+    // The pool the worker belongs to.
+    _Alignas(CACHE_LINE) Pool* pool;
+    // The index of the worker's thread.
+    int thread;
+    // The seed for picking victims to steal from.
+    unsigned seed;
+    // What the worker has been doing.
+    PoolStats stats;
+};
+
+struct Pool {
+    // The most threads that will run the pool.
+    int threads;
+    // The threads of the running parallel region.
+    int active;
+    // Set once the root task is finished.
+    atomic_bool done;
+    // One deque per thread.
+    _Deque* deques;
+    // One worker per thread.
+    Worker* workers;
+};
+
+Pool* Pool_make(int threads) {
+    Pool* pool = calloc(1, sizeof(Pool));
+    pool->threads = threads > 0 ? threads : 1;
+    pool->deques = aligned_alloc(CACHE_LINE, pool->threads * sizeof(_Deque));
+    pool->workers = aligned_alloc(CACHE_LINE, pool->threads * sizeof(Worker));
+    memset(pool->deques, 0, pool->threads * sizeof(_Deque));
+    memset(pool->workers, 0, pool->threads * sizeof(Worker));
+
+    for (int i = 0; i < pool->threads; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].thread = i;
+        pool->workers[i].seed = 2654435761u * (i + 1);
+    }
+    return pool;
+}
+
+void Pool_free(Pool* pool) {
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
+
+int Pool_threads(const Pool* pool) {
+    return pool->threads;
+}
+
+// Pushes a task at the bottom. Only called by the owner.
+// @param d The deque.
+// @param task The task.
+// @return False if the deque is full.
+static bool push(_Deque* d, Task* task) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= DEQUE_SIZE) {
+        return false;
+    }
+    atomic_store_explicit(&d->tasks[b & (DEQUE_SIZE - 1)], task,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+// Pops the newest task. Only called by the owner.
+// @param d The deque.
+// @return The task, or NULL if the deque is empty.
+static Task* pop(_Deque* d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    Task* task = NULL;
+    if (t <= b) {
+        task = atomic_load_explicit(&d->tasks[b & (DEQUE_SIZE - 1)],
+                                    memory_order_relaxed);
+        if (t != b) {
+            return task;
+        }
+        // The last task. Thieves may be racing for it.
+        if (!atomic_compare_exchange_strong_explicit(
+                &d->top, &t, t + 1, memory_order_seq_cst,
+                memory_order_relaxed)) {
+            task = NULL;
+        }
+    }
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return task;
+}
+
+// Steals the oldest task. Called by any thread but the owner.
+// @param d The deque.
+// @return The task, or NULL if the deque is empty or the race is lost.
+static Task* steal(_Deque* d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+
+    Task* task = atomic_load_explicit(&d->tasks[t & (DEQUE_SIZE - 1)],
+                                      memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+// Runs a task, and marks it finished.
+// @param w The calling thread's worker.
+// @param task The task.
+static void run(Worker* w, Task* task) {
+    ++w->stats.tasks;
+    task->fn(w, task->arg);
+    if (task->pending) {
+        atomic_fetch_sub_explicit(task->pending, 1, memory_order_release);
+    }
+}
+
+// Finds a task, first in the worker's own deque, then in a random other one.
+// @param w The calling thread's worker.
+// @return The task, or NULL if none is found.
+static Task* find(Worker* w) {
+    Pool* pool = w->pool;
+    Task* task = pop(pool->deques + w->thread);
+    if (task || pool->active < 2) {
+        return task;
+    }
+
+    int victim = rand_r(&w->seed) % (pool->active - 1);
+    victim += (victim >= w->thread);
+    task = steal(pool->deques + victim);
+    if (task) {
+        ++w->stats.steals;
+    } else {
+        ++w->stats.misses;
+    }
+    return task;
+}
+
+// Runs tasks until a condition holds.
+// @param w The calling thread's worker.
+// @param pending Run until it drops to 0. NULL to run until the pool is done.
+static void work(Worker* w, atomic_int* pending) {
+    Pool* pool = w->pool;
+    double idle = -1;
+
+    while (pending ? atomic_load_explicit(pending, memory_order_acquire) > 0
+                   : !atomic_load_explicit(&pool->done,
+                                           memory_order_acquire)) {
+        Task* task = find(w);
+        if (task) {
+            if (idle >= 0) {
+                w->stats.idle += omp_get_wtime() - idle;
+                idle = -1;
+            }
+            run(w, task);
+        } else {
+            if (idle < 0) {
+                idle = omp_get_wtime();
+            }
+            sched_yield();
+        }
+    }
+
+    if (idle >= 0) {
+        w->stats.idle += omp_get_wtime() - idle;
+    }
+}
+
+void Pool_run(Pool* pool, Task* task) {
+    atomic_store(&pool->done, false);
+
+#pragma omp parallel num_threads(pool->threads) default(none) \
+    shared(pool, task)
+    {
+#pragma omp single
+        pool->active = omp_get_num_threads();
+
+        Worker* w = pool->workers + omp_get_thread_num();
+        if (w->thread == 0) {
+            run(w, task);
+            atomic_store(&pool->done, true);
+        } else {
+            work(w, NULL);
+        }
+    }
+}
+
+// Number of indices of a share that are dealt at once. The rest of the share
+// waits in one task behind them, so deques keep room for the tasks that the
+// body spawns.
+#define LOOP_BATCH (DEQUE_SIZE / 4)
+
+typedef struct _PoolLoop _PoolLoop;
+
+// A task of a loop run by Pool_for.
+typedef struct _LoopTask {
+    // The task. Its argument is the _LoopTask itself.
+    Task task;
+    // The loop.
+    _PoolLoop* loop;
+    // The index that the task runs, or the first index of the share that it
+    // deals.
+    int index;
+} _LoopTask;
+
+// A loop run by Pool_for.
+struct _PoolLoop {
+    // Number of indices.
+    int length;
+    // Number of threads that indices are dealt to. Thread t is dealt the
+    // share t, t + step, t + 2 * step, and so on.
+    int step;
+    // The work for one index.
+    void (*body)(void* arg, int index, int thread);
+    // Passed to body.
+    void* arg;
+    // One task per index that runs it.
+    _LoopTask* items;
+    // One task per index that deals the share from that index on. Only the
+    // ones at the start of a batch are used.
+    _LoopTask* rests;
+    // Number of tasks of the loop not finished yet.
+    atomic_int pending;
+};
+
+// Runs one index of a loop.
+// @param w The calling thread's worker.
+// @param arg The _LoopTask of the index.
+static void run_index(Worker* w, void* arg) {
+    _LoopTask* item = arg;
+    _PoolLoop* loop = item->loop;
+    loop->body(loop->arg, item->index, w->thread);
+}
+
+// Pushes the indices of a share onto the calling thread's deque, the rest of
+// the share first and then the indices last to first. The owner then pops
+// the indices in order, so the first, most expensive ones start first, and
+// thieves steal from the end of the share, where the cheapest ones are.
+// @param w The calling thread's worker.
+// @param loop The loop.
+// @param first The first index of the share to deal.
+static void deal(Worker* w, _PoolLoop* loop, int first) {
+    int step = loop->step;
+    int count = (loop->length - first + step - 1) / step;
+    int n = count < LOOP_BATCH ? count : LOOP_BATCH;
+    if (count > n) {
+        Pool_spawn(w, &loop->rests[first + n * step].task);
+    }
+    for (int k = n - 1; k >= 0; --k) {
+        Pool_spawn(w, &loop->items[first + k * step].task);
+    }
+}
+
+// Deals the rest of a share.
+// @param w The calling thread's worker.
+// @param arg The _LoopTask of the rest.
+static void run_rest(Worker* w, void* arg) {
+    _LoopTask* rest = arg;
+    deal(w, rest->loop, rest->index);
+}
+
+void Pool_for(Pool* pool,
+              int length,
+              void (*body)(void* arg, int index, int thread),
+              void* arg) {
+    _PoolLoop loop = {
+        .length = length,
+        .body = body,
+        .arg = arg,
+        .items = calloc(length > 0 ? length : 1, sizeof(_LoopTask)),
+        .rests = calloc(length > 0 ? length : 1, sizeof(_LoopTask)),
+    };
+    atomic_init(&loop.pending, 0);
+    for (int i = 0; i < length; ++i) {
+        loop.items[i] = (_LoopTask){
+            .task = {.fn = run_index, .pending = &loop.pending},
+            .loop = &loop,
+            .index = i,
+        };
+        loop.items[i].task.arg = loop.items + i;
+        loop.rests[i] = (_LoopTask){
+            .task = {.fn = run_rest, .pending = &loop.pending},
+            .loop = &loop,
+            .index = i,
+        };
+        loop.rests[i].task.arg = loop.rests + i;
+    }
+
+#pragma omp parallel num_threads(pool->threads) default(none) \
+    shared(pool, loop, length)
+    {
+#pragma omp single
+        {
+            pool->active = omp_get_num_threads();
+            loop.step = pool->active;
+        }
+
+        // Only owners push, so every thread deals its own share, and none
+        // looks for work before all shares are dealt.
+        Worker* w = pool->workers + omp_get_thread_num();
+        if (w->thread < length) {
+            deal(w, &loop, w->thread);
+        }
+#pragma omp barrier
+        work(w, &loop.pending);
+    }
+
+    free(loop.items);
+    free(loop.rests);
+}
+
+PoolStats Pool_stats(const Pool* pool) {
+    PoolStats sum = {0};
+    for (int i = 0; i < pool->threads; ++i) {
+        PoolStats s = pool->workers[i].stats;
+        sum.tasks += s.tasks;
+        sum.steals += s.steals;
+        sum.misses += s.misses;
+        sum.idle += s.idle;
+    }
+    return sum;
+}
+
+void Pool_reset_stats(Pool* pool) {
+    for (int i = 0; i < pool->threads; ++i) {
+        pool->workers[i].stats = (PoolStats){0};
+    }
+}
+
+void Pool_spawn(Worker* w, Task* task) {
+    if (task->pending) {
+        atomic_fetch_add_explicit(task->pending, 1, memory_order_relaxed);
+    }
+    if (!push(w->pool->deques + w->thread, task)) {
+        run(w, task);
+    }
+}
+
+void Pool_wait(Worker* w, atomic_int* pending) {
+    work(w, pending);
+}
+
+int Worker_thread(const Worker* w) {
+    return w->thread;
+}
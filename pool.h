@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdatomic.h>
+
+// Pool is a work-stealing scheduler. Every thread owns a deque of tasks: it
+// pushes and pops tasks at the bottom of its own deque without locks, and
+// idle threads steal the oldest task at the top of a random other deque.
+// Old tasks tend to be large, so a steal takes a big share of the remaining
+// work, and threads rarely touch each other's deques otherwise.
+// @author RenTrueWang
+typedef struct Pool Pool;
+
+// The calling thread's handle to a running pool.
+typedef struct Worker Worker;
+
+// A unit of work. Tasks are owned by whoever spawns them, and must stay
+// valid until they are finished.
+// @author RenTrueWang
+typedef struct Task {
+    // The work.
+    // @param w The worker that runs the task.
+    // @param arg The task's argument.
+    void (*fn)(Worker* w, void* arg);
+    // Passed to fn.
+    void* arg;
+    // Decremented when the task is finished. Can be NULL.
+    atomic_int* pending;
+} Task;
+
+// What a pool has been doing, summed over its threads.
+// @author RenTrueWang
+typedef struct PoolStats {
+    // Number of tasks run.
+    unsigned long tasks;
+    // Number of tasks stolen from another thread.
+    unsigned long steals;
+    // Number of attempts to steal that found nothing.
+    unsigned long misses;
+    // Seconds that threads spent looking for work.
+    double idle;
+} PoolStats;
+
+// Creates a pool for the threads of OpenMP parallel regions.
+// @param threads The most threads that will run the pool.
+// @return A new Pool.
+Pool* Pool_make(int threads);
+
+// Free the pool.
+// @param pool Pool to free.
+// @see free
+void Pool_free(Pool* pool);
+
+// The most threads that will run the pool.
+// @param pool The pool.
+// @return Number of threads.
+int Pool_threads(const Pool* pool);
+
+// Runs a task on an OpenMP parallel region, and returns once it is finished.
+// Tasks must wait for the tasks they spawn with Pool_wait, so everything
+// the root task spawned is finished too. If called from a parallel region,
+// nested parallelism decides how many threads help.
+// @param pool The pool to run on. Not used by anyone else meanwhile.
+// @param task The root task.
+void Pool_run(Pool* pool, Task* task);
+
+// Calls a function for every index in [0, length), in parallel. Indices are
+// dealt round-robin to the threads' deques, and every thread runs its own in
+// order, so earlier indices start first. Idle threads steal the latest
+// indices of the others, and the tasks that the function spawns.
+// @param pool The pool to run on.
+// @param length Number of indices.
+// @param body The work for one index.
+// @param arg Passed to body.
+void Pool_for(Pool* pool,
+              int length,
+              void (*body)(void* arg, int index, int thread),
+              void* arg);
+
+// The statistics since the pool was made or last reset.
+// @param pool The pool.
+// @return The statistics, summed over threads.
+PoolStats Pool_stats(const Pool* pool);
+
+// Resets the statistics.
+// @param pool The pool.
+void Pool_reset_stats(Pool* pool);
+
+// Makes a task available to other threads. The task may also be run by the
+// calling thread, in Pool_wait.
+// @param w The calling thread's worker.
+// @param task The task. Its pending counter is incremented.
+void Pool_spawn(Worker* w, Task* task);
+
+// Runs tasks until a counter drops to 0.
+// @param w The calling thread's worker.
+// @param pending The counter to wait for.
+void Pool_wait(Worker* w, atomic_int* pending);
+
+// The index of a worker's thread in the pool, in [0, threads).
+// @param w The worker.
+// @return The index.
+int Worker_thread(const Worker* w);
@@ -0,0 +1,252 @@
+#include "progressive.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+// The spacing of the pixels rendered by the first pass. Must be a power of 2.
+#define PROG_STRIDE 8
+
+// Number of passes that render one sample on a grid, down to spacing 1.
+#define PROG_LEVELS 4
+
+Progressive Prog_make(Scene scene, int tile) {
+    int width = scene.cfg.width;
+    int height = scene.cfg.height;
+
+    Progressive prog = {
+        .scene = scene,
+        .tl = TileList_make(width, height, tile),
+        .acc = Accum_make(width, height),
+        .passes = 0,
+        .buffers =
+            {
+                calloc(width * height, sizeof(Pixel)),
+                calloc(width * height, sizeof(Pixel)),
+            },
+        .front = 0,
+        .version = 0,
+        .tone = ToneCfg_default(),
+        .pool = Pool_make(omp_get_max_threads()),
+        .primary = NULL,
+    };
+    omp_init_lock(&prog.lock);
+    atomic_init(&prog.cancel, false);
+    return prog;
+}
+
+void Prog_free(Progressive* prog) {
+    omp_destroy_lock(&prog->lock);
+    free(prog->buffers[0]);
+    free(prog->buffers[1]);
+    prog->buffers[0] = NULL;
+    prog->buffers[1] = NULL;
+    Accum_free(&prog->acc);
+    TileList_free(&prog->tl);
+    Pool_free(prog->pool);
+    prog->pool = NULL;
+    if (prog->primary) {
+        GBuf_free(prog->primary);
+        free(prog->primary);
+        prog->primary = NULL;
+    }
+}
+
+bool Prog_cache_primary(Progressive* prog, unsigned seed) {
+    assert(!prog->passes);
+    if (prog->scene.cam.aperture != 0) {
+        return false;
+    }
+
+    if (!prog->primary) {
+        prog->primary = malloc(sizeof(GBuffer));
+    } else {
+        GBuf_free(prog->primary);
+    }
+    *prog->primary = GBuf_make(&prog->scene, prog->scene.cfg.samples, seed);
+    return true;
+}
+
+// The spacing of the pixels rendered by a pass.
+// @param pass The index of the pass.
+// @return Pixels whose coordinates are both multiples of it are rendered.
+static int pass_stride(int pass) {
+    return pass < PROG_LEVELS ? PROG_STRIDE >> pass : 1;
+}
+
+// Number of samples every rendered pixel has once a pass is finished. The
+// passes after the grid double it until scene.cfg.samples is reached.
+// @param pass The index of the pass.
+// @param samples The samples per pixel of the finished image.
+// @return The target number of samples.
+static int pass_target(int pass, int samples) {
+    if (pass < PROG_LEVELS) {
+        return 1;
+    }
+    int shift = pass - PROG_LEVELS + 1;
+    return (shift >= 30 || samples >> shift == 0) ? samples : 1 << shift;
+}
+
+// Converts the accumulated samples to a snapshot and publishes it. Pixels
+// without samples yet show the nearest pixel of a coarser grid.
+// @param prog The render to publish.
+static void publish(Progressive* prog) {
+    Accum acc = prog->acc;
+    int width = acc.width;
+    int height = acc.height;
+    Pixel* back = prog->buffers[1 - prog->front];
+    Tone_resolve(prog->tone, acc, back);
+
+    // Only pixels without samples are written, and they copy pixels with
+    // samples, so rows don't race.
+#pragma omp parallel for default(none) shared(acc, width, height, back)
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int idx = y * width + x;
+            if (acc.count[idx]) {
+                continue;
+            }
+            for (int s = 2; s <= PROG_STRIDE; s *= 2) {
+                int anchor = (y - y % s) * width + (x - x % s);
+                if (acc.count[anchor]) {
+                    back[idx] = back[anchor];
+                    break;
+                }
+            }
+        }
+    }
+
+    omp_set_lock(&prog->lock);
+    prog->front = 1 - prog->front;
+    ++prog->version;
+    omp_unset_lock(&prog->lock);
+}
+
+// A pass in progress.
+typedef struct _ProgPass {
+    // The render.
+    Progressive* prog;
+    // The wall-clock time to stop at.
+    double deadline;
+    // Pixels whose coordinates are both multiples of it are rendered.
+    int stride;
+    // Number of samples every rendered pixel has once the pass is finished.
+    int target;
+    // The seed of the pass.
+    unsigned seed;
+    // The camera, prepared for the image.
+    Lens lens;
+    // Set once a pixel is skipped because of the deadline or cancel flag.
+    atomic_bool interrupted;
+} _ProgPass;
+
+// Renders the pixels of a tile that don't have enough samples yet.
+// @param arg The _ProgPass.
+// @param index The index of the tile.
+// @param thread The index of the calling thread.
+static void pass_tile(void* arg, int index, int thread) {
+    (void)thread;
+    _ProgPass* pass = arg;
+    Progressive* prog = pass->prog;
+    Scene scene = prog->scene;
+    Accum* acc = &prog->acc;
+    int width = scene.cfg.width;
+    Tile tile = prog->tl.list[index];
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            int idx = y * width + x;
+            int need = pass->target - (int)acc->count[idx];
+            if (x % pass->stride || y % pass->stride || need <= 0) {
+                continue;
+            }
+            if (atomic_load(&pass->interrupted) ||
+                atomic_load(&prog->cancel) ||
+                omp_get_wtime() > pass->deadline) {
+                atomic_store(&pass->interrupted, true);
+                return;
+            }
+
+            // Seeded by position, so an interrupted pass resumes with the
+            // samples it would have taken. Hashed, so that no other pixel of
+            // any pass draws the same samples.
+            unsigned px_seed = hash32(pass->seed + (unsigned)idx);
+            Vector radiance;
+            if (prog->primary) {
+                // Every sample gets the next position of the pixel.
+                int first = acc->count[idx] % prog->primary->positions;
+                radiance = GBuf_radiance(prog->primary, &scene, x, y, first,
+                                         need, &px_seed, NULL);
+            } else {
+                scene.cfg.samples = need;
+                radiance = Scn_radiance(&scene, &pass->lens, x, y, &px_seed,
+                                        NULL);
+            }
+            Accum_add_px(acc, idx, radiance, need);
+        }
+    }
+}
+
+// Renders the pixels of the current pass that don't have enough samples
+// yet. Pixels already rendered by an interrupted call are skipped.
+// @param prog The render to continue.
+// @param deadline The wall-clock time to stop at.
+// @param seed The seed of the render.
+// @return True if the pass is finished.
+static bool render_pass(Progressive* prog, double deadline, unsigned seed) {
+    _ProgPass pass = {
+        .prog = prog,
+        .deadline = deadline,
+        .stride = pass_stride(prog->passes),
+        .target = pass_target(prog->passes, prog->scene.cfg.samples),
+        .seed = hash32(seed + (unsigned)prog->passes),
+        .lens = Lens_make(prog->scene.cam, prog->scene.cfg.width,
+                          prog->scene.cfg.height),
+    };
+    atomic_init(&pass.interrupted, false);
+
+    Pool_for(prog->pool, prog->tl.length, pass_tile, &pass);
+    return !atomic_load(&pass.interrupted);
+}
+
+bool Prog_render(Progressive* prog, double budget, unsigned seed) {
+    double deadline = omp_get_wtime() + budget;
+    int samples = prog->scene.cfg.samples;
+
+    forever {
+        int pass = prog->passes;
+        if (pass >= PROG_LEVELS && pass_target(pass - 1, samples) >= samples) {
+            return true;
+        }
+
+        bool finished = render_pass(prog, deadline, seed);
+        publish(prog);
+        if (!finished) {
+            return false;
+        }
+        ++prog->passes;
+        if (prog->scene.guide) {
+            Guide_refine(prog->scene.guide);
+        }
+        if (prog->scene.photons) {
+            PhotonMap_shoot(prog->scene.photons);
+        }
+    }
+}
+
+void Prog_cancel(Progressive* prog) {
+    atomic_store(&prog->cancel, true);
+}
+
+unsigned Prog_snapshot(Progressive* prog, Pixel* image) {
+    omp_set_lock(&prog->lock);
+    unsigned version = prog->version;
+    if (version) {
+        size_t size = prog->acc.width * prog->acc.height;
+        memcpy(image, prog->buffers[prog->front], size * sizeof(Pixel));
+    }
+    omp_unset_lock(&prog->lock);
+    return version;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <omp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "accum.h"
+#include "gbuffer.h"
+#include "pixel.h"
+#include "pool.h"
+#include "render.h"
+#include "scene.h"
+#include "tonemap.h"
+
+// Progressive renders an image in passes that get better over time, so that
+// a preview is available long before the image is finished. The first passes
+// render one sample for a sparse grid of pixels, every pass halving the grid
+// spacing, and later passes double the samples per pixel until
+// scene.cfg.samples is reached. Every pass publishes a snapshot, which other
+// threads may read while the next pass is rendered. A guided scene learns
+// from every finished pass, and a scene with photons shoots a new generation
+// after every finished pass.
+// @author RenTrueWang
+typedef struct Progressive {
+    // The scene to render.
+    Scene scene;
+    // The tiles that passes are dispatched in.
+    TileList tl;
+    // The samples of all passes so far.
+    Accum acc;
+    // Number of passes finished so far.
+    int passes;
+    // The published snapshot is buffers[front]. The other one is written by
+    // the renderer.
+    Pixel* buffers[2];
+    // Index of the published snapshot.
+    int front;
+    // Incremented every time a snapshot is published.
+    unsigned version;
+    // Guards front and the published snapshot.
+    omp_lock_t lock;
+    // How snapshots are converted from radiance. Defaults to
+    // ToneCfg_default, and may be changed before rendering starts.
+    ToneCfg tone;
+    // Set to stop rendering as soon as possible.
+    atomic_bool cancel;
+    // The scheduler that passes run on, and its statistics.
+    Pool* pool;
+    // The first hits of the camera rays. NULL traces camera rays.
+    GBuffer* primary;
+} Progressive;
+
+// Creates a progressive render of a scene. Nothing is rendered yet.
+// @param scene The scene to render.
+// @param tile The side length of a tile.
+// @return A new Progressive. It must not move once rendering starts.
+Progressive Prog_make(Scene scene, int tile);
+
+// Free the resources controlled by Progressive.
+// @param prog Progressive to free.
+// @see free
+void Prog_free(Progressive* prog);
+
+// Caches the first hits of the camera rays, with scene.cfg.samples positions
+// per pixel, so that passes start their paths at the first bounce. Requires
+// a pinhole camera. Must be called before rendering starts.
+//
+// Antialiasing is capped at the cached positions: every sample of a pixel
+// gets a position of its own up to scene.cfg.samples samples, where the
+// image is finished, and samples past that would reuse them in turn.
+// @param prog The render.
+// @param seed The seed the positions are drawn with.
+// @return False if the camera isn't a pinhole one.
+bool Prog_cache_primary(Progressive* prog, unsigned seed);
+
+// Renders passes until the deadline, until cancelled, or until the image is
+// finished, whichever is first. Passes are interrupted between two pixels, so
+// it returns shortly after the deadline however expensive a pass is. Pixels
+// rendered by an interrupted pass are kept and published. Can be called
+// again to refine the image further.
+// @param prog The render to continue.
+// @param budget Wall-clock seconds to render for.
+// @param seed The seed of the render.
+// @return True if the image is finished.
+bool Prog_render(Progressive* prog, double budget, unsigned seed);
+
+// Stops a render from any thread. Prog_render returns shortly afterwards,
+// and returns immediately if called again.
+// @param prog The render to stop.
+void Prog_cancel(Progressive* prog);
+
+// Copies the latest published snapshot. Safe to call from any thread while
+// rendering.
+// @param prog The render to read.
+// @param image Where to copy to. Must hold width * height pixels.
+// @return The version of the snapshot. 0 if nothing is published yet.
+unsigned Prog_snapshot(Progressive* prog, Pixel* image);
@@ -0,0 +1,466 @@
+#include "render.h"
+
+#include <assert.h>
+#include <math.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "camera.h"
+#include "hittable.h"
+
+// Costs above this multiple of the mean cost are shown as the hottest color.
+#define HEATMAP_RANGE 4.
+
+CostMap CostMap_make(int width, int height, CostMetric metric) {
+    assert(width > 0);
+    assert(height > 0);
+    return (CostMap){
+        .cost = calloc(width * height, sizeof(double)),
+        .width = width,
+        .height = height,
+        .metric = metric,
+    };
+}
+
+void CostMap_free(CostMap* cm) {
+    free(cm->cost);
+    cm->cost = NULL;
+}
+
+// Clamps a number into the range [0, 1].
+// @param n The number to clamp.
+// @return The clamped number.
+static double clamp01(double n) {
+    return (n < 0) ? 0 : (n > 1) ? 1 : n;
+}
+
+bool CostMap_write_heatmap(CostMap cm, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    // A handful of outliers (preempted threads, page faults) would wash out
+    // the whole map if scaled by the maximum, so the colormap saturates at a
+    // multiple of the mean instead.
+    int size = cm.width * cm.height;
+    double mean = 0;
+    for (int i = 0; i < size; ++i) {
+        mean += cm.cost[i];
+    }
+    mean /= size;
+    double max = HEATMAP_RANGE * mean;
+
+    fprintf(file, "P6\n%d %d\n255\n", cm.width, cm.height);
+
+    // PPM stores the top row first, but y grows upwards in the scene.
+    for (int y = cm.height - 1; y >= 0; --y) {
+        for (int x = 0; x < cm.width; ++x) {
+            double t = max ? clamp01(cm.cost[y * cm.width + x] / max) : 0;
+
+            // The jet colormap, blue -> cyan -> yellow -> red.
+            unsigned char rgb[3] = {
+                (unsigned char)(255 * clamp01(1.5 - fabs(4 * t - 3))),
+                (unsigned char)(255 * clamp01(1.5 - fabs(4 * t - 2))),
+                (unsigned char)(255 * clamp01(1.5 - fabs(4 * t - 1))),
+            };
+            fwrite(rgb, sizeof(rgb), 1, file);
+        }
+    }
+
+    return fclose(file) == 0;
+}
+
+Frame Frame_make(int width, int height, bool features) {
+    assert(width > 0);
+    assert(height > 0);
+    int size = width * height;
+    Frame frame = {
+        .width = width,
+        .height = height,
+        .image = malloc(size * sizeof(Pixel)),
+        .radiance = malloc(size * sizeof(Vector)),
+        .aov = features ? malloc(size * sizeof(Aov)) : NULL,
+    };
+
+    // Pages are placed on the node of the thread that touches them first.
+    // Clearing rows in parallel spreads the frame over every node instead of
+    // the node of the calling thread.
+#pragma omp parallel for schedule(static) default(none) shared(frame, size)
+    for (int i = 0; i < size; ++i) {
+        frame.image[i] = (Pixel){0, 0, 0};
+        frame.radiance[i] = Vec_o();
+        if (frame.aov) {
+            frame.aov[i] = (Aov){.albedo = Vec_o(), .normal = Vec_o()};
+        }
+    }
+    return frame;
+}
+
+void Frame_free(Frame* frame) {
+    free(frame->image);
+    free(frame->radiance);
+    free(frame->aov);
+    frame->image = NULL;
+    frame->radiance = NULL;
+    frame->aov = NULL;
+}
+
+TileList TileList_make(int width, int height, int size) {
+    Tile image = {.x0 = 0, .y0 = 0, .x1 = width, .y1 = height, .cost = 0};
+    return TileList_region(image, size);
+}
+
+TileList TileList_region(Tile region, int size) {
+    assert(size > 0);
+    assert(region.x0 <= region.x1);
+    assert(region.y0 <= region.y1);
+
+    int nx = (region.x1 - region.x0 + size - 1) / size;
+    int ny = (region.y1 - region.y0 + size - 1) / size;
+    Tile* list = calloc((nx * ny > 0) ? nx * ny : 1, sizeof(Tile));
+
+    int idx = 0;
+    for (int ty = 0; ty < ny; ++ty) {
+        for (int tx = 0; tx < nx; ++tx) {
+            int x0 = region.x0 + tx * size;
+            int y0 = region.y0 + ty * size;
+            list[idx++] = (Tile){
+                .x0 = x0,
+                .y0 = y0,
+                .x1 = (x0 + size < region.x1) ? x0 + size : region.x1,
+                .y1 = (y0 + size < region.y1) ? y0 + size : region.y1,
+                .cost = 0,
+            };
+        }
+    }
+
+    return (TileList){.list = list, .length = nx * ny};
+}
+
+void TileList_free(TileList* tl) {
+    free(tl->list);
+    tl->list = NULL;
+}
+
+unsigned Tile_seed(Tile tile, int width, unsigned seed) {
+    unsigned pos = tile.y0 * width + tile.x0;
+    return seed ^ (pos * 2654435761u);
+}
+
+// Compare tiles by descending cost.
+// @param a The first Tile to compare.
+// @param b The second Tile to compare.
+// @return Negative if a is more expensive than b.
+static int cmp_cost(const void* a, const void* b) {
+    const Tile* ta = a;
+    const Tile* tb = b;
+    return (ta->cost < tb->cost) - (ta->cost > tb->cost);
+}
+
+void TileList_sort_cost(TileList* tl, CostMap cm) {
+    for (int i = 0; i < tl->length; ++i) {
+        Tile* tile = tl->list + i;
+        assert(tile->x1 <= cm.width);
+        assert(tile->y1 <= cm.height);
+
+        double cost = 0;
+        for (int y = tile->y0; y < tile->y1; ++y) {
+            for (int x = tile->x0; x < tile->x1; ++x) {
+                cost += cm.cost[y * cm.width + x];
+            }
+        }
+        tile->cost = cost;
+    }
+
+    qsort(tl->list, tl->length, sizeof(Tile), cmp_cost);
+}
+
+// Renders a single pixel from its camera rays, and records its cost and
+// features if requested.
+// @param scene The scene to render.
+// @param rays The camera rays of the pixel's tile.
+// @param first The index of the pixel's first ray.
+// @param primary The cached first hits, used instead of rays. Can be NULL.
+// @param position The index of the first position of primary to use.
+// @param frame The output.
+// @param x The X position of the pixel.
+// @param y The Y position of the pixel.
+// @param cm Where to record the cost. Can be NULL.
+// @param seed The seed pointer for the random number generator.
+// @return The radiance of the pixel.
+static Vector render_px(const Scene* scene,
+                        const RayBatch* rays,
+                        int first,
+                        const GBuffer* primary,
+                        int position,
+                        Frame frame,
+                        int x,
+                        int y,
+                        CostMap* cm,
+                        unsigned* seed) {
+    CostMetric metric = cm ? cm->metric : COST_NONE;
+    int idx = y * frame.width + x;
+    Aov* aov = frame.aov ? frame.aov + idx : NULL;
+
+    double start = 0;
+    switch (metric) {
+        case COST_NONE:
+            break;
+        case COST_TIME:
+            start = omp_get_wtime();
+            break;
+        case COST_STEPS:
+            start = Hittable_steps();
+            break;
+        default:
+            assert(0 && "unreachable");
+    }
+
+    int samples = scene->cfg.samples;
+    Vector radiance =
+        primary
+            ? GBuf_radiance(primary, scene, x, y, position, samples, seed, aov)
+            : Scn_trace_rays(scene, rays, first, samples, seed, aov);
+
+    switch (metric) {
+        case COST_NONE:
+            break;
+        case COST_TIME:
+            cm->cost[idx] = omp_get_wtime() - start;
+            break;
+        case COST_STEPS:
+            cm->cost[idx] = Hittable_steps() - start;
+            break;
+        default:
+            assert(0 && "unreachable");
+    }
+
+    return radiance;
+}
+
+// Renders a tile by tracing all of its paths together, sorted before every
+// bounce. Costs are only known for the whole tile, so every pixel is
+// charged the same share of it.
+// @param scene The scene to render.
+// @param rays The camera rays of the tile.
+// @param tile The tile.
+// @param frame The output. Only the features are written.
+// @param local Where to store the radiance of the tile's pixels, row-major.
+// @param cm Where to record the cost. Can be NULL.
+// @param scratch The buffers to trace in.
+// @param seed The seed pointer for the random number generator.
+// @see Scn_trace_sorted
+static void render_sorted(const Scene* scene,
+                          const RayBatch* rays,
+                          Tile tile,
+                          Frame frame,
+                          Vector* local,
+                          CostMap* cm,
+                          SortScratch* scratch,
+                          unsigned* seed) {
+    CostMetric metric = cm ? cm->metric : COST_NONE;
+    double start = (metric == COST_TIME)    ? omp_get_wtime()
+                   : (metric == COST_STEPS) ? Hittable_steps()
+                                            : 0;
+
+    int tw = tile.x1 - tile.x0;
+    int size = tw * (tile.y1 - tile.y0);
+    Aov* aov = frame.aov ? malloc(size * sizeof(Aov)) : NULL;
+    Scn_trace_sorted(scene, rays, scene->cfg.samples, scratch, seed, local,
+                     aov);
+
+    double cost = (metric == COST_TIME)    ? omp_get_wtime() - start
+                  : (metric == COST_STEPS) ? Hittable_steps() - start
+                                           : 0;
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            int k = (y - tile.y0) * tw + (x - tile.x0);
+            if (aov) {
+                frame.aov[y * frame.width + x] = aov[k];
+            }
+            if (metric != COST_NONE) {
+                cm->cost[y * frame.width + x] = cost / size;
+            }
+        }
+    }
+    free(aov);
+}
+
+void Rnd_render(Scene scene,
+                TileList tl,
+                Frame frame,
+                CostMap* cm,
+                unsigned seed) {
+    Rnd_render_notify(scene, tl, frame, cm, seed, NULL, NULL);
+}
+
+void Rnd_render_notify(Scene scene,
+                       TileList tl,
+                       Frame frame,
+                       CostMap* cm,
+                       unsigned seed,
+                       TileDone done,
+                       void* user) {
+    Rnd_render_replicas(&scene, NULL, NULL, tl, frame, cm, NULL, 0, seed, done,
+                        user);
+}
+
+// A render in progress.
+typedef struct _RenderJob {
+    // The scene on every node.
+    const Scene* replicas;
+    // The topology that replicas are indexed by. Can be NULL.
+    const Topology* topo;
+    // The tiles to render.
+    TileList tl;
+    // The output.
+    Frame frame;
+    // Where to record per-pixel costs. Can be NULL.
+    CostMap* cm;
+    // The first hits of the camera rays. Can be NULL.
+    const GBuffer* primary;
+    // The index of the first position of primary that every pixel uses.
+    int position;
+    // The seed of the frame.
+    unsigned seed;
+    // The camera, prepared once for the whole frame.
+    Lens lens;
+    // Called when a tile is finished. Can be NULL.
+    TileDone done;
+    // Passed to done.
+    void* user;
+    // One tile buffer per thread. A tile is rendered into a buffer that only
+    // its thread touches, so it lives on the thread's node, and copied out
+    // once finished.
+    Vector** locals;
+    // The capacity of every buffer.
+    int* capacities;
+    // One batch of camera rays per thread, for a tile at a time.
+    RayBatch* rays;
+    // The buffers of sorted traces, one per thread. Made by the thread's
+    // first sorted tile.
+    SortScratch** scratch;
+} _RenderJob;
+
+// Renders one tile of a job.
+// @param arg The _RenderJob.
+// @param index The index of the tile.
+// @param thread The index of the calling thread.
+static void render_tile(void* arg, int index, int thread) {
+    _RenderJob* job = arg;
+    Frame frame = job->frame;
+    int width = frame.width;
+
+    Tile tile = job->tl.list[index];
+    const Scene* scene =
+        job->replicas + (job->topo ? Topo_current(*job->topo) : 0);
+    unsigned ts = Tile_seed(tile, width, job->seed);
+
+    int tw = tile.x1 - tile.x0;
+    int size = tw * (tile.y1 - tile.y0);
+    if (size > job->capacities[thread]) {
+        job->capacities[thread] = size;
+        job->locals[thread] =
+            realloc(job->locals[thread], size * sizeof(Vector));
+    }
+    Vector* local = job->locals[thread];
+
+    // All camera rays of the tile are generated at once, then traced.
+    int samples = scene->cfg.samples;
+    RayBatch* rays = job->rays + thread;
+    if (!job->primary) {
+        RayBatch_reserve(rays, size * samples);
+        Lens_rays(&job->lens, tile.x0, tile.y0, tile.x1, tile.y1, samples,
+                  &ts, rays);
+        Hittable_prefetch(scene->hittable, rays);
+    }
+
+    if (scene->reorder && !job->primary) {
+        if (!job->scratch[thread]) {
+            job->scratch[thread] = SortScratch_make();
+        }
+        render_sorted(scene, rays, tile, frame, local, job->cm,
+                      job->scratch[thread], &ts);
+    } else {
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                int k = (y - tile.y0) * tw + (x - tile.x0);
+                local[k] =
+                    render_px(scene, rays, k * samples, job->primary,
+                              job->position, frame, x, y, job->cm, &ts);
+            }
+        }
+    }
+
+    for (int y = tile.y0; y < tile.y1; ++y) {
+        for (int x = tile.x0; x < tile.x1; ++x) {
+            Vector c = local[(y - tile.y0) * tw + (x - tile.x0)];
+            frame.radiance[y * width + x] = c;
+            frame.image[y * width + x] = Vec_2Px(c);
+        }
+    }
+
+    if (job->done) {
+        job->done(job->user, tile, frame);
+    }
+}
+
+void Rnd_render_replicas(const Scene* replicas,
+                         const Topology* topo,
+                         Pool* pool,
+                         TileList tl,
+                         Frame frame,
+                         CostMap* cm,
+                         const GBuffer* primary,
+                         int position,
+                         unsigned seed,
+                         TileDone done,
+                         void* user) {
+    assert(frame.width == replicas[0].cfg.width);
+    assert(frame.height == replicas[0].cfg.height);
+    assert(!primary || GBuf_matches(primary, replicas));
+
+    Pool* own = pool ? NULL : Pool_make(omp_get_max_threads());
+    pool = pool ? pool : own;
+    int threads = Pool_threads(pool);
+
+    _RenderJob job = {
+        .replicas = replicas,
+        .topo = topo,
+        .tl = tl,
+        .frame = frame,
+        .cm = cm,
+        .primary = primary,
+        .position = position,
+        .seed = seed,
+        .lens = Lens_make(replicas[0].cam, frame.width, frame.height),
+        .done = done,
+        .user = user,
+        .locals = calloc(threads, sizeof(Vector*)),
+        .capacities = calloc(threads, sizeof(int)),
+        .rays = calloc(threads, sizeof(RayBatch)),
+        .scratch = calloc(threads, sizeof(SortScratch*)),
+    };
+
+    // Threads start with the tiles listed first, and steal the ones listed
+    // last, so expensive tiles listed first don't end up as stragglers at
+    // the end of the frame.
+    Pool_for(pool, tl.length, render_tile, &job);
+
+    for (int i = 0; i < threads; ++i) {
+        free(job.locals[i]);
+        RayBatch_free(job.rays + i);
+        if (job.scratch[i]) {
+            SortScratch_free(job.scratch[i]);
+        }
+    }
+    free(job.locals);
+    free(job.capacities);
+    free(job.rays);
+    free(job.scratch);
+    if (own) {
+        Pool_free(own);
+    }
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "gbuffer.h"
+#include "numa.h"
+#include "pixel.h"
+#include "pool.h"
+#include "scene.h"
+
+// What is measured as the cost of rendering a pixel.
+typedef enum CostMetric {
+    // Nothing is recorded.
+    COST_NONE = 0,
+    // Wall-clock seconds spent in Scn_color.
+    COST_TIME,
+    // Number of acceleration structure nodes and primitives visited.
+    COST_STEPS,
+} CostMetric;
+
+// CostMap stores the cost of rendering each pixel of an image.
+// @author RenTrueWang
+typedef struct CostMap {
+    // Row-major costs, one per pixel. cost[y * width + x].
+    double* cost;
+    // The width of the image.
+    int width;
+    // The height of the image.
+    int height;
+    // What the costs mean.
+    CostMetric metric;
+} CostMap;
+
+// Creates a new cost map. All costs are initialized to 0.
+// @param width The width of the image.
+// @param height The height of the image.
+// @param metric What to record.
+// @return A new CostMap.
+CostMap CostMap_make(int width, int height, CostMetric metric);
+
+// Free the resources controlled by CostMap.
+// @param cm CostMap to free.
+// @see free
+void CostMap_free(CostMap* cm);
+
+// Writes the cost map as a heatmap image in the binary PPM format. Cheap
+// pixels are dark blue, expensive pixels are bright red.
+// @param cm The cost map to write.
+// @param path The file to write to.
+// @return True if the file is written successfully.
+bool CostMap_write_heatmap(CostMap cm, const char* path);
+
+// Frame holds the per-pixel outputs of a render. Every buffer is row-major,
+// with width * height elements.
+// @author RenTrueWang
+typedef struct Frame {
+    // The width of the image.
+    int width;
+    // The height of the image.
+    int height;
+    // The pixels to display.
+    Pixel* image;
+    // The radiance that the pixels are converted from.
+    Vector* radiance;
+    // The features of the first hits. NULL if they are not recorded.
+    Aov* aov;
+} Frame;
+
+// Creates a new frame.
+// @param width The width of the image.
+// @param height The height of the image.
+// @param features Whether the features of the first hits are recorded.
+// @return A new Frame.
+Frame Frame_make(int width, int height, bool features);
+
+// Free the resources controlled by Frame.
+// @param frame Frame to free.
+// @see free
+void Frame_free(Frame* frame);
+
+// A tile is a rectangular region of the image, rendered as one unit of work.
+// @author RenTrueWang
+typedef struct Tile {
+    // The lower corner, inclusive.
+    int x0, y0;
+    // The upper corner, exclusive.
+    int x1, y1;
+    // The estimated cost of rendering the tile.
+    double cost;
+} Tile;
+
+// TileList stores all tiles that cover an image, in dispatch order.
+// @author RenTrueWang
+typedef struct TileList {
+    // An array of tiles.
+    Tile* list;
+    // The length of the array.
+    int length;
+} TileList;
+
+// Splits an image into square tiles, in scanline order.
+// @param width The width of the image.
+// @param height The height of the image.
+// @param size The side length of a tile. Tiles on the border may be smaller.
+// @return A new TileList.
+TileList TileList_make(int width, int height, int size);
+
+// Splits a region of an image into square tiles, in scanline order. Tiles
+// are aligned to the region's lower corner.
+// @param region The region to split. Its cost is ignored.
+// @param size The side length of a tile. Tiles on the border may be smaller.
+// @return A new TileList.
+TileList TileList_region(Tile region, int size);
+
+// Free the resources controlled by TileList.
+// @param tl TileList to free.
+// @see free
+void TileList_free(TileList* tl);
+
+// The seed of a tile. It depends on the tile's position only, not on the
+// thread, process or order that renders it, so every renderer produces the
+// same image.
+// @param tile The tile to seed.
+// @param width The width of the image.
+// @param seed The seed of the frame.
+// @return The seed for the first pixel of the tile.
+unsigned Tile_seed(Tile tile, int width, unsigned seed);
+
+// Updates the cost of each tile from a cost map, and reorders the tiles such
+// that the most expensive tiles are dispatched first (longest-job-first).
+// @param tl TileList to reorder.
+// @param cm The cost map measured by a previous pass or frame.
+void TileList_sort_cost(TileList* tl, CostMap cm);
+
+// Called every time a tile is finished. It is called from the thread that
+// rendered the tile, so calls for different tiles may be concurrent.
+// @param user The pointer given to the renderer.
+// @param tile The finished tile.
+// @param frame The output. Only the pixels inside tile are final.
+typedef void (*TileDone)(void* user, Tile tile, Frame frame);
+
+// Renders the tiles of a scene in the order they are listed. Tiles are dealt
+// round-robin to the threads, which start with the first of theirs, and idle
+// threads steal the last ones of the others, so expensive tiles listed first
+// do not end up as stragglers at the end of the frame.
+// @param scene The scene to render.
+// @param tl The tiles to render.
+// @param frame The output. The same size as the scene's image.
+// @param cm Where to record per-pixel costs. Can be NULL.
+// @param seed The seed of the frame. Every tile derives its own seed from it.
+void Rnd_render(Scene scene,
+                TileList tl,
+                Frame frame,
+                CostMap* cm,
+                unsigned seed);
+
+// Renders like Rnd_render, and reports every tile as soon as it is finished.
+// @param scene The scene to render.
+// @param tl The tiles to render.
+// @param frame The output. The same size as the scene's image.
+// @param cm Where to record per-pixel costs. Can be NULL.
+// @param seed The seed of the frame. Every tile derives its own seed from it.
+// @param done Called when a tile is finished. Can be NULL.
+// @param user Passed to done.
+// @see Rnd_render
+void Rnd_render_notify(Scene scene,
+                       TileList tl,
+                       Frame frame,
+                       CostMap* cm,
+                       unsigned seed,
+                       TileDone done,
+                       void* user);
+
+// Renders like Rnd_render_notify, with a copy of the scene on every NUMA
+// node. Every tile is traced through the copy on the node of the thread that
+// renders it, so no thread reads another node's memory. The copies must be
+// identical, or the image depends on which thread rendered which tile.
+// @param replicas The scene on every node, indexed by node.
+// @param topo The topology that replicas are indexed by. NULL if there is
+// only one replica.
+// @param pool The scheduler to run on, which keeps the statistics. NULL
+// schedules on a temporary one.
+// @param tl The tiles to render.
+// @param frame The output. The same size as the scene's image.
+// @param cm Where to record per-pixel costs. Can be NULL.
+// @param primary The first hits of the camera rays, which are then not
+// traced. Must match the scene. NULL traces camera rays.
+// @param position The index of the first position of primary that every
+// pixel uses, so that passes can use different positions. Positions wrap
+// around. Ignored without primary.
+// @param seed The seed of the frame. Every tile derives its own seed from it.
+// @param done Called when a tile is finished. Can be NULL.
+// @param user Passed to done.
+// @see Rnd_render_notify
+void Rnd_render_replicas(const Scene* replicas,
+                         const Topology* topo,
+                         Pool* pool,
+                         TileList tl,
+                         Frame frame,
+                         CostMap* cm,
+                         const GBuffer* primary,
+                         int position,
+                         unsigned seed,
+                         TileDone done,
+                         void* user);
@@ -1,10 +1,48 @@
 #include "scene.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "guide.h"
+#include "irradiance.h"
 #include "macro.h"
 #include "material.h"
+#include "object.h"
+#include "photon.h"
+
+// The highest survival probability of RR_THROUGHPUT.
+#define RR_CAP .95
+
+// The part of the way to a light that a shadow ray checks for blockers. Just
+// short of 1, so that the light itself doesn't count.
+#define SHADOW_SPAN (1. - 1e-9)
+
+// The probability that a guided diffuse bounce samples the guide rather than
+// the BSDF.
+#define GUIDE_MIX .3
+
+// The most diffuse bounces of a path that teach the guide.
+#define GUIDE_VERTICES 16
+
+// Bits per axis of the origins of rays in their sort keys.
+#define SORT_ORIGIN_BITS 10
+
+// Bits per axis of the octahedral directions of rays in their sort keys.
+#define SORT_TOWARDS_BITS 6
+
+// Bits of a sort key.
+#define SORT_KEY_BITS (3 * SORT_ORIGIN_BITS + 2 * SORT_TOWARDS_BITS)
+
+// Bits of the digits that sort keys are sorted by.
+#define SORT_DIGIT_BITS 8
+
+// Number of kinds of materials that scatter, and that the hits of sorted
+// paths are batched by. Every kind before MAT_EMISSIVE scatters.
+#define SORT_BATCHES MAT_EMISSIVE
 
 // SceneHit is the implementation of hit for Scene.
 // @see Hittable
@@ -13,6 +51,16 @@ static HitData Scn_hit(const void* sc, Vector source, Vector towards) {
     return Hittable_hit(scene->hittable, source, towards);
 }
 
+// SceneOccluded is the implementation of occluded for Scene.
+// @see Hittable
+static bool Scn_occluded(const void* sc,
+                         Vector source,
+                         Vector towards,
+                         double t_max) {
+    const Scene* scene = sc;
+    return Hittable_occluded(scene->hittable, source, towards, t_max);
+}
+
 // SceneBounds is the implementation of bounds for Scene.
 // @see Hittable
 static Box Scn_bounds(const void* sc) {
@@ -20,69 +68,990 @@ static Box Scn_bounds(const void* sc) {
     return Hittable_bounds(scene->hittable);
 }
 
+// ScenePrefetch is the implementation of prefetch for Scene.
+// @see Hittable
+static void Scn_prefetch(const void* sc, const struct RayBatch* rays) {
+    const Scene* scene = sc;
+    Hittable_prefetch(scene->hittable, rays);
+}
+
 Hittable Scn_Hittable(const Scene* scene) {
-    return (Hittable){.object = scene, .hit = Scn_hit, .bounds = Scn_bounds};
+    return (Hittable){
+        .object = scene,
+        .hit = Scn_hit,
+        .occluded = Scn_occluded,
+        .bounds = Scn_bounds,
+        .prefetch = Scn_prefetch,
+    };
+}
+
+// Survival probability of Russian roulette.
+// @param cfg The configuration that holds the policy.
+// @param color The throughput of the path so far.
+// @return The probability that the path continues. In the range [0, 1].
+static double survival(ImgProp cfg, Vector color) {
+    switch (cfg.rr_policy) {
+        case RR_NONE:
+            return 1.;
+        case RR_FIXED:
+            return cfg.rr_prob;
+        case RR_THROUGHPUT: {
+            double p = color.x;
+            p = (color.y > p) ? color.y : p;
+            p = (color.z > p) ? color.z : p;
+            // Glass and mirrors keep the throughput near 1, so the
+            // probability is capped to also terminate those paths.
+            p = (p > RR_CAP) ? RR_CAP : p;
+            return (p < cfg.rr_prob) ? cfg.rr_prob : p;
+        }
+        default:
+            assert(0 && "unreachable");
+    }
+}
+
+// The power heuristic for multiple importance sampling.
+// @param pdf The density of the strategy that produced the sample.
+// @param other The density of the other strategy for the same sample.
+// @return The weight of the sample.
+static double power_heuristic(double pdf, double other) {
+    double sq = pdf * pdf;
+    double other_sq = other * other;
+    return (sq + other_sq) ? sq / (sq + other_sq) : 0;
+}
+
+// The density that a diffuse bounce samples a direction with.
+// @param cell The guide's cell at the bounce. NULL if it isn't guided.
+// @param towards The unit direction.
+// @param cos The cosine between towards and the normal.
+// @return The density, per unit solid angle.
+static double diffuse_pdf(const GuideCell* cell, Vector towards, double cos) {
+    double bsdf_pdf = (cos > 0) ? cos / M_PI : 0;
+    if (!cell) {
+        return bsdf_pdf;
+    }
+    double guide_pdf = GuideCell_pdf(cell, towards);
+    return GUIDE_MIX * guide_pdf + (1 - GUIDE_MIX) * bsdf_pdf;
+}
+
+// Samples a light directly from a diffuse hit (next event estimation).
+// @param scene The scene, with lights.
+// @param hd The diffuse hit.
+// @param cell The guide's cell at the hit. NULL if it isn't guided.
+// @param seed The seed pointer for the random number generator.
+// @return The radiance reflected from the light, weighted for combination
+// with BSDF sampling.
+static Vector direct(const Scene* scene,
+                     HitData hd,
+                     const GuideCell* cell,
+                     unsigned* seed) {
+    Vector un = Vec_unit(hd.normal);
+    LightSample ls = LightSampler_sample(scene->lights, hd.point, un, seed);
+    if (!ls.light || !ls.pdf) {
+        return Vec_o();
+    }
+
+    double cos = Vec_dot(ls.towards, un);
+    if (cos <= 0) {
+        return Vec_o();
+    }
+
+    // Shadow ray. The light is visible only if nothing is in front of it.
+    // Only blockers matter, so the scene is asked for any hit, not the
+    // closest one.
+    HitData lh = Hittable_hit(Sph_Hittable(ls.light), hd.point, ls.towards);
+    if (!HitData_has_hit(lh) ||
+        Hittable_occluded(scene->hittable, hd.point, ls.towards,
+                          lh.t * SHADOW_SPAN)) {
+        return Vec_o();
+    }
+
+    // Lambertian BSDF is albedo / pi, and Matte samples with cos / pi.
+    double bsdf_pdf = diffuse_pdf(cell, ls.towards, cos);
+    double weight = power_heuristic(ls.pdf, bsdf_pdf);
+    double scale = cos / M_PI * weight / ls.pdf;
+
+    Vector le = Mat_emitted(ls.light->mat);
+    return Vec_mul(Vec_mul_s(Mat_albedo(hd.mat), scale), le);
+}
+
+Vector Scn_sky(Vector towards) {
+    double t = .5 * (Vec_unit(towards).y + 1.);
+    return Vec_add(Vec_from(1. - t), (Vector){.5 * t, .7 * t, t});
+}
+
+Vector Scn_trace(const Scene* scene,
+                 Vector source,
+                 Vector towards,
+                 unsigned* seed) {
+    return Scn_trace_aov(scene, source, towards, seed, NULL);
+}
+
+// Records the features of the first hit of a camera ray.
+// @param aov Where to record. Can be NULL.
+// @param hd The first hit.
+// @param source The source of the camera ray.
+static void record_aov(Aov* aov, HitData hd, Vector source) {
+    if (!aov) {
+        return;
+    }
+
+    if (!HitData_has_hit(hd)) {
+        *aov = (Aov){.albedo = Vec_from(1.), .normal = Vec_o()};
+        aov->depth = INFINITY;
+        return;
+    }
+
+    bool emissive = hd.mat.kind == MAT_EMISSIVE;
+    *aov = (Aov){
+        .albedo = emissive ? Vec_from(1.) : Mat_albedo(hd.mat),
+        .normal = Vec_unit(hd.normal),
+        .depth = Vec_len(Vec_sub(hd.point, source)),
+    };
+}
+
+// Where a path starts.
+typedef struct _Path {
+    // The source of the first ray.
+    Vector source;
+    // The direction of the first ray.
+    Vector towards;
+    // The first hit of the ray, if known. Can be NULL.
+    const HitData* first;
+    // The bounce that the first ray leaves from. 0 for camera rays.
+    int bounce;
+    // The density of the BSDF sample that created the first ray. 0 if light
+    // sampling can't create it.
+    double bsdf_pdf;
+    // The unit normal that the first ray was scattered at.
+    Vector normal;
+    // Whether the first diffuse hit takes its indirect light from the
+    // scene's irradiance cache.
+    bool cached;
+    // Whether the first ray was scattered by a diffuse surface.
+    bool diffuse;
+} _Path;
+
+// A diffuse hit whose hemisphere is swept for the irradiance cache.
+typedef struct _Sweep {
+    // The scene.
+    const Scene* scene;
+    // The bounce of the hit.
+    int bounce;
+    // The unit normal at the hit.
+    Vector normal;
+} _Sweep;
+
+// A diffuse bounce that teaches the guide the radiance it finds.
+typedef struct _Vertex {
+    // The guide's cell at the bounce.
+    GuideCell* cell;
+    // Where the bounce is.
+    Vector point;
+    // The unit direction the bounce sampled.
+    Vector towards;
+    // The cosine between towards and the normal, over the density that
+    // towards was sampled with.
+    double weight;
+    // The throughput of the path after the bounce.
+    Vector throughput;
+    // The radiance the path collected before the bounce.
+    Vector radiance;
+} _Vertex;
+
+// The diffuse bounces of a path that teach the guide.
+typedef struct _Vertices {
+    // Number of bounces.
+    int length;
+    // The bounces.
+    _Vertex at[GUIDE_VERTICES];
+} _Vertices;
+
+static Vector trace(const Scene* scene, _Path path, unsigned* seed, Aov* aov);
+
+// Traces a direction of a sweep. Paths traced for the cache don't use it
+// themselves. Lights they hit are weighted as if the direction was sampled
+// from the BSDF, so that they complement direct() at the swept hit.
+// @see IrrSample
+static Vector sweep(const void* user,
+                    Vector source,
+                    Vector towards,
+                    double* distance,
+                    unsigned* seed) {
+    const _Sweep* from = user;
+    HitData hd = Hittable_hit(Scn_Hittable(from->scene), source, towards);
+    *distance = HitData_has_hit(hd) ? hd.t : INFINITY;
+
+    // towards is a unit vector.
+    double cos = Vec_dot(towards, from->normal);
+    _Path path = {
+        .source = source,
+        .towards = towards,
+        .first = &hd,
+        .bounce = from->bounce + 1,
+        .bsdf_pdf = (cos > 0) ? cos / M_PI : 0,
+        .normal = from->normal,
+        .cached = false,
+        .diffuse = true,
+    };
+    return trace(from->scene, path, seed, NULL);
+}
+
+// A path being traced.
+typedef struct _Walk {
+    // The source of the current ray.
+    Vector source;
+    // The direction of the current ray.
+    Vector towards;
+    // The throughput of the path.
+    Vector color;
+    // The radiance collected from the sky and lights along the path.
+    Vector radiance;
+    // The density of the BSDF sample that created the current ray. 0 if light
+    // sampling can't create the ray (camera rays and specular bounces).
+    double bsdf_pdf;
+    // The unit normal where the current ray is scattered.
+    Vector normal;
+    // Whether the current ray has only passed through glass since it was
+    // scattered by a diffuse surface, and whether it was last scattered by
+    // glass. The scene's photons bring the light that rays with both find.
+    bool diffused, glassy;
+} _Walk;
+
+// Starts tracing a path.
+// @param path Where the path starts.
+// @return The path before its first hit.
+static _Walk walk_start(_Path path) {
+    return (_Walk){
+        .source = path.source,
+        .towards = path.towards,
+        .color = Vec_from(1.),
+        .radiance = Vec_o(),
+        .bsdf_pdf = path.bsdf_pdf,
+        .normal = path.normal,
+        .diffused = path.diffuse,
+        .glassy = false,
+    };
+}
+
+// How the guide takes part in scattering a path at a diffuse hit.
+typedef struct _Shade {
+    // The guide's cell at the hit. NULL if the hit doesn't teach the guide.
+    GuideCell* cell;
+    // The cell, if it has learned enough to sample from. NULL otherwise.
+    const GuideCell* guided;
+} _Shade;
+
+// Collects the light at a hit of a path, before the path is scattered.
+// @param scene The scene to track.
+// @param w The path, whose current ray is the one that made the hit.
+// @param hd The hit. May be a miss.
+// @param d The bounce of the hit.
+// @param cached Whether the hit takes its indirect light from the scene's
+// irradiance cache if it is diffuse.
+// @param teaching Whether the path teaches the scene's guide.
+// @param seed The seed pointer for the random number generator.
+// @param shade Where to store how the guide takes part in the scattering.
+// @return False if the path ends here.
+static bool collect(const Scene* scene,
+                    _Walk* w,
+                    HitData hd,
+                    int d,
+                    bool cached,
+                    bool teaching,
+                    unsigned* seed,
+                    _Shade* shade) {
+    if (!HitData_has_hit(hd)) {
+        // The ray does not hit anything. Display the sky's color.
+        if (!(scene->photons && w->diffused && w->glassy)) {
+            Vec_iadd(&w->radiance, Vec_mul(w->color, Scn_sky(w->towards)));
+        }
+        return false;
+    }
+
+    Material mat = hd.mat;
+
+    bool caustic = scene->photons && w->diffused && w->glassy;
+    if (mat.kind == MAT_EMISSIVE) {
+        if (caustic) {
+            return false;
+        }
+        // Lights absorb, so the path ends here. If light sampling at the
+        // previous hit could also have found this light, the two estimates
+        // are combined with multiple importance sampling.
+        double weight = 1.;
+        if (w->bsdf_pdf && !LightSampler_is_null(scene->lights)) {
+            double light_pdf = LightSampler_pdf(scene->lights, hd.object,
+                                                w->source, w->normal);
+            weight = power_heuristic(w->bsdf_pdf, light_pdf);
+        }
+        Vector le = Vec_mul_s(Mat_emitted(mat), weight);
+        Vec_iadd(&w->radiance, Vec_mul(w->color, le));
+        return false;
+    }
+
+    bool diffuse = mat.kind == MAT_MATTE;
+    bool cache = diffuse && cached && scene->irradiance;
+
+    // Cells that haven't learned anything yet are still taught.
+    *shade = (_Shade){.cell = NULL, .guided = NULL};
+    if (diffuse && teaching && !cache) {
+        shade->cell = Guide_cell(scene->guide, hd.point);
+        shade->guided = GuideCell_trained(shade->cell) ? shade->cell : NULL;
+    }
+
+    if (diffuse && !LightSampler_is_null(scene->lights)) {
+        Vector ld = direct(scene, hd, shade->guided, seed);
+        Vec_iadd(&w->radiance, Vec_mul(w->color, ld));
+    }
+
+    if (diffuse && scene->photons) {
+        Vector e = PhotonMap_gather(scene->photons, hd.point,
+                                    Vec_unit(hd.normal));
+        Vector lc = Vec_mul_s(Mat_albedo(mat), 1. / M_PI);
+        Vec_iadd(&w->radiance, Vec_mul(w->color, Vec_mul(lc, e)));
+    }
+
+    if (cache) {
+        // The indirect light is interpolated from the cache instead of
+        // traced, which ends the path.
+        if (d + 1 < scene->cfg.depth) {
+            _Sweep from = {scene, d, Vec_unit(hd.normal)};
+            Vector e = IrrCache_get(scene->irradiance, hd.point, from.normal,
+                                    sweep, &from, seed);
+            Vector ld = Vec_mul(Mat_albedo(mat), e);
+            Vec_iadd(&w->radiance, Vec_mul(w->color, ld));
+        }
+        return false;
+    }
+    return true;
+}
+
+// Scatters a path on from a hit whose light is collected.
+// @param scene The scene to track.
+// @param w The path, whose current ray is the one that made the hit.
+// @param hd The hit.
+// @param d The bounce of the hit.
+// @param shade How the guide takes part in the scattering.
+// @param reflected The direction that the path is scattered to.
+// @param albedo The albedo of the material of the hit.
+// @param seed The seed pointer for the random number generator.
+// @param taught Where to note the bounces. NULL if the scene isn't guided.
+// @return False if the path ends here.
+static bool scatter_on(const Scene* scene,
+                       _Walk* w,
+                       HitData hd,
+                       int d,
+                       _Shade shade,
+                       Vector reflected,
+                       Vector albedo,
+                       unsigned* seed,
+                       _Vertices* taught) {
+    MatKind kind = hd.mat.kind;
+    bool diffuse = kind == MAT_MATTE;
+    const GuideCell* guided = shade.guided;
+
+    // If hit, update the (source, direction).
+    Vec_imul(&w->color, albedo);
+    w->source = hd.point;
+    w->towards = reflected;
+    w->normal = Vec_unit(hd.normal);
+    w->diffused = diffuse || (w->diffused && kind == MAT_GLASS);
+    w->glassy = kind == MAT_GLASS;
+
+    if (diffuse) {
+        Vector unit = Vec_unit(reflected);
+        double cos = Vec_dot(unit, w->normal);
+        w->bsdf_pdf = diffuse_pdf(guided, unit, cos);
+        if (guided) {
+            // The guide may sample below the surface, where the BSDF is 0.
+            if (cos <= 0) {
+                return false;
+            }
+            Vec_imul_s(&w->color, cos / M_PI / w->bsdf_pdf);
+        }
+        if (shade.cell && w->bsdf_pdf && taught->length < GUIDE_VERTICES) {
+            taught->at[taught->length++] = (_Vertex){
+                .cell = shade.cell,
+                .point = w->source,
+                .towards = unit,
+                .weight = cos / w->bsdf_pdf,
+                .throughput = w->color,
+                .radiance = w->radiance,
+            };
+        }
+    } else {
+        w->bsdf_pdf = 0;
+    }
+
+    if (d + 1 >= scene->cfg.rr_depth) {
+        // Russian roulette. Surviving paths are weighted by the inverse of
+        // the probability to keep the estimate unbiased.
+        double p = survival(scene->cfg, w->color);
+        if (p < 1.) {
+            if (genfloat(seed) >= p) {
+                return false;
+            }
+            Vec_idiv_s(&w->color, p);
+        }
+    }
+    return true;
 }
 
-Vector Scn_trace(Scene scene, Vector source, Vector towards, unsigned* seed) {
-    Vector color = Vec_from(1.);
-    Hittable sh = Scn_Hittable(&scene);
+// Collects the light at a hit of a path, and scatters the path on.
+// @param scene The scene to track.
+// @param w The path, whose current ray is the one that made the hit.
+// @param hd The hit. May be a miss.
+// @param d The bounce of the hit.
+// @param cached Whether the hit takes its indirect light from the scene's
+// irradiance cache if it is diffuse.
+// @param seed The seed pointer for the random number generator.
+// @param taught Where to note the bounces. NULL if the scene isn't guided.
+// @return False if the path ends here.
+static bool bounce(const Scene* scene,
+                   _Walk* w,
+                   HitData hd,
+                   int d,
+                   bool cached,
+                   unsigned* seed,
+                   _Vertices* taught) {
+    _Shade shade;
+    if (!collect(scene, w, hd, d, cached, taught != NULL, seed, &shade)) {
+        return false;
+    }
+
+    Material mat = hd.mat;
+    Vector reflected;
+    if (shade.guided && genfloat(seed) < GUIDE_MIX) {
+        reflected = GuideCell_sample(shade.guided, seed);
+    } else {
+        reflected = Mat_scatter(mat, w->towards, hd.normal, seed);
+    }
+    return scatter_on(scene, w, hd, d, shade, reflected, Mat_albedo(mat), seed,
+                      taught);
+}
+
+// Tracks the color of a path, and notes its diffuse bounces for the guide.
+// @param scene The scene to track.
+// @param path Where the path starts.
+// @param seed The seed pointer for the random number generator.
+// @param aov Where to record the features of the first hit. Can be NULL.
+// @param taught Where to note the bounces. NULL if the scene isn't guided.
+// @return The resulting color from the reflections
+static Vector walk(const Scene* scene,
+                   _Path path,
+                   unsigned* seed,
+                   Aov* aov,
+                   _Vertices* taught) {
+    _Walk w = walk_start(path);
+    Hittable sh = Scn_Hittable(scene);
+
+    for (int d = path.bounce; d < scene->cfg.depth; ++d) {
+        bool start = d == path.bounce;
+        HitData hd = (start && path.first)
+                         ? *path.first
+                         : Hittable_hit(sh, w.source, w.towards);
+        if (start) {
+            record_aov(aov, hd, w.source);
+        }
+        if (!bounce(scene, &w, hd, d, path.cached, seed, taught)) {
+            break;
+        }
+    }
+    // A path that bounces too many times collects nothing more, because it
+    // has mixed in so many colors during its bounces.
+    return w.radiance;
+}
+
+// Teaches the guide the radiance that a path found after every diffuse
+// bounce.
+// @param taught The bounces.
+// @param radiance The radiance of the whole path.
+static void teach(const _Vertices* taught, Vector radiance) {
+    for (int i = 0; i < taught->length; ++i) {
+        const _Vertex* v = taught->at + i;
+        Vector found = Vec_sub(radiance, v->radiance);
+        double f[3] = {found.x, found.y, found.z};
+        double t[3] = {v->throughput.x, v->throughput.y, v->throughput.z};
+
+        // The radiance arriving at the bounce is what the path found after
+        // it, without the throughput up to it. The guide learns it weighted
+        // by the cosine, which is what the surface reflects.
+        double incident = 0;
+        int channels = 0;
+        for (int c = 0; c < 3; ++c) {
+            if (t[c] > 0) {
+                incident += f[c] / t[c];
+                ++channels;
+            }
+        }
+        if (channels) {
+            double value = incident / channels * v->weight;
+            GuideCell_splat(v->cell, v->point, v->towards, value);
+        }
+    }
+}
+
+// Tracks the color of a path, and teaches the scene's guide from it.
+// @param scene The scene to track.
+// @param path Where the path starts.
+// @param seed The seed pointer for the random number generator.
+// @param aov Where to record the features of the first hit. Can be NULL.
+// @return The resulting color from the reflections
+static Vector trace(const Scene* scene, _Path path, unsigned* seed, Aov* aov) {
+    if (!scene->guide) {
+        return walk(scene, path, seed, aov, NULL);
+    }
+    // Only the bounces noted are read, so the rest is left uninitialized.
+    _Vertices taught;
+    taught.length = 0;
+    Vector radiance = walk(scene, path, seed, aov, &taught);
+    teach(&taught, radiance);
+    return radiance;
+}
+
+Vector Scn_trace_aov(const Scene* scene,
+                     Vector source,
+                     Vector towards,
+                     unsigned* seed,
+                     Aov* aov) {
+    _Path path = {.source = source, .towards = towards, .cached = true};
+    return trace(scene, path, seed, aov);
+}
+
+Vector Scn_trace_hit(const Scene* scene,
+                     Vector source,
+                     Vector towards,
+                     HitData first,
+                     unsigned* seed,
+                     Aov* aov) {
+    _Path path = {
+        .source = source,
+        .towards = towards,
+        .first = &first,
+        .cached = true,
+    };
+    return trace(scene, path, seed, aov);
+}
+
+// A ray to sort, by its sort key.
+typedef struct _SortKey {
+    // The sort key.
+    uint64_t key;
+    // The index of the path of the ray.
+    int index;
+} _SortKey;
+
+// Spreads the bits of a number, so that the interleaved bits of other
+// numbers fit in between.
+// @param n The number.
+// @param bits Number of bits of n.
+// @param gap Number of bits left in between.
+// @return The spread number.
+static uint64_t spread(unsigned n, int bits, int gap) {
+    uint64_t out = 0;
+    for (int b = 0; b < bits; ++b) {
+        out |= (uint64_t)((n >> b) & 1) << (b * (gap + 1));
+    }
+    return out;
+}
+
+// Quantizes a number in [0, 1].
+// @param f The number. Clamped into [0, 1].
+// @param bits Number of bits to quantize to.
+// @return The quantized number.
+static unsigned quantize(double f, int bits) {
+    double top = (double)((1u << bits) - 1);
+    f = (f < 0) ? 0 : (f > 1) ? 1 : f;
+    return (unsigned)(f * top + .5);
+}
+
+// The sort key of a ray: the Morton code of its origin in the bounds of the
+// scene, then the Morton code of its direction, mapped onto the square by
+// an octahedron. Rays with close keys start close to each other and point
+// the same way, so they traverse the same nodes.
+// @param bounds The bounds of the scene.
+// @param source The source of the ray.
+// @param towards The direction of the ray.
+// @return The key.
+static uint64_t sort_key(Box bounds, Vector source, Vector towards) {
+    Pair axes[3] = {bounds.x, bounds.y, bounds.z};
+    double o[3] = {source.x, source.y, source.z};
+    uint64_t origin = 0;
+    for (int a = 0; a < 3; ++a) {
+        double extent = axes[a].y - axes[a].x;
+        double f = (extent > 0) ? (o[a] - axes[a].x) / extent : 0;
+        unsigned q = quantize(f, SORT_ORIGIN_BITS);
+        origin |= spread(q, SORT_ORIGIN_BITS, 2) << a;
+    }
+
+    double l1 = fabs(towards.x) + fabs(towards.y) + fabs(towards.z);
+    double u = l1 ? towards.x / l1 : 0;
+    double v = l1 ? towards.y / l1 : 0;
+    if (towards.z < 0) {
+        double fu = (1 - fabs(v)) * (u < 0 ? -1 : 1);
+        double fv = (1 - fabs(u)) * (v < 0 ? -1 : 1);
+        u = fu;
+        v = fv;
+    }
+    unsigned qu = quantize((u + 1) / 2, SORT_TOWARDS_BITS);
+    unsigned qv = quantize((v + 1) / 2, SORT_TOWARDS_BITS);
+    uint64_t dir = spread(qu, SORT_TOWARDS_BITS, 1) |
+                   spread(qv, SORT_TOWARDS_BITS, 1) << 1;
+    return origin << (2 * SORT_TOWARDS_BITS) | dir;
+}
+
+// Sorts rays by their keys with a least significant digit radix sort,
+// which is stable and linear in the number of rays.
+// @param keys The rays to sort.
+// @param spare As long as keys, used while sorting.
+// @param length Number of rays.
+static void radix_sort(_SortKey* keys, _SortKey* spare, int length) {
+    enum { RADIX = 1 << SORT_DIGIT_BITS };
+    for (int shift = 0; shift < SORT_KEY_BITS; shift += SORT_DIGIT_BITS) {
+        int count[RADIX + 1] = {0};
+        for (int i = 0; i < length; ++i) {
+            ++count[((keys[i].key >> shift) & (RADIX - 1)) + 1];
+        }
+        for (int r = 0; r < RADIX; ++r) {
+            count[r + 1] += count[r];
+        }
+        for (int i = 0; i < length; ++i) {
+            spare[count[(keys[i].key >> shift) & (RADIX - 1)]++] = keys[i];
+        }
+        memcpy(keys, spare, length * sizeof(_SortKey));
+    }
+}
+
+struct SortScratch {
+    // Number of paths that the buffers below hold.
+    int capacity;
+    // The state of every path.
+    _Walk* walks;
+    // The hit of every path at the current bounce.
+    HitData* hits;
+    // The seed of every path.
+    unsigned* seeds;
+    // The paths still alive, in the order they are traced.
+    _SortKey* keys;
+    // As long as keys, used while sorting.
+    _SortKey* spare;
+    // How every path is scattered at the current bounce.
+    _Shade* shades;
+    // The hits of every material, scattered together.
+    ShadeBatch batches[SORT_BATCHES];
+    // The features of every path. Only grown for renders that record them.
+    Aov* features;
+    // Number of paths that features holds.
+    int nfeatures;
+    // The bounces of every path that teach the guide. Only grown for guided
+    // scenes, as it is by far the largest buffer.
+    _Vertices* taught;
+    // Number of paths that taught holds.
+    int ntaught;
+    // The rays of a bounce, in the order they are traced, for prefetching.
+    RayBatch rays;
+};
+
+SortScratch* SortScratch_make(void) {
+    return calloc(1, sizeof(SortScratch));
+}
 
-    for (int d = 0; d < scene.cfg.depth; ++d) {
-        HitData hd = Hittable_hit(sh, source, towards);
-        if (HitData_has_hit(hd)) {
-            // If hit, update the (source, direction).
-            Material mat = hd.mat;
-            Vector reflected = Mat_scatter(mat, towards, hd.normal, seed);
-            Vec_imul(&color, Mat_albedo(mat));
-            source = hd.point;
-            towards = reflected;
-        } else {
-            // The ray does not hit anything. Display the sky's color.
-            double t = .5 * Vec_unit(towards).y + 1.;
-            Vector bg = Vec_add(Vec_from(1. - t), (Vector){.5 * t, .7 * t, t});
-            return Vec_mul(color, bg);
+void SortScratch_free(SortScratch* scratch) {
+    free(scratch->walks);
+    free(scratch->hits);
+    free(scratch->seeds);
+    free(scratch->keys);
+    free(scratch->spare);
+    free(scratch->shades);
+    for (int m = 0; scratch->capacity && m < SORT_BATCHES; ++m) {
+        ShadeBatch_free(scratch->batches + m);
+    }
+    free(scratch->features);
+    free(scratch->taught);
+    RayBatch_free(&scratch->rays);
+    free(scratch);
+}
+
+// Makes sure the buffers of a scratch hold a number of paths. What they
+// hold is lost if they grow.
+// @param scratch The scratch.
+// @param n Number of paths.
+// @param features Whether features are recorded.
+// @param taught Whether the guide is taught.
+static void scratch_reserve(SortScratch* scratch,
+                            int n,
+                            bool features,
+                            bool taught) {
+    if (n > scratch->capacity) {
+        free(scratch->walks);
+        free(scratch->hits);
+        free(scratch->seeds);
+        free(scratch->keys);
+        free(scratch->spare);
+        free(scratch->shades);
+        scratch->walks = malloc(n * sizeof(_Walk));
+        scratch->hits = malloc(n * sizeof(HitData));
+        scratch->seeds = malloc(n * sizeof(unsigned));
+        scratch->keys = malloc(n * sizeof(_SortKey));
+        scratch->spare = malloc(n * sizeof(_SortKey));
+        scratch->shades = malloc(n * sizeof(_Shade));
+        for (int m = 0; m < SORT_BATCHES; ++m) {
+            if (scratch->capacity) {
+                ShadeBatch_free(scratch->batches + m);
+            }
+            scratch->batches[m] = ShadeBatch_make((MatKind)m, n);
         }
+        scratch->capacity = n;
+    }
+    if (features && n > scratch->nfeatures) {
+        free(scratch->features);
+        scratch->features = malloc(n * sizeof(Aov));
+        scratch->nfeatures = n;
+    }
+    if (taught && n > scratch->ntaught) {
+        free(scratch->taught);
+        scratch->taught = malloc(n * sizeof(_Vertices));
+        scratch->ntaught = n;
     }
-    // This means that the ray bounces too many times. The reason black is used
-    // because the ray has mixed in so many colors during its bounces.
-    return Vec_o();
 }
 
-Pixel Scn_color(Scene scene, int x, int y, unsigned* seed) {
+void Scn_trace_sorted(const Scene* scene,
+                      const RayBatch* rays,
+                      int samples,
+                      SortScratch* scratch,
+                      unsigned* seed,
+                      Vector* radiance,
+                      Aov* aov) {
+    assert(samples > 0);
+    assert(rays->length % samples == 0);
+
+    int n = rays->length;
+    scratch_reserve(scratch, n, aov, scene->guide);
+    _Walk* walks = scratch->walks;
+    HitData* hits = scratch->hits;
+    unsigned* seeds = scratch->seeds;
+    _SortKey* keys = scratch->keys;
+    _SortKey* spare = scratch->spare;
+    Aov* features = aov ? scratch->features : NULL;
+    _Vertices* taught = scene->guide ? scratch->taught : NULL;
+    _Shade* shades = scratch->shades;
+    ShadeBatch* batches = scratch->batches;
+    RayBatch* ahead = &scratch->rays;
+
+    // Every path draws from its own seed, so the order that they are traced
+    // in doesn't change the image.
+    unsigned base = rand_r(seed);
+    for (int k = 0; k < n; ++k) {
+        Vector source = {rays->ox[k], rays->oy[k], rays->oz[k]};
+        Vector towards = {rays->dx[k], rays->dy[k], rays->dz[k]};
+        _Path path = {.source = source, .towards = towards, .cached = true};
+        walks[k] = walk_start(path);
+        seeds[k] = base ^ ((unsigned)k * 2654435761u);
+        keys[k] = (_SortKey){.key = 0, .index = k};
+        if (taught) {
+            taught[k].length = 0;
+        }
+    }
+
+    // Camera rays are coherent already, and prefetched by the caller. Every
+    // later bounce sorts the paths that are still alive, and schedules reads
+    // of what they are about to enter in that order.
+    Hittable sh = Scn_Hittable(scene);
+    Box bounds = Hittable_bounds(sh);
+    int alive = n;
+    for (int d = 0; d < scene->cfg.depth && alive; ++d) {
+        if (d) {
+            for (int i = 0; i < alive; ++i) {
+                const _Walk* w = walks + keys[i].index;
+                keys[i].key = sort_key(bounds, w->source, w->towards);
+            }
+            radix_sort(keys, spare, alive);
+        }
+        if (d && scene->hittable.prefetch) {
+            RayBatch_reserve(ahead, alive);
+            for (int i = 0; i < alive; ++i) {
+                const _Walk* w = walks + keys[i].index;
+                ahead->ox[i] = w->source.x;
+                ahead->oy[i] = w->source.y;
+                ahead->oz[i] = w->source.z;
+                ahead->dx[i] = w->towards.x;
+                ahead->dy[i] = w->towards.y;
+                ahead->dz[i] = w->towards.z;
+            }
+            ahead->length = alive;
+            Hittable_prefetch(scene->hittable, ahead);
+        }
+
+        for (int i = 0; i < alive; ++i) {
+            const _Walk* w = walks + keys[i].index;
+            hits[keys[i].index] = Hittable_hit(sh, w->source, w->towards);
+        }
+
+        // Light is collected path by path. Paths that the guide scatters
+        // go on right away, and the rest are batched by their material.
+        int next = 0;
+        for (int i = 0; i < alive; ++i) {
+            int k = keys[i].index;
+            _Walk* w = walks + k;
+            if (!d && features) {
+                record_aov(features + k, hits[k], w->source);
+            }
+            _Vertices* noted = taught ? taught + k : NULL;
+            if (!collect(scene, w, hits[k], d, true, taught != NULL,
+                         seeds + k, shades + k)) {
+                continue;
+            }
+            const GuideCell* guided = shades[k].guided;
+            if (guided && genfloat(seeds + k) < GUIDE_MIX) {
+                Vector reflected = GuideCell_sample(guided, seeds + k);
+                Vector albedo = Mat_albedo(hits[k].mat);
+                if (scatter_on(scene, w, hits[k], d, shades[k], reflected,
+                               albedo, seeds + k, noted)) {
+                    keys[next++] = keys[i];
+                }
+                continue;
+            }
+            ShadeBatch_push(batches + hits[k].mat.kind, hits[k].mat,
+                            w->towards, hits[k].normal, seeds[k], k);
+        }
+
+        // The batches are scattered together, then every path goes on.
+        for (int m = 0; m < SORT_BATCHES; ++m) {
+            ShadeBatch* b = batches + m;
+            Mat_scatter_batch(b);
+            for (int j = 0; j < b->length; ++j) {
+                int k = b->tag[j];
+                seeds[k] = b->seed[j];
+                Vector reflected = {b->ox[j], b->oy[j], b->oz[j]};
+                Vector albedo = {b->ar[j], b->ag[j], b->ab[j]};
+                _Vertices* noted = taught ? taught + k : NULL;
+                if (scatter_on(scene, walks + k, hits[k], d, shades[k],
+                               reflected, albedo, seeds + k, noted)) {
+                    keys[next++] = (_SortKey){.key = 0, .index = k};
+                }
+            }
+            b->length = 0;
+        }
+        alive = next;
+    }
+
+    for (int p = 0; p < n / samples; ++p) {
+        Vector color = Vec_o();
+        Aov sum = {.albedo = Vec_o(), .normal = Vec_o(), .depth = 0};
+        for (int k = p * samples; k < (p + 1) * samples; ++k) {
+            if (taught) {
+                teach(taught + k, walks[k].radiance);
+            }
+            Vec_iadd(&color, walks[k].radiance);
+            if (features) {
+                Vec_iadd(&sum.albedo, features[k].albedo);
+                Vec_iadd(&sum.normal, features[k].normal);
+                sum.depth += features[k].depth;
+            }
+        }
+        radiance[p] = Vec_div_s(color, samples);
+        if (aov) {
+            aov[p] = Aov_mean(sum, samples);
+        }
+    }
+}
+
+Aov Aov_mean(Aov sum, int samples) {
+    // Normals that average to 0 (the sky) are kept at 0.
+    double len = Vec_len(sum.normal);
+    return (Aov){
+        .albedo = Vec_div_s(sum.albedo, samples),
+        .normal = len ? Vec_div_s(sum.normal, len) : Vec_o(),
+        .depth = sum.depth / samples,
+    };
+}
+
+Vector Scn_radiance(const Scene* scene,
+                    const Lens* lens,
+                    int x,
+                    int y,
+                    unsigned* seed,
+                    Aov* aov) {
     assert(x >= 0);
-    assert(x < scene.cfg.width);
+    assert(x < scene->cfg.width);
     assert(y >= 0);
-    assert(y < scene.cfg.height);
+    assert(y < scene->cfg.height);
 
     // Light through the aperture.
-    Pair aij = Pair_rand_disk(scene.cam.aperture, seed);
-    double ai = aij.x;
-    double aj = aij.y;
-
-    // Light through the viewport.
-    Vector h = Vec_mul_s(Vec_unit(scene.cam.horiz), ai);
-    Vector v = Vec_mul_s(Vec_unit(scene.cam.vertic), aj);
-    Vector start = Vec_add(scene.cam.source, Vec_add(h, v));
+    Pair a = Pair_rand_disk(lens->aperture, seed);
+    Vector h = Vec_mul_s(lens->right, a.x);
+    Vector v = Vec_mul_s(lens->up, a.y);
+    Vector start = Vec_add(lens->source, Vec_add(h, v));
 
     Vector color = Vec_o();
-    for (int s = 0; s < scene.cfg.samples; ++s) {
-        double i = (double)(x + genfloat(seed)) / scene.cfg.width;
-        double j = (double)(y + genfloat(seed)) / scene.cfg.height;
+    Aov sum = {.albedo = Vec_o(), .normal = Vec_o(), .depth = 0};
+    for (int s = 0; s < scene->cfg.samples; ++s) {
+        double i = (x + genfloat(seed)) * lens->inv_width;
+        double j = (y + genfloat(seed)) * lens->inv_height;
 
-        // Difference between the endpoint of the vector and the corner
-        Vector h = Vec_mul_s(scene.cam.horiz, i);
-        Vector v = Vec_mul_s(scene.cam.vertic, j);
-        Vector fc = Vec_add(h, v);
-
-        Vector end = Vec_add(scene.cam.corner, fc);
+        // Light through the viewport.
+        Vector h = Vec_mul_s(lens->horiz, i);
+        Vector v = Vec_mul_s(lens->vertic, j);
+        Vector end = Vec_add(lens->corner, Vec_add(h, v));
         Vector towards = Vec_sub(end, start);
 
         // Color on this sample.
-        Vector sc = Scn_trace(scene, start, towards, seed);
+        Aov sa;
+        Aov* rec = aov ? &sa : NULL;
+        Vector sc = Scn_trace_aov(scene, start, towards, seed, rec);
 
         Vec_iadd(&color, sc);
+        if (aov) {
+            Vec_iadd(&sum.albedo, sa.albedo);
+            Vec_iadd(&sum.normal, sa.normal);
+            sum.depth += sa.depth;
+        }
     }
-    Vec_idiv_s(&color, scene.cfg.samples);
-    return Vec_2Px(color);
+    Vec_idiv_s(&color, scene->cfg.samples);
+
+    if (aov) {
+        *aov = Aov_mean(sum, scene->cfg.samples);
+    }
+    return color;
+}
+
+Vector Scn_trace_rays(const Scene* scene,
+                      const RayBatch* rays,
+                      int first,
+                      int count,
+                      unsigned* seed,
+                      Aov* aov) {
+    assert(first >= 0);
+    assert(count > 0);
+    assert(first + count <= rays->length);
+
+    Vector color = Vec_o();
+    Aov sum = {.albedo = Vec_o(), .normal = Vec_o(), .depth = 0};
+    for (int k = first; k < first + count; ++k) {
+        Vector source = {rays->ox[k], rays->oy[k], rays->oz[k]};
+        Vector towards = {rays->dx[k], rays->dy[k], rays->dz[k]};
+
+        Aov sa;
+        Aov* rec = aov ? &sa : NULL;
+        Vec_iadd(&color, Scn_trace_aov(scene, source, towards, seed, rec));
+        if (aov) {
+            Vec_iadd(&sum.albedo, sa.albedo);
+            Vec_iadd(&sum.normal, sa.normal);
+            sum.depth += sa.depth;
+        }
+    }
+    Vec_idiv_s(&color, count);
+
+    if (aov) {
+        *aov = Aov_mean(sum, count);
+    }
+    return color;
+}
+
+Pixel Scn_color(const Scene* scene,
+                const Lens* lens,
+                int x,
+                int y,
+                unsigned* seed) {
+    return Vec_2Px(Scn_radiance(scene, lens, x, y, seed, NULL));
 }
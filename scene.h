@@ -1,7 +1,23 @@
 #pragma once
 
+#include "camera.h"
 #include "geometric.h"
+#include "guide.h"
 #include "hittable.h"
+#include "irradiance.h"
+#include "light.h"
+#include "photon.h"
+
+// How a path decides to survive Russian roulette.
+typedef enum RoulettePolicy {
+    // Paths are only terminated by depth or by escaping the scene.
+    RR_NONE = 0,
+    // Paths survive with a constant probability.
+    RR_FIXED,
+    // Paths survive with a probability proportional to their throughput, so
+    // paths that can barely contribute anymore are terminated early.
+    RR_THROUGHPUT,
+} RoulettePolicy;
 
 // Image's properties for the scenes.
 // @author RenTrueWang
@@ -14,23 +30,15 @@ typedef struct ImgProp {
     int width;
     // The height of the image.
     int height;
+    // How paths are terminated by Russian roulette.
+    RoulettePolicy rr_policy;
+    // Number of bounces that always survive before Russian roulette starts.
+    int rr_depth;
+    // The survival probability of RR_FIXED, or the lowest survival
+    // probability of RR_THROUGHPUT. In the range [0, 1].
+    double rr_prob;
 } ImgProp;
 
-// Camera stores the source, corner, horizontal and vertical directions.
-// @author RenTrueWang
-typedef struct Camera {
-    // The location of the film.
-    Vector source;
-    // The viewport's bottom-left corner.
-    Vector corner;
-    // Camera's right direction.
-    Vector horiz;
-    // Camera's up direction.
-    Vector vertic;
-    // The size of the aperture.
-    double aperture;
-} Camera;
-
 // A scene is a shot taken by a camera.
 // @author RenTrueWang
 typedef struct Scene {
@@ -40,25 +48,172 @@ typedef struct Scene {
     struct Camera cam;
     // Something in the scene to hit.
     Hittable hittable;
+    // Picks the emissive spheres in the scene to sample at every diffuse hit.
+    // Every emissive sphere in hittable must be pickable. Can be null, in
+    // which case lights are only found by chance.
+    LightSampler lights;
+    // Caches the indirect light of diffuse surfaces. The first diffuse hit of
+    // a path interpolates it instead of tracing on. Can be NULL.
+    IrrCache* irradiance;
+    // Learns where light comes from while rendering, and samples diffuse
+    // bounces towards it. Can be NULL.
+    Guide* guide;
+    // Brings the caustics of glass to diffuse surfaces. Paths that reach the
+    // sky or a light from a diffuse surface through glass only are dropped,
+    // because the photons already carry their light. Can be NULL.
+    PhotonMap* photons;
+    // Whether renders trace the paths of a tile together, one bounce at a
+    // time, sorted so that similar rays are traced one after another.
+    // @see Scn_trace_sorted
+    bool reorder;
 } Scene;
 
+// Auxiliary features of the first surface a camera ray hits. Used to guide
+// denoising, because they are noise-free when rendering noisy images.
+// @author RenTrueWang
+typedef struct Aov {
+    // The albedo of the surface. 1 for lights and the sky.
+    Vector albedo;
+    // The unit normal of the surface. 0 for the sky.
+    Vector normal;
+    // The distance from the camera to the surface. INFINITY for the sky.
+    double depth;
+} Aov;
+
 // Converts a Scene to a Hittable.
 // @param scene Scene to convert.
 // Either scene lives on the heap or has static lifetime.
 // @return The Hittable object that stores a Scene
 Hittable Scn_Hittable(const Scene* scene);
 
+// The color of the sky.
+// @param towards The direction that the sky is seen in.
+// @return The radiance of the sky.
+Vector Scn_sky(Vector towards);
+
 // Tracks the color of a path.
 // @param scene The scene to track.
 // @param source The source of the ray.
 // @param towards The direction of the ray.
 // @param depth The remaining depth (bounces) to track.
 // @return The resulting color from the reflections
-Vector Scn_trace(Scene scene, Vector source, Vector towards, unsigned* seed);
+Vector Scn_trace(const Scene* scene,
+                 Vector source,
+                 Vector towards,
+                 unsigned* seed);
+
+// Tracks the color of a path, and records the features of its first hit.
+// @param scene The scene to track.
+// @param source The source of the ray.
+// @param towards The direction of the ray.
+// @param aov Where to record the features. Can be NULL.
+// @return The resulting color from the reflections
+Vector Scn_trace_aov(const Scene* scene,
+                     Vector source,
+                     Vector towards,
+                     unsigned* seed,
+                     Aov* aov);
+
+// Tracks the color of a path whose first hit is already known, and records
+// the features of that hit.
+// @param scene The scene to track.
+// @param source The source of the ray.
+// @param towards The direction of the ray.
+// @param first The first hit of the ray, as the scene's hittable reports it.
+// @param aov Where to record the features. Can be NULL.
+// @return The resulting color from the reflections
+Vector Scn_trace_hit(const Scene* scene,
+                     Vector source,
+                     Vector towards,
+                     HitData first,
+                     unsigned* seed,
+                     Aov* aov);
+
+// Averages the features of the samples of a pixel. Normals that average to
+// 0 (the sky) are kept at 0.
+// @param sum The sum of the features.
+// @param samples Number of samples.
+// @return The averaged features.
+Aov Aov_mean(Aov sum, int samples);
+
+// Determines the radiance given the scene and the pixel location, averaged
+// over all samples of the pixel.
+// @param scene The scene to use.
+// @param lens The scene's camera, prepared for its image by Lens_make.
+// @param x The X position of the pixel. x is smaller than the width.
+// @param y The Y position of the pixel. y is smaller than the height.
+// @param aov Where to record the averaged features. Can be NULL.
+// @return The radiance calculated. Not limited to [0, 1].
+Vector Scn_radiance(const Scene* scene,
+                    const Lens* lens,
+                    int x,
+                    int y,
+                    unsigned* seed,
+                    Aov* aov);
+
+// Traces the camera rays of a pixel, as generated by Lens_rays, and averages
+// them.
+// @param scene The scene to use.
+// @param rays The camera rays.
+// @param first The index of the pixel's first ray.
+// @param count Number of rays of the pixel.
+// @param seed The seed pointer for the random number generator.
+// @param aov Where to record the averaged features. Can be NULL.
+// @return The radiance calculated. Not limited to [0, 1].
+Vector Scn_trace_rays(const Scene* scene,
+                      const RayBatch* rays,
+                      int first,
+                      int count,
+                      unsigned* seed,
+                      Aov* aov);
+
+// The buffers of Scn_trace_sorted. They grow to the largest batch traced
+// with them, and are kept, so that a thread can trace batch after batch
+// without allocating. A scratch is used by one thread at a time.
+// @author RenTrueWang
+typedef struct SortScratch SortScratch;
+
+// Creates an empty scratch.
+// @return A new SortScratch.
+SortScratch* SortScratch_make(void);
+
+// Free the scratch.
+// @param scratch Scratch to free.
+// @see free
+void SortScratch_free(SortScratch* scratch);
+
+// Traces all camera rays of a batch together, one bounce at a time, and
+// averages them per pixel. Paths are scattered incoherently after their
+// first bounce, so before every later bounce, the rays still alive are
+// sorted by their origins and directions, and traced in that order. Rays
+// that traverse the same nodes then follow each other, and find them in
+// the cache. Paths draw from seeds of their own, so their order doesn't
+// change the image.
+// @param scene The scene to use.
+// @param rays The camera rays. The rays of a pixel are consecutive.
+// @param samples Number of rays per pixel.
+// @param scratch The buffers to trace in.
+// @param seed The seed pointer for the random number generator.
+// @param radiance Where to store the radiance of every pixel, in the order
+// of the rays. Not limited to [0, 1].
+// @param aov Where to store the averaged features of every pixel, in the
+// order of the rays. Can be NULL.
+void Scn_trace_sorted(const Scene* scene,
+                      const RayBatch* rays,
+                      int samples,
+                      SortScratch* scratch,
+                      unsigned* seed,
+                      Vector* radiance,
+                      Aov* aov);
 
 // Determines the pixel color given the scene and the pixel location.
 // @param scene The scene to use.
+// @param lens The scene's camera, prepared for its image by Lens_make.
 // @param x The X position of the pixel. x is smaller than the width.
 // @param y The Y position of the pixel. y is smaller than the height.
 // @return The pixel calculated.
-Pixel Scn_color(Scene scene, int x, int y, unsigned* seed);
+Pixel Scn_color(const Scene* scene,
+                const Lens* lens,
+                int x,
+                int y,
+                unsigned* seed);
@@ -0,0 +1,531 @@
+#include "service.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "macro.h"
+#include "net.h"
+#include "pixel.h"
+#include "render.h"
+
+// The side length of a tile.
+#define SVC_TILE 16
+
+// The longest request header accepted, in bytes.
+#define SVC_HEADER 8192
+
+// The longest scene accepted, in bytes.
+#define SVC_BODY (16 << 20)
+
+// How long a client may take to send its request, in seconds.
+#define SVC_TIMEOUT 5
+
+// The widest and tallest image accepted. Images must also have few enough
+// pixels that their channels can be indexed by an int.
+#define SVC_MAX_SIDE 16384
+#define SVC_MAX_PIXELS (INT_MAX / 3)
+
+// The most samples per pixel and bounces accepted, so that one job can't
+// keep the server busy indefinitely.
+#define SVC_MAX_SAMPLES 4096
+#define SVC_MAX_DEPTH 1024
+
+// A scene kept resident, with its acceleration structures built.
+typedef struct _SvcEntry {
+    // Hash of the scene's materials and spheres.
+    uint64_t hash;
+    // The committed scene. NULL if the entry is empty.
+    Context* ctx;
+    // When the entry was last used. Larger is more recent.
+    unsigned long used;
+} _SvcEntry;
+
+// A render job waiting in the queue.
+typedef struct _SvcJob {
+    // The socket to reply on.
+    int fd;
+    // Higher priorities are rendered first.
+    int priority;
+    // Arrival order, among jobs of equal priority.
+    unsigned long seq;
+    // The seed of the render.
+    unsigned seed;
+    // The scene text. NUL-terminated.
+    char* body;
+    // The image properties of the job.
+    ImgProp cfg;
+    // The camera of the job.
+    Camera cam;
+    // Hash of the scene's materials and spheres.
+    uint64_t hash;
+} _SvcJob;
+
+// Mixes bytes into an FNV-1a hash.
+// @param hash The hash so far.
+// @param data The bytes to mix in.
+// @param len Number of bytes.
+// @return The updated hash.
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Parses the numbers of a statement.
+// @param text The text after the keyword.
+// @param vals Where to store the numbers.
+// @param max The capacity of vals.
+// @return The number of numbers, or -1 if text has anything else.
+static int numbers(const char* text, double* vals, int max) {
+    int n = 0;
+    forever {
+        char* end;
+        double v = strtod(text, &end);
+        if (end == text) {
+            break;
+        }
+        if (n == max) {
+            return -1;
+        }
+        vals[n++] = v;
+        text = end;
+    }
+    while (*text == ' ' || *text == '\t' || *text == '\r') {
+        ++text;
+    }
+    return *text ? -1 : n;
+}
+
+// Parses a scene.
+// @param text The scene text. NUL-terminated.
+// @param ctx Where materials and spheres are added. NULL to only read the
+// settings and the hash.
+// @param cfg Where the image properties are stored.
+// @param cam Where the camera is stored.
+// @param hash Where the hash of the materials and spheres is stored.
+// @return NULL if the scene is valid, an error message if not.
+static const char* parse(const char* text,
+                         Context* ctx,
+                         ImgProp* cfg,
+                         Camera* cam,
+                         uint64_t* hash) {
+    *cfg = (ImgProp){
+        .samples = 16,
+        .depth = 50,
+        .width = 400,
+        .height = 200,
+        .rr_policy = RR_THROUGHPUT,
+        .rr_depth = 3,
+        .rr_prob = .05,
+    };
+    *cam = (Camera){
+        .source = {0, 0, 0},
+        .corner = {-2, -1, -1},
+        .horiz = {4, 0, 0},
+        .vertic = {0, 2, 0},
+        .aperture = 0,
+    };
+    *hash = 14695981039346656037ull;
+
+    int materials = 0;
+    int spheres = 0;
+    const char* line = text;
+    for (; *line; line += strcspn(line, "\n"), line += (*line == '\n')) {
+        const char* first = line + strspn(line, " \t\r");
+        if (!*first || *first == '\n' || *first == '#') {
+            continue;
+        }
+
+        char key[16];
+        int used;
+        if (sscanf(line, " %15[a-z]%n", key, &used) != 1) {
+            return "invalid statement";
+        }
+
+        char rest[1024];
+        size_t len = strcspn(line + used, "\n");
+        if (len >= sizeof(rest)) {
+            return "line too long";
+        }
+        memcpy(rest, line + used, len);
+        rest[len] = '\0';
+
+        double v[13] = {0};
+        int n = numbers(rest, v, 13);
+        Vector rgb = {v[0], v[1], v[2]};
+
+        // Numbers are checked against their limits before they are converted
+        // to int, which is undefined for numbers out of its range.
+        if (!strcmp(key, "size") && n == 2) {
+            if (!(v[0] >= 1 && v[0] <= SVC_MAX_SIDE && v[1] >= 1 &&
+                  v[1] <= SVC_MAX_SIDE && v[0] * v[1] <= SVC_MAX_PIXELS)) {
+                return "size out of range";
+            }
+            cfg->width = v[0];
+            cfg->height = v[1];
+            continue;
+        }
+        if (!strcmp(key, "samples") && n == 1) {
+            if (!(v[0] >= 1 && v[0] <= SVC_MAX_SAMPLES)) {
+                return "samples out of range";
+            }
+            cfg->samples = v[0];
+            continue;
+        }
+        if (!strcmp(key, "depth") && n == 1) {
+            if (!(v[0] >= 1 && v[0] <= SVC_MAX_DEPTH)) {
+                return "depth out of range";
+            }
+            cfg->depth = v[0];
+            continue;
+        }
+        if (!strcmp(key, "camera") && n == 13) {
+            *cam = (Camera){
+                .source = {v[0], v[1], v[2]},
+                .corner = {v[3], v[4], v[5]},
+                .horiz = {v[6], v[7], v[8]},
+                .vertic = {v[9], v[10], v[11]},
+                .aperture = v[12],
+            };
+            continue;
+        }
+
+        if (!strcmp(key, "matte") && n == 3) {
+            if (ctx) {
+                Ctx_matte(ctx, (Matte){.albedo = rgb});
+            }
+            ++materials;
+        } else if (!strcmp(key, "metal") && n == 4) {
+            if (ctx) {
+                Ctx_metal(ctx, (Metal){.albedo = rgb, .blur = v[3]});
+            }
+            ++materials;
+        } else if (!strcmp(key, "glass") && n == 5) {
+            if (ctx) {
+                Glass glass = {.albedo = rgb, .blur = v[3], .refractive = v[4]};
+                Ctx_glass(ctx, glass);
+            }
+            ++materials;
+        } else if (!strcmp(key, "emissive") && n == 3) {
+            if (ctx) {
+                Ctx_emissive(ctx, (Emissive){.radiance = rgb});
+            }
+            ++materials;
+        } else if (!strcmp(key, "sphere") && n == 5) {
+            if (!(v[4] >= 0 && v[4] < materials) || !(v[3] > 0)) {
+                return "invalid sphere";
+            }
+            int mat = v[4];
+            if (mat != v[4]) {
+                return "invalid sphere";
+            }
+            if (ctx) {
+                Ctx_sphere(ctx, (Vector){v[0], v[1], v[2]}, v[3], mat);
+            }
+            ++spheres;
+        } else {
+            return "invalid statement";
+        }
+
+        // Only what goes into the acceleration structures is hashed, in a
+        // form that doesn't depend on formatting.
+        *hash = fnv1a(*hash, key, strlen(key) + 1);
+        *hash = fnv1a(*hash, v, n * sizeof(double));
+    }
+
+    return spheres ? NULL : "no sphere";
+}
+
+// Finds a request parameter in a request target.
+// @param target The request target, such as "/render?priority=2".
+// @param name The name of the parameter.
+// @param fallback The value if the parameter is absent.
+// @return The value of the parameter.
+static long param(const char* target, const char* name, long fallback) {
+    const char* query = strchr(target, '?');
+    size_t len = strlen(name);
+    for (const char* p = query; p; p = strchr(p + 1, '&')) {
+        if (!strncmp(p + 1, name, len) && p[1 + len] == '=') {
+            return strtol(p + 2 + len, NULL, 10);
+        }
+    }
+    return fallback;
+}
+
+// Sends a reply, and closes the connection.
+// @param fd The socket.
+// @param status The status line, such as "200 OK".
+// @param headers Extra header lines, each ending with "\r\n".
+// @param body The body.
+// @param len The length of the body.
+static void reply(int fd,
+                  const char* status,
+                  const char* headers,
+                  const void* body,
+                  size_t len) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %s\r\nContent-Length: %zu\r\n"
+                     "Connection: close\r\n%s\r\n",
+                     status, len, headers);
+    if (Net_write(fd, head, n)) {
+        Net_write(fd, body, len);
+    }
+    close(fd);
+}
+
+// Sends a plain text error, and closes the connection.
+// @param fd The socket.
+// @param status The status line.
+// @param message The error message.
+static void fail(int fd, const char* status, const char* message) {
+    char body[256];
+    int n = snprintf(body, sizeof(body), "%s\n", message);
+    reply(fd, status, "Content-Type: text/plain\r\n", body, n);
+}
+
+// Reads a request.
+// @param fd The socket.
+// @param method Where the method is stored. Holds 8 bytes.
+// @param target Where the request target is stored. Holds SVC_HEADER bytes.
+// @param body Where the body is stored, NUL-terminated. Must be freed.
+// @return False if the request is malformed.
+static bool read_request(int fd, char* method, char* target, char** body) {
+    char head[SVC_HEADER + 1];
+    size_t got = 0;
+    char* end = NULL;
+    while (!end) {
+        if (got == SVC_HEADER) {
+            return false;
+        }
+        ssize_t n = recv(fd, head + got, SVC_HEADER - got, 0);
+        if (n <= 0) {
+            return false;
+        }
+        got += n;
+        head[got] = '\0';
+        end = strstr(head, "\r\n\r\n");
+    }
+
+    if (sscanf(head, "%7s %8191s", method, target) != 2) {
+        return false;
+    }
+
+    size_t length = 0;
+    for (char* h = strstr(head, "\r\n"); h < end; h = strstr(h + 2, "\r\n")) {
+        if (!strncasecmp(h + 2, "Content-Length:", 15)) {
+            length = strtoul(h + 17, NULL, 10);
+        }
+    }
+    if (length > SVC_BODY) {
+        return false;
+    }
+
+    // Part of the body may have arrived with the header.
+    size_t early = got - (end + 4 - head);
+    if (early > length) {
+        return false;
+    }
+    *body = malloc(length + 1);
+    memcpy(*body, end + 4, early);
+    if (!Net_read(fd, *body + early, length - early)) {
+        free(*body);
+        *body = NULL;
+        return false;
+    }
+    (*body)[length] = '\0';
+    return true;
+}
+
+// Handles a new connection. Render requests are queued, anything else is
+// answered right away.
+// @param fd The socket.
+// @param queue The queue of jobs. Updated if it moves.
+// @param njobs The length of queue.
+// @param seq The arrival counter.
+// @return False if the request asks the service to shut down.
+static bool accept_job(int fd,
+                       _SvcJob** queue,
+                       int* njobs,
+                       unsigned long* seq) {
+    // A client that stalls must not stall the service for long.
+    struct timeval timeout = {.tv_sec = SVC_TIMEOUT};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char method[8];
+    char target[SVC_HEADER + 1];
+    char* body = NULL;
+    if (!read_request(fd, method, target, &body)) {
+        fail(fd, "400 Bad Request", "malformed request");
+        return true;
+    }
+
+    size_t path = strcspn(target, "?");
+    if (strcmp(method, "POST")) {
+        free(body);
+        fail(fd, "405 Method Not Allowed", "use POST");
+        return true;
+    }
+    if (path == 9 && !strncmp(target, "/shutdown", path)) {
+        free(body);
+        reply(fd, "200 OK", "", "", 0);
+        return false;
+    }
+    if (path != 7 || strncmp(target, "/render", path)) {
+        free(body);
+        fail(fd, "404 Not Found", "no such endpoint");
+        return true;
+    }
+
+    _SvcJob job = {
+        .fd = fd,
+        .priority = param(target, "priority", 0),
+        .seq = (*seq)++,
+        .seed = param(target, "seed", 0),
+        .body = body,
+    };
+    const char* error = parse(body, NULL, &job.cfg, &job.cam, &job.hash);
+    if (error) {
+        free(body);
+        fail(fd, "400 Bad Request", error);
+        return true;
+    }
+
+    *queue = realloc(*queue, (*njobs + 1) * sizeof(_SvcJob));
+    (*queue)[(*njobs)++] = job;
+    return true;
+}
+
+// Finds a scene in the cache, or builds it and caches it, evicting the
+// least recently used scene if the cache is full.
+// @param cache The cache.
+// @param capacity The capacity of the cache.
+// @param job The job that needs the scene.
+// @param clock The current time, in jobs.
+// @param hit Whether the scene was cached.
+// @return The scene, ready to render.
+static Context* lookup(_SvcEntry* cache,
+                       int capacity,
+                       _SvcJob job,
+                       unsigned long clock,
+                       bool* hit) {
+    _SvcEntry* victim = cache;
+    for (int i = 0; i < capacity; ++i) {
+        if (cache[i].ctx && cache[i].hash == job.hash) {
+            cache[i].used = clock;
+            *hit = true;
+            return cache[i].ctx;
+        }
+        if (!cache[i].ctx || (victim->ctx && cache[i].used < victim->used)) {
+            victim = cache + i;
+        }
+    }
+
+    if (victim->ctx) {
+        Ctx_free(victim->ctx);
+    }
+    ImgProp cfg;
+    Camera cam;
+    uint64_t hash;
+    Context* ctx = Ctx_make(job.cfg, job.cam);
+    parse(job.body, ctx, &cfg, &cam, &hash);
+    Ctx_commit(ctx);
+
+    *victim = (_SvcEntry){.hash = job.hash, .ctx = ctx, .used = clock};
+    *hit = false;
+    return ctx;
+}
+
+// Renders a job and replies with the image.
+// @param ctx The job's scene.
+// @param job The job.
+// @param hit Whether the scene was cached.
+static void run(Context* ctx, _SvcJob job, bool hit) {
+    Ctx_set_cfg(ctx, job.cfg);
+    Ctx_set_camera(ctx, job.cam);
+
+    int width = job.cfg.width;
+    int height = job.cfg.height;
+    Frame frame = Frame_make(width, height, false);
+    Tile image = {.x0 = 0, .y0 = 0, .x1 = width, .y1 = height, .cost = 0};
+    Ctx_render(ctx, image, SVC_TILE, frame, job.seed, NULL, NULL);
+
+    char* data = NULL;
+    size_t len = 0;
+    FILE* stream = open_memstream(&data, &len);
+    Px_fwrite_ppm(frame.image, width, height, stream);
+    fclose(stream);
+
+    reply(job.fd, "200 OK",
+          hit ? "Content-Type: image/x-portable-pixmap\r\nX-Cache: hit\r\n"
+              : "Content-Type: image/x-portable-pixmap\r\nX-Cache: miss\r\n",
+          data, len);
+    free(data);
+    Frame_free(&frame);
+}
+
+bool Svc_serve(const char* addr, int capacity) {
+    int lfd = Net_open(addr, true);
+    if (lfd < 0) {
+        return false;
+    }
+
+    _SvcEntry* cache = calloc(capacity, sizeof(_SvcEntry));
+    _SvcJob* queue = NULL;
+    int njobs = 0;
+    unsigned long seq = 0;
+    unsigned long clock = 0;
+    bool running = true;
+
+    while (running || njobs) {
+        // Every request that arrived during the last render is queued before
+        // the next job is picked. Block only if there is nothing to do.
+        struct pollfd pfd = {.fd = lfd, .events = POLLIN};
+        while (running && poll(&pfd, 1, njobs ? 0 : -1) > 0) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd >= 0) {
+                running = accept_job(fd, &queue, &njobs, &seq);
+            }
+        }
+        if (!njobs) {
+            continue;
+        }
+
+        int best = 0;
+        for (int i = 1; i < njobs; ++i) {
+            if (queue[i].priority > queue[best].priority ||
+                (queue[i].priority == queue[best].priority &&
+                 queue[i].seq < queue[best].seq)) {
+                best = i;
+            }
+        }
+        _SvcJob job = queue[best];
+        queue[best] = queue[--njobs];
+
+        bool hit;
+        Context* ctx = lookup(cache, capacity, job, ++clock, &hit);
+        run(ctx, job, hit);
+        free(job.body);
+    }
+
+    for (int i = 0; i < capacity; ++i) {
+        if (cache[i].ctx) {
+            Ctx_free(cache[i].ctx);
+        }
+    }
+    free(cache);
+    free(queue);
+    close(lfd);
+    return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+
+// The render service speaks HTTP/1.1, one request per connection. Over a
+// Unix socket, curl --unix-socket works as a client.
+//
+//   POST /render?priority=P&seed=S   Renders the scene in the body, and
+//                                    replies with a binary PPM image.
+//                                    Higher priorities are rendered first;
+//                                    equal priorities in arrival order.
+//   POST /shutdown                   Stops accepting jobs. Jobs already
+//                                    queued are still rendered.
+//
+// A scene is text, one statement per line, numbers separated by spaces.
+// Lines starting with # are ignored. Every statement but sphere is optional.
+//
+//   size WIDTH HEIGHT
+//   samples N
+//   depth N
+//   camera SOURCE(3) CORNER(3) HORIZ(3) VERTIC(3) APERTURE
+//   matte R G B
+//   metal R G B BLUR
+//   glass R G B BLUR REFRACTIVE
+//   emissive R G B
+//   sphere X Y Z RADIUS MATERIAL
+//
+// Materials are numbered from 0 in the order they are declared. Scenes are
+// cached by a hash of their materials and spheres only, so a job that only
+// changes the size, samples, depth or camera of a cached scene skips
+// straight to tracing. Replies carry "X-Cache: hit" or "X-Cache: miss".
+
+// Serves render jobs on an address until a shutdown request.
+// @param addr The address to listen on. "unix:path" or "tcp:host:port".
+// @param capacity Number of scenes kept in the cache. The least recently used
+// scene is evicted first.
+// @return False if addr can't be listened on.
+bool Svc_serve(const char* addr, int capacity);
@@ -0,0 +1,197 @@
+#include "temporal.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+TemporalCfg TemporalCfg_default(void) {
+    return (TemporalCfg){
+        .alpha = .1,
+        .sigma_depth = .05,
+        .min_cos = .9,
+    };
+}
+
+Temporal Temporal_make(int width, int height) {
+    assert(width > 0);
+    assert(height > 0);
+
+    int size = width * height;
+    return (Temporal){
+        .width = width,
+        .height = height,
+        .frames = 0,
+        .radiance = calloc(size, sizeof(Vector)),
+        .aov = calloc(size, sizeof(Aov)),
+        .age = calloc(size, sizeof(float)),
+        .next_age = calloc(size, sizeof(float)),
+    };
+}
+
+void Temporal_free(Temporal* tmp) {
+    free(tmp->radiance);
+    free(tmp->aov);
+    free(tmp->age);
+    free(tmp->next_age);
+    memset(tmp, 0, sizeof(Temporal));
+}
+
+// Finds where a camera sees a direction from its source.
+// @param cam The camera.
+// @param towards The direction, from the source of the camera.
+// @param fx Where to store the position on the viewport along horiz.
+// @param fy Where to store the position on the viewport along vertic.
+// @return False if the direction points away from the viewport.
+static bool project(Camera cam, Vector towards, double* fx, double* fy) {
+    // The ray through the viewport is corner + fx * horiz + fy * vertic,
+    // relative to the source, so towards is scaled to reach its plane.
+    Vector c = Vec_sub(cam.corner, cam.source);
+    Vector m = Vec_cross(cam.horiz, cam.vertic);
+    double facing = Vec_dot(towards, m);
+    if (!facing) {
+        return false;
+    }
+    double s = Vec_dot(c, m) / facing;
+    if (s <= 0) {
+        return false;
+    }
+
+    Vector r = Vec_sub(Vec_mul_s(towards, s), c);
+    Vector ph = Vec_cross(cam.vertic, m);
+    Vector pv = Vec_cross(m, cam.horiz);
+    *fx = Vec_dot(r, ph) / Vec_dot(cam.horiz, ph);
+    *fy = Vec_dot(r, pv) / Vec_dot(cam.vertic, pv);
+    return true;
+}
+
+// Whether a pixel of the history shows the same surface as a first hit.
+// @param hist The features of the pixel of the history.
+// @param cur The features of the first hit.
+// @param expected The distance from the last camera to the first hit.
+// INFINITY for the sky.
+// @param cfg The parameters of the blend.
+// @return True if the history can be reused.
+static bool same_surface(Aov hist, Aov cur, double expected, TemporalCfg cfg) {
+    if (isinf(expected) || isinf(hist.depth)) {
+        return isinf(expected) && isinf(hist.depth);
+    }
+    double gap = fabs(hist.depth - expected);
+    return gap <= cfg.sigma_depth * expected &&
+           Vec_dot(hist.normal, cur.normal) >= cfg.min_cos;
+}
+
+// Blends the history of one pixel with its new radiance.
+// @param tmp The accumulator, with the history of the last frame.
+// @param frame The new frame.
+// @param cam The camera of the new frame.
+// @param cfg The parameters of the blend.
+// @param x The X position of the pixel.
+// @param y The Y position of the pixel.
+// @param age Where to store the age of the pixel.
+// @return The blended radiance.
+static Vector blend_px(const Temporal* tmp,
+                       Frame frame,
+                       Camera cam,
+                       TemporalCfg cfg,
+                       int x,
+                       int y,
+                       float* age) {
+    int width = tmp->width;
+    int height = tmp->height;
+    Vector now = frame.radiance[y * width + x];
+    Aov cur = frame.aov[y * width + x];
+    *age = 1;
+    if (!tmp->frames) {
+        return now;
+    }
+
+    // The first hit, seen through the center of the pixel.
+    double cx = (x + .5) / width;
+    double cy = (y + .5) / height;
+    Vector ray = Vec_add(Vec_mul_s(cam.horiz, cx), Vec_mul_s(cam.vertic, cy));
+    ray = Vec_unit(Vec_sub(Vec_add(cam.corner, ray), cam.source));
+    Vector from_last = ray;
+    double expected = INFINITY;
+    if (!isinf(cur.depth)) {
+        Vector point = Vec_add(cam.source, Vec_mul_s(ray, cur.depth));
+        from_last = Vec_sub(point, tmp->cam.source);
+        expected = Vec_len(from_last);
+    }
+
+    double fx, fy;
+    if (!project(tmp->cam, from_last, &fx, &fy)) {
+        return now;
+    }
+
+    // Bilinear taps of the history, without the ones of other surfaces.
+    double px = fx * width - .5;
+    double py = fy * height - .5;
+    int x0 = (int)floor(px);
+    int y0 = (int)floor(py);
+    double ax = px - x0;
+    double ay = py - y0;
+    Vector hist = Vec_o();
+    double hist_age = 0;
+    double total = 0;
+    for (int k = 0; k < 4; ++k) {
+        int qx = x0 + (k & 1);
+        int qy = y0 + (k >> 1);
+        if (qx < 0 || qx >= width || qy < 0 || qy >= height) {
+            continue;
+        }
+        int q = qy * width + qx;
+        if (!same_surface(tmp->aov[q], cur, expected, cfg)) {
+            continue;
+        }
+        double w = ((k & 1) ? ax : 1 - ax) * ((k >> 1) ? ay : 1 - ay);
+        Vec_iadd(&hist, Vec_mul_s(tmp->radiance[q], w));
+        hist_age += w * tmp->age[q];
+        total += w;
+    }
+    if (total <= 0) {
+        // Disoccluded: the surface wasn't seen by the last frame.
+        return now;
+    }
+
+    double n = hist_age / total + 1;
+    double weight = fmax(1 / n, cfg.alpha);
+    *age = (float)fmin(n, 1 / cfg.alpha);
+    hist = Vec_div_s(hist, total);
+    return Vec_add(Vec_mul_s(hist, 1 - weight), Vec_mul_s(now, weight));
+}
+
+void Temporal_add(Temporal* tmp, Frame frame, Camera cam, TemporalCfg cfg) {
+    assert(frame.aov);
+    assert(frame.width == tmp->width);
+    assert(frame.height == tmp->height);
+    assert(cfg.alpha > 0 && cfg.alpha <= 1);
+
+    int width = tmp->width;
+    int height = tmp->height;
+
+    // The history is only read, and the frame and the next ages are only
+    // written at the pixel itself, so rows are independent.
+#pragma omp parallel for schedule(static) default(none) \
+    shared(tmp, frame, cam, cfg, width, height)
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int i = y * width + x;
+            Vector c = blend_px(tmp, frame, cam, cfg, x, y, tmp->next_age + i);
+            frame.radiance[i] = c;
+            frame.image[i] = Vec_2Px(c);
+        }
+    }
+
+    int size = width * height;
+    memcpy(tmp->radiance, frame.radiance, size * sizeof(Vector));
+    memcpy(tmp->aov, frame.aov, size * sizeof(Aov));
+    float* age = tmp->age;
+    tmp->age = tmp->next_age;
+    tmp->next_age = age;
+    tmp->cam = cam;
+    ++tmp->frames;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "camera.h"
+#include "render.h"
+
+// Parameters of temporal accumulation.
+// @author RenTrueWang
+typedef struct TemporalCfg {
+    // The smallest weight of the new frame in the blend. The history then
+    // averages about 1 / alpha frames, so it still follows changes in
+    // lighting. In the range (0, 1].
+    double alpha;
+    // How much the depth of a reprojected pixel may differ from the depth
+    // expected of it, relative to that depth.
+    double sigma_depth;
+    // The smallest cosine between the normal of a pixel and the normal of
+    // the history it is reprojected to.
+    double min_cos;
+} TemporalCfg;
+
+// Default parameters, suitable for fly-throughs rendered with 1-4 samples
+// per frame.
+// @return The default TemporalCfg.
+TemporalCfg TemporalCfg_default(void);
+
+// Temporal accumulates the frames of an animation whose camera moves through
+// a static scene. Every pixel of a new frame finds its first hit in the last
+// frame by reprojecting it through the last camera, and blends its radiance
+// with what was accumulated there. History whose depth or normal doesn't
+// match the hit belongs to another surface, which was in front of it or has
+// just come into view, and is rejected, so the pixel starts over.
+//
+// The first hits are taken from the features of the frames, so it works
+// best with pinhole cameras.
+// @author RenTrueWang
+typedef struct Temporal {
+    // The width of the image.
+    int width;
+    // The height of the image.
+    int height;
+    // Number of frames accumulated so far. 0 if there is no history.
+    int frames;
+    // The camera of the last frame.
+    Camera cam;
+    // Row-major accumulated radiance.
+    Vector* radiance;
+    // Row-major features of the first hits of the last frame.
+    Aov* aov;
+    // Row-major number of frames that every pixel has accumulated, capped
+    // by the smallest weight of a new frame.
+    float* age;
+    // Where the ages of the next frame are computed.
+    float* next_age;
+} Temporal;
+
+// Creates an accumulator without any history.
+// @param width The width of the image.
+// @param height The height of the image.
+// @return A new Temporal.
+Temporal Temporal_make(int width, int height);
+
+// Free the resources controlled by Temporal.
+// @param tmp Temporal to free.
+// @see free
+void Temporal_free(Temporal* tmp);
+
+// Blends a frame with the history, and makes the result the new history.
+// Both radiance and image of the frame are updated.
+// @param tmp The accumulator.
+// @param frame The new frame. frame.aov must not be NULL, and it must be
+// the same size as the accumulator.
+// @param cam The camera that the frame was rendered with.
+// @param cfg The parameters of the blend.
+void Temporal_add(Temporal* tmp, Frame frame, Camera cam, TemporalCfg cfg);
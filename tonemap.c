@@ -0,0 +1,224 @@
+#include "tonemap.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+// Channels up to it are encoded linearly by sRGB, and above it by a power.
+#define SRGB_KNEE .0031308f
+
+// The largest step of 8-bit channels.
+#define TONE_LEVELS8 255
+
+// The largest step of 16-bit channels.
+#define TONE_LEVELS16 65535
+
+ToneCfg ToneCfg_default(void) {
+    return (ToneCfg){
+        .exposure = 0,
+        .aces = false,
+        .srgb = false,
+        .dither = false,
+        .seed = 0,
+    };
+}
+
+// Reads the bits of a float.
+// @param f The float.
+// @return Its bits.
+static inline uint32_t float_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+// Makes a float of its bits.
+// @param bits The bits.
+// @return The float.
+static inline float bits_float(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// The base 2 logarithm of a positive normal float. libm's doesn't vectorize,
+// so the exponent is read from the bits and the logarithm of the mantissa
+// comes from a series that is exact to a float in its range.
+// @param x The float.
+// @return log2(x).
+static inline float tone_log2(float x) {
+    uint32_t bits = float_bits(x);
+    int e = (int)(bits >> 23) - 127;
+    float m = bits_float((bits & 0x7fffffu) | 0x3f800000u);
+
+    // The mantissa is moved into [sqrt(.5), sqrt(2)), so that the series of
+    // ln(m) = 2 atanh((m - 1) / (m + 1)) converges quickly.
+    bool high = m > (float)M_SQRT2;
+    m = high ? m * .5f : m;
+    e = high ? e + 1 : e;
+    float t = (m - 1) / (m + 1);
+    float t2 = t * t;
+    float s = t * (2 + t2 * (2.f / 3 +
+                             t2 * (2.f / 5 + t2 * (2.f / 7 + t2 * (2.f / 9)))));
+    return e + s * (float)M_LOG2E;
+}
+
+// 2 to the power of a float in the range of normal floats, from its integer
+// part put into the exponent and a series for its fraction.
+// @param y The power.
+// @return exp2(y).
+static inline float tone_exp2(float y) {
+    // Truncated, then moved down for negative powers, which is floor.
+    int i = (int)y;
+    i = (float)i > y ? i - 1 : i;
+    float f = (y - i) * (float)M_LN2;
+    float p =
+        1 + f * (1 + f * (1.f / 2 +
+                          f * (1.f / 6 +
+                               f * (1.f / 24 +
+                                    f * (1.f / 120 +
+                                         f * (1.f / 720 +
+                                              f * (1.f / 5040 +
+                                                   f * (1.f / 40320))))))));
+    return p * bits_float((uint32_t)(i + 127) << 23);
+}
+
+// A random number of a channel, hashed from its index, so that channels are
+// drawn together and the noise doesn't depend on how the work is split.
+// @param seed The seed of the noise.
+// @param index The index of the channel.
+// @return A random number in [0, 1).
+static inline float tone_noise(unsigned seed, unsigned index) {
+    unsigned s = hash32(seed + index * 0x9e3779b9u);
+    return (int)(s >> 8) * (1.f / 16777216.f);
+}
+
+// Converts a row of a buffer to quantization steps. The row is converted
+// in stages, every one a kernel over the channels of the row, and stages
+// for options that are off are skipped.
+// @param cfg The parameters of the conversion.
+// @param acc The buffer to read.
+// @param levels The largest step.
+// @param y The row.
+// @param v Where the row is kept between stages, 3 * width floats.
+// @param steps Where to store the steps, 3 * width of them.
+static void tone_row(ToneCfg cfg,
+                     Accum acc,
+                     int levels,
+                     int y,
+                     float* restrict v,
+                     int* restrict steps) {
+    int width = acc.width;
+    int channels = 3 * width;
+    int first = y * channels;
+    const uint32_t* restrict count = acc.count + y * width;
+    const float* restrict sum = acc.sum + first;
+    float scale = (float)exp2(cfg.exposure);
+
+    for (int x = 0; x < width; ++x) {
+        // Counts fit in an int, which converts to float without branches.
+        int n = (int)count[x];
+        float gain = scale / (float)(n ? n : 1);
+        v[3 * x + 0] = gain;
+        v[3 * x + 1] = gain;
+        v[3 * x + 2] = gain;
+    }
+
+#pragma omp simd
+    for (int j = 0; j < channels; ++j) {
+        float c = sum[j] * v[j];
+        v[j] = c > 0 ? c : 0;
+    }
+
+    if (cfg.aces) {
+        // Narkowicz's fit of the ACES reference rendering transform.
+#pragma omp simd
+        for (int j = 0; j < channels; ++j) {
+            float c = v[j];
+            v[j] = c * (2.51f * c + .03f) / (c * (2.43f * c + .59f) + .14f);
+        }
+    }
+
+#pragma omp simd
+    for (int j = 0; j < channels; ++j) {
+        v[j] = v[j] < 1 ? v[j] : 1;
+    }
+
+    if (cfg.srgb) {
+        // Both sides are computed, so that lanes don't branch.
+#pragma omp simd
+        for (int j = 0; j < channels; ++j) {
+            float c = v[j];
+            float knee = c > SRGB_KNEE ? c : SRGB_KNEE;
+            float power = 1.055f * tone_exp2(tone_log2(knee) / 2.4f) - .055f;
+            v[j] = c > SRGB_KNEE ? power : c * 12.92f;
+        }
+    }
+
+    if (cfg.dither) {
+        unsigned seed = cfg.seed;
+#pragma omp simd
+        for (int j = 0; j < channels; ++j) {
+            int q = (int)(v[j] * levels + tone_noise(seed, first + j));
+            steps[j] = q < levels ? q : levels;
+        }
+    } else {
+        // Rounded to nearest.
+#pragma omp simd
+        for (int j = 0; j < channels; ++j) {
+            int q = (int)(v[j] * levels + .5f);
+            steps[j] = q < levels ? q : levels;
+        }
+    }
+}
+
+void Tone_resolve(ToneCfg cfg, Accum acc, Pixel* image) {
+    // Pixels are three bytes with nothing in between.
+    _Static_assert(sizeof(Pixel) == 3, "Pixel is padded");
+    int width = acc.width;
+    int height = acc.height;
+
+#pragma omp parallel default(none) shared(cfg, acc, width, height, image)
+    {
+        float* v = malloc(3 * width * sizeof(float));
+        int* steps = malloc(3 * width * sizeof(int));
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            tone_row(cfg, acc, TONE_LEVELS8, y, v, steps);
+            unsigned char* row = (unsigned char*)(image + y * width);
+#pragma omp simd
+            for (int j = 0; j < 3 * width; ++j) {
+                row[j] = steps[j];
+            }
+        }
+        free(v);
+        free(steps);
+    }
+}
+
+void Tone_resolve16(ToneCfg cfg, Accum acc, uint16_t* image) {
+    int width = acc.width;
+    int height = acc.height;
+
+#pragma omp parallel default(none) shared(cfg, acc, width, height, image)
+    {
+        float* v = malloc(3 * width * sizeof(float));
+        int* steps = malloc(3 * width * sizeof(int));
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            tone_row(cfg, acc, TONE_LEVELS16, y, v, steps);
+            uint16_t* row = image + 3 * y * width;
+#pragma omp simd
+            for (int j = 0; j < 3 * width; ++j) {
+                row[j] = steps[j];
+            }
+        }
+        free(v);
+        free(steps);
+    }
+}
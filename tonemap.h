@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "accum.h"
+#include "pixel.h"
+
+// Parameters of the conversion from radiance to displayable channels.
+// @author RenTrueWang
+typedef struct ToneCfg {
+    // Stops that radiance is scaled by. 0 leaves it as it is.
+    double exposure;
+    // Whether highlights are compressed by the ACES filmic curve. Otherwise
+    // channels above 1 are clamped.
+    bool aces;
+    // Whether channels are encoded with the sRGB transfer function.
+    // Otherwise they are stored linearly.
+    bool srgb;
+    // Whether quantization adds noise of one step, so that gradients don't
+    // band. Otherwise channels are rounded.
+    bool dither;
+    // The seed of the noise. Frames of an animation should use different
+    // seeds, or the noise stands still.
+    unsigned seed;
+} ToneCfg;
+
+// Default parameters: linear channels, clamped and rounded, as Vec_2Px
+// converts them.
+// @return The default ToneCfg.
+ToneCfg ToneCfg_default(void);
+
+// Converts the mean radiance of every pixel of a buffer to 8-bit pixels.
+// Pixels without samples are black.
+// @param cfg The parameters of the conversion.
+// @param acc The buffer to read.
+// @param image The output, width * height pixels.
+void Tone_resolve(ToneCfg cfg, Accum acc, Pixel* image);
+
+// Converts the mean radiance of every pixel of a buffer to 16-bit channels,
+// three per pixel.
+// @param cfg The parameters of the conversion.
+// @param acc The buffer to read.
+// @param image The output, 3 * width * height channels.
+// @see Tone_resolve
+void Tone_resolve16(ToneCfg cfg, Accum acc, uint16_t* image);